@@ -54,12 +54,12 @@ project "App-Client"
 	  }
 
    filter "configurations:Debug"
-      defines { "WL_DEBUG" }
+      defines { "WL_DEBUG", "WC_ENABLE_TRACING" }
       runtime "Debug"
       symbols "On"
 
    filter "configurations:Release"
-      defines { "WL_RELEASE" }
+      defines { "WL_RELEASE", "WC_ENABLE_TRACING" }
       runtime "Release"
       optimize "On"
       symbols "On"
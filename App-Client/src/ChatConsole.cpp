@@ -0,0 +1,257 @@
+#include "ChatConsole.h"
+
+#include "Trace.h"
+
+#include "Walnut/Application.h"
+
+#include "imgui.h"
+#include "misc/cpp/imgui_stdlib.h"
+
+#include <algorithm>
+
+ChatConsole::ChatConsole(std::string_view title)
+	: m_Title(title)
+{
+}
+
+void ChatConsole::ClearLog()
+{
+	AddPending(PendingType::Clear, {}, {}, 0, false);
+}
+
+void ChatConsole::AddOlderMessage(uint32_t color, std::string_view tag, std::string_view message, bool italic)
+{
+	AddPending(PendingType::OlderMessage, tag, message, color, italic);
+}
+
+void ChatConsole::EndOlderMessages()
+{
+	AddPending(PendingType::EndOlderMessages, {}, {}, 0, false);
+}
+
+void ChatConsole::AddFormattedMessage(std::string_view tag, uint32_t color, bool italic, std::string_view format, fmt::format_args args)
+{
+	thread_local fmt::memory_buffer s_FormatBuffer;
+	s_FormatBuffer.clear();
+	fmt::vformat_to(fmt::appender(s_FormatBuffer), format, args);
+	AddPending(PendingType::Message, tag, std::string_view(s_FormatBuffer.data(), s_FormatBuffer.size()), color, italic);
+}
+
+void ChatConsole::AddPending(PendingType type, std::string_view tag, std::string_view message, uint32_t color, bool italic)
+{
+	std::scoped_lock lock(m_PendingMutex);
+	PendingMessage& pending = m_PendingMessages.emplace_back();
+	pending.Type = type;
+	pending.Italic = italic;
+	pending.Color = color;
+	pending.TagSize = (uint32_t)tag.size();
+	pending.MessageSize = (uint32_t)message.size();
+	m_PendingText.append(tag);
+	m_PendingText.append(message);
+}
+
+void ChatConsole::ApplyPendingMessages()
+{
+	{
+		std::scoped_lock lock(m_PendingMutex);
+		std::swap(m_PendingMessages, m_AppliedMessages);
+		std::swap(m_PendingText, m_AppliedText);
+	}
+
+	size_t offset = 0;
+	for (const PendingMessage& pending : m_AppliedMessages)
+	{
+		std::string_view tag(m_AppliedText.data() + offset, pending.TagSize);
+		offset += pending.TagSize;
+		std::string_view message(m_AppliedText.data() + offset, pending.MessageSize);
+		offset += pending.MessageSize;
+
+		switch (pending.Type)
+		{
+		case PendingType::Message:
+			m_Scrollback.Append(tag, message, pending.Color, pending.Italic);
+			break;
+		case PendingType::OlderMessage:
+			m_Scrollback.AddOlder(tag, message, pending.Color, pending.Italic);
+			break;
+		case PendingType::EndOlderMessages:
+			m_Scrollback.CommitOlder();
+			break;
+		case PendingType::Clear:
+			m_Scrollback.Clear();
+			m_FollowLatest = true;
+			break;
+		}
+	}
+
+	m_AppliedMessages.clear();
+	m_AppliedText.clear();
+}
+
+void ChatConsole::OnUIRender()
+{
+	WC_TRACE_SCOPE("ChatConsole::OnUIRender");
+	ImGui::Begin(m_Title.c_str());
+
+	const float footerHeight = ImGui::GetStyle().ItemSpacing.y + ImGui::GetFrameHeightWithSpacing();
+	UI_Scrollback(-footerHeight);
+	ImGui::Separator();
+
+	if (!m_FollowLatest)
+	{
+		if (ImGui::Button("Latest"))
+			m_JumpToLatest = true;
+		ImGui::SameLine();
+	}
+
+	// InputText consumes the frame's typed characters, so edits are caught as it makes them
+	auto onEdit = [](ImGuiInputTextCallbackData* data)
+	{
+		((ChatConsole*)data->UserData)->m_InputEdited = true;
+		return 0;
+	};
+
+	bool reclaimFocus = false;
+	m_InputEdited = false;
+	ImGui::PushItemWidth(-1.0f);
+	if (ImGui::InputText("##Input", &m_InputBuffer, ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputTextFlags_CallbackEdit, onEdit, this))
+	{
+		if (!m_InputBuffer.empty() && m_MessageSendCallback)
+			m_MessageSendCallback(m_InputBuffer);
+		m_InputBuffer.clear();
+		m_InputEdited = false; // Sent, not typing anymore
+		reclaimFocus = true;
+		// What you just sent is at the bottom
+		m_JumpToLatest = true;
+	}
+	ImGui::PopItemWidth();
+
+	ImGui::SetItemDefaultFocus();
+	if (reclaimFocus)
+		ImGui::SetKeyboardFocusHere(-1);
+
+	ImGui::End();
+}
+
+void ChatConsole::UI_Scrollback(float height)
+{
+	// Everything that changes what's laid out happens before the child window begins, so the
+	// scroll position can be corrected in this same frame (SetNextWindowScroll) and the view
+	// stays on the same row however much was added or dropped above it
+	ChatScrollback::Anchor anchor = m_Scrollback.GetAnchor(m_ScrollY);
+	float anchorY = m_Scrollback.GetAnchorY(anchor);
+	float previousHeight = m_Scrollback.GetHeight();
+
+	ApplyPendingMessages();
+
+	bool followLatest = m_FollowLatest && m_Scrollback.IsWindowAtLatest();
+	bool scrollToLatest = false;
+	if (m_JumpToLatest)
+	{
+		m_JumpToLatest = false;
+		if (!m_Scrollback.IsWindowAtLatest())
+			m_Scrollback.MoveWindowToLatest();
+		followLatest = true;
+		scrollToLatest = true;
+	}
+	else if (!followLatest)
+	{
+		// Move the window along once the view gets within a screen of either end, and ask for
+		// more once we're at the very top of what we have
+		if (m_ScrollY < m_ViewHeight)
+		{
+			if (!m_Scrollback.ExtendWindowUp() && m_ScrollY <= 0.0f && m_ScrollMaxY > 0.0f && m_OlderMessagesCallback)
+				m_OlderMessagesCallback();
+		}
+		else if (m_ScrollMaxY - m_ScrollY < m_ViewHeight)
+		{
+			m_Scrollback.ExtendWindowDown();
+		}
+	}
+
+	// Wrapped to the space left minus a scrollbar, so the layout is known before the child
+	// window exists. Without a scrollbar that just wraps a little early.
+	const ImGuiStyle& style = ImGui::GetStyle();
+	m_LayoutWidth = std::max(ImGui::GetContentRegionAvail().x - style.ScrollbarSize, 1.0f);
+	auto measure = [this](const ChatScrollback::Row& row) { return MeasureRow(row); };
+
+	m_Scrollback.UpdateLayout(m_LayoutWidth, measure);
+	float viewY = anchorY >= 0.0f ? m_Scrollback.GetAnchorY(anchor) : m_ScrollY;
+	m_Scrollback.ShrinkWindow(followLatest ? m_Scrollback.GetHeight() : viewY);
+	m_Scrollback.UpdateLayout(m_LayoutWidth, measure);
+
+	float contentHeight = m_Scrollback.GetHeight();
+	ImGui::SetNextWindowContentSize(ImVec2(0.0f, contentHeight));
+	if (followLatest)
+	{
+		// Clamped to the bottom
+		if (scrollToLatest || contentHeight != previousHeight)
+			ImGui::SetNextWindowScroll(ImVec2(-1.0f, contentHeight));
+	}
+	else if (anchorY >= 0.0f)
+	{
+		float newAnchorY = m_Scrollback.GetAnchorY(anchor);
+		if (newAnchorY < 0.0f)
+			ImGui::SetNextWindowScroll(ImVec2(-1.0f, 0.0f)); // The window moved somewhere else entirely
+		else if (newAnchorY != anchorY)
+			ImGui::SetNextWindowScroll(ImVec2(-1.0f, m_ScrollY + newAnchorY - anchorY));
+	}
+
+	if (ImGui::BeginChild("ScrollingRegion", ImVec2(0.0f, height)))
+	{
+		m_ScrollY = ImGui::GetScrollY();
+		m_ScrollMaxY = ImGui::GetScrollMaxY();
+		m_ViewHeight = ImGui::GetWindowHeight();
+
+		// Only the rows in view
+		float startX = ImGui::GetCursorPosX();
+		float startY = ImGui::GetCursorPosY();
+		ImGui::PushTextWrapPos(startX + m_LayoutWidth);
+		m_Scrollback.ForEachRow(m_ScrollY, m_ScrollY + m_ViewHeight, [&](const ChatScrollback::Row& row, float y)
+		{
+			ImFont* font = row.Italic ? Walnut::Application::GetFont("Italic") : nullptr;
+			if (font)
+				ImGui::PushFont(font);
+			ImGui::PushStyleColor(ImGuiCol_Text, ImColor(row.Color).Value);
+
+			std::string_view text = FormatRow(row);
+			ImGui::SetCursorPosY(startY + y);
+			ImGui::TextUnformatted(text.data(), text.data() + text.size());
+
+			ImGui::PopStyleColor();
+			if (font)
+				ImGui::PopFont();
+		});
+		ImGui::PopTextWrapPos();
+
+		m_FollowLatest = m_Scrollback.IsWindowAtLatest() && m_ScrollY >= m_ScrollMaxY - 1.0f;
+	}
+	ImGui::EndChild();
+}
+
+float ChatConsole::MeasureRow(const ChatScrollback::Row& row)
+{
+	ImFont* font = row.Italic ? Walnut::Application::GetFont("Italic") : nullptr;
+	if (font)
+		ImGui::PushFont(font);
+
+	std::string_view text = FormatRow(row);
+	float height = ImGui::CalcTextSize(text.data(), text.data() + text.size(), false, m_LayoutWidth).y;
+
+	if (font)
+		ImGui::PopFont();
+	return height + ImGui::GetStyle().ItemSpacing.y;
+}
+
+std::string_view ChatConsole::FormatRow(const ChatScrollback::Row& row)
+{
+	m_RowBuffer.clear();
+	if (!row.Tag.empty())
+	{
+		m_RowBuffer += '[';
+		m_RowBuffer += row.Tag;
+		m_RowBuffer += "] ";
+	}
+	m_RowBuffer += row.Text;
+	return m_RowBuffer;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "ChatScrollback.h"
+
+#include "spdlog/spdlog.h"
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// ChatConsole - the chat window, in place of Walnut::UI::Console (same Add*Message() calls).
+// Messages are kept in a ChatScrollback and only the rows in view are drawn, so neither
+// memory nor frame time grows with the length of the session.
+//
+// Messages can be added from any thread, they're handed over to the UI thread's next frame.
+//
+class ChatConsole
+{
+public:
+	using MessageSendCallback = std::function<void(std::string_view)>;
+	// Scrolled to the top of everything we have
+	using OlderMessagesCallback = std::function<void()>;
+public:
+	ChatConsole(std::string_view title = "Chat");
+
+	void ClearLog();
+
+	template<typename... Args>
+	void AddMessage(std::string_view format, Args&&... args)
+	{
+		AddFormattedMessage({}, 0xffffffff, false, format, fmt::make_format_args(args...));
+	}
+
+	template<typename... Args>
+	void AddItalicMessage(std::string_view format, Args&&... args)
+	{
+		AddFormattedMessage({}, 0xffffffff, true, format, fmt::make_format_args(args...));
+	}
+
+	template<typename... Args>
+	void AddTaggedMessage(std::string_view tag, std::string_view format, Args&&... args)
+	{
+		AddFormattedMessage(tag, 0xffffffff, false, format, fmt::make_format_args(args...));
+	}
+
+	template<typename... Args>
+	void AddMessageWithColor(uint32_t color, std::string_view format, Args&&... args)
+	{
+		AddFormattedMessage({}, color, false, format, fmt::make_format_args(args...));
+	}
+
+	template<typename... Args>
+	void AddItalicMessageWithColor(uint32_t color, std::string_view format, Args&&... args)
+	{
+		AddFormattedMessage({}, color, true, format, fmt::make_format_args(args...));
+	}
+
+	template<typename... Args>
+	void AddTaggedMessageWithColor(uint32_t color, std::string_view tag, std::string_view format, Args&&... args)
+	{
+		AddFormattedMessage(tag, color, false, format, fmt::make_format_args(args...));
+	}
+
+	// Messages from before everything so far (eg. paged in from the server), oldest first. They
+	// show up once EndOlderMessages() is called.
+	void AddOlderMessage(uint32_t color, std::string_view tag, std::string_view message, bool italic = false);
+	void EndOlderMessages();
+
+	void OnUIRender();
+	// Text was typed into (or deleted from, pasted into) the input during the last OnUIRender()
+	bool WasInputEdited() const { return m_InputEdited; }
+
+	void SetMessageSendCallback(const MessageSendCallback& callback) { m_MessageSendCallback = callback; }
+	void SetOlderMessagesCallback(const OlderMessagesCallback& callback) { m_OlderMessagesCallback = callback; }
+private:
+	enum class PendingType : uint8_t
+	{
+		Message, OlderMessage, EndOlderMessages, Clear
+	};
+	struct PendingMessage
+	{
+		PendingType Type = PendingType::Message;
+		bool Italic = false;
+		uint32_t Color = 0xffffffff;
+		uint32_t TagSize = 0;
+		uint32_t MessageSize = 0;
+	};
+
+	void AddFormattedMessage(std::string_view tag, uint32_t color, bool italic, std::string_view format, fmt::format_args args);
+	void AddPending(PendingType type, std::string_view tag, std::string_view message, uint32_t color, bool italic);
+	// Into the scrollback, on the UI thread
+	void ApplyPendingMessages();
+
+	void UI_Scrollback(float height);
+	float MeasureRow(const ChatScrollback::Row& row);
+	// "[tag] message" into m_RowBuffer
+	std::string_view FormatRow(const ChatScrollback::Row& row);
+private:
+	std::string m_Title;
+	ChatScrollback m_Scrollback;
+
+	std::mutex m_PendingMutex;
+	std::vector<PendingMessage> m_PendingMessages;
+	// Every pending message's tag and text back to back
+	std::string m_PendingText;
+	// Swapped with the above, keeps both sides' capacity
+	std::vector<PendingMessage> m_AppliedMessages;
+	std::string m_AppliedText;
+
+	// Last frame's view of the scrolling region
+	float m_ScrollY = 0.0f;
+	float m_ScrollMaxY = 0.0f;
+	float m_ViewHeight = 0.0f;
+	float m_LayoutWidth = 0.0f;
+	// At the bottom of the latest messages, new ones scroll into view
+	bool m_FollowLatest = true;
+	bool m_JumpToLatest = false;
+
+	std::string m_RowBuffer;
+	std::string m_InputBuffer;
+	bool m_InputEdited = false;
+
+	MessageSendCallback m_MessageSendCallback;
+	OlderMessagesCallback m_OlderMessagesCallback;
+};
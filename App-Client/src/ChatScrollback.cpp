@@ -0,0 +1,392 @@
+#include "ChatScrollback.h"
+
+#include "Trace.h"
+
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+ChatScrollback::ChatScrollback(const ChatScrollbackSpecification& specification)
+	: m_Specification(specification)
+{
+}
+
+ChatScrollback::~ChatScrollback()
+{
+	if (m_CacheFile.is_open())
+	{
+		m_CacheFile.close();
+		std::error_code error;
+		std::filesystem::remove(m_CacheFilepath, error);
+	}
+}
+
+void ChatScrollback::Clear()
+{
+	m_Blocks.clear();
+	m_FrontBlocksAdded = 0;
+	m_WindowBegin = 0;
+	m_WindowEnd = 0;
+	m_OlderRows = BlockData();
+	m_BlockTops.clear();
+	m_Height = 0.0f;
+
+	// Nothing in there is referenced anymore, so just write over it
+	m_CacheFileSize = 0;
+}
+
+void ChatScrollback::Append(std::string_view tag, std::string_view text, uint32_t color, bool italic)
+{
+	if (m_Blocks.empty() || m_Blocks.back().Closed)
+	{
+		// A window that was showing the latest rows keeps doing so
+		bool windowAtLatest = IsWindowAtLatest();
+		Block& block = m_Blocks.emplace_back();
+		block.Data = std::make_unique<BlockData>();
+		if (windowAtLatest)
+			m_WindowEnd = m_Blocks.size();
+	}
+
+	Block& block = m_Blocks.back();
+	AddRow(*block.Data, tag, text, color, italic);
+	block.RowCount++;
+
+	if (IsBlockFull(*block.Data))
+	{
+		CloseBlock(block);
+		UnloadBlock(m_Blocks.size() - 1);
+	}
+}
+
+void ChatScrollback::AddOlder(std::string_view tag, std::string_view text, uint32_t color, bool italic)
+{
+	AddRow(m_OlderRows, tag, text, color, italic);
+}
+
+void ChatScrollback::CommitOlder()
+{
+	WC_TRACE_SCOPE("ChatScrollback::CommitOlder");
+	if (m_OlderRows.Rows.empty())
+		return;
+
+	// Cut into blocks oldest first, then put them in front newest first
+	std::vector<std::unique_ptr<BlockData>> blocks;
+	for (uint32_t i = 0; i < (uint32_t)m_OlderRows.Rows.size(); i++)
+	{
+		if (blocks.empty() || IsBlockFull(*blocks.back()))
+			blocks.push_back(std::make_unique<BlockData>());
+
+		Row row = GetRow(m_OlderRows, i);
+		AddRow(*blocks.back(), row.Tag, row.Text, row.Color, row.Italic);
+	}
+	m_OlderRows = BlockData();
+
+	bool windowAtOldest = IsWindowAtOldest() && m_WindowEnd > m_WindowBegin;
+	for (auto it = blocks.rbegin(); it != blocks.rend(); it++)
+	{
+		Block& block = m_Blocks.emplace_front();
+		block.RowCount = (uint32_t)(*it)->Rows.size();
+		block.Data = std::move(*it);
+		CloseBlock(block);
+	}
+	m_FrontBlocksAdded += blocks.size();
+	m_WindowBegin += blocks.size();
+	m_WindowEnd += blocks.size();
+
+	if (windowAtOldest)
+	{
+		// They go right above what's being looked at, ShrinkWindow() trims whatever is too much
+		m_WindowBegin = 0;
+	}
+	else
+	{
+		MoveWindowToOldest();
+		for (size_t i = m_WindowEnd; i < blocks.size(); i++)
+			UnloadBlock(i);
+	}
+}
+
+bool ChatScrollback::ExtendWindowUp()
+{
+	if (m_WindowBegin == 0 || !LoadBlock(m_Blocks[m_WindowBegin - 1]))
+		return false;
+
+	m_WindowBegin--;
+	return true;
+}
+
+bool ChatScrollback::ExtendWindowDown()
+{
+	if (m_WindowEnd == m_Blocks.size() || !LoadBlock(m_Blocks[m_WindowEnd]))
+		return false;
+
+	m_WindowEnd++;
+	return true;
+}
+
+void ChatScrollback::ShrinkWindow(float y)
+{
+	while (m_WindowEnd - m_WindowBegin > m_Specification.MaxWindowBlocks)
+	{
+		// Heights of blocks that just came into the window may not be known yet, halves are
+		// close enough to tell which end is further away
+		if (y < m_Height * 0.5f)
+		{
+			m_WindowEnd--;
+			UnloadBlock(m_WindowEnd);
+		}
+		else
+		{
+			m_WindowBegin++;
+			UnloadBlock(m_WindowBegin - 1);
+		}
+	}
+}
+
+void ChatScrollback::MoveWindowToOldest()
+{
+	size_t begin = m_WindowBegin, end = m_WindowEnd;
+	m_WindowBegin = 0;
+	m_WindowEnd = 0;
+	for (size_t i = begin; i < end; i++)
+		UnloadBlock(i);
+
+	while (m_WindowEnd - m_WindowBegin < m_Specification.MaxWindowBlocks && ExtendWindowDown())
+		;
+}
+
+void ChatScrollback::MoveWindowToLatest()
+{
+	size_t begin = m_WindowBegin, end = m_WindowEnd;
+	m_WindowBegin = m_Blocks.size();
+	m_WindowEnd = m_Blocks.size();
+	for (size_t i = begin; i < end; i++)
+		UnloadBlock(i);
+
+	while (m_WindowEnd - m_WindowBegin < m_Specification.MaxWindowBlocks && ExtendWindowUp())
+		;
+}
+
+void ChatScrollback::UpdateLayout(float width, const MeasureFunc& measure)
+{
+	WC_TRACE_SCOPE("ChatScrollback::UpdateLayout");
+
+	m_BlockTops.resize(m_WindowEnd - m_WindowBegin);
+	m_Height = 0.0f;
+	for (size_t i = m_WindowBegin; i < m_WindowEnd; i++)
+	{
+		BlockData& data = *m_Blocks[i].Data;
+		if (data.LayoutWidth != width)
+		{
+			data.MeasuredRows = 0;
+			data.LayoutWidth = width;
+		}
+
+		// Only new rows, unless everything moved
+		data.RowTops.resize(data.Rows.size());
+		float top = data.MeasuredRows ? data.RowTops[data.MeasuredRows - 1] : 0.0f;
+		for (uint32_t row = data.MeasuredRows; row < (uint32_t)data.Rows.size(); row++)
+		{
+			if (row > 0)
+				top += measure(GetRow(data, row - 1));
+			data.RowTops[row] = top;
+		}
+		if (data.MeasuredRows < (uint32_t)data.Rows.size())
+			data.Height = data.RowTops.back() + measure(GetRow(data, (uint32_t)data.Rows.size() - 1));
+		data.MeasuredRows = (uint32_t)data.Rows.size();
+
+		m_BlockTops[i - m_WindowBegin] = m_Height;
+		m_Height += data.Height;
+	}
+}
+
+ChatScrollback::Anchor ChatScrollback::GetAnchor(float y) const
+{
+	Anchor anchor;
+	if (m_BlockTops.empty() || m_BlockTops.size() != m_WindowEnd - m_WindowBegin)
+		return anchor;
+
+	size_t blockIndex = FindWindowBlock(y);
+	const BlockData& data = *m_Blocks[blockIndex].Data;
+	if (data.MeasuredRows == 0)
+		return anchor;
+
+	float blockTop = m_BlockTops[blockIndex - m_WindowBegin];
+	auto rowTopsEnd = data.RowTops.begin() + data.MeasuredRows;
+	auto it = std::upper_bound(data.RowTops.begin(), rowTopsEnd, y - blockTop);
+	uint32_t row = it == data.RowTops.begin() ? 0 : (uint32_t)(it - data.RowTops.begin() - 1);
+
+	anchor.Block = GetBlockNumber(blockIndex);
+	anchor.Row = row;
+	anchor.Offset = y - (blockTop + data.RowTops[row]);
+	anchor.Valid = true;
+	return anchor;
+}
+
+float ChatScrollback::GetAnchorY(const Anchor& anchor) const
+{
+	if (!anchor.Valid)
+		return -1.0f;
+
+	int64_t blockIndex = anchor.Block + m_FrontBlocksAdded;
+	if (blockIndex < (int64_t)m_WindowBegin || blockIndex >= (int64_t)m_WindowEnd || m_BlockTops.size() != m_WindowEnd - m_WindowBegin)
+		return -1.0f;
+
+	const BlockData& data = *m_Blocks[blockIndex].Data;
+	if (anchor.Row >= data.MeasuredRows)
+		return -1.0f;
+
+	return m_BlockTops[blockIndex - m_WindowBegin] + data.RowTops[anchor.Row] + anchor.Offset;
+}
+
+void ChatScrollback::ForEachRow(float top, float bottom, const std::function<void(const Row& row, float y)>& func) const
+{
+	if (m_BlockTops.empty() || m_BlockTops.size() != m_WindowEnd - m_WindowBegin)
+		return;
+
+	for (size_t blockIndex = FindWindowBlock(top); blockIndex < m_WindowEnd; blockIndex++)
+	{
+		const BlockData& data = *m_Blocks[blockIndex].Data;
+		float blockTop = m_BlockTops[blockIndex - m_WindowBegin];
+		if (blockTop >= bottom)
+			break;
+
+		auto rowTopsEnd = data.RowTops.begin() + data.MeasuredRows;
+		auto it = std::upper_bound(data.RowTops.begin(), rowTopsEnd, top - blockTop);
+		uint32_t row = it == data.RowTops.begin() ? 0 : (uint32_t)(it - data.RowTops.begin() - 1);
+		for (; row < data.MeasuredRows; row++)
+		{
+			float y = blockTop + data.RowTops[row];
+			if (y >= bottom)
+				return;
+
+			func(GetRow(data, row), y);
+		}
+	}
+}
+
+ChatScrollback::Row ChatScrollback::GetRow(const BlockData& data, uint32_t row) const
+{
+	const RowInfo& info = data.Rows[row];
+	Row result;
+	result.Tag = std::string_view(data.Text.data() + info.Offset, info.TagSize);
+	result.Text = std::string_view(data.Text.data() + info.Offset + info.TagSize, info.TextSize);
+	result.Color = info.Color;
+	result.Italic = info.Italic;
+	return result;
+}
+
+void ChatScrollback::AddRow(BlockData& data, std::string_view tag, std::string_view text, uint32_t color, bool italic)
+{
+	// Usernames are short, anything that doesn't fit a tag gets cut
+	tag = tag.substr(0, UINT16_MAX);
+
+	RowInfo& info = data.Rows.emplace_back();
+	info.Offset = (uint32_t)data.Text.size();
+	info.TagSize = (uint16_t)tag.size();
+	info.TextSize = (uint32_t)text.size();
+	info.Color = color;
+	info.Italic = italic;
+	data.Text.append(tag);
+	data.Text.append(text);
+}
+
+bool ChatScrollback::IsBlockFull(const BlockData& data) const
+{
+	return data.Rows.size() >= m_Specification.MaxBlockRows || data.Text.size() >= m_Specification.MaxBlockTextSize;
+}
+
+bool ChatScrollback::LoadBlock(Block& block)
+{
+	if (block.Data)
+		return true;
+
+	WC_TRACE_SCOPE("ChatScrollback::LoadBlock");
+
+	uint64_t rowsSize = (uint64_t)block.RowCount * sizeof(RowInfo);
+	if (!m_CacheFile.is_open() || block.FileSize < rowsSize)
+		return false;
+
+	auto data = std::make_unique<BlockData>();
+	data->Rows.resize(block.RowCount);
+	data->Text.resize(block.FileSize - rowsSize);
+
+	m_CacheFile.clear();
+	m_CacheFile.seekg(block.FileOffset);
+	m_CacheFile.read((char*)data->Rows.data(), rowsSize);
+	m_CacheFile.read(data->Text.data(), data->Text.size());
+	if (!m_CacheFile)
+	{
+		std::cout << "[ERROR] Failed to read chat scrollback cache " << m_CacheFilepath << std::endl;
+		return false;
+	}
+
+	block.Data = std::move(data);
+	return true;
+}
+
+void ChatScrollback::CloseBlock(Block& block)
+{
+	block.Closed = true;
+	// Should the cache be unusable the block just stays in memory
+	WriteBlock(block);
+}
+
+bool ChatScrollback::WriteBlock(Block& block)
+{
+	WC_TRACE_SCOPE("ChatScrollback::WriteBlock");
+	if (m_CacheFileFailed)
+		return false;
+
+	if (!m_CacheFile.is_open())
+	{
+		// Random, there can be any number of clients running
+		std::random_device device;
+		m_CacheFilepath = m_Specification.CacheDirectory / fmt::format("WalnutChat-{:08x}{:08x}.scrollback", device(), device());
+		m_CacheFile.open(m_CacheFilepath, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!m_CacheFile.is_open())
+		{
+			std::cout << "[ERROR] Could not create chat scrollback cache " << m_CacheFilepath << ", keeping everything in memory" << std::endl;
+			m_CacheFileFailed = true;
+			return false;
+		}
+	}
+
+	const BlockData& data = *block.Data;
+	uint64_t rowsSize = data.Rows.size() * sizeof(RowInfo);
+
+	m_CacheFile.clear();
+	m_CacheFile.seekp(m_CacheFileSize);
+	m_CacheFile.write((const char*)data.Rows.data(), rowsSize);
+	m_CacheFile.write(data.Text.data(), data.Text.size());
+	if (!m_CacheFile)
+	{
+		std::cout << "[ERROR] Failed to write chat scrollback cache " << m_CacheFilepath << ", keeping everything in memory" << std::endl;
+		m_CacheFileFailed = true;
+		return false;
+	}
+
+	block.FileOffset = m_CacheFileSize;
+	block.FileSize = (uint32_t)(rowsSize + data.Text.size());
+	m_CacheFileSize += block.FileSize;
+	return true;
+}
+
+void ChatScrollback::UnloadBlock(size_t index)
+{
+	Block& block = m_Blocks[index];
+	bool inWindow = index >= m_WindowBegin && index < m_WindowEnd;
+	if (inWindow || !block.Closed || block.FileSize == 0)
+		return;
+
+	block.Data.reset();
+}
+
+size_t ChatScrollback::FindWindowBlock(float y) const
+{
+	auto it = std::upper_bound(m_BlockTops.begin(), m_BlockTops.end(), y);
+	size_t offset = it == m_BlockTops.begin() ? 0 : (size_t)(it - m_BlockTops.begin() - 1);
+	return m_WindowBegin + offset;
+}
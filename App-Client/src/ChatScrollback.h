@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ChatScrollbackSpecification
+{
+	// The cache file goes here, it's removed again when the scrollback is destroyed
+	std::filesystem::path CacheDirectory = std::filesystem::temp_directory_path();
+
+	// A block is closed once it has this many rows or this much text
+	uint32_t MaxBlockRows = 512;
+	uint32_t MaxBlockTextSize = 128 * 1024;
+	// Blocks that are laid out and can be scrolled through. The block being appended to is
+	// always in memory on top of these.
+	uint32_t MaxWindowBlocks = 8;
+};
+
+//
+// ChatScrollback - the client's chat log, so a long session doesn't keep every message in
+// memory and lay all of them out every frame.
+//
+// Rows are kept in blocks: one string with every row's tag and text back to back, and a
+// small fixed-size record per row. Closed blocks are written to a cache file. The window is
+// the run of blocks that's in memory and laid out (row heights measured), and is what gets
+// scrolled through. It's moved a block at a time as the view nears either end, reading
+// blocks back from the cache as needed, so what a frame costs depends on the window and not
+// on how long the session has been going.
+//
+// Rows from before anything we have (history paged in from the server) are put in front with
+// AddOlder()/CommitOlder().
+//
+class ChatScrollback
+{
+public:
+	struct Row
+	{
+		std::string_view Tag;
+		std::string_view Text;
+		uint32_t Color = 0xffffffff;
+		bool Italic = false;
+	};
+	// Height of a row (including spacing) at the current layout width
+	using MeasureFunc = std::function<float(const Row& row)>;
+
+	// A row and how far into it, to keep the view on the same row when what's above it changes
+	struct Anchor
+	{
+		int64_t Block = 0;
+		uint32_t Row = 0;
+		float Offset = 0.0f;
+		bool Valid = false;
+	};
+public:
+	ChatScrollback(const ChatScrollbackSpecification& specification = ChatScrollbackSpecification());
+	~ChatScrollback();
+
+	void Clear();
+
+	// The text is copied, only has to be valid for the call
+	void Append(std::string_view tag, std::string_view text, uint32_t color, bool italic);
+
+	// Collects rows older than everything so far, oldest first. CommitOlder() puts them in
+	// front and moves the window there if it wasn't at the oldest rows already.
+	void AddOlder(std::string_view tag, std::string_view text, uint32_t color, bool italic);
+	void CommitOlder();
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Window
+	////////////////////////////////////////////////////////////////////////////////
+	bool IsWindowAtOldest() const { return m_WindowBegin == 0; }
+	bool IsWindowAtLatest() const { return m_WindowEnd == m_Blocks.size(); }
+
+	// One more block at either end, false if there's nothing more (or it couldn't be read)
+	bool ExtendWindowUp();
+	bool ExtendWindowDown();
+	// Drops blocks from whichever end is further from y until the window is small enough
+	void ShrinkWindow(float y);
+	void MoveWindowToOldest();
+	void MoveWindowToLatest();
+
+	// Measures rows that haven't been at this width yet, all of a block's if it was laid out at another width
+	void UpdateLayout(float width, const MeasureFunc& measure);
+	float GetHeight() const { return m_Height; }
+
+	Anchor GetAnchor(float y) const;
+	// Where the anchor's row starts plus its offset, negative if the row isn't in the window
+	float GetAnchorY(const Anchor& anchor) const;
+
+	// Rows overlapping [top, bottom) with where they start, top to bottom
+	void ForEachRow(float top, float bottom, const std::function<void(const Row& row, float y)>& func) const;
+	////////////////////////////////////////////////////////////////////////////////
+private:
+	struct RowInfo
+	{
+		uint32_t Offset = 0;
+		uint32_t TextSize = 0;
+		uint32_t Color = 0xffffffff;
+		uint16_t TagSize = 0;
+		uint8_t Italic = 0;
+		uint8_t Padding = 0;
+	};
+
+	struct BlockData
+	{
+		std::string Text;
+		std::vector<RowInfo> Rows;
+		// Where each row starts, from the top of the block. Only rows up to MeasuredRows, and
+		// only at LayoutWidth (blocks outside the window keep theirs through width changes).
+		std::vector<float> RowTops;
+		uint32_t MeasuredRows = 0;
+		float LayoutWidth = -1.0f;
+		float Height = 0.0f;
+	};
+
+	struct Block
+	{
+		uint32_t RowCount = 0;
+		// In the cache file, FileSize is 0 until it's been written
+		uint64_t FileOffset = 0;
+		uint32_t FileSize = 0;
+		bool Closed = false;
+		// Only while it's in the window (or being appended to)
+		std::unique_ptr<BlockData> Data;
+	};
+
+	Row GetRow(const BlockData& data, uint32_t row) const;
+	static void AddRow(BlockData& data, std::string_view tag, std::string_view text, uint32_t color, bool italic);
+	bool IsBlockFull(const BlockData& data) const;
+
+	// Index into m_Blocks, blocks before the front ones get negative numbers
+	int64_t GetBlockNumber(size_t index) const { return (int64_t)index - m_FrontBlocksAdded; }
+
+	// Reads it back if it's been unloaded
+	bool LoadBlock(Block& block);
+	void CloseBlock(Block& block);
+	bool WriteBlock(Block& block);
+	// Drops the rows if they're in the cache and the block is out of the window
+	void UnloadBlock(size_t index);
+
+	// The window block (index into m_Blocks) that y is in, the last one if it's past the end
+	size_t FindWindowBlock(float y) const;
+private:
+	ChatScrollbackSpecification m_Specification;
+
+	std::deque<Block> m_Blocks;
+	// Blocks put in front since the last Clear(), keeps block numbers stable
+	int64_t m_FrontBlocksAdded = 0;
+	// [begin, end) into m_Blocks
+	size_t m_WindowBegin = 0;
+	size_t m_WindowEnd = 0;
+
+	// Waiting for CommitOlder()
+	BlockData m_OlderRows;
+
+	// Top of every window block, as of the last UpdateLayout()
+	std::vector<float> m_BlockTops;
+	float m_Height = 0.0f;
+
+	std::filesystem::path m_CacheFilepath;
+	std::fstream m_CacheFile;
+	uint64_t m_CacheFileSize = 0;
+	bool m_CacheFileFailed = false;
+};
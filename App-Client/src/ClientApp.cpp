@@ -1,8 +1,15 @@
+#ifdef WL_HEADLESS
+#include "Walnut/Application.h"
+#else
 #include "Walnut/ApplicationGUI.h"
+#endif
 #include "Walnut/EntryPoint.h"
 
 #include "ClientLayer.h"
 
+#include <cstdlib>
+#include <string_view>
+
 const static uint64_t s_BufferSize = 1024;
 static uint8_t* s_Buffer = new uint8_t[s_BufferSize];
 
@@ -10,13 +17,30 @@ Walnut::Application* Walnut::CreateApplication(int argc, char** argv)
 {
 	Walnut::ApplicationSpecification spec;
 	spec.Name = "Walnut Chat Client 1.2";
+#ifndef WL_HEADLESS
 	spec.IconPath = "res/Walnut-Icon.png";
 	spec.CustomTitlebar = true;
 	spec.CenterWindow = true;
+#endif
+
+	ClientLayerSpecification clientSpec;
+	for (int i = 1; i < argc; i++)
+	{
+		// --server <address> (hostname or IP, with optional :port)
+		if (std::string_view(argv[i]) == "--server" && i + 1 < argc)
+			clientSpec.ServerAddress = argv[++i];
+		// --username <name>
+		else if (std::string_view(argv[i]) == "--username" && i + 1 < argc)
+			clientSpec.Username = argv[++i];
+		// --color <hex> as stored in ConnectionDetails.yaml (0xAABBGGRR)
+		else if (std::string_view(argv[i]) == "--color" && i + 1 < argc)
+			clientSpec.Color = (uint32_t)std::strtoul(argv[++i], nullptr, 16);
+	}
 
 	Walnut::Application* app = new Walnut::Application(spec);
-	std::shared_ptr<ClientLayer> clientLayer = std::make_shared<ClientLayer>();
+	std::shared_ptr<ClientLayer> clientLayer = std::make_shared<ClientLayer>(clientSpec);
 	app->PushLayer(clientLayer);
+#ifndef WL_HEADLESS
 	app->SetMenubarCallback([app, clientLayer]()
 	{
 		if (ImGui::BeginMenu("File"))
@@ -29,5 +53,6 @@ Walnut::Application* Walnut::CreateApplication(int argc, char** argv)
 			ImGui::EndMenu();
 		}
 	});
+#endif
 	return app;
-}
\ No newline at end of file
+}
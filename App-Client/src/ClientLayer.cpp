@@ -1,32 +1,93 @@
 #include "ClientLayer.h"
 
 #include "ServerPacket.h"
+#include "WalnutClientTransport.h"
+#include "Trace.h"
 
 #include "Walnut/Application.h"
-#include "Walnut/UI/UI.h"
 #include "Walnut/Serialization/BufferStream.h"
 #include "Walnut/Networking/NetworkingUtils.h"
 #include "Walnut/Utils/StringUtils.h"
 
+#ifndef WL_HEADLESS
+#include "Walnut/UI/UI.h"
 #include "misc/cpp/imgui_stdlib.h"
+#endif
 
 #include <yaml-cpp/yaml.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
+ClientLayer::ClientLayer(const ClientLayerSpecification& specification, std::unique_ptr<ClientTransport> transport)
+	: m_Specification(specification), m_Client(std::move(transport))
+{
+}
+
 void ClientLayer::OnAttach()
 {
+	Trace::SetThreadName("Main");
+
 	m_ScratchBuffer.Allocate(1024);
 
-	m_Client = std::make_unique<Walnut::Client>();
+	if (!m_Client)
+		m_Client = std::make_unique<WalnutClientTransport>();
+
+#ifdef WL_HEADLESS
+	// Transport callbacks come in on the networking thread and console input on the console's
+	// input thread, so hand them over to the event loop
+	m_Client->SetServerConnectedCallback([this]() { m_EventLoop.Post([this]() { OnConnected(); }); });
+	m_Client->SetServerDisconnectedCallback([this]() { m_EventLoop.Post([this]() { OnDisconnected(); }); });
+	m_Client->SetDataReceivedCallback([this](const Walnut::Buffer data)
+	{
+		// Data is only valid for the duration of this callback
+		Walnut::Buffer dataCopy = Walnut::Buffer::Copy(data);
+		m_EventLoop.Post([this, dataCopy]() mutable
+		{
+			OnDataReceived(dataCopy);
+			dataCopy.Release();
+		});
+	});
+
+	m_Console.SetMessageSendCallback([this](std::string_view message)
+	{
+		m_EventLoop.Post([this, message = std::string(message)]() { SendChatMessage(message); });
+	});
+#else
 	m_Client->SetServerConnectedCallback([this]() { OnConnected(); });
 	m_Client->SetServerDisconnectedCallback([this]() { OnDisconnected(); });
 	m_Client->SetDataReceivedCallback([this](const Walnut::Buffer data) { OnDataReceived(data); });
 
 	m_Console.SetMessageSendCallback([this](std::string_view message) { SendChatMessage(message); });
+	m_Console.SetOlderMessagesCallback([this]() { OnScrolledToOldestMessage(); });
+#endif
 
 	LoadConnectionDetails(m_ConnectionDetailsFilePath);
+	if (!m_Specification.ServerAddress.empty())
+		m_ServerIP = m_Specification.ServerAddress;
+	if (!m_Specification.Username.empty())
+		m_Username = m_Specification.Username;
+	if (m_Specification.Color)
+		m_Color = m_Specification.Color;
+
+#ifdef WL_HEADLESS
+	if (m_ServerIP.empty() || m_Username.empty())
+	{
+		m_Console.AddMessage("No server address or username, use --server <address> --username <name> (or ConnectionDetails.yaml)");
+		Walnut::Application::Get().Close();
+		return;
+	}
+
+	m_Console.AddItalicMessage("Connecting to {} as {}...", m_ServerIP, m_Username);
+	ConnectToServer();
+#else
+	ImVec4 color = ImColor(m_Color).Value;
+	m_ColorBuffer[0] = color.x;
+	m_ColorBuffer[1] = color.y;
+	m_ColorBuffer[2] = color.z;
+	m_ColorBuffer[3] = color.w;
+#endif
 }
 
 void ClientLayer::OnDetach()
@@ -34,20 +95,55 @@ void ClientLayer::OnDetach()
 	m_Client->Disconnect();
 	// ^ currently disconnect is blocking
 
+	DiscardIncomingFiles();
+	m_OutgoingFiles.clear();
+
 	m_ScratchBuffer.Release();
 }
 
+void ClientLayer::OnUpdate(float ts)
+{
+#ifdef WL_HEADLESS
+	// Nothing to draw, so sleep until a network event or console input wakes us up. Connection
+	// status is only polled, so don't sleep for long.
+	m_EventLoop.RunOnce(std::chrono::milliseconds(100));
+#endif
+
+	if (m_ResumeToken)
+		UpdateSessionResume();
+
+#ifdef WL_HEADLESS
+	// Nothing left to do once the connection is gone (failed, lost, kicked...), unless it's a
+	// restarting server we're waiting for
+	ClientTransport::ConnectionStatus status = m_Client->GetConnectionStatus();
+	if (status == ClientTransport::ConnectionStatus::FailedToConnect && !m_ResumeToken)
+	{
+		m_Console.AddMessage("Failed to connect to {}: {}", m_ServerIP, m_Client->GetConnectionDebugMessage());
+		Walnut::Application::Get().Close();
+	}
+	else if (status == ClientTransport::ConnectionStatus::Disconnected && m_HasBeenConnected && !m_ResumeToken)
+	{
+		Walnut::Application::Get().Close();
+	}
+#endif
+}
+
 void ClientLayer::OnUIRender()
 {
+#ifndef WL_HEADLESS
+	WC_TRACE_SCOPE("ClientLayer::OnUIRender");
 	UI_ConnectionModal();
 	
 	m_Console.OnUIRender();
+	UpdateLocalPresence();
+
 	UI_ClientList();
+#endif
 }
 
 bool ClientLayer::IsConnected() const
 {
-	return m_Client->GetConnectionStatus() == Walnut::Client::ConnectionStatus::Connected;
+	return m_Client->GetConnectionStatus() == ClientTransport::ConnectionStatus::Connected;
 }
 
 void ClientLayer::OnDisconnectButton()
@@ -55,9 +151,10 @@ void ClientLayer::OnDisconnectButton()
 	m_Client->Disconnect();
 }
 
+#ifndef WL_HEADLESS
 void ClientLayer::UI_ConnectionModal()
 {
-	if (!m_ConnectionModalOpen && m_Client->GetConnectionStatus() != Walnut::Client::ConnectionStatus::Connected)
+	if (!m_ConnectionModalOpen && m_Client->GetConnectionStatus() != ClientTransport::ConnectionStatus::Connected)
 	{
 		ImGui::OpenPopup("Connect to server");
 	}
@@ -78,52 +175,28 @@ void ClientLayer::UI_ConnectionModal()
 		if (ImGui::Button("Connect"))
 		{
 			m_Color = IM_COL32(m_ColorBuffer[0] * 255.0f, m_ColorBuffer[1] * 255.0f, m_ColorBuffer[2] * 255.0f, m_ColorBuffer[3] * 255.0f);
-
-			if (Walnut::Utils::IsValidIPAddress(m_ServerIP))
-			{
-				m_Client->ConnectToServer(m_ServerIP);
-			}
-			else
-			{
-				// Try resolve domain name
-				auto ipTokens = Walnut::Utils::SplitString(m_ServerIP, ':'); // [0] == hostname, [1] (optional) == port
-				std::string serverIP = Walnut::Utils::ResolveDomainName(ipTokens[0]);
-				if (ipTokens.size() != 2)
-					serverIP = fmt::format("{}:{}", serverIP, 8192); // Add default port if hostname doesn't contain port
-				else
-					serverIP = fmt::format("{}:{}", serverIP, ipTokens[1]); // Add specified port
-
-				m_Client->ConnectToServer(serverIP);
-			}
-
+			ConnectToServer();
 		}
 
 		if (Walnut::UI::ButtonCentered("Quit"))
 			Walnut::Application::Get().Close();
 
-		if (m_Client->GetConnectionStatus() == Walnut::Client::ConnectionStatus::Connected)
+		if (m_Client->GetConnectionStatus() == ClientTransport::ConnectionStatus::Connected)
 		{
-			// Send username
-			Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-			stream.WriteRaw<PacketType>(PacketType::ClientConnectionRequest);
-			stream.WriteRaw<uint32_t>(m_Color); // Color
-			stream.WriteString(m_Username); // Username
-
-			m_Client->SendBuffer(stream.GetBuffer());
-
+			SendConnectionRequest();
 			SaveConnectionDetails(m_ConnectionDetailsFilePath);
 
 			// Wait for response
 			ImGui::CloseCurrentPopup();
 		}
-		else if (m_Client->GetConnectionStatus() == Walnut::Client::ConnectionStatus::FailedToConnect)
+		else if (m_Client->GetConnectionStatus() == ClientTransport::ConnectionStatus::FailedToConnect)
 		{
 			ImGui::TextColored(ImVec4(0.9f, 0.2f, 0.1f, 1.0f), "Connection failed.");
 			const auto& debugMessage = m_Client->GetConnectionDebugMessage();
 			if (!debugMessage.empty())
 				ImGui::TextColored(ImVec4(0.9f, 0.2f, 0.1f, 1.0f), debugMessage.c_str());
 		}
-		else if (m_Client->GetConnectionStatus() == Walnut::Client::ConnectionStatus::Connecting)
+		else if (m_Client->GetConnectionStatus() == ClientTransport::ConnectionStatus::Connecting)
 		{
 			ImGui::TextColored(ImVec4(0.8f, 0.8f, 0.8f, 1.0f), "Connecting...");
 		}
@@ -135,7 +208,21 @@ void ClientLayer::UI_ConnectionModal()
 void ClientLayer::UI_ClientList()
 {
 	ImGui::Begin("Users Online");
+	if (m_AdmissionPosition)
+		ImGui::TextColored(ImVec4(0.8f, 0.8f, 0.8f, 1.0f), "Waiting to join: %u of %u", m_AdmissionPosition, m_AdmissionQueueLength);
 	ImGui::Text("Online: %d", m_ConnectedClients.size());
+	if (m_RoundTripTime)
+	{
+		ImGui::TextColored(ImVec4(0.6f, 0.6f, 0.6f, 1.0f), "Ping: %.0f ms", m_RoundTripTime / 1000.0f);
+		if (m_DeliveryTimes.GetCount())
+		{
+			if (ImGui::IsItemHovered())
+			{
+				ImGui::SetTooltip("Relayed messages (median): %.1f ms on the server, %.1f ms from the server receiving them to here",
+					m_ServerResidenceTimes.GetPercentile(50.0) / 1000.0f, m_DeliveryTimes.GetPercentile(50.0) / 1000.0f);
+			}
+		}
+	}
 
 	static bool selected = false;
 	for (const auto& [username, clientInfo] : m_ConnectedClients)
@@ -146,101 +233,246 @@ void ClientLayer::UI_ClientList()
 		ImGui::PushStyleColor(ImGuiCol_Text, ImColor(clientInfo.Color).Value);
 		ImGui::Selectable(username.c_str(), &selected);
 		ImGui::PopStyleColor();
+
+		if (clientInfo.Presence & PresenceFlags::Typing)
+		{
+			ImGui::SameLine();
+			ImGui::TextColored(ImVec4(0.6f, 0.6f, 0.6f, 1.0f), "typing...");
+		}
+		else if (clientInfo.Presence & PresenceFlags::Away)
+		{
+			ImGui::SameLine();
+			ImGui::TextColored(ImVec4(0.6f, 0.6f, 0.6f, 1.0f), "(away)");
+		}
 	}
 	ImGui::End();
 }
+#endif
 
 void ClientLayer::OnConnected()
 {
-	m_Console.ClearLog();
+	// Resuming after a server restart, what we have stays and only what's new gets sent. If
+	// the server doesn't take the token this is done in the response handling instead.
+	if (!m_ResumeToken)
+	{
+		m_Console.ClearLog();
+		m_OldestHistorySequence = UINT64_MAX;
+	}
+
+	// Everything is legacy-encoded until the server tells us otherwise
+	m_Encoding = WireEncoding::Legacy;
+	m_ProtocolVersion = LegacyProtocolVersion;
+	m_Capabilities = 0;
+	m_UserID = 0;
+	m_MessageHistoryRequestPending = false;
+	DiscardIncomingFiles();
+	m_RoundTripTime = 0;
+
+	// The server keeps away across a restart, but not typing
+	m_LocalPresence = m_ResumeToken ? m_LocalPresence & ~PresenceFlags::Typing : PresenceFlags::None;
+	m_LastKeystrokeTime = {};
+	m_LastActivityTime = Clock::now();
 	// Welcome message sent in PacketType::ClientConnectionRequest response handling
+
+#ifdef WL_HEADLESS
+	// No connection modal to do it
+	m_HasBeenConnected = true;
+	SendConnectionRequest();
+#endif
 }
 
 void ClientLayer::OnDisconnected()
 {
-	m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Lost connection to server!");
+	if (!m_ResumeToken)
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Lost connection to server!");
 }
 
 void ClientLayer::OnDataReceived(const Walnut::Buffer buffer)
 {
+	WC_TRACE_SCOPE("ClientLayer::OnDataReceived");
 	Walnut::BufferStreamReader stream(buffer);
 
 	PacketType type;
-	stream.ReadRaw<PacketType>(type);
+	if (!Wire::ReadPacketType(stream, type, m_Encoding))
+		return;
 
-	switch (type)
+	using namespace Packets::ToClient;
+	Wire::DispatchResult result = Wire::DispatchPacket<Packets::ToClient::All>(type, stream, m_Encoding, Wire::PacketHandlers
 	{
-	case PacketType::Message:
-	{
-		std::string fromUsername, message;
-		stream.ReadString(fromUsername);
-		stream.ReadString(message);
-
-		// Find user
-		if (m_ConnectedClients.contains(fromUsername))
+		[&](const Message& packet)
 		{
-			const auto& clientInfo = m_ConnectedClients.at(fromUsername);
-			m_Console.AddTaggedMessageWithColor(clientInfo.Color, fromUsername, message);
-		}
-		else if (fromUsername == "SERVER") // special message from server
+			std::string_view fromUsername = packet.From.Username;
+			if (m_Encoding == WireEncoding::Compact)
+			{
+				if (const UserInfo* fromUser = FindConnectedClient(packet.From.ID))
+					fromUsername = fromUser->Username;
+				else if (packet.From.ID == ServerUserID)
+					fromUsername = "SERVER";
+			}
+
+			// Only on chat relayed from other clients
+			if (packet.Stamps)
+				OnMessageStamps(packet.Stamps->ReceiveServerTime, packet.Stamps->SendServerTime);
+
+			// Find user
+			if (auto it = m_ConnectedClients.find(std::string(fromUsername)); it != m_ConnectedClients.end())
+			{
+				m_Console.AddTaggedMessageWithColor(it->second.Color, fromUsername, packet.Text);
+			}
+			else if (fromUsername == "SERVER") // special message from server
+			{
+				m_Console.AddTaggedMessage(fromUsername, packet.Text);
+			}
+			else
+			{
+				std::cout << "[ERROR] Message from unknown user? This shouldn't happen..." << std::endl;
+				// display message anyway
+				m_Console.AddTaggedMessage(fromUsername, packet.Text);
+			}
+		},
+		[&](const DirectMessage& packet)
 		{
-			m_Console.AddTaggedMessage(fromUsername, message);
-		}
-		else
+			std::string_view fromUsername = packet.From.Username;
+			uint32_t fromColor = 0xffffffff;
+			if (m_Encoding == WireEncoding::Compact)
+			{
+				const UserInfo* fromUser = FindConnectedClient(packet.From.ID);
+				fromUsername = fromUser ? std::string_view(fromUser->Username) : "SERVER";
+				if (fromUser)
+					fromColor = fromUser->Color;
+			}
+			else if (auto it = m_ConnectedClients.find(std::string(fromUsername)); it != m_ConnectedClients.end())
+			{
+				fromColor = it->second.Color;
+			}
+
+			m_Console.AddTaggedMessageWithColor(fromColor, fmt::format("{} -> you", fromUsername), packet.Text);
+		},
+		[&](const ClientConnectionResponse& packet) { OnClientConnectionResponse(packet); },
+		[&](const Ping& packet) { OnPing(packet.ServerTime, packet.RoundTripTime); },
+		[&](const AdmissionStatus& packet)
 		{
-			std::cout << "[ERROR] Message from unknown user? This shouldn't happen..." << std::endl;
-			// display message anyway
-			m_Console.AddTaggedMessage(fromUsername, message);
-		}
+			if (!m_AdmissionPosition)
+				m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Server is busy, waiting to join ({} of {})...", packet.Position, packet.QueueLength);
 
-		break;
-	}
-	case PacketType::ClientConnectionRequest:
-	{
-		bool requestStatus;
-		stream.ReadRaw<bool>(requestStatus);
-		if (requestStatus)
+			m_AdmissionPosition = packet.Position;
+			m_AdmissionQueueLength = packet.QueueLength;
+		},
+		[&](const ServerShutdown&)
 		{
-			// Defer connection message to after message history is received
-			m_ShowSuccessfulConnectionMessage = true;
-			// m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Successfully connected to {} with username {}", m_ServerIP, m_Username);
-		}
-		else
+			m_Console.AddItalicMessage("Server is shutting down... goodbye!");
+			m_Client->Disconnect();
+		},
+		[&](const ServerRestart& packet)
 		{
-			m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Server rejected connection with username {}", m_Username);
-		}
-		break;
-	}
-	case PacketType::ConnectionStatus:
-		break;
+			if (!packet.ResumeToken)
+				return;
+
+			// Give the old process a moment to go away before trying to reconnect
+			Clock::time_point now = Clock::now();
+			m_ResumeToken = packet.ResumeToken;
+			m_ResumeDeadline = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(m_ResumeTimeout));
+			m_NextReconnectTime = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(m_ReconnectInterval));
+			m_Console.AddItalicMessage("Server is restarting, reconnecting...");
+			m_Client->Disconnect();
+		},
+		[&](const ClientKick& packet)
+		{
+			m_Console.AddItalicMessage("You have been kicked by server!");
+			if (packet.Reason && !packet.Reason->Text.empty())
+				m_Console.AddItalicMessage("Reason: {}", packet.Reason->Text);
+
+			m_Client->Disconnect();
+		},
+		[&](const FileOffer& packet) { OnFileOffer(packet.TransferID, packet.FromUserID, packet.Filename, packet.Size); },
+		[&](const FileChunk& packet) { OnFileChunk(packet.TransferID, packet.Offset, packet.Data); },
+		[&](const FileAck& packet) { OnFileAck(packet.TransferID, packet.Offset); },
+		[&](const FileComplete& packet) { OnFileComplete(packet.TransferID, packet.Status, packet.Upload); }
+	});
+	if (result != Wire::DispatchResult::UnknownType)
+		return;
+
+	// Packets carrying lists are read by hand
+	switch (type)
+	{
 	case PacketType::ClientList:
 	{
 		std::vector<UserInfo> clientList;
-		stream.ReadArray(clientList);
+		Wire::ReadUserList(stream, clientList, m_Encoding);
 
 		// Update our client list
 		m_ConnectedClients.clear();
+		m_UsernamesByID.clear();
 		for (const auto& client : clientList)
-			m_ConnectedClients[client.Username] = client;
+			AddConnectedClient(client);
 
 		break;
 	}
 	case PacketType::ClientConnect:
 	{
 		UserInfo newClient;
-		stream.ReadObject(newClient);
+		Wire::ReadUserInfo(stream, newClient, m_Encoding);
 
-		m_ConnectedClients[newClient.Username] = newClient;
+		AddConnectedClient(newClient);
 		m_Console.AddItalicMessageWithColor(newClient.Color, "Welcome {}!", newClient.Username);
 
 		break;
 	}
+	case PacketType::ClientListUpdate:
+	{
+		std::vector<UserInfo> joined;
+		uint32_t leftCount;
+		if (!Wire::ReadUserList(stream, joined, m_Encoding) || !Wire::ReadCount(stream, leftCount, m_Encoding))
+			break;
+
+		// Leaves first, someone can leave and rejoin with the same name within one update
+		for (uint32_t i = 0; i < leftCount; i++)
+		{
+			uint32_t userID;
+			if (!Wire::ReadUserID(stream, userID))
+				break;
+
+			const UserInfo* userInfo = FindConnectedClient(userID);
+			if (!userInfo)
+				continue; // never knew about them (left before we joined)
+
+			UserInfo disconnectedClient = *userInfo;
+			m_ConnectedClients.erase(disconnectedClient.Username);
+			m_UsernamesByID.erase(userID);
+			m_Console.AddItalicMessageWithColor(disconnectedClient.Color, "Goodbye {}!", disconnectedClient.Username);
+		}
+
+		// Anyone who joined around the same time we did is already in our ClientList
+		for (const auto& newClient : joined)
+		{
+			if (m_UsernamesByID.contains(newClient.ID))
+				continue;
+
+			AddConnectedClient(newClient);
+			m_Console.AddItalicMessageWithColor(newClient.Color, "Welcome {}!", newClient.Username);
+		}
+		break;
+	}
 	case PacketType::ClientUpdate:
 		break;
 	case PacketType::ClientDisconnect:
 	{
 		UserInfo disconnectedClient;
-		stream.ReadObject(disconnectedClient);
+		if (m_Encoding == WireEncoding::Compact)
+		{
+			uint32_t userID;
+			Wire::ReadUserID(stream, userID);
+			const UserInfo* userInfo = FindConnectedClient(userID);
+			if (!userInfo)
+				break;
+
+			disconnectedClient = *userInfo;
+			m_UsernamesByID.erase(userID);
+		}
+		else
+		{
+			stream.ReadObject(disconnectedClient);
+		}
 
 		m_ConnectedClients.erase(disconnectedClient.Username);
 		m_Console.AddItalicMessageWithColor(disconnectedClient.Color, "Goodbye {}!", disconnectedClient.Username);
@@ -248,10 +480,55 @@ void ClientLayer::OnDataReceived(const Walnut::Buffer buffer)
 	}
 	case PacketType::ClientUpdateResponse:
 		break;
+	case PacketType::MessageHistoryRequest:
+	{
+		uint64_t firstSequence;
+		std::vector<ChatMessage> messageHistory;
+		if (!stream.ReadRaw<uint64_t>(firstSequence) || !Wire::ReadChatMessages(stream, messageHistory, m_Encoding))
+			break;
+
+		m_MessageHistoryRequestPending = false;
+		m_OldestHistorySequence = firstSequence;
+		if (messageHistory.empty())
+		{
+			m_OldestHistorySequence = 0;
+#ifdef WL_HEADLESS
+			m_Console.AddItalicMessageWithColor(0xff8a8a8a, "No earlier messages.");
+#else
+			m_Console.AddOlderMessage(0xff8a8a8a, {}, "Start of message history", true);
+			m_Console.EndOlderMessages();
+#endif
+			break;
+		}
+
+#ifdef WL_HEADLESS
+		// Printed as they come, so older messages show up as their own block
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "--- {} earlier messages ---", messageHistory.size());
+#endif
+		for (const auto& message : messageHistory)
+		{
+			uint32_t userColor = 0xffffffff;
+			if (m_ConnectedClients.contains(message.Username))
+				userColor = m_ConnectedClients.at(message.Username).Color;
+
+#ifdef WL_HEADLESS
+			m_Console.AddTaggedMessageWithColor(userColor, message.Username, message.Message);
+#else
+			m_Console.AddOlderMessage(userColor, message.Username, message.Message);
+#endif
+		}
+#ifdef WL_HEADLESS
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "--- end of earlier messages ---");
+#else
+		// Above everything else, where they belong
+		m_Console.EndOlderMessages();
+#endif
+		break;
+	}
 	case PacketType::MessageHistory:
 	{
 		std::vector<ChatMessage> messageHistory;
-		stream.ReadArray(messageHistory);
+		Wire::ReadChatMessages(stream, messageHistory, m_Encoding);
 		for (const auto& message : messageHistory)
 		{
 			// find user color if connected
@@ -262,7 +539,9 @@ void ClientLayer::OnDataReceived(const Walnut::Buffer buffer)
 			m_Console.AddTaggedMessageWithColor(userColor, message.Username, message.Message);
 		}
 
-		if (m_ShowSuccessfulConnectionMessage)
+		// Under the last page, which servers that can say so mark with an empty one
+		bool lastPage = !(m_Capabilities & ProtocolCapability::JoinHistoryEnd) || messageHistory.empty();
+		if (m_ShowSuccessfulConnectionMessage && lastPage)
 		{
 			m_ShowSuccessfulConnectionMessage = false;
 			m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Successfully connected to {} with username {}", m_ServerIP, m_Username);
@@ -270,21 +549,36 @@ void ClientLayer::OnDataReceived(const Walnut::Buffer buffer)
 
 		break;
 	}
-	case PacketType::ServerShutdown:
-	{
-		m_Console.AddItalicMessage("Server is shutting down... goodbye!");
-		m_Client->Disconnect();
-		break;
-	}
-	case PacketType::ClientKick:
+	case PacketType::UserPresence:
 	{
-		m_Console.AddItalicMessage("You have been kicked by server!");
-		std::string reason;
-		stream.ReadString(reason);
-		if (!reason.empty())
-			m_Console.AddItalicMessage("Reason: {}", reason);
+		uint32_t count;
+		if (!Wire::ReadCount(stream, count, m_Encoding))
+			break;
 
-		m_Client->Disconnect();
+		for (uint32_t i = 0; i < count; i++)
+		{
+			UserInfo* userInfo = nullptr;
+			if (m_Encoding == WireEncoding::Compact)
+			{
+				uint32_t userID;
+				Wire::ReadUserID(stream, userID);
+				userInfo = FindConnectedClient(userID);
+			}
+			else
+			{
+				std::string username;
+				Wire::ReadString(stream, username, m_Encoding);
+				if (auto it = m_ConnectedClients.find(username); it != m_ConnectedClients.end())
+					userInfo = &it->second;
+			}
+
+			uint8_t presence;
+			if (!stream.ReadRaw<uint8_t>(presence))
+				break;
+
+			if (userInfo)
+				userInfo->Presence = presence;
+		}
 		break;
 	}
 	default:
@@ -292,23 +586,700 @@ void ClientLayer::OnDataReceived(const Walnut::Buffer buffer)
 	}
 }
 
+void ClientLayer::OnClientConnectionResponse(const Packets::ToClient::ClientConnectionResponse& packet)
+{
+	m_AdmissionPosition = 0;
+
+	bool resuming = m_ResumeToken != 0;
+	m_ResumeToken = 0;
+
+	if (!packet.Accepted)
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Server rejected connection with username {}", m_Username);
+#ifdef WL_HEADLESS
+		// Can't pick another one
+		m_Client->Disconnect();
+#endif
+		return;
+	}
+
+	// Servers that understand protocol versions reply with the negotiated version,
+	// older servers only send the boolean and we stay on the legacy encoding
+	if (packet.Protocol)
+	{
+		m_ProtocolVersion = packet.Protocol->ProtocolVersion;
+		m_Capabilities = packet.Protocol->Capabilities;
+		m_UserID = packet.Protocol->UserID;
+		m_Encoding = GetWireEncoding(m_Capabilities);
+	}
+	bool resumed = packet.Resume && packet.Resume->Resumed;
+
+	// Unfinished uploads from before we got disconnected
+	if (!m_OutgoingFiles.empty() && !(m_Capabilities & ProtocolCapability::FileTransfer))
+		m_OutgoingFiles.clear();
+	for (auto& [transferID, file] : m_OutgoingFiles)
+	{
+		file.WaitingForOfferAck = true;
+		SendFileOffer(transferID, file);
+	}
+
+	if (resumed)
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Reconnected to {} after server restart", m_ServerIP);
+		return;
+	}
+
+	// Too late to resume, this is a regular join and the whole join history is coming
+	if (resuming)
+	{
+		m_Console.ClearLog();
+		m_OldestHistorySequence = UINT64_MAX;
+	}
+
+	// Defer connection message to after message history is received
+	m_ShowSuccessfulConnectionMessage = true;
+	// m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Successfully connected to {} with username {}", m_ServerIP, m_Username);
+}
+
+void ClientLayer::ConnectToServer()
+{
+	if (Walnut::Utils::IsValidIPAddress(m_ServerIP))
+	{
+		m_Client->ConnectToServer(m_ServerIP);
+		return;
+	}
+
+	// Try resolve domain name
+	auto ipTokens = Walnut::Utils::SplitString(m_ServerIP, ':'); // [0] == hostname, [1] (optional) == port
+	std::string serverIP = Walnut::Utils::ResolveDomainName(ipTokens[0]);
+	if (ipTokens.size() != 2)
+		serverIP = fmt::format("{}:{}", serverIP, 8192); // Add default port if hostname doesn't contain port
+	else
+		serverIP = fmt::format("{}:{}", serverIP, ipTokens[1]); // Add specified port
+
+	m_Client->ConnectToServer(serverIP);
+}
+
+void ClientLayer::SendConnectionRequest()
+{
+	// Always legacy-encoded, the server picks the encoding from this
+	Packets::ToServer::ClientConnectionRequest packet;
+	packet.Color = m_Color;
+	packet.Username = m_Username;
+	packet.Protocol = { CurrentProtocolVersion, SupportedProtocolCapabilities };
+	if (m_ResumeToken)
+		packet.Resume = { m_ResumeToken };
+	SendPacket(packet, WireEncoding::Legacy);
+}
+
+void ClientLayer::UpdateSessionResume()
+{
+	ClientTransport::ConnectionStatus status = m_Client->GetConnectionStatus();
+	if (status == ClientTransport::ConnectionStatus::Connected || status == ClientTransport::ConnectionStatus::Connecting)
+		return;
+
+	Clock::time_point now = Clock::now();
+	if (now >= m_ResumeDeadline)
+	{
+		m_ResumeToken = 0;
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Server didn't come back after restarting");
+		return;
+	}
+
+	if (now < m_NextReconnectTime)
+		return;
+
+	m_NextReconnectTime = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(m_ReconnectInterval));
+	ConnectToServer();
+}
+
 void ClientLayer::SendChatMessage(std::string_view message)
 {
+	WC_TRACE_SCOPE("ClientLayer::SendChatMessage");
+	if (IsChatCommand(message, "/msg"))
+	{
+		SendDirectMessage(message);
+		return;
+	}
+
+	if (IsChatCommand(message, "/history"))
+	{
+		RequestOlderMessageHistory(message);
+		return;
+	}
+
+	if (IsChatCommand(message, "/trace"))
+	{
+		OnTraceCommand(message);
+		return;
+	}
+
+	if (IsChatCommand(message, "/send"))
+	{
+		SendFile(message);
+		return;
+	}
+
+	if (IsChatCommand(message, "/accept"))
+	{
+		AnswerFileOffer(message, true);
+		return;
+	}
+
+	if (IsChatCommand(message, "/decline"))
+	{
+		AnswerFileOffer(message, false);
+		return;
+	}
+
+	if (message == "/latency")
+	{
+		ShowLatency();
+		return;
+	}
+
+	if (message == "/quit")
+	{
+		Walnut::Application::Get().Close();
+		return;
+	}
+
 	std::string messageToSend(message);
 	if (IsValidMessage(messageToSend))
 	{
-		Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-		stream.WriteRaw<PacketType>(PacketType::Message);
-		stream.WriteString(messageToSend);
-		m_Client->SendBuffer(stream.GetBuffer());
+		// Would be cut off, send the whole thing as a file instead
+		if (message.size() > messageToSend.size() && (m_Capabilities & ProtocolCapability::FileTransfer))
+		{
+			OutgoingFile file;
+			file.Filename = "paste.txt";
+			file.Data = message;
+			file.Size = file.Data.size();
+			StartFileUpload(std::move(file));
+			return;
+		}
+
+		SendPacket(Packets::ToServer::Message{ messageToSend });
 
 		// echo in own console
 		m_Console.AddTaggedMessageWithColor(m_Color | 0xff000000, m_Username, messageToSend);
+
+		// Server clears our typing state when it gets the message
+		m_LastKeystrokeTime = {};
+		m_LastActivityTime = Clock::now();
+		m_LocalPresence &= ~PresenceFlags::Typing;
 	}
 }
 
+void ClientLayer::OnTraceCommand(std::string_view command)
+{
+	if (!Trace::IsCompiledIn())
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Tracing isn't compiled into this build (WC_ENABLE_TRACING)");
+		return;
+	}
+
+	std::vector<std::string> tokens = Walnut::Utils::SplitString(std::string(command), ' ');
+	if (tokens.size() >= 2 && tokens[1] == "start")
+	{
+		if (Trace::Start())
+			m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Tracing started");
+		else
+			m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Already tracing");
+	}
+	else if (tokens.size() >= 2 && tokens[1] == "stop")
+	{
+		std::string filepath = tokens.size() >= 3 ? tokens[2] : "ClientTrace.json";
+		if (Trace::Stop(filepath))
+			m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Trace written to {}", filepath);
+		else
+			m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Failed to write trace (not tracing?)");
+	}
+	else
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Usage: /trace start or /trace stop [file]");
+	}
+}
+
+void ClientLayer::SendDirectMessage(std::string_view command)
+{
+	WC_TRACE_SCOPE("ClientLayer::SendDirectMessage");
+	std::string_view toUsername, message;
+	if (!ParseDirectMessageCommand(command, toUsername, message))
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Usage: /msg <username> <message>");
+		return;
+	}
+
+	if (!(m_Capabilities & ProtocolCapability::DirectMessages))
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "This server doesn't support direct messages.");
+		return;
+	}
+
+	std::string messageToSend(message);
+	if (!IsValidMessage(messageToSend))
+		return;
+
+	SendPacket(Packets::ToServer::DirectMessage{ toUsername, messageToSend });
+
+	// echo in own console
+	m_Console.AddTaggedMessageWithColor(m_Color | 0xff000000, fmt::format("{} -> {}", m_Username, toUsername), messageToSend);
+}
+
+void ClientLayer::SendFile(std::string_view command)
+{
+	WC_TRACE_SCOPE("ClientLayer::SendFile");
+	// "/send <username> <path>", the path can have spaces in it
+	std::string_view arguments = command.substr(std::string_view("/send").size());
+	size_t usernameBegin = arguments.find_first_not_of(' ');
+	size_t usernameEnd = arguments.find(' ', usernameBegin);
+	size_t pathBegin = arguments.find_first_not_of(' ', usernameEnd);
+	if (pathBegin == std::string_view::npos)
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Usage: /send <username> <file> (* as username sends to everyone)");
+		return;
+	}
+
+	if (!(m_Capabilities & ProtocolCapability::FileTransfer))
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "This server doesn't support sending files.");
+		return;
+	}
+
+	std::string_view toUsername = arguments.substr(usernameBegin, usernameEnd - usernameBegin);
+	std::filesystem::path filepath(arguments.substr(pathBegin));
+	OutgoingFile file;
+	file.Recipient = toUsername == "*" ? "" : std::string(toUsername);
+	file.Filename = filepath.filename().string();
+	file.Stream.open(filepath, std::ios::binary | std::ios::ate);
+	if (!file.Stream || !IsValidFilename(file.Filename))
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Can't send {}", filepath.string());
+		return;
+	}
+
+	file.Size = (uint64_t)file.Stream.tellg();
+	file.Stream.seekg(0);
+	if (file.Size == 0)
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "{} is empty", filepath.string());
+		return;
+	}
+
+	StartFileUpload(std::move(file));
+}
+
+void ClientLayer::AnswerFileOffer(std::string_view command, bool accept)
+{
+	WC_TRACE_SCOPE("ClientLayer::AnswerFileOffer");
+	auto tokens = Walnut::Utils::SplitString(command, ' ');
+
+	auto it = m_IncomingFiles.end();
+	if (tokens.size() == 2)
+	{
+		it = m_IncomingFiles.find((uint32_t)std::atoi(tokens[1].c_str()));
+	}
+	else
+	{
+		// The latest one still waiting for an answer (transfer IDs only go up)
+		auto latest = std::find_if(m_IncomingFiles.rbegin(), m_IncomingFiles.rend(), [](const auto& entry) { return !entry.second.Accepted; });
+		if (latest != m_IncomingFiles.rend())
+			it = std::prev(latest.base());
+	}
+
+	if (it == m_IncomingFiles.end() || it->second.Accepted)
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "No such file offer. Usage: /accept [id] or /decline [id]");
+		return;
+	}
+
+	if (accept)
+	{
+		AcceptFileOffer(it->first, it->second);
+	}
+	else
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Declined {} from {}", it->second.Filename, it->second.FromUsername);
+		DeclineFileOffer(it->first, FileTransferStatus::Cancelled);
+	}
+}
+
+void ClientLayer::StartFileUpload(OutgoingFile&& file)
+{
+	uint32_t transferID = m_NextFileTransferID++;
+	m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Offering {} ({} KB) to {}...", file.Filename, (file.Size + 1023) / 1024, file.Recipient.empty() ? "everyone" : file.Recipient);
+
+	auto& outgoingFile = m_OutgoingFiles[transferID] = std::move(file);
+	SendFileOffer(transferID, outgoingFile);
+}
+
+void ClientLayer::SendFileOffer(uint32_t transferID, const OutgoingFile& file)
+{
+	SendPacket(Packets::ToServer::FileOffer{ transferID, file.Recipient, file.Filename, file.Size });
+}
+
+void ClientLayer::SendFileChunks(uint32_t transferID, OutgoingFile& file)
+{
+	WC_TRACE_SCOPE("ClientLayer::SendFileChunks");
+	std::string data;
+	while (file.Sent < file.Size && file.Sent - file.Acked < FileTransferWindow)
+	{
+		size_t chunkSize = (size_t)std::min<uint64_t>(FileChunkSize, file.Size - file.Sent);
+		if (file.Data.empty())
+		{
+			data.resize(chunkSize);
+			if (!file.Stream.read(data.data(), chunkSize))
+			{
+				m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Failed to read {}", file.Filename);
+
+				SendPacket(Packets::ToServer::FileComplete{ transferID, FileTransferStatus::Cancelled, {} });
+				m_OutgoingFiles.erase(transferID);
+				return;
+			}
+		}
+		else
+		{
+			data.assign(file.Data, (size_t)file.Sent, chunkSize);
+		}
+
+		SendPacket(Packets::ToServer::FileChunk{ transferID, file.Sent, data });
+
+		file.Sent += chunkSize;
+	}
+}
+
+void ClientLayer::OnFileAck(uint32_t transferID, uint64_t offset)
+{
+	auto it = m_OutgoingFiles.find(transferID);
+	if (it == m_OutgoingFiles.end() || offset > it->second.Size)
+		return;
+
+	auto& file = it->second;
+	if (file.WaitingForOfferAck)
+	{
+		// Where the server wants it from, 0 unless this is resuming
+		file.WaitingForOfferAck = false;
+		file.Sent = offset;
+		if (file.Data.empty())
+		{
+			file.Stream.clear();
+			file.Stream.seekg(offset);
+		}
+	}
+
+	file.Acked = std::min(offset, file.Sent);
+	SendFileChunks(transferID, file);
+}
+
+void ClientLayer::OnFileOffer(uint32_t transferID, uint32_t fromUserID, std::string_view filename, uint64_t size)
+{
+	const UserInfo* fromUser = FindConnectedClient(fromUserID);
+
+	IncomingFile file;
+	file.FromUsername = fromUser ? fromUser->Username : "SERVER";
+	file.Filename = filename;
+	file.Size = size;
+
+	// Nothing is written until it's accepted
+	m_Console.AddItalicMessageWithColor(0xff8a8a8a, "{} wants to send you {} ({} KB), /accept {} or /decline {}", file.FromUsername, filename, (size + 1023) / 1024, transferID, transferID);
+	m_IncomingFiles[transferID] = std::move(file);
+}
+
+void ClientLayer::AcceptFileOffer(uint32_t transferID, IncomingFile& file)
+{
+	std::error_code error;
+	std::filesystem::create_directories(m_DownloadDirectory, error);
+	file.Filepath = GetDownloadFilepath(file.Filename);
+
+	std::filesystem::path partFilepath = file.Filepath;
+	partFilepath += ".part";
+	file.Stream.open(partFilepath, std::ios::binary | std::ios::trunc);
+	if (!file.Stream)
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Can't receive {} from {}, could not create {}", file.Filename, file.FromUsername, partFilepath.string());
+		DeclineFileOffer(transferID, FileTransferStatus::Failed);
+		return;
+	}
+
+	file.Accepted = true;
+	m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Receiving {} from {}...", file.Filename, file.FromUsername);
+	SendPacket(Packets::ToServer::FileAck{ transferID, 0 });
+}
+
+void ClientLayer::DeclineFileOffer(uint32_t transferID, FileTransferStatus status)
+{
+	SendPacket(Packets::ToServer::FileComplete{ transferID, status, Packets::ToServer::FileComplete::DownloadInfo{} });
+
+	// Already told the user why
+	auto it = m_IncomingFiles.find(transferID);
+	if (it == m_IncomingFiles.end())
+		return;
+
+	auto& file = it->second;
+	if (file.Accepted)
+	{
+		file.Stream.close();
+
+		std::filesystem::path partFilepath = file.Filepath;
+		partFilepath += ".part";
+		std::error_code error;
+		std::filesystem::remove(partFilepath, error);
+	}
+	m_IncomingFiles.erase(it);
+}
+
+std::filesystem::path ClientLayer::GetDownloadFilepath(std::string_view filename) const
+{
+	std::string safeFilename = GetSafeFilename(filename);
+	for (uint32_t i = 0; ; i++)
+	{
+		std::filesystem::path filepath = m_DownloadDirectory / (i == 0 ? safeFilename : fmt::format("{}-{}", i, safeFilename));
+		std::filesystem::path partFilepath = filepath;
+		partFilepath += ".part";
+
+		bool downloading = std::any_of(m_IncomingFiles.begin(), m_IncomingFiles.end(), [&filepath](const auto& entry) { return entry.second.Filepath == filepath; });
+		std::error_code error;
+		if (!downloading && !std::filesystem::exists(filepath, error) && !std::filesystem::exists(partFilepath, error))
+			return filepath;
+	}
+}
+
+void ClientLayer::OnFileChunk(uint32_t transferID, uint64_t offset, std::string_view data)
+{
+	auto it = m_IncomingFiles.find(transferID);
+	if (it == m_IncomingFiles.end() || !it->second.Accepted)
+		return;
+
+	auto& file = it->second;
+	if (offset != file.Received || data.size() > file.Size - file.Received || !file.Stream.write(data.data(), data.size()))
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Failed to receive {} from {}", file.Filename, file.FromUsername);
+		DeclineFileOffer(transferID, FileTransferStatus::Failed);
+		return;
+	}
+
+	file.Received += data.size();
+}
+
+void ClientLayer::OnFileComplete(uint32_t transferID, FileTransferStatus status, bool upload)
+{
+	if (upload)
+	{
+		auto it = m_OutgoingFiles.find(transferID);
+		if (it == m_OutgoingFiles.end())
+			return;
+
+		if (status == FileTransferStatus::Completed)
+			m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Sent {}", it->second.Filename);
+		else if (status == FileTransferStatus::Declined)
+			m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Nobody accepted {}", it->second.Filename);
+		else
+			m_Console.AddItalicMessageWithColor(0xfffa4a4a, "Failed to send {}", it->second.Filename);
+		m_OutgoingFiles.erase(it);
+		return;
+	}
+
+	auto it = m_IncomingFiles.find(transferID);
+	if (it == m_IncomingFiles.end())
+		return;
+
+	auto& file = it->second;
+	if (!file.Accepted)
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "{} is no longer offering {}", file.FromUsername, file.Filename);
+		m_IncomingFiles.erase(it);
+		return;
+	}
+	file.Stream.close();
+
+	std::filesystem::path partFilepath = file.Filepath;
+	partFilepath += ".part";
+	std::error_code error;
+	if (status == FileTransferStatus::Completed && file.Received == file.Size)
+	{
+		std::filesystem::rename(partFilepath, file.Filepath, error);
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Received {} from {}, saved to {}", file.Filename, file.FromUsername, file.Filepath.string());
+	}
+	else
+	{
+		std::filesystem::remove(partFilepath, error);
+		if (status == FileTransferStatus::Cancelled)
+			m_Console.AddItalicMessageWithColor(0xff8a8a8a, "{} stopped sending {}", file.FromUsername, file.Filename);
+	}
+	m_IncomingFiles.erase(it);
+}
+
+void ClientLayer::DiscardIncomingFiles()
+{
+	for (auto& [transferID, file] : m_IncomingFiles)
+	{
+		if (!file.Accepted)
+			continue;
+
+		file.Stream.close();
+
+		std::filesystem::path partFilepath = file.Filepath;
+		partFilepath += ".part";
+		std::error_code error;
+		std::filesystem::remove(partFilepath, error);
+	}
+	m_IncomingFiles.clear();
+}
+
+void ClientLayer::RequestOlderMessageHistory(std::string_view command)
+{
+	WC_TRACE_SCOPE("ClientLayer::RequestOlderMessageHistory");
+	if (!(m_Capabilities & ProtocolCapability::HistoryPaging))
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "This server doesn't support loading older messages.");
+		return;
+	}
+
+	if (m_OldestHistorySequence == 0)
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "No earlier messages.");
+		return;
+	}
+
+	if (m_MessageHistoryRequestPending)
+		return;
+
+	uint32_t maxMessages = 50;
+	auto tokens = Walnut::Utils::SplitString(command, ' ');
+	if (tokens.size() == 2)
+		maxMessages = std::max(1, std::atoi(tokens[1].c_str()));
+
+	SendPacket(Packets::ToServer::MessageHistoryRequest{ m_OldestHistorySequence, maxMessages });
+	m_MessageHistoryRequestPending = true;
+}
+
+#ifndef WL_HEADLESS
+void ClientLayer::OnScrolledToOldestMessage()
+{
+	if (!IsConnected() || !(m_Capabilities & ProtocolCapability::HistoryPaging) || m_OldestHistorySequence == 0 || m_MessageHistoryRequestPending)
+		return;
+
+	RequestOlderMessageHistory("/history");
+}
+#endif
+
+void ClientLayer::ShowLatency()
+{
+	if (!(m_Capabilities & ProtocolCapability::LatencyStamps))
+	{
+		m_Console.AddItalicMessageWithColor(0xfffa4a4a, "This server doesn't report latency.");
+		return;
+	}
+
+	if (!m_RoundTripTime)
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "No round trip measured yet.");
+		return;
+	}
+
+	m_Console.AddItalicMessageWithColor(0xff8a8a8a, "Round trip to server: {:.1f} ms", m_RoundTripTime / 1000.0f);
+	if (m_DeliveryTimes.GetCount() == 0)
+		return;
+
+	// A slow link shows up in delivery only, a busy server in both
+	auto show = [this](std::string_view name, const LatencyHistogram& histogram)
+	{
+		m_Console.AddItalicMessageWithColor(0xff8a8a8a, "{}: p50 {:.2f} ms, p90 {:.2f} ms, p99 {:.2f} ms ({} messages)", name,
+			histogram.GetPercentile(50.0) / 1000.0f, histogram.GetPercentile(90.0) / 1000.0f, histogram.GetPercentile(99.0) / 1000.0f, histogram.GetCount());
+	};
+	show("On the server", m_ServerResidenceTimes);
+	show("Server to here", m_DeliveryTimes);
+}
+
+void ClientLayer::OnPing(uint64_t serverTime, uint32_t roundTripTime)
+{
+	SendPacket(Packets::ToServer::Pong{ serverTime });
+
+	// The ping was sent about half a round trip ago
+	m_RoundTripTime = roundTripTime;
+	if (m_RoundTripTime)
+	{
+		int64_t localTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+		m_ServerClockOffset = (int64_t)(serverTime + m_RoundTripTime / 2) - localTime;
+	}
+}
+
+void ClientLayer::OnMessageStamps(uint64_t receiveServerTime, uint64_t sendServerTime)
+{
+	if (sendServerTime >= receiveServerTime)
+		m_ServerResidenceTimes.Record(sendServerTime - receiveServerTime);
+
+	if (!m_RoundTripTime)
+		return;
+
+	int64_t serverTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count() + m_ServerClockOffset;
+	if (serverTime > (int64_t)receiveServerTime)
+		m_DeliveryTimes.Record(serverTime - receiveServerTime);
+}
+
+#ifndef WL_HEADLESS
+void ClientLayer::UpdateLocalPresence()
+{
+	if (!IsConnected() || !(m_Capabilities & ProtocolCapability::Presence))
+		return;
+
+	Clock::time_point now = Clock::now();
+
+	// Typed into the chat input this frame (OnUIRender() has run, and consumed the input queue)
+	bool keystroke = !m_ConnectionModalOpen && m_Console.WasInputEdited();
+	if (keystroke)
+	{
+		m_LastKeystrokeTime = now;
+		m_LastActivityTime = now;
+	}
+
+	auto secondsSince = [now](Clock::time_point time) { return std::chrono::duration<float>(now - time).count(); };
+
+	uint8_t presence = PresenceFlags::None;
+	if (m_LastKeystrokeTime != Clock::time_point() && secondsSince(m_LastKeystrokeTime) < m_TypingIdleTimeout)
+		presence |= PresenceFlags::Typing;
+	if (secondsSince(m_LastActivityTime) > m_AwayTimeout)
+		presence |= PresenceFlags::Away;
+
+	// Keystrokes only ever produce a packet on state change or the periodic typing refresh.
+	// State changes are sent reliably, since away state is never refreshed; refreshes are
+	// fire-and-forget since the next one is only seconds away.
+	if (presence != m_LocalPresence)
+		SendPresence(presence, true);
+	else if ((presence & PresenceFlags::Typing) && secondsSince(m_LastPresenceSendTime) > m_TypingRefreshInterval)
+		SendPresence(presence, false);
+}
+#endif
+
+void ClientLayer::SendPresence(uint8_t presence, bool reliable)
+{
+	WC_TRACE_SCOPE("ClientLayer::SendPresence");
+	SendPacket(Packets::ToServer::UserPresence{ presence }, m_Encoding, reliable);
+
+	m_LocalPresence = presence;
+	m_LastPresenceSendTime = Clock::now();
+}
+
+void ClientLayer::AddConnectedClient(const UserInfo& userInfo)
+{
+	m_ConnectedClients[userInfo.Username] = userInfo;
+	if (m_Encoding == WireEncoding::Compact)
+		m_UsernamesByID[userInfo.ID] = userInfo.Username;
+}
+
+UserInfo* ClientLayer::FindConnectedClient(uint32_t userID)
+{
+	auto it = m_UsernamesByID.find(userID);
+	if (it == m_UsernamesByID.end())
+		return nullptr;
+
+	auto clientIt = m_ConnectedClients.find(it->second);
+	return clientIt != m_ConnectedClients.end() ? &clientIt->second : nullptr;
+}
+
 void ClientLayer::SaveConnectionDetails(const std::filesystem::path& filepath)
 {
+	WC_TRACE_SCOPE("ClientLayer::SaveConnectionDetails");
 	YAML::Emitter out;
 	{
 		out << YAML::BeginMap; // Root
@@ -329,6 +1300,7 @@ void ClientLayer::SaveConnectionDetails(const std::filesystem::path& filepath)
 
 bool ClientLayer::LoadConnectionDetails(const std::filesystem::path& filepath)
 {
+	WC_TRACE_SCOPE("ClientLayer::LoadConnectionDetails");
 	if (!std::filesystem::exists(filepath))
 		return false;
 
@@ -350,12 +1322,6 @@ bool ClientLayer::LoadConnectionDetails(const std::filesystem::path& filepath)
 	m_Username = rootNode["Username"].as<std::string>();
 
 	m_Color = rootNode["Color"].as<uint32_t>();
-	ImVec4 color = ImColor(m_Color).Value;
-	m_ColorBuffer[0] = color.x;
-	m_ColorBuffer[1] = color.y;
-	m_ColorBuffer[2] = color.z;
-	m_ColorBuffer[3] = color.w;
-
 	m_ServerIP = rootNode["ServerIP"].as<std::string>();
 
 	return true;
@@ -1,45 +1,180 @@
 #pragma once
 
 #include "Walnut/Layer.h"
-#include "Walnut/Networking/Client.h"
 
-#include "Walnut/UI/Console.h"
+#ifdef WL_HEADLESS
+#include "HeadlessConsole.h"
+#include "EventLoop.h"
+#else
+#include "ChatConsole.h"
+#endif
 
 #include "UserInfo.h"
+#include "WireFormat.h"
+#include "Packets.h"
+#include "ClientTransport.h"
+#include "LatencyHistogram.h"
 
 #include <set>
+#include <unordered_map>
 #include <filesystem>
+#include <fstream>
+#include <chrono>
+
+struct ClientLayerSpecification
+{
+	// Headless clients connect on startup, anything left empty here comes from
+	// ConnectionDetails.yaml
+	std::string ServerAddress;
+	std::string Username;
+	uint32_t Color = 0;
+};
 
 class ClientLayer : public Walnut::Layer
 {
 public:
+	// Without a transport a WalnutClientTransport is used
+	ClientLayer(const ClientLayerSpecification& specification = ClientLayerSpecification(), std::unique_ptr<ClientTransport> transport = nullptr);
+
 	virtual void OnAttach() override;
 	virtual void OnDetach() override;
+	virtual void OnUpdate(float ts) override;
 	virtual void OnUIRender() override;
 
 	bool IsConnected() const;
 	void OnDisconnectButton();
 private:
+#ifndef WL_HEADLESS
 	// UI
 	void UI_ConnectionModal();
 	void UI_ClientList();
+#endif
 
 	// Server event callbacks
 	void OnConnected();
 	void OnDisconnected();
 	void OnDataReceived(const Walnut::Buffer buffer);
+	void OnClientConnectionResponse(const Packets::ToClient::ClientConnectionResponse& packet);
+
+	// Sent with the negotiated encoding and the packet type's usual reliability. The scratch
+	// buffer is grown first if the packet wouldn't fit.
+	template<Wire::Packet P>
+	void SendPacket(const P& packet) { SendPacket(packet, m_Encoding, IsReliableDelivery(GetDeliveryClass(P::Type))); }
+	template<Wire::Packet P>
+	void SendPacket(const P& packet, WireEncoding encoding, bool reliable = true)
+	{
+		uint64_t size = Wire::GetPacketSize(packet, encoding);
+		if (m_ScratchBuffer.Size < size)
+			m_ScratchBuffer.Allocate(size);
+
+		Walnut::BufferStreamWriter stream(m_ScratchBuffer);
+		Wire::WritePacket(stream, packet, encoding);
+		m_Client->SendBuffer(stream.GetBuffer(), reliable);
+	}
+
+	// m_ServerIP can be a hostname, with or without a port
+	void ConnectToServer();
+	void SendConnectionRequest();
+	// Reconnects after PacketType::ServerRestart until the server is back (or we give up)
+	void UpdateSessionResume();
 
 	void SendChatMessage(std::string_view message);
+	// "/msg <username> <message>"
+	void OnTraceCommand(std::string_view command);
+	void SendDirectMessage(std::string_view command);
+	// "/history [count]", asks for messages older than the oldest we have
+	void RequestOlderMessageHistory(std::string_view command);
+#ifndef WL_HEADLESS
+	// Scrolled to the top of the chat, same as /history but quiet when there's nothing to get
+	void OnScrolledToOldestMessage();
+#endif
+	// "/accept [id]" / "/decline [id]", the latest offer if there's no ID
+	void AnswerFileOffer(std::string_view command, bool accept);
+	// "/send <username|*> <path>"
+	void SendFile(std::string_view command);
+	// "/latency", round trip time and where relayed messages spent their time
+	void ShowLatency();
+
+	// PacketType::ConnectionStatus ping, answered right away
+	void OnPing(uint64_t serverTime, uint32_t roundTripTime);
+	// Server timestamps on a relayed PacketType::Message
+	void OnMessageStamps(uint64_t receiveServerTime, uint64_t sendServerTime);
+
+#ifndef WL_HEADLESS
+	// Typing/away detection, sends PacketType::UserPresence on change
+	void UpdateLocalPresence();
+#endif
+	void SendPresence(uint8_t presence, bool reliable);
+
+	////////////////////////////////////////////////////////////////////////////////
+	// File transfers (see PacketType::FileOffer)
+	////////////////////////////////////////////////////////////////////////////////
+	struct OutgoingFile
+	{
+		// Empty for everyone
+		std::string Recipient;
+		std::string Filename;
+		uint64_t Size = 0;
+		uint64_t Sent = 0;
+		uint64_t Acked = 0;
+		// Offered, nothing can be sent before the server says where to start
+		bool WaitingForOfferAck = true;
+		// A file, or a long paste in Data
+		std::ifstream Stream;
+		std::string Data;
+	};
+	struct IncomingFile
+	{
+		std::string FromUsername;
+		std::string Filename;
+		uint64_t Size = 0;
+		uint64_t Received = 0;
+		// Only offered until it's accepted, nothing is written before that
+		bool Accepted = false;
+		std::filesystem::path Filepath;
+		std::ofstream Stream;
+	};
+	void StartFileUpload(OutgoingFile&& file);
+	void SendFileOffer(uint32_t transferID, const OutgoingFile& file);
+	// Up to FileTransferWindow past the last PacketType::FileAck
+	void SendFileChunks(uint32_t transferID, OutgoingFile& file);
+	void OnFileAck(uint32_t transferID, uint64_t offset);
+	void OnFileOffer(uint32_t transferID, uint32_t fromUserID, std::string_view filename, uint64_t size);
+	void AcceptFileOffer(uint32_t transferID, IncomingFile& file);
+	// Tells the server to stop sending it and forgets it, declining it if it's only offered
+	void DeclineFileOffer(uint32_t transferID, FileTransferStatus status);
+	// Never overwrites anything: nothing on disk has the name (or its .part) and no other
+	// download is using it
+	std::filesystem::path GetDownloadFilepath(std::string_view filename) const;
+	void OnFileChunk(uint32_t transferID, uint64_t offset, std::string_view data);
+	void OnFileComplete(uint32_t transferID, FileTransferStatus status, bool upload);
+	// Partial downloads can't be resumed, the server's transfer IDs are per connection
+	void DiscardIncomingFiles();
+	////////////////////////////////////////////////////////////////////////////////
+
+	void AddConnectedClient(const UserInfo& userInfo);
+	UserInfo* FindConnectedClient(uint32_t userID);
 
 private:
 	void SaveConnectionDetails(const std::filesystem::path& filepath);
 	bool LoadConnectionDetails(const std::filesystem::path& filepath);
 private:
-	std::unique_ptr<Walnut::Client> m_Client;
-	Walnut::UI::Console m_Console{ "Chat" };
+	ClientLayerSpecification m_Specification;
+	std::unique_ptr<ClientTransport> m_Client;
+#ifdef WL_HEADLESS
+	HeadlessConsole m_Console{ "Chat" };
+	// Transport callbacks and console input are handed over to the main thread through here,
+	// OnUpdate() sleeps in it until there's something to do
+	EventLoop m_EventLoop;
+	// Quits once the connection is gone
+	bool m_HasBeenConnected = false;
+#else
+	ChatConsole m_Console{ "Chat" };
+#endif
 	std::string m_ServerIP;
 	std::filesystem::path m_ConnectionDetailsFilePath = "ConnectionDetails.yaml";
 
+	// Grown to fit by SendPacket()
 	Walnut::Buffer m_ScratchBuffer;
 
 	float m_ColorBuffer[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
@@ -48,6 +183,56 @@ private:
 	uint32_t m_Color = 0xffffffff;
 
 	std::map<std::string, UserInfo> m_ConnectedClients;
+	// Compact encoding refers to users by ID
+	std::unordered_map<uint32_t, std::string> m_UsernamesByID;
+
+	using Clock = std::chrono::steady_clock;
+
+	// Negotiated with server in the ClientConnectionRequest handshake
+	WireEncoding m_Encoding = WireEncoding::Legacy;
+	uint16_t m_ProtocolVersion = LegacyProtocolVersion;
+	uint32_t m_Capabilities = 0;
+	uint32_t m_UserID = 0;
+	// Oldest message history sequence we have, UINT64_MAX until we've paged back once
+	uint64_t m_OldestHistorySequence = UINT64_MAX;
+	bool m_MessageHistoryRequestPending = false;
+
+	// Uploads are kept across reconnects and offered again, the server resumes them
+	std::map<uint32_t, OutgoingFile> m_OutgoingFiles;
+	std::map<uint32_t, IncomingFile> m_IncomingFiles;
+	uint32_t m_NextFileTransferID = 1;
+	std::filesystem::path m_DownloadDirectory = "Downloads";
+
+	// Microseconds, as measured by the server (see PacketType::ConnectionStatus), 0 = not yet
+	uint32_t m_RoundTripTime = 0;
+	// Server time minus ours (microseconds), from the last ping and half the round trip. Only
+	// valid once m_RoundTripTime is.
+	int64_t m_ServerClockOffset = 0;
+	// Relayed messages: time spent on the server, and from the server receiving it to us
+	// having it (server residence plus our half of the link)
+	LatencyHistogram m_ServerResidenceTimes;
+	LatencyHistogram m_DeliveryTimes;
+
+	// From PacketType::ServerRestart, sent with the next ClientConnectionRequest (0 = none)
+	uint64_t m_ResumeToken = 0;
+	Clock::time_point m_ResumeDeadline;
+	Clock::time_point m_NextReconnectTime;
+	// Same as the server's window for resuming
+	const float m_ResumeTimeout = 30.0f;
+	const float m_ReconnectInterval = 1.0f;
+
+	uint8_t m_LocalPresence = PresenceFlags::None;
+	Clock::time_point m_LastKeystrokeTime;
+	Clock::time_point m_LastActivityTime;
+	Clock::time_point m_LastPresenceSendTime;
+	// Typing stops this long after the last keystroke
+	const float m_TypingIdleTimeout = 4.0f;
+	// While typing, re-send typing state this often so the server doesn't expire it
+	const float m_TypingRefreshInterval = 3.0f;
+	const float m_AwayTimeout = 5.0f * 60.0f;
 	bool m_ConnectionModalOpen = false;
 	bool m_ShowSuccessfulConnectionMessage = false;
+	// Place in the server's admission queue while waiting to join (0 = not waiting)
+	uint32_t m_AdmissionPosition = 0;
+	uint32_t m_AdmissionQueueLength = 0;
 };
\ No newline at end of file
@@ -13,10 +13,12 @@ project "App-Common-Headless"
 
       "../Walnut/Walnut/Source",
       "../Walnut-Networking/Source",
+      "../Walnut/Walnut-Modules/Walnut-Networking/Source",
 
       "../Walnut/vendor/spdlog/include",
 
-      "../vendor/GameNetworkingSockets/include"
+      "../vendor/GameNetworkingSockets/include",
+      "../Walnut/Walnut-Modules/Walnut-Networking/vendor/GameNetworkingSockets/include"
    }
 
    links
@@ -33,12 +35,12 @@ project "App-Common-Headless"
       defines { "WL_PLATFORM_WINDOWS" }
 
    filter "configurations:Debug"
-      defines { "WL_DEBUG" }
+      defines { "WL_DEBUG", "WC_ENABLE_TRACING" }
       runtime "Debug"
       symbols "On"
 
    filter "configurations:Release"
-      defines { "WL_RELEASE" }
+      defines { "WL_RELEASE", "WC_ENABLE_TRACING" }
       runtime "Release"
       optimize "On"
       symbols "On"
@@ -15,11 +15,13 @@ project "App-Common"
 
       "../Walnut/Walnut/Source",
       "../Walnut-Networking/Source",
+      "../Walnut/Walnut-Modules/Walnut-Networking/Source",
 
       "%{IncludeDir.VulkanSDK}",
       "../Walnut/vendor/spdlog/include",
 
-      "../Walnut-Networking/vendor/GameNetworkingSockets/include"
+      "../Walnut-Networking/vendor/GameNetworkingSockets/include",
+      "../Walnut/Walnut-Modules/Walnut-Networking/vendor/GameNetworkingSockets/include"
    }
 
    links
@@ -36,12 +38,12 @@ project "App-Common"
       defines { "WL_PLATFORM_WINDOWS" }
 
    filter "configurations:Debug"
-      defines { "WL_DEBUG" }
+      defines { "WL_DEBUG", "WC_ENABLE_TRACING" }
       runtime "Debug"
       symbols "On"
 
    filter "configurations:Release"
-      defines { "WL_RELEASE" }
+      defines { "WL_RELEASE", "WC_ENABLE_TRACING" }
       runtime "Release"
       optimize "On"
       symbols "On"
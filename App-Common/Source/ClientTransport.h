@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Walnut/Networking/Client.h"
+
+#include <string>
+
+//
+// ClientTransport - everything a chat client needs from the network. WalnutClientTransport
+// is the real thing, LoopbackClientTransport connects to a LoopbackServerTransport in the
+// same process.
+//
+class ClientTransport
+{
+public:
+	using ConnectionStatus = Walnut::Client::ConnectionStatus;
+	using DataReceivedCallback = Walnut::Client::DataReceivedCallback;
+	using ServerConnectedCallback = Walnut::Client::ServerConnectedCallback;
+	using ServerDisconnectedCallback = Walnut::Client::ServerDisconnectedCallback;
+public:
+	virtual ~ClientTransport() = default;
+
+	virtual void ConnectToServer(const std::string& serverAddress) = 0;
+	virtual void Disconnect() = 0;
+
+	virtual void SetServerConnectedCallback(const ServerConnectedCallback& function) = 0;
+	virtual void SetServerDisconnectedCallback(const ServerDisconnectedCallback& function) = 0;
+	virtual void SetDataReceivedCallback(const DataReceivedCallback& function) = 0;
+
+	virtual void SendBuffer(Walnut::Buffer buffer, bool reliable = true) = 0;
+
+	virtual ConnectionStatus GetConnectionStatus() const = 0;
+	virtual const std::string& GetConnectionDebugMessage() const = 0;
+};
@@ -0,0 +1,140 @@
+#include "EventLoop.h"
+
+#include "Trace.h"
+
+void EventLoop::Post(Task task)
+{
+	{
+		std::scoped_lock<std::mutex> lock(m_TaskMutex);
+		m_PendingTasks.push_back(std::move(task));
+	}
+	m_TaskCondition.notify_one();
+}
+
+void EventLoop::Wake()
+{
+	{
+		std::scoped_lock<std::mutex> lock(m_TaskMutex);
+		m_WakeRequested = true;
+	}
+	m_TaskCondition.notify_one();
+}
+
+EventLoop::TimerID EventLoop::AddTimer(float intervalSeconds, Task callback, bool repeat)
+{
+	TimerID timerID = m_NextTimerID++;
+
+	auto& timer = m_Timers[timerID];
+	timer.Interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(intervalSeconds));
+	timer.Deadline = Clock::now() + timer.Interval;
+	timer.Callback = std::move(callback);
+	timer.Repeat = repeat;
+
+	m_TimerQueue.push({ timer.Deadline, timerID });
+	return timerID;
+}
+
+void EventLoop::CancelTimer(TimerID timerID)
+{
+	m_Timers.erase(timerID);
+}
+
+void EventLoop::ResetTimer(TimerID timerID)
+{
+	auto it = m_Timers.find(timerID);
+	if (it == m_Timers.end())
+		return;
+
+	it->second.Deadline = Clock::now() + it->second.Interval;
+	m_TimerQueue.push({ it->second.Deadline, timerID });
+}
+
+void EventLoop::RunOnce(Clock::duration maxWait)
+{
+	// Drop stale heap entries so the top is always a live deadline
+	while (!m_TimerQueue.empty())
+	{
+		const auto& top = m_TimerQueue.top();
+		auto it = m_Timers.find(top.ID);
+		if (it != m_Timers.end() && it->second.Deadline == top.Deadline)
+			break;
+		m_TimerQueue.pop();
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(m_TaskMutex);
+
+		auto ready = [this]() { return !m_PendingTasks.empty() || m_WakeRequested; };
+		// Polling (or already due) never touches the condition variable, even an already
+		// expired wait_until() costs a syscall
+		bool wait = !ready() && maxWait > Clock::duration::zero();
+		if (wait && !m_TimerQueue.empty())
+		{
+			Clock::time_point deadline = m_TimerQueue.top().Deadline;
+			Clock::time_point now = Clock::now();
+			if (maxWait < deadline - now)
+				deadline = now + maxWait;
+			if (deadline > now)
+				m_TaskCondition.wait_until(lock, deadline, ready);
+		}
+		else if (wait && maxWait == Clock::duration::max())
+		{
+			m_TaskCondition.wait(lock, ready);
+		}
+		else if (wait)
+		{
+			m_TaskCondition.wait_for(lock, maxWait, ready);
+		}
+
+		m_WakeRequested = false;
+		std::swap(m_PendingTasks, m_RunningTasks);
+	}
+
+	if (!m_RunningTasks.empty())
+	{
+		WC_TRACE_SCOPE("EventLoop::RunTasks");
+		for (auto& task : m_RunningTasks)
+			task();
+		m_RunningTasks.clear();
+	}
+
+	RunDueTimers();
+}
+
+uint32_t EventLoop::GetPendingTaskCount() const
+{
+	std::scoped_lock<std::mutex> lock(m_TaskMutex);
+	return (uint32_t)m_PendingTasks.size();
+}
+
+void EventLoop::RunDueTimers()
+{
+	Clock::time_point now = Clock::now();
+	while (!m_TimerQueue.empty() && m_TimerQueue.top().Deadline <= now)
+	{
+		TimerEntry entry = m_TimerQueue.top();
+		m_TimerQueue.pop();
+
+		auto it = m_Timers.find(entry.ID);
+		if (it == m_Timers.end() || it->second.Deadline != entry.Deadline)
+			continue; // cancelled or rescheduled
+
+		WC_TRACE_SCOPE("EventLoop::Timer");
+
+		if (it->second.Repeat)
+		{
+			it->second.Deadline = now + it->second.Interval;
+			m_TimerQueue.push({ it->second.Deadline, entry.ID });
+
+			// Copy, callback may cancel (and erase) its own timer
+			Task callback = it->second.Callback;
+			callback();
+		}
+		else
+		{
+			Task callback = std::move(it->second.Callback);
+			m_Timers.erase(it);
+			callback();
+		}
+	}
+}
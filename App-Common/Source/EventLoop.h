@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <unordered_map>
+
+//
+// EventLoop - runs posted tasks and timers on whichever thread calls RunOnce().
+// Other threads (networking, console input) Post() work to it, which wakes the
+// loop up; otherwise it sleeps until the next timer deadline.
+//
+class EventLoop
+{
+public:
+	using Task = std::function<void()>;
+	using Clock = std::chrono::steady_clock;
+	using TimerID = uint64_t;
+public:
+	// Thread-safe, wakes up the loop if it's sleeping
+	void Post(Task task);
+	void Wake();
+
+	// Timers must be added/cancelled from the loop thread
+	TimerID AddTimer(float intervalSeconds, Task callback, bool repeat = true);
+	void CancelTimer(TimerID timerID);
+	void ResetTimer(TimerID timerID);
+
+	// Runs everything that is ready. If nothing is, sleeps until a task is posted,
+	// the next timer is due or maxWait has passed (whichever comes first)
+	void RunOnce(Clock::duration maxWait = Clock::duration::max());
+
+	uint32_t GetPendingTaskCount() const;
+private:
+	struct Timer
+	{
+		Clock::duration Interval;
+		Clock::time_point Deadline;
+		Task Callback;
+		bool Repeat = true;
+	};
+
+	struct TimerEntry
+	{
+		Clock::time_point Deadline;
+		TimerID ID;
+
+		bool operator>(const TimerEntry& other) const { return Deadline > other.Deadline; }
+	};
+
+	void RunDueTimers();
+private:
+	mutable std::mutex m_TaskMutex;
+	std::condition_variable m_TaskCondition;
+	std::vector<Task> m_PendingTasks;
+	std::vector<Task> m_RunningTasks;
+	bool m_WakeRequested = false;
+
+	// Min-heap of deadlines; cancelled or rescheduled timers are skipped lazily
+	std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> m_TimerQueue;
+	std::unordered_map<TimerID, Timer> m_Timers;
+	TimerID m_NextTimerID = 1;
+};
@@ -0,0 +1,74 @@
+#include "HeadlessConsole.h"
+
+#include "Trace.h"
+
+HeadlessConsole::HeadlessConsole(std::string_view title)
+	: m_Title(title)
+{
+}
+
+HeadlessConsole::~HeadlessConsole()
+{
+	m_InputThreadRunning = false;
+	if (m_InputThread.joinable())
+		m_InputThread.join();
+}
+
+void HeadlessConsole::ClearLog()
+{
+	m_MessageHistory.clear();
+	m_NextMessage = 0;
+}
+
+void HeadlessConsole::AddFormattedMessage(std::string_view tag, uint32_t color, bool italic, std::string_view format, fmt::format_args args)
+{
+	thread_local fmt::memory_buffer s_FormatBuffer;
+	s_FormatBuffer.clear();
+	fmt::vformat_to(fmt::appender(s_FormatBuffer), format, args);
+	std::string_view message(s_FormatBuffer.data(), s_FormatBuffer.size());
+
+	if (m_MessageHistory.size() < s_MaxMessageHistory)
+		m_MessageHistory.emplace_back();
+
+	// Assigning keeps the slot's capacity
+	MessageInfo& info = m_MessageHistory[m_NextMessage];
+	info.Tag.assign(tag);
+	info.Message.assign(message);
+	info.Italic = italic;
+	info.Color = color;
+	m_NextMessage = (m_NextMessage + 1) % s_MaxMessageHistory;
+
+	if (m_OutputEnabled)
+	{
+		if (!tag.empty())
+			std::cout << '[' << tag << "] ";
+		std::cout << message << std::endl;
+	}
+}
+
+void HeadlessConsole::SetMessageSendCallback(const MessageSendCallback& callback)
+{
+	m_MessageSendCallback = callback;
+
+	// NOTE(Yan): to run in background on Linux server you'll need to comment out
+	//            the following line, since we can't std::getline with no terminal
+	if (!m_InputThread.joinable())
+		m_InputThread = std::thread([this]() { InputThreadFunc(); });
+}
+
+void HeadlessConsole::InputThreadFunc()
+{
+	Trace::SetThreadName("Console Input");
+
+	m_InputThreadRunning = true;
+	while (m_InputThreadRunning)
+	{
+		std::string line;
+		if (!std::getline(std::cin, line))
+			break; // stdin closed (eg. running in background), don't spin on it
+
+		if (m_MessageSendCallback)
+			m_MessageSendCallback(line);
+	}
+
+}
@@ -5,11 +5,13 @@
 #include <string_view>
 #include <functional>
 #include <iostream>
+#include <thread>
 
 #include "spdlog/spdlog.h"
 
 //
-// HeadlessConsole - similar to Walnut::UI::Console but for non-GUI builds
+// HeadlessConsole - similar to Walnut::UI::Console but for non-GUI builds (server and client),
+// messages go to stdout and lines typed on stdin are sent
 //
 class HeadlessConsole
 {
@@ -24,59 +26,51 @@ public:
 	template<typename... Args>
 	void AddMessage(std::string_view format, Args&&... args)
 	{
-		std::string messageString = fmt::vformat(format, fmt::make_format_args(args...));
-		std::cout << messageString << std::endl;
-		m_MessageHistory.push_back(messageString);
+		AddFormattedMessage({}, 0xffffffff, false, format, fmt::make_format_args(args...));
 	}
 
 	template<typename... Args>
 	void AddItalicMessage(std::string_view format, Args&&... args)
 	{
-		std::string messageString = fmt::vformat(format, fmt::make_format_args(args...));
-		MessageInfo info = messageString;
-		info.Italic = true;
-		m_MessageHistory.push_back(info);
-		std::cout << messageString << std::endl;
+		AddFormattedMessage({}, 0xffffffff, true, format, fmt::make_format_args(args...));
 	}
 
 	template<typename... Args>
 	void AddTaggedMessage(std::string_view tag, std::string_view format, Args&&... args)
 	{
-		std::string messageString = fmt::vformat(format, fmt::make_format_args(args...));
-		m_MessageHistory.push_back(MessageInfo(std::string(tag), messageString));
-		std::cout << '[' << tag << "] " << messageString << std::endl;
+		AddFormattedMessage(tag, 0xffffffff, false, format, fmt::make_format_args(args...));
 	}
 
 	template<typename... Args>
 	void AddMessageWithColor(uint32_t color, std::string_view format, Args&&... args)
 	{
-		std::string messageString = fmt::vformat(format, fmt::make_format_args(args...));
-		m_MessageHistory.push_back(MessageInfo(messageString, color));
-		std::cout << messageString << std::endl;
+		AddFormattedMessage({}, color, false, format, fmt::make_format_args(args...));
 	}
 
 	template<typename... Args>
 	void AddItalicMessageWithColor(uint32_t color, std::string_view format, Args&&... args)
 	{
-		std::string messageString = fmt::vformat(format, fmt::make_format_args(args...));
-		MessageInfo info(messageString, color);
-		info.Italic = true;
-		m_MessageHistory.push_back(info);
-		std::cout << messageString << std::endl;
+		AddFormattedMessage({}, color, true, format, fmt::make_format_args(args...));
 	}
 
 	template<typename... Args>
 	void AddTaggedMessageWithColor(uint32_t color, std::string_view tag, std::string_view format, Args&&... args)
 	{
-		std::string messageString = fmt::vformat(format, fmt::make_format_args(args...));
-		m_MessageHistory.push_back(MessageInfo(std::string(tag), messageString, color));
-		std::cout << '[' << tag << "] " << messageString << std::endl;
+		AddFormattedMessage(tag, color, false, format, fmt::make_format_args(args...));
 	}
 
 	void OnUIRender() {}
 
+	// Starts reading stdin, consoles without a callback never touch it
 	void SetMessageSendCallback(const MessageSendCallback& callback);
+
+	// Messages are still recorded when output is disabled, just not printed
+	void SetOutputEnabled(bool enabled) { m_OutputEnabled = enabled; }
 private:
+	// Formats into a per-thread buffer and copies into the oldest history slot, so once the
+	// history is full (and the slots have grown to fit) logging doesn't allocate
+	void AddFormattedMessage(std::string_view tag, uint32_t color, bool italic, std::string_view format, fmt::format_args args);
+
 	void InputThreadFunc();
 private:
 	struct MessageInfo
@@ -85,20 +79,18 @@ private:
 		std::string Message;
 		bool Italic = false;
 		uint32_t Color = 0xffffffff;
-
-		MessageInfo(const std::string& message, uint32_t color = 0xffffffff)
-			: Message(message), Color(color) {}
-
-		MessageInfo(const std::string& tag, const std::string& message, uint32_t color = 0xffffffff)
-			: Tag(tag), Message(message), Color(color) {}
 	};
 
 	std::string m_Title;
+	// Ring of the newest s_MaxMessageHistory messages, m_NextMessage is the oldest once full
+	static const uint32_t s_MaxMessageHistory = 1024;
 	std::vector<MessageInfo> m_MessageHistory;
+	uint32_t m_NextMessage = 0;
 
 	std::thread m_InputThread;
 	bool m_InputThreadRunning = false;
 
 	MessageSendCallback m_MessageSendCallback;
+	bool m_OutputEnabled = true;
 
 };
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "LatencyHistogram.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+void LatencyHistogram::Record(uint64_t microseconds)
+{
+	m_Buckets[GetBucket(microseconds)]++;
+	m_Count++;
+	m_Total += microseconds;
+	m_Max = std::max(m_Max, microseconds);
+}
+
+void LatencyHistogram::Clear()
+{
+	*this = LatencyHistogram();
+}
+
+uint64_t LatencyHistogram::GetPercentile(double percentile) const
+{
+	if (m_Count == 0)
+		return 0;
+
+	// Rank of the sample we're after, 1-based
+	uint64_t rank = std::max<uint64_t>((uint64_t)std::ceil(std::clamp(percentile, 0.0, 100.0) / 100.0 * m_Count), 1);
+	uint64_t seen = 0;
+	for (uint32_t bucket = 0; bucket < s_BucketCount; bucket++)
+	{
+		seen += m_Buckets[bucket];
+		if (seen >= rank)
+			return std::min(GetBucketUpperBound(bucket), m_Max);
+	}
+	return m_Max;
+}
+
+uint32_t LatencyHistogram::GetBucket(uint64_t microseconds)
+{
+	// Values below 2^s_SubBucketBits get a bucket each, above that every power of two is
+	// split into 2^s_SubBucketBits buckets by the bits right below the top one
+	const uint64_t linearLimit = 1ull << s_SubBucketBits;
+	if (microseconds < linearLimit)
+		return (uint32_t)microseconds;
+
+	uint32_t topBit = 63 - std::countl_zero(microseconds);
+	uint32_t subBucket = (uint32_t)(microseconds >> (topBit - s_SubBucketBits)) & (linearLimit - 1);
+	return ((topBit - s_SubBucketBits + 1) << s_SubBucketBits) + subBucket;
+}
+
+uint64_t LatencyHistogram::GetBucketUpperBound(uint32_t bucket)
+{
+	const uint64_t linearLimit = 1ull << s_SubBucketBits;
+	if (bucket < linearLimit)
+		return bucket;
+
+	uint32_t topBit = (bucket >> s_SubBucketBits) + s_SubBucketBits - 1;
+	uint64_t subBucket = bucket & (linearLimit - 1);
+	uint64_t lowerBound = (1ull << topBit) | (subBucket << (topBit - s_SubBucketBits));
+	return lowerBound + (1ull << (topBit - s_SubBucketBits)) - 1;
+}
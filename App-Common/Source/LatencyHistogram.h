@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+//
+// LatencyHistogram - fixed-size histogram of durations in microseconds, for percentiles
+// without keeping every sample. Buckets are log-scaled with four per power of two, so a
+// percentile is at most 25% over the real value (exact below 8us).
+//
+class LatencyHistogram
+{
+public:
+	void Record(uint64_t microseconds);
+	void Clear();
+
+	// Upper bound of the bucket the percentile (0-100) falls into, 0 if there are no samples
+	uint64_t GetPercentile(double percentile) const;
+
+	uint64_t GetCount() const { return m_Count; }
+	uint64_t GetMax() const { return m_Max; }
+	uint64_t GetMean() const { return m_Count ? m_Total / m_Count : 0; }
+private:
+	static uint32_t GetBucket(uint64_t microseconds);
+	static uint64_t GetBucketUpperBound(uint32_t bucket);
+private:
+	static const uint32_t s_SubBucketBits = 2;
+	static const uint32_t s_BucketCount = 64 << s_SubBucketBits;
+	uint64_t m_Buckets[s_BucketCount] = {};
+
+	uint64_t m_Count = 0;
+	uint64_t m_Total = 0;
+	uint64_t m_Max = 0;
+};
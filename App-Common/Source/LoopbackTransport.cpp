@@ -0,0 +1,146 @@
+#include "LoopbackTransport.h"
+
+#include <string>
+
+////////////////////////////////////////////////////////////////////////////////
+// LoopbackServerTransport
+////////////////////////////////////////////////////////////////////////////////
+
+void LoopbackServerTransport::Stop()
+{
+	m_Running = false;
+
+	// Clients just see the connection drop
+	auto clients = m_Clients;
+	for (auto& [clientID, client] : clients)
+		KickClient(clientID);
+}
+
+void LoopbackServerTransport::SendBufferToClient(Walnut::ClientID clientID, Walnut::Buffer buffer, bool /*reliable*/)
+{
+	auto it = m_Clients.find(clientID);
+	if (it == m_Clients.end())
+		return;
+
+	m_SentBytes.fetch_add(buffer.Size, std::memory_order_relaxed);
+	m_SentMessages.fetch_add(1, std::memory_order_relaxed);
+	it->second->OnReceive(buffer);
+}
+
+void LoopbackServerTransport::KickClient(Walnut::ClientID clientID)
+{
+	auto it = m_Clients.find(clientID);
+	if (it == m_Clients.end())
+		return;
+
+	LoopbackClientTransport* client = it->second;
+	m_Clients.erase(it);
+	m_ConnectedClients.erase(clientID);
+	client->OnKicked();
+}
+
+Walnut::ClientID LoopbackServerTransport::Connect(LoopbackClientTransport* client)
+{
+	if (!m_Running)
+		return 0;
+
+	Walnut::ClientID clientID = m_NextClientID++;
+	m_Clients[clientID] = client;
+
+	Walnut::ClientInfo& clientInfo = m_ConnectedClients[clientID];
+	clientInfo.ID = clientID;
+	clientInfo.ConnectionDesc = "loopback#" + std::to_string(clientID);
+
+	if (m_ClientConnectedCallback)
+		m_ClientConnectedCallback(clientInfo);
+
+	return clientID;
+}
+
+void LoopbackServerTransport::Disconnect(Walnut::ClientID clientID)
+{
+	auto it = m_ConnectedClients.find(clientID);
+	if (it == m_ConnectedClients.end())
+		return;
+
+	Walnut::ClientInfo clientInfo = it->second;
+	m_Clients.erase(clientID);
+	m_ConnectedClients.erase(it);
+
+	if (m_ClientDisconnectedCallback)
+		m_ClientDisconnectedCallback(clientInfo);
+}
+
+void LoopbackServerTransport::Receive(Walnut::ClientID clientID, Walnut::Buffer buffer)
+{
+	auto it = m_ConnectedClients.find(clientID);
+	if (it == m_ConnectedClients.end())
+		return;
+
+	if (m_DataReceivedCallback)
+		m_DataReceivedCallback(it->second, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LoopbackClientTransport
+////////////////////////////////////////////////////////////////////////////////
+
+LoopbackClientTransport::LoopbackClientTransport(LoopbackServerTransport& server)
+	: m_Server(server)
+{
+}
+
+LoopbackClientTransport::~LoopbackClientTransport()
+{
+	// Don't leave a dangling pointer behind in the server
+	Disconnect();
+}
+
+void LoopbackClientTransport::ConnectToServer(const std::string& /*serverAddress*/)
+{
+	if (m_ConnectionStatus == ConnectionStatus::Connected)
+		return;
+
+	m_ClientID = m_Server.Connect(this);
+	if (!m_ClientID)
+	{
+		m_ConnectionStatus = ConnectionStatus::FailedToConnect;
+		m_ConnectionDebugMessage = "Loopback server is not running";
+		return;
+	}
+
+	m_ConnectionStatus = ConnectionStatus::Connected;
+	m_ConnectionDebugMessage.clear();
+	if (m_ServerConnectedCallback)
+		m_ServerConnectedCallback();
+}
+
+void LoopbackClientTransport::Disconnect()
+{
+	if (m_ConnectionStatus != ConnectionStatus::Connected)
+		return;
+
+	m_ConnectionStatus = ConnectionStatus::Disconnected;
+	m_Server.Disconnect(m_ClientID);
+	m_ClientID = 0;
+}
+
+void LoopbackClientTransport::SendBuffer(Walnut::Buffer buffer, bool /*reliable*/)
+{
+	if (m_ConnectionStatus == ConnectionStatus::Connected)
+		m_Server.Receive(m_ClientID, buffer);
+}
+
+void LoopbackClientTransport::OnReceive(Walnut::Buffer buffer)
+{
+	if (m_DataReceivedCallback)
+		m_DataReceivedCallback(buffer);
+}
+
+void LoopbackClientTransport::OnKicked()
+{
+	m_ConnectionStatus = ConnectionStatus::Disconnected;
+	m_ClientID = 0;
+	if (m_ServerDisconnectedCallback)
+		m_ServerDisconnectedCallback();
+}
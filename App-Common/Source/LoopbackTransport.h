@@ -0,0 +1,101 @@
+#pragma once
+
+#include "ServerTransport.h"
+#include "ClientTransport.h"
+
+#include <atomic>
+#include <unordered_map>
+
+//
+// In-process transport: any number of LoopbackClientTransports connect to one
+// LoopbackServerTransport without sockets. Sends are delivered synchronously, on the calling
+// thread, straight into the other side's callback (the buffer is only valid for the duration
+// of that callback, same as with Walnut). Nothing here is thread-safe, drive both sides from
+// one thread. The one exception is SetConcurrentSends(): server sends to different clients
+// from different threads, with the clients' callbacks running on those threads.
+//
+
+class LoopbackClientTransport;
+
+class LoopbackServerTransport : public ServerTransport
+{
+public:
+	virtual void Start() override { m_Running = true; }
+	virtual void Stop() override;
+	virtual bool IsRunning() const override { return m_Running; }
+
+	virtual void SetDataReceivedCallback(const DataReceivedCallback& function) override { m_DataReceivedCallback = function; }
+	virtual void SetClientConnectedCallback(const ClientConnectedCallback& function) override { m_ClientConnectedCallback = function; }
+	virtual void SetClientDisconnectedCallback(const ClientDisconnectedCallback& function) override { m_ClientDisconnectedCallback = function; }
+
+	// Sends to unknown clients are dropped
+	virtual void SendBufferToClient(Walnut::ClientID clientID, Walnut::Buffer buffer, bool reliable = true) override;
+	virtual void KickClient(Walnut::ClientID clientID) override;
+	virtual bool SupportsConcurrentSends() const override { return m_ConcurrentSends; }
+	// Off by default, only for clients whose callbacks can take it
+	void SetConcurrentSends(bool enabled) { m_ConcurrentSends = enabled; }
+
+	virtual const std::map<Walnut::ClientID, Walnut::ClientInfo>& GetConnectedClients() const override { return m_ConnectedClients; }
+
+	// Server -> client traffic
+	uint64_t GetSentBytes() const { return m_SentBytes; }
+	uint64_t GetSentMessages() const { return m_SentMessages; }
+private:
+	friend class LoopbackClientTransport;
+
+	// Returns 0 if the server isn't running
+	Walnut::ClientID Connect(LoopbackClientTransport* client);
+	void Disconnect(Walnut::ClientID clientID);
+	void Receive(Walnut::ClientID clientID, Walnut::Buffer buffer);
+private:
+	bool m_Running = false;
+	bool m_ConcurrentSends = false;
+
+	std::map<Walnut::ClientID, Walnut::ClientInfo> m_ConnectedClients;
+	std::unordered_map<Walnut::ClientID, LoopbackClientTransport*> m_Clients;
+	Walnut::ClientID m_NextClientID = 1;
+
+	DataReceivedCallback m_DataReceivedCallback;
+	ClientConnectedCallback m_ClientConnectedCallback;
+	ClientDisconnectedCallback m_ClientDisconnectedCallback;
+
+	std::atomic<uint64_t> m_SentBytes = 0;
+	std::atomic<uint64_t> m_SentMessages = 0;
+};
+
+class LoopbackClientTransport : public ClientTransport
+{
+public:
+	LoopbackClientTransport(LoopbackServerTransport& server);
+	virtual ~LoopbackClientTransport();
+
+	// The address is ignored, it always connects to the server it was created with
+	virtual void ConnectToServer(const std::string& serverAddress) override;
+	virtual void Disconnect() override;
+
+	virtual void SetServerConnectedCallback(const ServerConnectedCallback& function) override { m_ServerConnectedCallback = function; }
+	virtual void SetServerDisconnectedCallback(const ServerDisconnectedCallback& function) override { m_ServerDisconnectedCallback = function; }
+	virtual void SetDataReceivedCallback(const DataReceivedCallback& function) override { m_DataReceivedCallback = function; }
+
+	virtual void SendBuffer(Walnut::Buffer buffer, bool reliable = true) override;
+
+	virtual ConnectionStatus GetConnectionStatus() const override { return m_ConnectionStatus; }
+	virtual const std::string& GetConnectionDebugMessage() const override { return m_ConnectionDebugMessage; }
+
+	Walnut::ClientID GetClientID() const { return m_ClientID; }
+private:
+	friend class LoopbackServerTransport;
+
+	void OnReceive(Walnut::Buffer buffer);
+	void OnKicked();
+private:
+	LoopbackServerTransport& m_Server;
+	Walnut::ClientID m_ClientID = 0;
+
+	ConnectionStatus m_ConnectionStatus = ConnectionStatus::Disconnected;
+	std::string m_ConnectionDebugMessage;
+
+	ServerConnectedCallback m_ServerConnectedCallback;
+	ServerDisconnectedCallback m_ServerDisconnectedCallback;
+	DataReceivedCallback m_DataReceivedCallback;
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "WireFormat.h"
+
+#include <concepts>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+
+//
+// Compile-time packet layouts. A packet is a struct that lists its fields once, in wire order:
+//
+//   struct FileAck
+//   {
+//       static constexpr PacketType Type = PacketType::FileAck;
+//       uint32_t TransferID = 0;
+//       uint64_t Offset = 0;
+//       using Schema = Wire::Schema<Wire::Field<&FileAck::TransferID>, Wire::Field<&FileAck::Offset>>;
+//   };
+//
+// and gets its encoder (Wire::WritePacket), exact encoded size (Wire::GetPacketSize) and
+// bounds-checked decoder (Wire::ReadPacket) from that, for both wire encodings. Packets read
+// with Wire::DispatchPacket() are decoded and handed to the matching handler overload.
+//
+// Strings are std::string_view: decoding doesn't copy, so decoded packets are only valid as
+// long as the received buffer is.
+//
+namespace Wire {
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// Codecs - how a single field is encoded
+	///////////////////////////////////////////////////////////////////////////////////////////
+
+	// Fixed-size value, the same in every encoding
+	struct RawCodec
+	{
+		template<typename T>
+		static constexpr uint64_t GetSize(const T&, WireEncoding) { return sizeof(T); }
+		template<typename T>
+		static void Write(Walnut::StreamWriter& stream, const T& value, WireEncoding) { stream.WriteRaw<T>(value); }
+		template<typename T>
+		static bool Read(Walnut::BufferStreamReader& stream, T& value, WireEncoding) { return stream.ReadRaw<T>(value); }
+	};
+
+	struct StringCodec
+	{
+		static constexpr uint64_t GetSize(std::string_view value, WireEncoding encoding) { return GetStringSize(value, encoding); }
+		static void Write(Walnut::StreamWriter& stream, std::string_view value, WireEncoding encoding) { WriteString(stream, value, encoding); }
+		static bool Read(Walnut::BufferStreamReader& stream, std::string_view& value, WireEncoding encoding) { return ReadStringView(stream, value, encoding); }
+	};
+
+	// Element counts and other small numbers, see WriteCount()
+	struct CountCodec
+	{
+		static constexpr uint64_t GetSize(uint32_t value, WireEncoding encoding) { return encoding == WireEncoding::Compact ? GetVarUIntSize(value) : sizeof(uint32_t); }
+		static void Write(Walnut::StreamWriter& stream, uint32_t value, WireEncoding encoding) { WriteCount(stream, value, encoding); }
+		static bool Read(Walnut::BufferStreamReader& stream, uint32_t& value, WireEncoding encoding) { return ReadSmallNumber(stream, value, encoding); }
+	};
+
+	// User ID as a varint, in every encoding (only used by compact-only packets)
+	struct UserIDCodec
+	{
+		static constexpr uint64_t GetSize(uint32_t value, WireEncoding) { return GetVarUIntSize(value); }
+		static void Write(Walnut::StreamWriter& stream, uint32_t value, WireEncoding) { WriteUserID(stream, value); }
+		static bool Read(Walnut::BufferStreamReader& stream, uint32_t& value, WireEncoding) { return ReadUserID(stream, value); }
+	};
+
+	// A user, by ID in the compact encoding and by username in the legacy one. Only the one
+	// the encoding uses is written or read.
+	struct UserRef
+	{
+		uint32_t ID = 0;
+		std::string_view Username;
+	};
+
+	struct UserRefCodec
+	{
+		static constexpr uint64_t GetSize(const UserRef& value, WireEncoding encoding)
+		{
+			return encoding == WireEncoding::Compact ? GetVarUIntSize(value.ID) : GetStringSize(value.Username, encoding);
+		}
+
+		static void Write(Walnut::StreamWriter& stream, const UserRef& value, WireEncoding encoding)
+		{
+			if (encoding == WireEncoding::Compact)
+				WriteUserID(stream, value.ID);
+			else
+				WriteString(stream, value.Username, encoding);
+		}
+
+		static bool Read(Walnut::BufferStreamReader& stream, UserRef& value, WireEncoding encoding)
+		{
+			return encoding == WireEncoding::Compact ? ReadUserID(stream, value.ID) : ReadStringView(stream, value.Username, encoding);
+		}
+	};
+
+	template<typename T>
+	concept FieldGroup = requires { typename T::Schema; };
+
+	// Optional fields at the end of a packet (added in later protocol versions, or only sent
+	// to some clients). Written if set; read if there is anything left, in which case all of
+	// them have to be there.
+	struct TrailingCodec
+	{
+		template<FieldGroup T>
+		static constexpr uint64_t GetSize(const std::optional<T>& value, WireEncoding encoding) { return value ? T::Schema::GetSize(*value, encoding) : 0; }
+
+		template<FieldGroup T>
+		static void Write(Walnut::StreamWriter& stream, const std::optional<T>& value, WireEncoding encoding)
+		{
+			if (value)
+				T::Schema::Write(stream, *value, encoding);
+		}
+
+		template<FieldGroup T>
+		static bool Read(Walnut::BufferStreamReader& stream, std::optional<T>& value, WireEncoding encoding)
+		{
+			value.reset();
+			if (stream.GetStreamPosition() >= stream.GetBuffer().Size)
+				return true;
+
+			return T::Schema::Read(stream, value.emplace(), encoding);
+		}
+	};
+
+	template<typename T>
+	struct DefaultCodec { using Type = RawCodec; };
+	template<>
+	struct DefaultCodec<std::string_view> { using Type = StringCodec; };
+	template<>
+	struct DefaultCodec<UserRef> { using Type = UserRefCodec; };
+	template<typename T>
+	struct DefaultCodec<std::optional<T>> { using Type = TrailingCodec; };
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// Fields and schemas
+	///////////////////////////////////////////////////////////////////////////////////////////
+
+	template<typename T>
+	struct MemberPointerTraits;
+	template<typename C, typename T>
+	struct MemberPointerTraits<T C::*> { using Class = C; using Type = T; };
+
+	template<auto Member, typename Codec = typename DefaultCodec<typename MemberPointerTraits<decltype(Member)>::Type>::Type>
+	struct Field
+	{
+		using Type = typename MemberPointerTraits<decltype(Member)>::Type;
+		static_assert(!std::is_same_v<Codec, RawCodec> || std::is_trivially_copyable_v<Type>, "Raw fields have to be trivially copyable");
+
+		template<typename P>
+		static constexpr uint64_t GetSize(const P& packet, WireEncoding encoding) { return Codec::GetSize(packet.*Member, encoding); }
+		template<typename P>
+		static void Write(Walnut::StreamWriter& stream, const P& packet, WireEncoding encoding) { Codec::Write(stream, packet.*Member, encoding); }
+		template<typename P>
+		static bool Read(Walnut::BufferStreamReader& stream, P& packet, WireEncoding encoding) { return Codec::Read(stream, packet.*Member, encoding); }
+	};
+
+	template<typename... Fields>
+	struct Schema
+	{
+		// Packets without fields don't look at the encoding
+		template<typename P>
+		static constexpr uint64_t GetSize(const P& packet, [[maybe_unused]] WireEncoding encoding) { return (Fields::GetSize(packet, encoding) + ... + 0); }
+		template<typename P>
+		static void Write(Walnut::StreamWriter& stream, const P& packet, [[maybe_unused]] WireEncoding encoding) { (Fields::Write(stream, packet, encoding), ...); }
+		// Stops at the first field that can't be read
+		template<typename P>
+		static bool Read(Walnut::BufferStreamReader& stream, P& packet, [[maybe_unused]] WireEncoding encoding) { return (Fields::Read(stream, packet, encoding) && ...); }
+	};
+
+	template<typename T>
+	concept Packet = FieldGroup<T> && requires { { T::Type } -> std::convertible_to<PacketType>; };
+
+	constexpr uint64_t GetPacketTypeSize(PacketType type, WireEncoding encoding)
+	{
+		return encoding == WireEncoding::Compact ? GetVarUIntSize((uint64_t)type) : sizeof(PacketType);
+	}
+
+	// Exact size of the whole packet, PacketType included
+	template<Packet P>
+	constexpr uint64_t GetPacketSize(const P& packet, WireEncoding encoding)
+	{
+		return GetPacketTypeSize(P::Type, encoding) + P::Schema::GetSize(packet, encoding);
+	}
+
+	// Everything after the PacketType (the part a ServerLayer::PacketEncoder writes)
+	template<Packet P>
+	void WritePacketFields(Walnut::StreamWriter& stream, const P& packet, WireEncoding encoding)
+	{
+		P::Schema::Write(stream, packet, encoding);
+	}
+
+	template<Packet P>
+	void WritePacket(Walnut::StreamWriter& stream, const P& packet, WireEncoding encoding)
+	{
+		WritePacketType(stream, P::Type, encoding);
+		P::Schema::Write(stream, packet, encoding);
+	}
+
+	// Reads everything after the PacketType. Fails if the packet is cut short, trailing bytes
+	// are ignored like they always have been (that's how older readers skip newer fields).
+	template<Packet P>
+	bool ReadPacket(Walnut::BufferStreamReader& stream, P& packet, WireEncoding encoding)
+	{
+		return P::Schema::Read(stream, packet, encoding);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// Dispatch
+	///////////////////////////////////////////////////////////////////////////////////////////
+
+	template<Packet... Packets>
+	struct PacketList
+	{
+		static constexpr bool HasUniqueTypes()
+		{
+			PacketType types[] = { Packets::Type... };
+			for (size_t i = 0; i < sizeof...(Packets); i++)
+			{
+				for (size_t j = i + 1; j < sizeof...(Packets); j++)
+				{
+					if (types[i] == types[j])
+						return false;
+				}
+			}
+			return true;
+		}
+		static_assert(HasUniqueTypes(), "PacketList has two packets of the same PacketType");
+
+		static constexpr bool Contains(PacketType type) { return ((Packets::Type == type) || ...); }
+	};
+
+	enum class DispatchResult : uint8_t
+	{
+		Handled = 0,
+		UnknownType, // not in the list
+		Malformed    // cut short or otherwise unreadable, handler wasn't called
+	};
+
+	template<Packet... Packets, typename Handler>
+	DispatchResult DispatchPacket(PacketList<Packets...>, PacketType type, Walnut::BufferStreamReader& stream, WireEncoding encoding, Handler&& handler)
+	{
+		DispatchResult result = DispatchResult::UnknownType;
+		auto tryPacket = [&]<Packet P>(P* /* tag */)
+		{
+			if (P::Type != type)
+				return false;
+
+			P packet;
+			if (ReadPacket(stream, packet, encoding))
+			{
+				handler(static_cast<const P&>(packet));
+				result = DispatchResult::Handled;
+			}
+			else
+			{
+				result = DispatchResult::Malformed;
+			}
+			return true;
+		};
+		(tryPacket((Packets*)nullptr) || ...);
+		return result;
+	}
+
+	// Decodes the packet of the given type from the list and calls handler(const P&). Every
+	// packet in the list needs a handler overload, or this doesn't compile.
+	template<typename List, typename Handler>
+	DispatchResult DispatchPacket(PacketType type, Walnut::BufferStreamReader& stream, WireEncoding encoding, Handler&& handler)
+	{
+		return DispatchPacket(List{}, type, stream, encoding, std::forward<Handler>(handler));
+	}
+
+	// Handler made of lambdas, one per packet: Wire::PacketHandlers{ [](const A&) {}, [](const B&) {} }
+	template<typename... Handlers>
+	struct PacketHandlers : Handlers...
+	{
+		using Handlers::operator()...;
+	};
+
+}
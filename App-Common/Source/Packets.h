@@ -0,0 +1,303 @@
+#pragma once
+
+#include "PacketSchema.h"
+
+//
+// Packet layouts (see PacketSchema.h), one struct per PacketType and direction. The comments
+// in ServerPacket.h say what the fields mean. Packets carrying lists (client lists, history,
+// presence and membership updates) are still written and read by hand with the Wire:: helpers.
+//
+namespace Packets {
+
+	// Same layout in both directions
+	struct FileChunk
+	{
+		static constexpr PacketType Type = PacketType::FileChunk;
+		uint32_t TransferID = 0;
+		uint64_t Offset = 0;
+		std::string_view Data;
+
+		using Schema = Wire::Schema<Wire::Field<&FileChunk::TransferID>, Wire::Field<&FileChunk::Offset>, Wire::Field<&FileChunk::Data>>;
+	};
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// Client->Server
+	///////////////////////////////////////////////////////////////////////////////////////////
+	namespace ToServer {
+
+		struct Message
+		{
+			static constexpr PacketType Type = PacketType::Message;
+			std::string_view Text;
+
+			using Schema = Wire::Schema<Wire::Field<&Message::Text>>;
+		};
+
+		// Always legacy-encoded, it's what picks the encoding
+		struct ClientConnectionRequest
+		{
+			static constexpr PacketType Type = PacketType::ClientConnectionRequest;
+
+			struct ProtocolInfo
+			{
+				uint16_t ProtocolVersion = LegacyProtocolVersion;
+				uint32_t Capabilities = 0;
+
+				using Schema = Wire::Schema<Wire::Field<&ProtocolInfo::ProtocolVersion>, Wire::Field<&ProtocolInfo::Capabilities>>;
+			};
+
+			// Only with ProtocolCapability::SessionResume
+			struct ResumeInfo
+			{
+				uint64_t ResumeToken = 0;
+
+				using Schema = Wire::Schema<Wire::Field<&ResumeInfo::ResumeToken>>;
+			};
+
+			uint32_t Color = 0;
+			std::string_view Username;
+			std::optional<ProtocolInfo> Protocol; // not sent by legacy (v1) clients
+			std::optional<ResumeInfo> Resume;
+
+			using Schema = Wire::Schema<Wire::Field<&ClientConnectionRequest::Color>, Wire::Field<&ClientConnectionRequest::Username>,
+				Wire::Field<&ClientConnectionRequest::Protocol>, Wire::Field<&ClientConnectionRequest::Resume>>;
+		};
+
+		struct Pong
+		{
+			static constexpr PacketType Type = PacketType::ConnectionStatus;
+			uint64_t ServerTime = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&Pong::ServerTime>>;
+		};
+
+		struct UserPresence
+		{
+			static constexpr PacketType Type = PacketType::UserPresence;
+			uint8_t Presence = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&UserPresence::Presence>>;
+		};
+
+		struct DirectMessage
+		{
+			static constexpr PacketType Type = PacketType::DirectMessage;
+			std::string_view ToUsername;
+			std::string_view Text;
+
+			using Schema = Wire::Schema<Wire::Field<&DirectMessage::ToUsername>, Wire::Field<&DirectMessage::Text>>;
+		};
+
+		struct MessageHistoryRequest
+		{
+			static constexpr PacketType Type = PacketType::MessageHistoryRequest;
+			uint64_t BeforeSequence = UINT64_MAX;
+			uint32_t MaxMessages = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&MessageHistoryRequest::BeforeSequence>, Wire::Field<&MessageHistoryRequest::MaxMessages, Wire::CountCodec>>;
+		};
+
+		struct FileOffer
+		{
+			static constexpr PacketType Type = PacketType::FileOffer;
+			uint32_t TransferID = 0;
+			std::string_view ToUsername;
+			std::string_view Filename;
+			uint64_t Size = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&FileOffer::TransferID>, Wire::Field<&FileOffer::ToUsername>,
+				Wire::Field<&FileOffer::Filename>, Wire::Field<&FileOffer::Size>>;
+		};
+
+		using FileChunk = Packets::FileChunk;
+
+		// Accepts a FileOffer from the server
+		struct FileAck
+		{
+			static constexpr PacketType Type = PacketType::FileAck;
+			uint32_t TransferID = 0;
+			uint64_t Offset = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&FileAck::TransferID>, Wire::Field<&FileAck::Offset>>;
+		};
+
+		struct FileComplete
+		{
+			static constexpr PacketType Type = PacketType::FileComplete;
+
+			// Only for files the client was offered
+			struct DownloadInfo
+			{
+				bool Download = true;
+
+				using Schema = Wire::Schema<Wire::Field<&DownloadInfo::Download>>;
+			};
+
+			uint32_t TransferID = 0;
+			FileTransferStatus Status = FileTransferStatus::Cancelled;
+			std::optional<DownloadInfo> Download; // not sent for the client's own uploads
+
+			using Schema = Wire::Schema<Wire::Field<&FileComplete::TransferID>, Wire::Field<&FileComplete::Status>, Wire::Field<&FileComplete::Download>>;
+		};
+
+		// Everything the server decodes through Wire::DispatchPacket()
+		using All = Wire::PacketList<Message, ClientConnectionRequest, Pong, UserPresence, DirectMessage, MessageHistoryRequest,
+			FileOffer, FileChunk, FileAck, FileComplete>;
+
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////
+	// Server->Client
+	///////////////////////////////////////////////////////////////////////////////////////////
+	namespace ToClient {
+
+		struct Message
+		{
+			static constexpr PacketType Type = PacketType::Message;
+
+			// Only with ProtocolCapability::LatencyStamps, on chat relayed from other clients
+			struct LatencyStamps
+			{
+				uint64_t ReceiveServerTime = 0;
+				uint64_t SendServerTime = 0;
+
+				using Schema = Wire::Schema<Wire::Field<&LatencyStamps::ReceiveServerTime>, Wire::Field<&LatencyStamps::SendServerTime>>;
+			};
+
+			Wire::UserRef From;
+			std::string_view Text;
+			std::optional<LatencyStamps> Stamps;
+
+			using Schema = Wire::Schema<Wire::Field<&Message::From>, Wire::Field<&Message::Text>, Wire::Field<&Message::Stamps>>;
+		};
+
+		// Always legacy-encoded, like the request
+		struct ClientConnectionResponse
+		{
+			static constexpr PacketType Type = PacketType::ClientConnectionRequest;
+
+			// Only if the client sent its protocol version
+			struct Negotiated
+			{
+				uint16_t ProtocolVersion = LegacyProtocolVersion;
+				uint32_t Capabilities = 0;
+				uint32_t UserID = 0;
+
+				using Schema = Wire::Schema<Wire::Field<&Negotiated::ProtocolVersion>, Wire::Field<&Negotiated::Capabilities>, Wire::Field<&Negotiated::UserID>>;
+			};
+
+			// Only if ProtocolCapability::SessionResume was negotiated
+			struct ResumeResult
+			{
+				bool Resumed = false;
+
+				using Schema = Wire::Schema<Wire::Field<&ResumeResult::Resumed>>;
+			};
+
+			bool Accepted = false;
+			std::optional<Negotiated> Protocol;
+			std::optional<ResumeResult> Resume;
+
+			using Schema = Wire::Schema<Wire::Field<&ClientConnectionResponse::Accepted>, Wire::Field<&ClientConnectionResponse::Protocol>,
+				Wire::Field<&ClientConnectionResponse::Resume>>;
+		};
+
+		struct Ping
+		{
+			static constexpr PacketType Type = PacketType::ConnectionStatus;
+			uint64_t ServerTime = 0;
+			uint32_t RoundTripTime = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&Ping::ServerTime>, Wire::Field<&Ping::RoundTripTime>>;
+		};
+
+		struct DirectMessage
+		{
+			static constexpr PacketType Type = PacketType::DirectMessage;
+			Wire::UserRef From;
+			std::string_view Text;
+
+			using Schema = Wire::Schema<Wire::Field<&DirectMessage::From>, Wire::Field<&DirectMessage::Text>>;
+		};
+
+		// Always legacy-encoded
+		struct AdmissionStatus
+		{
+			static constexpr PacketType Type = PacketType::AdmissionStatus;
+			uint32_t Position = 0;
+			uint32_t QueueLength = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&AdmissionStatus::Position>, Wire::Field<&AdmissionStatus::QueueLength>>;
+		};
+
+		struct ServerShutdown
+		{
+			static constexpr PacketType Type = PacketType::ServerShutdown;
+
+			using Schema = Wire::Schema<>;
+		};
+
+		struct ServerRestart
+		{
+			static constexpr PacketType Type = PacketType::ServerRestart;
+			uint64_t ResumeToken = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&ServerRestart::ResumeToken>>;
+		};
+
+		struct ClientKick
+		{
+			static constexpr PacketType Type = PacketType::ClientKick;
+
+			struct ReasonInfo
+			{
+				std::string_view Text;
+
+				using Schema = Wire::Schema<Wire::Field<&ReasonInfo::Text>>;
+			};
+
+			std::optional<ReasonInfo> Reason; // the server always sends it, kicks without one still have to disconnect
+
+			using Schema = Wire::Schema<Wire::Field<&ClientKick::Reason>>;
+		};
+
+		struct FileOffer
+		{
+			static constexpr PacketType Type = PacketType::FileOffer;
+			uint32_t TransferID = 0;
+			uint32_t FromUserID = 0;
+			std::string_view Filename;
+			uint64_t Size = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&FileOffer::TransferID>, Wire::Field<&FileOffer::FromUserID, Wire::UserIDCodec>,
+				Wire::Field<&FileOffer::Filename>, Wire::Field<&FileOffer::Size>>;
+		};
+
+		using FileChunk = Packets::FileChunk;
+
+		struct FileAck
+		{
+			static constexpr PacketType Type = PacketType::FileAck;
+			uint32_t TransferID = 0;
+			uint64_t Offset = 0;
+
+			using Schema = Wire::Schema<Wire::Field<&FileAck::TransferID>, Wire::Field<&FileAck::Offset>>;
+		};
+
+		struct FileComplete
+		{
+			static constexpr PacketType Type = PacketType::FileComplete;
+			uint32_t TransferID = 0;
+			FileTransferStatus Status = FileTransferStatus::Completed;
+			bool Upload = false;
+
+			using Schema = Wire::Schema<Wire::Field<&FileComplete::TransferID>, Wire::Field<&FileComplete::Status>, Wire::Field<&FileComplete::Upload>>;
+		};
+
+		// Everything the client decodes through Wire::DispatchPacket()
+		using All = Wire::PacketList<Message, ClientConnectionResponse, Ping, DirectMessage, AdmissionStatus, ServerShutdown,
+			ServerRestart, ClientKick, FileOffer, FileChunk, FileAck, FileComplete>;
+
+	}
+
+}
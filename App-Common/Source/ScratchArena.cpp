@@ -0,0 +1,7 @@
+#include "ScratchArena.h"
+
+std::pmr::memory_resource* GetThreadPool()
+{
+	thread_local std::pmr::unsynchronized_pool_resource s_Pool;
+	return &s_Pool;
+}
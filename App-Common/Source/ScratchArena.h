@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <cstddef>
+#include <memory_resource>
+
+// Unsynchronized pool owned by the calling thread, only ever use it from that thread
+std::pmr::memory_resource* GetThreadPool();
+
+//
+// ScratchArena - std::pmr monotonic allocator over an inline buffer, for temporaries that die
+// together (everything a packet handler or console command needs for one call). Allocating
+// is a pointer bump, freeing does nothing, Reset() hands back everything at once.
+//
+// Whatever doesn't fit spills into the calling thread's pooled resource, which keeps freed
+// blocks around for the next time, so a warmed-up arena never touches the heap.
+//
+template<size_t Size>
+class ScratchArena : public std::pmr::monotonic_buffer_resource
+{
+public:
+	ScratchArena()
+		: std::pmr::monotonic_buffer_resource(m_Buffer, Size, GetThreadPool()) {}
+
+	ScratchArena(const ScratchArena&) = delete;
+	ScratchArena& operator=(const ScratchArena&) = delete;
+
+	void Reset() { release(); }
+private:
+	alignas(std::max_align_t) std::byte m_Buffer[Size];
+};
@@ -1,24 +1,78 @@
 #include "ServerPacket.h"
 
-std::string_view PacketTypeToString(PacketType type)
-{
-	switch (type)
+#include <iterator>
+
+namespace {
+
+	struct PacketTypeInfo
+	{
+		PacketType Type;
+		std::string_view Name;
+		DeliveryClass Delivery;
+		uint32_t RequiredCapabilities;
+	};
+
+	// Indexed by PacketType. File offers and completions go in the Transfer lane with the
+	// chunks: it's never dropped, and sharing it keeps them in order with the data.
+	constexpr PacketTypeInfo s_PacketTypes[] =
+	{
+		{ PacketType::None,                    "PacketType::None",                    DeliveryClass::Control,     0 },
+		{ PacketType::Message,                 "PacketType::Message",                 DeliveryClass::Interactive, 0 },
+		{ PacketType::ClientConnectionRequest, "PacketType::ClientConnectionRequest", DeliveryClass::Control,     0 },
+		{ PacketType::ConnectionStatus,        "PacketType::ConnectionStatus",        DeliveryClass::Control,     ProtocolCapability::LatencyStamps },
+		{ PacketType::ClientList,              "PacketType::ClientList",              DeliveryClass::Control,     0 },
+		{ PacketType::ClientConnect,           "PacketType::ClientConnect",           DeliveryClass::Control,     0 },
+		{ PacketType::ClientUpdate,            "PacketType::ClientUpdate",            DeliveryClass::Control,     0 },
+		{ PacketType::ClientDisconnect,        "PacketType::ClientDisconnect",        DeliveryClass::Control,     0 },
+		{ PacketType::ClientUpdateResponse,    "PacketType::ClientUpdateResponse",    DeliveryClass::Control,     0 },
+		{ PacketType::MessageHistory,          "PacketType::MessageHistory",          DeliveryClass::Bulk,        0 },
+		{ PacketType::ServerShutdown,          "PacketType::ServerShutdown",          DeliveryClass::Control,     0 },
+		{ PacketType::ClientKick,              "PacketType::ClientKick",              DeliveryClass::Control,     0 },
+		{ PacketType::UserPresence,            "PacketType::UserPresence",            DeliveryClass::Presence,    ProtocolCapability::Presence },
+		{ PacketType::DirectMessage,           "PacketType::DirectMessage",           DeliveryClass::Interactive, ProtocolCapability::DirectMessages },
+		{ PacketType::MessageHistoryRequest,   "PacketType::MessageHistoryRequest",   DeliveryClass::Bulk,        ProtocolCapability::HistoryPaging },
+		{ PacketType::AdmissionStatus,         "PacketType::AdmissionStatus",         DeliveryClass::Control,     0 },
+		{ PacketType::ClientListUpdate,        "PacketType::ClientListUpdate",        DeliveryClass::Control,     ProtocolCapability::MembershipUpdates },
+		{ PacketType::ServerRestart,           "PacketType::ServerRestart",           DeliveryClass::Control,     ProtocolCapability::SessionResume },
+		{ PacketType::FileOffer,               "PacketType::FileOffer",               DeliveryClass::Transfer,    ProtocolCapability::FileTransfer },
+		{ PacketType::FileChunk,               "PacketType::FileChunk",               DeliveryClass::Transfer,    ProtocolCapability::FileTransfer },
+		{ PacketType::FileAck,                 "PacketType::FileAck",                 DeliveryClass::Control,     ProtocolCapability::FileTransfer },
+		{ PacketType::FileComplete,            "PacketType::FileComplete",            DeliveryClass::Transfer,    ProtocolCapability::FileTransfer },
+	};
+
+	constexpr bool IsIndexedByPacketType()
+	{
+		for (size_t i = 0; i < std::size(s_PacketTypes); i++)
+		{
+			if ((size_t)s_PacketTypes[i].Type != i)
+				return false;
+		}
+		return true;
+	}
+	static_assert(IsIndexedByPacketType(), "s_PacketTypes has to list every PacketType in order");
+	static_assert((size_t)PacketType::FileComplete + 1 == std::size(s_PacketTypes), "s_PacketTypes is missing a PacketType");
+
+	constexpr const PacketTypeInfo* GetPacketTypeInfo(PacketType type)
 	{
-		case PacketType::None:                     return "PacketType::None";
-		case PacketType::Message:                  return "PacketType::Message";
-		case PacketType::ClientConnectionRequest:  return "PacketType::ClientConnectionRequest";
-		case PacketType::ConnectionStatus:         return "PacketType::ConnectionStatus";
-		case PacketType::ClientList:               return "PacketType::ClientList";
-		case PacketType::ClientConnect:            return "PacketType::ClientConnect";
-		case PacketType::ClientUpdate:             return "PacketType::ClientUpdate";
-		case PacketType::ClientDisconnect:         return "PacketType::ClientDisconnect";
-		case PacketType::ClientUpdateResponse:     return "PacketType::ClientUpdateResponse";
-		case PacketType::MessageHistory:           return "PacketType::MessageHistory";
-		case PacketType::ServerShutdown:           return "PacketType::ServerShutdown";
-		case PacketType::ClientKick:               return "PacketType::ClientKick";
-
-		default: return "PacketType::<Invalid>";
+		return (size_t)type < std::size(s_PacketTypes) ? &s_PacketTypes[(size_t)type] : nullptr;
 	}
 
-	return "PacketType::<Invalid>";
-}
\ No newline at end of file
+}
+
+std::string_view PacketTypeToString(PacketType type)
+{
+	const PacketTypeInfo* info = GetPacketTypeInfo(type);
+	return info ? info->Name : "PacketType::<Invalid>";
+}
+
+DeliveryClass GetDeliveryClass(PacketType type)
+{
+	const PacketTypeInfo* info = GetPacketTypeInfo(type);
+	return info ? info->Delivery : DeliveryClass::Control;
+}
+
+uint32_t GetRequiredCapabilities(PacketType type)
+{
+	const PacketTypeInfo* info = GetPacketTypeInfo(type);
+	return info ? info->RequiredCapabilities : 0;
+}
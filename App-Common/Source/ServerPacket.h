@@ -7,6 +7,7 @@
 // Common "protocol" for server<->client communication for this example chat application //
 ///////////////////////////////////////////////////////////////////////////////////////////
 
+// New packet types also go into s_PacketTypes (ServerPacket.cpp), and their layouts into Packets.h
 enum class PacketType : uint16_t
 {
 	//
@@ -20,6 +21,9 @@ enum class PacketType : uint16_t
 	// [Server->Client]
 	// 1. Username - UTF-8 serialized as per Hazel
 	// 2. Message - UTF-8 string serialized as per Hazel
+	// 3. (optional, ProtocolCapability::LatencyStamps) 64-bit server time the message was
+	//    received (see ConnectionStatus). Only on chat relayed from other clients.
+	// 4. (only with 3.) 64-bit server time it was relayed
 	// [Client->Server]
 	// 1. Message - buffer of UTF-8 chars
 	Message = 1,
@@ -30,15 +34,32 @@ enum class PacketType : uint16_t
 	// [Client->Server]
 	// 1. 32-bit int with requested user color (RGB, most significant 8 bits ignored)
 	// 2. Hazel serialized UTF-8 string with requested username
+	// 3. (optional, protocol v2+) 16-bit protocol version
+	// 4. (optional, protocol v2+) 32-bit capability flags (see ProtocolCapability)
+	// 5. (optional, ProtocolCapability::SessionResume) 64-bit resume token from PacketType::ServerRestart
 	// [Server->Client]
-	// boolean response indicating acceptance of requested username
+	// 1. boolean response indicating acceptance of requested username
+	// 2. (only if client sent 3.) 16-bit negotiated protocol version
+	// 3. (only if client sent 3.) 32-bit negotiated capability flags
+	// 4. (only if client sent 3.) 32-bit user ID assigned to client
+	// 5. (only if client sent 5.) boolean, true if the session was resumed. The client keeps
+	//    its message history then and only gets what it missed, otherwise it's a regular join.
+	// This packet is always sent with the legacy encoding, everything after it uses
+	// the negotiated encoding (see WireFormat.h)
 	ClientConnectionRequest = 2,
 	
 	// 
-	// -- ConnectionStatus --
+	// -- ConnectionStatus -- (requires ProtocolCapability::LatencyStamps)
 	// 
+	// Ping/pong for measuring round trip time. Server time is microseconds on the server's own
+	// (monotonic) clock, only differences between server times mean anything.
 	// [Server->Client]
-	// idk
+	// Ping, sent every few seconds
+	// 1. 64-bit server time
+	// 2. 32-bit round trip time in microseconds the server last measured for this client (0 = none yet)
+	// [Client->Server]
+	// Pong, sent right away
+	// 1. 64-bit server time from the ping
 	ConnectionStatus = 3,
 
 	// 
@@ -95,6 +116,7 @@ enum class PacketType : uint16_t
 	// [Server->Client]
 	// Server chat history - big boi
 	// 1. A vector of ChatMessage in order of send time
+	// Sent in pages on join, followed by an empty page with ProtocolCapability::JoinHistoryEnd
 	MessageHistory = 9,
 
 	// 
@@ -110,9 +132,224 @@ enum class PacketType : uint16_t
 	// 
 	// [Server->Client]
 	// User has been kicked from server
-	// 1. String reason, could be empty string
+	// 1. (optional) String reason, could be empty string - disconnect without one too
 	ClientKick = 11,
+
+	// 
+	// -- UserPresence -- (requires ProtocolCapability::Presence)
+	// 
+	// [Client->Server]
+	// Own presence state, sent on change and refreshed every few seconds while typing
+	// 1. 8-bit PresenceFlags
+	// [Server->Client]
+	// Presence changes of other users, coalesced by the server and sent at a bounded rate.
+	// Only users whose state actually changed are included.
+	// 1. Count
+	// 2. Count x { user ID, 8-bit PresenceFlags }
+	UserPresence = 12,
+
+	// 
+	// -- DirectMessage -- (requires ProtocolCapability::DirectMessages)
+	// 
+	// [Client->Server]
+	// 1. Recipient username
+	// 2. Message
+	// [Server->Client]
+	// Only sent to the recipient
+	// 1. Sender user ID (0 for server)
+	// 2. Message
+	DirectMessage = 13,
+
+	// 
+	// -- MessageHistoryRequest -- (requires ProtocolCapability::HistoryPaging)
+	// 
+	// Clients only get the newest part of the history on join, older pages are requested
+	// [Client->Server]
+	// 1. 64-bit sequence to page back from (exclusive), UINT64_MAX for "before what I got on join"
+	// 2. Max message count
+	// [Server->Client]
+	// 1. 64-bit sequence of the first message in this page
+	// 2. A vector of ChatMessage in order of send time, empty if there is nothing older
+	MessageHistoryRequest = 14,
+
+	// 
+	// -- AdmissionStatus -- (only sent to clients that asked for ProtocolCapability::AdmissionQueue)
+	// 
+	// [Server->Client]
+	// Too many clients are joining at once, the ClientConnectionRequest is queued and will be
+	// answered when it's this client's turn. Sent when queued and then every second or so.
+	// Like the ClientConnectionRequest response, always sent with the legacy encoding.
+	// 1. 32-bit position in the queue (1 = next)
+	// 2. 32-bit queue length
+	AdmissionStatus = 15,
+
+	// 
+	// -- ClientListUpdate -- (requires ProtocolCapability::MembershipUpdates)
+	// 
+	// [Server->Client]
+	// Replaces ClientConnect/ClientDisconnect: joins and leaves are collected over a short
+	// window and sent together. Apply the leaves first. A client that joined and left within
+	// the window isn't in either list.
+	// 1. Count
+	// 2. Count x UserInfo of clients that joined
+	// 3. Count
+	// 4. Count x user ID of clients that left
+	ClientListUpdate = 16,
+
+	// 
+	// -- ServerRestart -- (only sent to clients that asked for ProtocolCapability::SessionResume)
+	// 
+	// [Server->Client]
+	// Sent instead of ServerShutdown when the server restarts with /restart. Everything sent
+	// before it made it into the restart snapshot, so reconnecting with the token (see
+	// ClientConnectionRequest) resumes the session without a full join.
+	// 1. 64-bit resume token
+	ServerRestart = 17,
+
+	// 
+	// -- FileOffer -- (requires ProtocolCapability::FileTransfer)
+	// 
+	// Files (and pastes too long for a Message) are sent in chunks of at most FileChunkSize,
+	// see FileChunk/FileAck/FileComplete. Transfer IDs are picked by whoever sends the file,
+	// the client for its uploads and the server for what it forwards.
+	// [Client->Server]
+	// 1. 32-bit transfer ID. Offering an unfinished upload again (same ID, name and size, eg.
+	//    after reconnecting) resumes it from where the server's FileAck says it got to.
+	// 2. Recipient username, empty for everyone
+	// 3. File name
+	// 4. 64-bit size
+	// [Server->Client]
+	// Someone wants to send the client a file. The client answers with FileAck to accept it
+	// or FileComplete to decline, its chunks follow once the upload starts.
+	// 1. 32-bit transfer ID
+	// 2. Sender user ID
+	// 3. File name
+	// 4. 64-bit size
+	FileOffer = 18,
+
+	// 
+	// -- FileChunk -- (requires ProtocolCapability::FileTransfer)
+	// 
+	// [Client->Server] / [Server->Client]
+	// 1. 32-bit transfer ID
+	// 2. 64-bit offset, chunks are always sent in order
+	// 3. Data (string, at most FileChunkSize bytes)
+	FileChunk = 19,
+
+	// 
+	// -- FileAck -- (requires ProtocolCapability::FileTransfer)
+	// 
+	// [Server->Client]
+	// Flow control for uploads: the client can have at most FileTransferWindow bytes sent past
+	// the last acknowledged offset. The server holds acks back while recipients are behind.
+	// Also the answer to a FileOffer, with the offset to resume from (0 for a new upload). A
+	// new upload isn't answered until its recipients have answered the offer (or didn't in
+	// time), see ServerLayer::StartFileUpload().
+	// 1. 32-bit transfer ID (the client's)
+	// 2. 64-bit offset everything before which has been received
+	// [Client->Server]
+	// Accepts a file the server offered
+	// 1. 32-bit transfer ID (the server's)
+	// 2. 64-bit offset, always 0
+	FileAck = 20,
+
+	// 
+	// -- FileComplete -- (requires ProtocolCapability::FileTransfer)
+	// 
+	// [Client->Server]
+	// Cancels an upload (the server notices when it has everything by itself), or declines /
+	// stops receiving a file the server offered
+	// 1. 32-bit transfer ID
+	// 2. 8-bit FileTransferStatus
+	// 3. boolean, only sent (true) when it's about a file the client was offered (the
+	//    server's transfer ID)
+	// [Server->Client]
+	// 1. 32-bit transfer ID
+	// 2. 8-bit FileTransferStatus
+	// 3. boolean, true if this is about one of the client's own uploads (the client's transfer
+	//    ID), false for a file it was receiving (the server's)
+	FileComplete = 21,
 };
 
 std::string_view PacketTypeToString(PacketType type);
 
+//
+// How a packet should be delivered. Every PacketType declares its class in GetDeliveryClass()
+// 
+// Control:     connection/membership state - reliable, sent immediately
+// Interactive: chat - reliable, sent immediately, never queued behind bulk transfers
+// Presence:    transient state where only the latest value matters - reliable (only changes are
+//              sent, so a lost one would stick), coalesced per user rather than queued
+// Bulk:        large transfers (history) - reliable, queued per client and paced so it
+//              can't head-of-line block Control/Interactive packets
+// Transfer:    file transfers - like Bulk, but never dropped to catch a client up (a missing
+//              chunk breaks the file), a client that can't keep up is disconnected instead
+//
+enum class DeliveryClass : uint8_t
+{
+	Control = 0, Interactive, Presence, Bulk, Transfer
+};
+
+DeliveryClass GetDeliveryClass(PacketType type);
+
+// Capabilities a client must have negotiated to be sent this packet type (0 = every client)
+uint32_t GetRequiredCapabilities(PacketType type);
+
+// Every class is. The client's periodic typing refresh is the one unreliable send, and it
+// says so itself (the next refresh is only seconds away).
+inline bool IsReliableDelivery(DeliveryClass /*deliveryClass*/)
+{
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Protocol versioning
+// Clients that don't send a version with ClientConnectionRequest are legacy (v1) clients,
+// and get exactly the same packets as before versioning existed.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+const uint16_t LegacyProtocolVersion = 1;
+const uint16_t CurrentProtocolVersion = 2;
+
+namespace ProtocolCapability
+{
+	// Varint packet types/lengths, 24-bit colors, user IDs instead of usernames
+	const uint32_t CompactEncoding = 1 << 0;
+	// Typing/away indicators via PacketType::UserPresence (only granted with CompactEncoding)
+	const uint32_t Presence = 1 << 1;
+	// Private messages via PacketType::DirectMessage
+	const uint32_t DirectMessages = 1 << 2;
+	// Older history on request via PacketType::MessageHistoryRequest
+	const uint32_t HistoryPaging = 1 << 3;
+	// Batched joins/leaves via PacketType::ClientListUpdate (only granted with CompactEncoding)
+	const uint32_t MembershipUpdates = 1 << 4;
+	// Queue position via PacketType::AdmissionStatus while waiting to join a busy server
+	const uint32_t AdmissionQueue = 1 << 5;
+	// Reconnect after a server restart without a full join via PacketType::ServerRestart
+	const uint32_t SessionResume = 1 << 6;
+	// Chunked file transfers via PacketType::FileOffer etc. (only granted with CompactEncoding)
+	const uint32_t FileTransfer = 1 << 7;
+	// Round trip times via PacketType::ConnectionStatus pings and server timestamps on
+	// relayed PacketType::Message
+	const uint32_t LatencyStamps = 1 << 8;
+	// Join history ends with an empty PacketType::MessageHistory page
+	const uint32_t JoinHistoryEnd = 1 << 9;
+}
+
+const uint32_t SupportedProtocolCapabilities = ProtocolCapability::CompactEncoding | ProtocolCapability::Presence
+	| ProtocolCapability::DirectMessages | ProtocolCapability::HistoryPaging | ProtocolCapability::MembershipUpdates
+	| ProtocolCapability::AdmissionQueue | ProtocolCapability::SessionResume | ProtocolCapability::FileTransfer
+	| ProtocolCapability::LatencyStamps | ProtocolCapability::JoinHistoryEnd;
+
+// File transfers: chunks fit the scratch buffers with room to spare, and an upload can be
+// this far ahead of the last PacketType::FileAck
+const uint32_t FileChunkSize = 4 * 1024;
+const uint32_t FileTransferWindow = 64 * 1024;
+
+enum class FileTransferStatus : uint8_t
+{
+	Completed = 0, Cancelled, Failed,
+	// No recipient accepted it
+	Declined
+};
+
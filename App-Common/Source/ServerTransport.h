@@ -0,0 +1,47 @@
+#pragma once
+
+#include "Walnut/Networking/Server.h"
+
+#include <map>
+
+//
+// ServerTransport - everything ServerLayer needs from the network. WalnutServerTransport
+// is the real thing, LoopbackServerTransport connects clients living in the same process.
+//
+class ServerTransport
+{
+public:
+	using DataReceivedCallback = Walnut::Server::DataReceivedCallback;
+	using ClientConnectedCallback = Walnut::Server::ClientConnectedCallback;
+	using ClientDisconnectedCallback = Walnut::Server::ClientDisconnectedCallback;
+
+	// What's waiting in the transport to go out to a client
+	struct SendQueueStatus
+	{
+		uint64_t PendingBytes = 0;
+		// How long something sent now would wait before it goes out, in seconds
+		float QueueTime = 0.0f;
+	};
+public:
+	virtual ~ServerTransport() = default;
+
+	virtual void Start() = 0;
+	virtual void Stop() = 0;
+	virtual bool IsRunning() const = 0;
+
+	virtual void SetDataReceivedCallback(const DataReceivedCallback& function) = 0;
+	virtual void SetClientConnectedCallback(const ClientConnectedCallback& function) = 0;
+	virtual void SetClientDisconnectedCallback(const ClientDisconnectedCallback& function) = 0;
+
+	virtual void SendBufferToClient(Walnut::ClientID clientID, Walnut::Buffer buffer, bool reliable = true) = 0;
+	// SendBufferToClient() can be called from several threads at once, for different clients
+	// (see ServerLayer::FanOutPacketToAllClients)
+	virtual bool SupportsConcurrentSends() const { return false; }
+	// Transports that can't tell get a fixed send budget per client from ServerLayer instead
+	virtual bool HasSendQueueStatus() const { return false; }
+	virtual bool GetSendQueueStatus(Walnut::ClientID /*clientID*/, SendQueueStatus& /*status*/) const { return false; }
+	// Closes the connection, the disconnected callback is not called for kicked clients
+	virtual void KickClient(Walnut::ClientID clientID) = 0;
+
+	virtual const std::map<Walnut::ClientID, Walnut::ClientInfo>& GetConnectedClients() const = 0;
+};
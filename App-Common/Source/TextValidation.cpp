@@ -0,0 +1,414 @@
+#include "TextValidation.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#define WC_TEXT_VALIDATION_X86 1
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define WC_TARGET(features)
+	#else
+		#define WC_TARGET(features) __attribute__((target(features)))
+	#endif
+#else
+	#define WC_TEXT_VALIDATION_X86 0
+#endif
+
+namespace TextValidation {
+
+	static bool IsContinuationByte(uint8_t byte)
+	{
+		return (byte & 0xC0) == 0x80;
+	}
+
+	// Where to cut text to at most maxLength bytes without splitting a code point. Only looks
+	// back as far as a code point can be long, anything odd there is left for validation.
+	static size_t GetTruncatedLength(const uint8_t* data, size_t length, size_t maxLength)
+	{
+		if (length <= maxLength)
+			return length;
+
+		size_t cut = maxLength;
+		for (int i = 0; i < 3 && cut > 0 && IsContinuationByte(data[cut]); i++)
+			cut--;
+		return cut;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Scalar
+	//////////////////////////////////////////////////////////////////////////////////////
+
+	static void ScanScalar(const uint8_t* data, size_t length, ScanResult& result)
+	{
+		size_t i = 0;
+		while (i < length)
+		{
+			uint8_t byte = data[i];
+			if (byte < 0x80)
+			{
+				bool whitespace = byte == ' ' || (byte >= '\t' && byte <= '\r');
+				if (!whitespace)
+				{
+					result.OnlyWhitespace = false;
+					if (byte < 0x20 || byte == 0x7F)
+						result.HasControlCharacters = true;
+				}
+				i++;
+				continue;
+			}
+
+			size_t sequenceLength;
+			uint32_t codePoint;
+			if ((byte & 0xE0) == 0xC0)
+			{
+				sequenceLength = 2;
+				codePoint = byte & 0x1F;
+			}
+			else if ((byte & 0xF0) == 0xE0)
+			{
+				sequenceLength = 3;
+				codePoint = byte & 0x0F;
+			}
+			else if ((byte & 0xF8) == 0xF0)
+			{
+				sequenceLength = 4;
+				codePoint = byte & 0x07;
+			}
+			else
+			{
+				result.ValidUTF8 = false;
+				return;
+			}
+
+			if (length - i < sequenceLength)
+			{
+				result.ValidUTF8 = false;
+				return;
+			}
+
+			for (size_t j = 1; j < sequenceLength; j++)
+			{
+				if (!IsContinuationByte(data[i + j]))
+				{
+					result.ValidUTF8 = false;
+					return;
+				}
+				codePoint = (codePoint << 6) | (data[i + j] & 0x3F);
+			}
+
+			static const uint32_t s_MinCodePoint[] = { 0, 0, 0x80, 0x800, 0x10000 };
+			if (codePoint < s_MinCodePoint[sequenceLength] || codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+			{
+				result.ValidUTF8 = false;
+				return;
+			}
+
+			result.OnlyWhitespace = false;
+			i += sequenceLength;
+		}
+	}
+
+#if WC_TEXT_VALIDATION_X86
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// SIMD
+	//
+	// UTF-8 validation is the lookup table algorithm from "Validating UTF-8 In Less Than One
+	// Instruction Per Byte" (Keiser, Lemire): the high nibble of each byte and the previous
+	// byte, plus the low nibble of the previous byte, index three 16-entry tables (pshufb)
+	// whose AND is non-zero for every invalid two byte combination. 3 and 4 byte sequences
+	// are checked by where continuation bytes are required.
+	//////////////////////////////////////////////////////////////////////////////////////
+
+	// Error bits of the lookup tables
+	static const uint8_t TooShort = 1 << 0;     // lead byte followed by a lead byte or ASCII
+	static const uint8_t TooLong = 1 << 1;      // ASCII followed by a continuation byte
+	static const uint8_t Overlong3 = 1 << 2;    // E0 followed by 80..9F
+	static const uint8_t TooLarge = 1 << 3;     // F4 followed by 90..BF, or F5..FF
+	static const uint8_t Surrogate = 1 << 4;    // ED followed by A0..BF
+	static const uint8_t Overlong2 = 1 << 5;    // C0, C1
+	static const uint8_t TooLarge1000 = 1 << 6; // F5..FF followed by 80..8F
+	static const uint8_t Overlong4 = 1 << 6;    // F0 followed by 80..8F
+	static const uint8_t TwoConts = 1 << 7;     // two continuation bytes in a row
+	static const uint8_t Carry = TooShort | TooLong | TwoConts;
+
+	// Indexed by the previous byte's high nibble
+	static const uint8_t s_Byte1High[16] = {
+		TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+		TwoConts, TwoConts, TwoConts, TwoConts,
+		TooShort | Overlong2,
+		TooShort,
+		TooShort | Overlong3 | Surrogate,
+		TooShort | TooLarge | TooLarge1000 | Overlong4
+	};
+
+	// Indexed by the previous byte's low nibble
+	static const uint8_t s_Byte1Low[16] = {
+		Carry | Overlong3 | Overlong2 | Overlong4,
+		Carry | Overlong2,
+		Carry,
+		Carry,
+		Carry | TooLarge,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000 | Surrogate,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000
+	};
+
+	// Indexed by the current byte's high nibble
+	static const uint8_t s_Byte2High[16] = {
+		TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+		TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+		TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+		TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+		TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+		TooShort, TooShort, TooShort, TooShort
+	};
+
+	// Anything above these in the last three bytes of a block starts a sequence that
+	// continues into the next block
+	static const uint8_t s_IncompleteMax[32] = {
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+	};
+
+	struct SSEState
+	{
+		__m128i Error, PreviousInput, PreviousIncomplete, Control, Content;
+	};
+
+	WC_TARGET("sse4.1")
+	static void ScanBlockSSE(__m128i input, SSEState& state)
+	{
+		const __m128i lowNibbleMask = _mm_set1_epi8(0x0F);
+
+		// Control characters and anything that isn't whitespace, bytes >= 0x80 are content
+		__m128i belowTab = _mm_cmpeq_epi8(_mm_min_epu8(input, _mm_set1_epi8(0x08)), input);
+		__m128i shiftedOut = _mm_sub_epi8(input, _mm_set1_epi8(0x0E));
+		__m128i outOfTabToCR = _mm_cmpeq_epi8(_mm_min_epu8(shiftedOut, _mm_set1_epi8(0x11)), shiftedOut);
+		__m128i del = _mm_cmpeq_epi8(input, _mm_set1_epi8(0x7F));
+		state.Control = _mm_or_si128(state.Control, _mm_or_si128(_mm_or_si128(belowTab, outOfTabToCR), del));
+
+		__m128i shiftedTab = _mm_sub_epi8(input, _mm_set1_epi8('\t'));
+		__m128i tabToCR = _mm_cmpeq_epi8(_mm_min_epu8(shiftedTab, _mm_set1_epi8('\r' - '\t')), shiftedTab);
+		__m128i whitespace = _mm_or_si128(tabToCR, _mm_cmpeq_epi8(input, _mm_set1_epi8(' ')));
+		state.Content = _mm_or_si128(state.Content, _mm_andnot_si128(whitespace, _mm_set1_epi8(-1)));
+
+		if (_mm_movemask_epi8(input) == 0)
+		{
+			// All ASCII, only a sequence left open by the previous block can be wrong
+			state.Error = _mm_or_si128(state.Error, state.PreviousIncomplete);
+			state.PreviousInput = input;
+			state.PreviousIncomplete = _mm_setzero_si128();
+			return;
+		}
+
+		__m128i previous1 = _mm_alignr_epi8(input, state.PreviousInput, 16 - 1);
+		__m128i previous2 = _mm_alignr_epi8(input, state.PreviousInput, 16 - 2);
+		__m128i previous3 = _mm_alignr_epi8(input, state.PreviousInput, 16 - 3);
+
+		__m128i byte1High = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s_Byte1High), _mm_and_si128(_mm_srli_epi16(previous1, 4), lowNibbleMask));
+		__m128i byte1Low = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s_Byte1Low), _mm_and_si128(previous1, lowNibbleMask));
+		__m128i byte2High = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s_Byte2High), _mm_and_si128(_mm_srli_epi16(input, 4), lowNibbleMask));
+		__m128i specialCases = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+		// Third/fourth bytes of 3/4 byte sequences must be continuations (and nothing else may)
+		__m128i thirdByte = _mm_subs_epu8(previous2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+		__m128i fourthByte = _mm_subs_epu8(previous3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+		__m128i mustBeContinuation = _mm_and_si128(_mm_or_si128(thirdByte, fourthByte), _mm_set1_epi8((char)0x80));
+
+		state.Error = _mm_or_si128(state.Error, _mm_xor_si128(mustBeContinuation, specialCases));
+		state.PreviousInput = input;
+		state.PreviousIncomplete = _mm_subs_epu8(input, _mm_loadu_si128((const __m128i*)(s_IncompleteMax + 16)));
+	}
+
+	WC_TARGET("sse4.1")
+	static void ScanSSE(const uint8_t* data, size_t length, ScanResult& result)
+	{
+		SSEState state;
+		state.Error = state.PreviousInput = state.PreviousIncomplete = state.Control = state.Content = _mm_setzero_si128();
+
+		size_t i = 0;
+		for (; i + 16 <= length; i += 16)
+			ScanBlockSSE(_mm_loadu_si128((const __m128i*)(data + i)), state);
+
+		// Padded with spaces, they're whitespace and end any open sequence (as an error)
+		if (i < length)
+		{
+			uint8_t tail[16];
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, data + i, length - i);
+			ScanBlockSSE(_mm_loadu_si128((const __m128i*)tail), state);
+		}
+		state.Error = _mm_or_si128(state.Error, state.PreviousIncomplete);
+
+		result.ValidUTF8 = _mm_testz_si128(state.Error, state.Error);
+		result.HasControlCharacters = !_mm_testz_si128(state.Control, state.Control);
+		result.OnlyWhitespace = _mm_testz_si128(state.Content, state.Content);
+	}
+
+	struct AVX2State
+	{
+		__m256i Error, PreviousInput, PreviousIncomplete, Control, Content;
+	};
+
+	WC_TARGET("avx2")
+	static void ScanBlockAVX2(__m256i input, AVX2State& state)
+	{
+		const __m256i lowNibbleMask = _mm256_set1_epi8(0x0F);
+
+		__m256i belowTab = _mm256_cmpeq_epi8(_mm256_min_epu8(input, _mm256_set1_epi8(0x08)), input);
+		__m256i shiftedOut = _mm256_sub_epi8(input, _mm256_set1_epi8(0x0E));
+		__m256i outOfTabToCR = _mm256_cmpeq_epi8(_mm256_min_epu8(shiftedOut, _mm256_set1_epi8(0x11)), shiftedOut);
+		__m256i del = _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7F));
+		state.Control = _mm256_or_si256(state.Control, _mm256_or_si256(_mm256_or_si256(belowTab, outOfTabToCR), del));
+
+		__m256i shiftedTab = _mm256_sub_epi8(input, _mm256_set1_epi8('\t'));
+		__m256i tabToCR = _mm256_cmpeq_epi8(_mm256_min_epu8(shiftedTab, _mm256_set1_epi8('\r' - '\t')), shiftedTab);
+		__m256i whitespace = _mm256_or_si256(tabToCR, _mm256_cmpeq_epi8(input, _mm256_set1_epi8(' ')));
+		state.Content = _mm256_or_si256(state.Content, _mm256_andnot_si256(whitespace, _mm256_set1_epi8(-1)));
+
+		if (_mm256_movemask_epi8(input) == 0)
+		{
+			state.Error = _mm256_or_si256(state.Error, state.PreviousIncomplete);
+			state.PreviousInput = input;
+			state.PreviousIncomplete = _mm256_setzero_si256();
+			return;
+		}
+
+		// alignr works per 128-bit lane, so shift in from [previous high lane, input low lane]
+		__m256i previousShifted = _mm256_permute2x128_si256(state.PreviousInput, input, 0x21);
+		__m256i previous1 = _mm256_alignr_epi8(input, previousShifted, 16 - 1);
+		__m256i previous2 = _mm256_alignr_epi8(input, previousShifted, 16 - 2);
+		__m256i previous3 = _mm256_alignr_epi8(input, previousShifted, 16 - 3);
+
+		__m256i byte1HighTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)s_Byte1High));
+		__m256i byte1LowTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)s_Byte1Low));
+		__m256i byte2HighTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)s_Byte2High));
+
+		__m256i byte1High = _mm256_shuffle_epi8(byte1HighTable, _mm256_and_si256(_mm256_srli_epi16(previous1, 4), lowNibbleMask));
+		__m256i byte1Low = _mm256_shuffle_epi8(byte1LowTable, _mm256_and_si256(previous1, lowNibbleMask));
+		__m256i byte2High = _mm256_shuffle_epi8(byte2HighTable, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibbleMask));
+		__m256i specialCases = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+		__m256i thirdByte = _mm256_subs_epu8(previous2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+		__m256i fourthByte = _mm256_subs_epu8(previous3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+		__m256i mustBeContinuation = _mm256_and_si256(_mm256_or_si256(thirdByte, fourthByte), _mm256_set1_epi8((char)0x80));
+
+		state.Error = _mm256_or_si256(state.Error, _mm256_xor_si256(mustBeContinuation, specialCases));
+		state.PreviousInput = input;
+		state.PreviousIncomplete = _mm256_subs_epu8(input, _mm256_loadu_si256((const __m256i*)s_IncompleteMax));
+	}
+
+	WC_TARGET("avx2")
+	static void ScanAVX2(const uint8_t* data, size_t length, ScanResult& result)
+	{
+		AVX2State state;
+		state.Error = state.PreviousInput = state.PreviousIncomplete = state.Control = state.Content = _mm256_setzero_si256();
+
+		size_t i = 0;
+		for (; i + 32 <= length; i += 32)
+			ScanBlockAVX2(_mm256_loadu_si256((const __m256i*)(data + i)), state);
+
+		if (i < length)
+		{
+			uint8_t tail[32];
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, data + i, length - i);
+			ScanBlockAVX2(_mm256_loadu_si256((const __m256i*)tail), state);
+		}
+		state.Error = _mm256_or_si256(state.Error, state.PreviousIncomplete);
+
+		result.ValidUTF8 = _mm256_testz_si256(state.Error, state.Error);
+		result.HasControlCharacters = !_mm256_testz_si256(state.Control, state.Control);
+		result.OnlyWhitespace = _mm256_testz_si256(state.Content, state.Content);
+	}
+
+	static Implementation DetectImplementation()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		bool sse41 = info[2] & (1 << 19);
+		// AVX state has to be enabled by the OS too
+		bool osAVX = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 0x6) == 0x6;
+
+		__cpuidex(info, 7, 0);
+		bool avx2 = osAVX && (info[1] & (1 << 5));
+#else
+		__builtin_cpu_init();
+		bool sse41 = __builtin_cpu_supports("sse4.1");
+		bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+		if (avx2)
+			return Implementation::AVX2;
+		if (sse41)
+			return Implementation::SSE4;
+		return Implementation::Scalar;
+	}
+
+#else
+
+	static Implementation DetectImplementation()
+	{
+		return Implementation::Scalar;
+	}
+
+#endif
+
+	static const Implementation s_Implementation = DetectImplementation();
+
+	ScanResult Scan(std::string_view text, size_t maxLength)
+	{
+		return Scan(text, maxLength, s_Implementation);
+	}
+
+	ScanResult Scan(std::string_view text, size_t maxLength, Implementation implementation)
+	{
+		const uint8_t* data = (const uint8_t*)text.data();
+
+		ScanResult result;
+		result.Length = GetTruncatedLength(data, text.size(), maxLength);
+
+		switch (implementation)
+		{
+#if WC_TEXT_VALIDATION_X86
+			case Implementation::AVX2: ScanAVX2(data, result.Length, result); break;
+			case Implementation::SSE4: ScanSSE(data, result.Length, result); break;
+#endif
+			default:                   ScanScalar(data, result.Length, result); break;
+		}
+
+		return result;
+	}
+
+	bool IsSupported(Implementation implementation)
+	{
+		return implementation <= s_Implementation;
+	}
+
+	Implementation GetImplementation()
+	{
+		return s_Implementation;
+	}
+
+	const char* ImplementationToString(Implementation implementation)
+	{
+		switch (implementation)
+		{
+			case Implementation::Scalar: return "Scalar";
+			case Implementation::SSE4:   return "SSE4.1";
+			case Implementation::AVX2:   return "AVX2";
+		}
+		return "Unknown";
+	}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+
+//
+// Validation of user supplied text (chat messages) before it's stored or rebroadcast.
+//
+// One pass over the text checks that it's well-formed UTF-8 (no overlong encodings,
+// surrogates or code points past U+10FFFF), whether it has any control characters and
+// whether it's anything but whitespace. Runs 32 (AVX2) or 16 (SSE4.1) bytes at a time when
+// the CPU supports it, picked at startup, scalar otherwise.
+//
+namespace TextValidation {
+
+	enum class Implementation : uint8_t
+	{
+		Scalar = 0, SSE4, AVX2
+	};
+
+	struct ScanResult
+	{
+		// Everything below only covers the first Length bytes, and the other flags are
+		// meaningless once ValidUTF8 is false
+		bool ValidUTF8 = true;
+		// C0 controls other than \t \n \v \f \r, and DEL
+		bool HasControlCharacters = false;
+		// Only ' ' \t \n \v \f \r (or empty)
+		bool OnlyWhitespace = true;
+		// At most maxLength, backed up so it never ends in the middle of a code point
+		size_t Length = 0;
+	};
+
+	ScanResult Scan(std::string_view text, size_t maxLength = SIZE_MAX);
+	// For benchmarks/tests, implementation must be supported
+	ScanResult Scan(std::string_view text, size_t maxLength, Implementation implementation);
+
+	bool IsSupported(Implementation implementation);
+	// What Scan() uses
+	Implementation GetImplementation();
+	const char* ImplementationToString(Implementation implementation);
+
+}
@@ -0,0 +1,168 @@
+#include "Trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Trace {
+
+	struct Event
+	{
+		const char* Name;
+		int64_t Start;
+		int64_t Duration;
+	};
+
+	// One per thread that has ever recorded. The mutex is only contended while a trace is
+	// being started or written out.
+	struct ThreadBuffer
+	{
+		std::mutex Mutex;
+		std::vector<Event> Events;
+		std::string Name;
+		uint32_t ThreadID = 0;
+	};
+
+	// Per thread, so a runaway trace can't eat all memory (~24 MB per thread), anything past
+	// it is dropped
+	static const size_t s_MaxEventsPerThread = 1024 * 1024;
+
+	static std::atomic<bool> s_Active = false;
+	static std::mutex s_ThreadBuffersMutex;
+	static std::vector<std::shared_ptr<ThreadBuffer>> s_ThreadBuffers;
+	static int64_t s_StartTime = 0;
+
+	static int64_t Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static ThreadBuffer& GetThreadBuffer()
+	{
+		thread_local std::shared_ptr<ThreadBuffer> buffer;
+		if (!buffer)
+		{
+			buffer = std::make_shared<ThreadBuffer>();
+
+			std::scoped_lock<std::mutex> lock(s_ThreadBuffersMutex);
+			buffer->ThreadID = (uint32_t)s_ThreadBuffers.size() + 1;
+			s_ThreadBuffers.push_back(buffer);
+		}
+		return *buffer;
+	}
+
+	static void WriteEscaped(std::ofstream& stream, const char* string)
+	{
+		for (const char* c = string; *c; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				stream << '\\';
+			if ((unsigned char)*c >= 0x20)
+				stream << *c;
+		}
+	}
+
+	bool Start()
+	{
+		if (s_Active)
+			return false;
+
+		std::scoped_lock<std::mutex> lock(s_ThreadBuffersMutex);
+		for (auto& buffer : s_ThreadBuffers)
+		{
+			std::scoped_lock<std::mutex> bufferLock(buffer->Mutex);
+			buffer->Events.clear();
+		}
+
+		s_StartTime = Now();
+		s_Active = true;
+		return true;
+	}
+
+	bool Stop(const std::filesystem::path& filepath)
+	{
+		if (!s_Active.exchange(false))
+			return false;
+
+		std::ofstream stream(filepath);
+		if (!stream)
+			return false;
+
+		stream << std::fixed << std::setprecision(3);
+		stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+		bool first = true;
+		std::scoped_lock<std::mutex> lock(s_ThreadBuffersMutex);
+		for (auto& buffer : s_ThreadBuffers)
+		{
+			std::scoped_lock<std::mutex> bufferLock(buffer->Mutex);
+
+			if (!buffer->Name.empty())
+			{
+				stream << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->ThreadID << ",\"args\":{\"name\":\"";
+				WriteEscaped(stream, buffer->Name.c_str());
+				stream << "\"}}";
+				first = false;
+			}
+
+			for (const Event& event : buffer->Events)
+			{
+				// Scopes that started before this trace did
+				if (event.Start < s_StartTime)
+					continue;
+
+				stream << (first ? "" : ",\n") << "{\"name\":\"";
+				WriteEscaped(stream, event.Name);
+				stream << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->ThreadID
+					<< ",\"ts\":" << (event.Start - s_StartTime) / 1000.0 << ",\"dur\":" << event.Duration / 1000.0 << "}";
+				first = false;
+			}
+
+			buffer->Events.clear();
+			buffer->Events.shrink_to_fit();
+		}
+
+		stream << "\n]}\n";
+		return (bool)stream;
+	}
+
+	bool IsActive()
+	{
+		return s_Active.load(std::memory_order_relaxed);
+	}
+
+	void SetThreadName(const char* name)
+	{
+		ThreadBuffer& buffer = GetThreadBuffer();
+		std::scoped_lock<std::mutex> lock(buffer.Mutex);
+		buffer.Name = name;
+	}
+
+	Scope::Scope(const char* name)
+		: m_Name(nullptr), m_Start(0)
+	{
+		if (!s_Active.load(std::memory_order_relaxed))
+			return;
+
+		m_Name = name;
+		m_Start = Now();
+	}
+
+	Scope::~Scope()
+	{
+		if (!m_Name)
+			return;
+
+		int64_t end = Now();
+		ThreadBuffer& buffer = GetThreadBuffer();
+		std::scoped_lock<std::mutex> lock(buffer.Mutex);
+		if (buffer.Events.size() < s_MaxEventsPerThread)
+			buffer.Events.push_back({ m_Name, m_Start, end - m_Start });
+	}
+
+}
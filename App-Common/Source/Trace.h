@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <filesystem>
+
+//
+// Scoped span tracing, exported as Chrome trace-event JSON (open in Perfetto or
+// chrome://tracing).
+//
+// WC_TRACE_SCOPE compiles to nothing unless WC_ENABLE_TRACING is defined
+// (Debug and Release builds). When compiled in, a scope costs one relaxed atomic load while
+// no trace is running, and two clock reads plus an append to a thread-local buffer while
+// one is. Names must be string literals (or otherwise outlive the trace).
+//
+namespace Trace {
+
+	bool Start();
+	// Stops recording and writes everything recorded since Start()
+	bool Stop(const std::filesystem::path& filepath);
+	bool IsActive();
+
+	// Shows up as the thread's name in the trace
+	void SetThreadName(const char* name);
+
+	constexpr bool IsCompiledIn()
+	{
+#ifdef WC_ENABLE_TRACING
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	class Scope
+	{
+	public:
+		Scope(const char* name);
+		~Scope();
+	private:
+		const char* m_Name;
+		int64_t m_Start;
+	};
+
+}
+
+#ifdef WC_ENABLE_TRACING
+	#define WC_TRACE_CONCAT_INTERNAL(a, b) a##b
+	#define WC_TRACE_CONCAT(a, b) WC_TRACE_CONCAT_INTERNAL(a, b)
+	#define WC_TRACE_SCOPE(name) ::Trace::Scope WC_TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+	#define WC_TRACE_SCOPE(name)
+#endif
@@ -1,20 +1,76 @@
 #include "UserInfo.h"
 
+#include "TextValidation.h"
+
 bool IsValidMessage(std::string& message)
+{
+	std::string_view view = message;
+	if (!IsValidMessage(view))
+		return false;
+
+	message.resize(view.size());
+	return true;
+}
+
+bool IsValidMessage(std::string_view& message)
 {
 	if (message.empty())
 		return false;
 
-	// Only white-space
-	if (message.find_first_not_of(" \t\n\v\f\r") == std::string::npos)
+	TextValidation::ScanResult result = TextValidation::Scan(message, MaxMessageLength);
+	if (!result.ValidUTF8 || result.HasControlCharacters || result.OnlyWhitespace)
 		return false;
 
-	// Trim if exceeds max message length
-	if (message.size() > MaxMessageLength)
+	// Trim if exceeds max message length (without splitting a code point)
+	message = message.substr(0, result.Length);
+	return true;
+}
+
+bool IsValidFilename(std::string_view filename)
+{
+	if (filename.empty() || filename.size() > MaxFilenameLength || filename.find_first_of("/\\") != std::string_view::npos)
+		return false;
+
+	TextValidation::ScanResult result = TextValidation::Scan(filename);
+	return result.ValidUTF8 && !result.HasControlCharacters && !result.OnlyWhitespace;
+}
+
+std::string GetSafeFilename(std::string_view filename)
+{
+	std::string safeFilename(filename);
+	for (size_t i = 0; i < safeFilename.size(); i++)
 	{
-		message = message.substr(0, MaxMessageLength);
-		return true;
+		char c = safeFilename[i];
+		bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || (c == '.' && i > 0);
+		if (!safe)
+			safeFilename[i] = '_';
 	}
+	return safeFilename;
+}
 
-	return true;
+bool IsChatCommand(std::string_view message, std::string_view command)
+{
+	return message.starts_with(command) && (message.size() == command.size() || message[command.size()] == ' ');
+}
+
+bool ParseDirectMessageCommand(std::string_view command, std::string_view& username, std::string_view& message)
+{
+	auto skipSpaces = [](std::string_view string)
+	{
+		size_t start = string.find_first_not_of(' ');
+		return start == std::string_view::npos ? std::string_view() : string.substr(start);
+	};
+
+	const std::string_view prefix = "/msg ";
+	if (!command.starts_with(prefix))
+		return false;
+
+	std::string_view arguments = skipSpaces(command.substr(prefix.size()));
+	size_t usernameEnd = arguments.find(' ');
+	if (usernameEnd == std::string_view::npos)
+		return false;
+
+	username = arguments.substr(0, usernameEnd);
+	message = skipSpaces(arguments.substr(usernameEnd));
+	return !message.empty();
 }
\ No newline at end of file
@@ -3,11 +3,26 @@
 #include "Walnut/Serialization/StreamReader.h"
 #include "Walnut/Serialization/StreamWriter.h"
 
+// Transient user state sent with PacketType::UserPresence
+namespace PresenceFlags
+{
+	const uint8_t None = 0;
+	const uint8_t Typing = 1 << 0;
+	const uint8_t Away = 1 << 1;
+
+	const uint8_t All = Typing | Away;
+}
+
 struct UserInfo
 {
 	uint32_t Color;
 	std::string Username;
 
+	// Assigned by server, only sent with the compact wire encoding (0 is the server itself)
+	uint32_t ID = 0;
+	// PresenceFlags, only sent with the compact wire encoding
+	uint8_t Presence = PresenceFlags::None;
+
 	static void Serialize(Walnut::StreamWriter* serializer, const UserInfo& instance)
 	{
 		serializer->WriteRaw(instance.Color);
@@ -44,5 +59,40 @@ struct ChatMessage
 	}
 };
 
+// A chat message that's only being passed through (eg. straight out of a received packet),
+// the text belongs to someone else
+struct ChatMessageView
+{
+	std::string_view Username;
+	std::string_view Message;
+
+	ChatMessageView() = default;
+
+	ChatMessageView(std::string_view username, std::string_view message)
+		: Username(username), Message(message) {}
+
+	ChatMessageView(const ChatMessage& message)
+		: Username(message.Username), Message(message.Message) {}
+};
+
 const int MaxMessageLength = 4096;
+// False for empty/whitespace-only text, invalid UTF-8 or control characters, otherwise
+// trims to at most MaxMessageLength bytes on a code point boundary
 bool IsValidMessage(std::string& message);
+// Same, trimming the view instead
+bool IsValidMessage(std::string_view& message);
+
+const int MaxFilenameLength = 255;
+// Names of offered files: at most MaxFilenameLength bytes of valid UTF-8, no control
+// characters, path separators or whitespace-only names
+bool IsValidFilename(std::string_view filename);
+// For storing a received file under its offered name: anything but ASCII letters, digits,
+// '-', '_' and (not leading) '.' becomes '_'
+std::string GetSafeFilename(std::string_view filename);
+
+// The message is this command, on its own or followed by a space and arguments (so "/msgs"
+// isn't "/msg")
+bool IsChatCommand(std::string_view message, std::string_view command);
+
+// Parses "/msg <username> <message>", message keeps its inner spacing
+bool ParseDirectMessageCommand(std::string_view command, std::string_view& username, std::string_view& message);
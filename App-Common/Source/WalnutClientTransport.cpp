@@ -0,0 +1,6 @@
+#include "WalnutClientTransport.h"
+
+void WalnutClientTransport::SendBuffer(Walnut::Buffer buffer, bool reliable)
+{
+	m_Client.SendBuffer(buffer, reliable);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "ClientTransport.h"
+
+//
+// ClientTransport over Walnut::Client (GameNetworkingSockets). Callbacks come in on the
+// client's networking thread.
+//
+class WalnutClientTransport : public ClientTransport
+{
+public:
+	virtual void ConnectToServer(const std::string& serverAddress) override { m_Client.ConnectToServer(serverAddress); }
+	virtual void Disconnect() override { m_Client.Disconnect(); }
+
+	virtual void SetServerConnectedCallback(const ServerConnectedCallback& function) override { m_Client.SetServerConnectedCallback(function); }
+	virtual void SetServerDisconnectedCallback(const ServerDisconnectedCallback& function) override { m_Client.SetServerDisconnectedCallback(function); }
+	virtual void SetDataReceivedCallback(const DataReceivedCallback& function) override { m_Client.SetDataReceivedCallback(function); }
+
+	virtual void SendBuffer(Walnut::Buffer buffer, bool reliable = true) override;
+
+	virtual ConnectionStatus GetConnectionStatus() const override { return m_Client.GetConnectionStatus(); }
+	virtual const std::string& GetConnectionDebugMessage() const override { return m_Client.GetConnectionDebugMessage(); }
+private:
+	Walnut::Client m_Client;
+};
@@ -0,0 +1,25 @@
+#include "WalnutServerTransport.h"
+
+#include "steam/isteamnetworkingsockets.h"
+
+WalnutServerTransport::WalnutServerTransport(int port)
+	: m_Server(port)
+{
+}
+
+void WalnutServerTransport::SendBufferToClient(Walnut::ClientID clientID, Walnut::Buffer buffer, bool reliable)
+{
+	m_Server.SendBufferToClient(clientID, buffer, reliable);
+}
+
+bool WalnutServerTransport::GetSendQueueStatus(Walnut::ClientID clientID, SendQueueStatus& status) const
+{
+	// Client IDs are GameNetworkingSockets connection handles
+	SteamNetworkingQuickConnectionStatus connectionStatus;
+	if (!SteamNetworkingSockets()->GetQuickConnectionStatus(clientID, &connectionStatus))
+		return false;
+
+	status.PendingBytes = (uint64_t)connectionStatus.m_cbPendingReliable + (uint64_t)connectionStatus.m_cbPendingUnreliable;
+	status.QueueTime = (float)connectionStatus.m_usecQueueTime / 1000000.0f;
+	return true;
+}
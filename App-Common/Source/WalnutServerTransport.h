@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ServerTransport.h"
+
+//
+// ServerTransport over Walnut::Server (GameNetworkingSockets). Callbacks come in on the
+// server's networking thread.
+//
+class WalnutServerTransport : public ServerTransport
+{
+public:
+	WalnutServerTransport(int port);
+
+	virtual void Start() override { m_Server.Start(); }
+	virtual void Stop() override { m_Server.Stop(); }
+	virtual bool IsRunning() const override { return m_Server.IsRunning(); }
+
+	virtual void SetDataReceivedCallback(const DataReceivedCallback& function) override { m_Server.SetDataReceivedCallback(function); }
+	virtual void SetClientConnectedCallback(const ClientConnectedCallback& function) override { m_Server.SetClientConnectedCallback(function); }
+	virtual void SetClientDisconnectedCallback(const ClientDisconnectedCallback& function) override { m_Server.SetClientDisconnectedCallback(function); }
+
+	virtual void SendBufferToClient(Walnut::ClientID clientID, Walnut::Buffer buffer, bool reliable = true) override;
+	// GameNetworkingSockets' sends are thread-safe
+	virtual bool SupportsConcurrentSends() const override { return true; }
+	virtual bool HasSendQueueStatus() const override { return true; }
+	virtual bool GetSendQueueStatus(Walnut::ClientID clientID, SendQueueStatus& status) const override;
+	virtual void KickClient(Walnut::ClientID clientID) override { m_Server.KickClient(clientID); }
+
+	virtual const std::map<Walnut::ClientID, Walnut::ClientInfo>& GetConnectedClients() const override { return m_Server.GetConnectedClients(); }
+private:
+	Walnut::Server m_Server;
+};
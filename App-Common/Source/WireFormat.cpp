@@ -0,0 +1,271 @@
+#include "WireFormat.h"
+
+namespace Wire {
+
+	void WriteVarUInt(Walnut::StreamWriter& stream, uint64_t value)
+	{
+		uint8_t bytes[10];
+		uint32_t count = 0;
+		do
+		{
+			uint8_t byte = value & 0x7f;
+			value >>= 7;
+			if (value)
+				byte |= 0x80;
+			bytes[count++] = byte;
+		} while (value);
+
+		stream.WriteData((const char*)bytes, count);
+	}
+
+	bool ReadVarUInt(Walnut::StreamReader& stream, uint64_t& value)
+	{
+		value = 0;
+		for (uint32_t shift = 0; shift < 64; shift += 7)
+		{
+			uint8_t byte;
+			if (!stream.ReadRaw<uint8_t>(byte))
+				return false;
+
+			value |= (uint64_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+
+		return false; // too long
+	}
+
+	void WritePacketType(Walnut::StreamWriter& stream, PacketType type, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Compact)
+			WriteVarUInt(stream, (uint64_t)type);
+		else
+			stream.WriteRaw<PacketType>(type);
+	}
+
+	bool ReadPacketType(Walnut::StreamReader& stream, PacketType& type, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+			return stream.ReadRaw<PacketType>(type);
+
+		uint64_t value;
+		if (!ReadVarUInt(stream, value) || value > UINT16_MAX)
+			return false;
+
+		type = (PacketType)value;
+		return true;
+	}
+
+	void WriteString(Walnut::StreamWriter& stream, std::string_view string, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+		{
+			stream.WriteString(string);
+			return;
+		}
+
+		WriteVarUInt(stream, string.size());
+		stream.WriteData(string.data(), string.size());
+	}
+
+	static uint64_t GetRemainingSize(Walnut::BufferStreamReader& stream)
+	{
+		return stream.GetBuffer().Size - stream.GetStreamPosition();
+	}
+
+	// Length prefix of a string, no bigger than what's left in the packet
+	static bool ReadStringSize(Walnut::BufferStreamReader& stream, uint64_t& size, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+		{
+			size_t legacySize;
+			if (!stream.ReadRaw<size_t>(legacySize))
+				return false;
+			size = legacySize;
+		}
+		else if (!ReadVarUInt(stream, size) || size > MaxCompactLength)
+		{
+			return false;
+		}
+
+		return size <= GetRemainingSize(stream);
+	}
+
+	bool ReadString(Walnut::BufferStreamReader& stream, std::string& string, WireEncoding encoding)
+	{
+		uint64_t size;
+		if (!ReadStringSize(stream, size, encoding))
+			return false;
+
+		string.resize(size);
+		return stream.ReadData(string.data(), size);
+	}
+
+	bool ReadStringView(Walnut::BufferStreamReader& stream, std::string_view& string, WireEncoding encoding)
+	{
+		uint64_t size;
+		if (!ReadStringSize(stream, size, encoding))
+			return false;
+
+		uint64_t position = stream.GetStreamPosition();
+		string = std::string_view((const char*)stream.GetBuffer().Data + position, (size_t)size);
+		stream.SetStreamPosition(position + size);
+		return true;
+	}
+
+	void WriteColor(Walnut::StreamWriter& stream, uint32_t color, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+		{
+			stream.WriteRaw<uint32_t>(color);
+			return;
+		}
+
+		uint8_t rgb[3] = { (uint8_t)(color & 0xff), (uint8_t)((color >> 8) & 0xff), (uint8_t)((color >> 16) & 0xff) };
+		stream.WriteData((const char*)rgb, sizeof(rgb));
+	}
+
+	bool ReadColor(Walnut::StreamReader& stream, uint32_t& color, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+			return stream.ReadRaw<uint32_t>(color);
+
+		uint8_t rgb[3];
+		if (!stream.ReadData((char*)rgb, sizeof(rgb)))
+			return false;
+
+		// Top 8 bits are documented as ignored, make them opaque so the color is usable as-is
+		color = 0xff000000 | ((uint32_t)rgb[2] << 16) | ((uint32_t)rgb[1] << 8) | (uint32_t)rgb[0];
+		return true;
+	}
+
+	void WriteCount(Walnut::StreamWriter& stream, uint32_t count, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Compact)
+			WriteVarUInt(stream, count);
+		else
+			stream.WriteRaw<uint32_t>(count);
+	}
+
+	bool ReadSmallNumber(Walnut::StreamReader& stream, uint32_t& value, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+			return stream.ReadRaw<uint32_t>(value);
+
+		uint64_t varint;
+		if (!ReadVarUInt(stream, varint) || varint > MaxCompactLength)
+			return false;
+
+		value = (uint32_t)varint;
+		return true;
+	}
+
+	bool ReadCount(Walnut::BufferStreamReader& stream, uint32_t& count, WireEncoding encoding)
+	{
+		// Every element takes at least a byte
+		return ReadSmallNumber(stream, count, encoding) && count <= GetRemainingSize(stream);
+	}
+
+	void WriteUserID(Walnut::StreamWriter& stream, uint32_t userID)
+	{
+		WriteVarUInt(stream, userID);
+	}
+
+	bool ReadUserID(Walnut::StreamReader& stream, uint32_t& userID)
+	{
+		uint64_t value;
+		if (!ReadVarUInt(stream, value) || value > UINT32_MAX)
+			return false;
+
+		userID = (uint32_t)value;
+		return true;
+	}
+
+	void WriteUserInfo(Walnut::StreamWriter& stream, const UserInfo& userInfo, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+		{
+			UserInfo::Serialize(&stream, userInfo);
+			return;
+		}
+
+		WriteUserID(stream, userInfo.ID);
+		WriteColor(stream, userInfo.Color, encoding);
+		stream.WriteRaw<uint8_t>(userInfo.Presence);
+		WriteString(stream, userInfo.Username, encoding);
+	}
+
+	bool ReadUserInfo(Walnut::BufferStreamReader& stream, UserInfo& userInfo, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Legacy)
+			return ReadColor(stream, userInfo.Color, encoding) && ReadString(stream, userInfo.Username, encoding);
+
+		return ReadUserID(stream, userInfo.ID)
+			&& ReadColor(stream, userInfo.Color, encoding)
+			&& stream.ReadRaw<uint8_t>(userInfo.Presence)
+			&& ReadString(stream, userInfo.Username, encoding);
+	}
+
+	void WriteUserList(Walnut::StreamWriter& stream, const std::vector<UserInfo>& userList, WireEncoding encoding)
+	{
+		WriteCount(stream, (uint32_t)userList.size(), encoding);
+		for (const auto& userInfo : userList)
+			WriteUserInfo(stream, userInfo, encoding);
+	}
+
+	bool ReadUserList(Walnut::BufferStreamReader& stream, std::vector<UserInfo>& userList, WireEncoding encoding)
+	{
+		uint32_t count;
+		if (!ReadCount(stream, count, encoding))
+			return false;
+
+		userList.clear();
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (!ReadUserInfo(stream, userList.emplace_back(), encoding))
+				return false;
+		}
+
+		return true;
+	}
+
+	uint64_t GetChatMessageSize(const ChatMessageView& message, WireEncoding encoding)
+	{
+		return GetStringSize(message.Username, encoding) + GetStringSize(message.Message, encoding);
+	}
+
+	void WriteChatMessage(Walnut::StreamWriter& stream, const ChatMessageView& message, WireEncoding encoding)
+	{
+		WriteString(stream, message.Username, encoding);
+		WriteString(stream, message.Message, encoding);
+	}
+
+	bool ReadChatMessage(Walnut::BufferStreamReader& stream, ChatMessage& message, WireEncoding encoding)
+	{
+		return ReadString(stream, message.Username, encoding) && ReadString(stream, message.Message, encoding);
+	}
+
+	void WriteChatMessages(Walnut::StreamWriter& stream, const std::vector<ChatMessage>& messages, WireEncoding encoding)
+	{
+		WriteCount(stream, (uint32_t)messages.size(), encoding);
+		for (const auto& message : messages)
+			WriteChatMessage(stream, message, encoding);
+	}
+
+	bool ReadChatMessages(Walnut::BufferStreamReader& stream, std::vector<ChatMessage>& messages, WireEncoding encoding)
+	{
+		uint32_t count;
+		if (!ReadCount(stream, count, encoding))
+			return false;
+
+		messages.clear();
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (!ReadChatMessage(stream, messages.emplace_back(), encoding))
+				return false;
+		}
+
+		return true;
+	}
+
+}
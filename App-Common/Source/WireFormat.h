@@ -0,0 +1,100 @@
+#pragma once
+
+#include "ServerPacket.h"
+#include "UserInfo.h"
+
+#include "Walnut/Serialization/StreamReader.h"
+#include "Walnut/Serialization/StreamWriter.h"
+#include "Walnut/Serialization/BufferStream.h"
+
+#include <vector>
+
+//
+// Packet field encoding, selected per connection during the ClientConnectionRequest handshake.
+// 
+// Legacy:  what v1 clients expect - 16-bit PacketType, size_t string lengths, 32-bit colors,
+//          users referred to by username
+// Compact: varint PacketType/lengths/counts, 24-bit RGB colors, users referred to by ID,
+//          UserInfo includes presence (requires ProtocolCapability::CompactEncoding)
+//
+enum class WireEncoding : uint8_t
+{
+	Legacy = 0, Compact = 1
+};
+
+const uint32_t WireEncodingCount = 2;
+
+// User ID used to refer to the server (eg. "SERVER" chat messages) in the compact encoding
+const uint32_t ServerUserID = 0;
+
+inline WireEncoding GetWireEncoding(uint32_t capabilities)
+{
+	return (capabilities & ProtocolCapability::CompactEncoding) ? WireEncoding::Compact : WireEncoding::Legacy;
+}
+
+namespace Wire {
+
+	// Nothing we send legitimately comes close to this, anything bigger is a corrupt or malicious packet
+	const uint64_t MaxCompactLength = 16 * 1024 * 1024;
+
+	// LEB128-style unsigned varint
+	void WriteVarUInt(Walnut::StreamWriter& stream, uint64_t value);
+	bool ReadVarUInt(Walnut::StreamReader& stream, uint64_t& value);
+
+	void WritePacketType(Walnut::StreamWriter& stream, PacketType type, WireEncoding encoding);
+	bool ReadPacketType(Walnut::StreamReader& stream, PacketType& type, WireEncoding encoding);
+
+	void WriteString(Walnut::StreamWriter& stream, std::string_view string, WireEncoding encoding);
+	// Fails on a length bigger than what's left in the packet, before allocating anything
+	bool ReadString(Walnut::BufferStreamReader& stream, std::string& string, WireEncoding encoding);
+	// Points into the stream's buffer instead of copying, only valid as long as that is
+	bool ReadStringView(Walnut::BufferStreamReader& stream, std::string_view& string, WireEncoding encoding);
+
+	void WriteColor(Walnut::StreamWriter& stream, uint32_t color, WireEncoding encoding);
+	bool ReadColor(Walnut::StreamReader& stream, uint32_t& color, WireEncoding encoding);
+
+	// Element count for arrays, reading fails if the rest of the packet can't hold that many
+	void WriteCount(Walnut::StreamWriter& stream, uint32_t count, WireEncoding encoding);
+	bool ReadCount(Walnut::BufferStreamReader& stream, uint32_t& count, WireEncoding encoding);
+	// Any other small number written with WriteCount()
+	bool ReadSmallNumber(Walnut::StreamReader& stream, uint32_t& value, WireEncoding encoding);
+
+	// Reference to a user (compact only - legacy refers to users by username)
+	void WriteUserID(Walnut::StreamWriter& stream, uint32_t userID);
+	bool ReadUserID(Walnut::StreamReader& stream, uint32_t& userID);
+
+	void WriteUserInfo(Walnut::StreamWriter& stream, const UserInfo& userInfo, WireEncoding encoding);
+	bool ReadUserInfo(Walnut::BufferStreamReader& stream, UserInfo& userInfo, WireEncoding encoding);
+
+	void WriteUserList(Walnut::StreamWriter& stream, const std::vector<UserInfo>& userList, WireEncoding encoding);
+	bool ReadUserList(Walnut::BufferStreamReader& stream, std::vector<UserInfo>& userList, WireEncoding encoding);
+
+	// Exact encoded sizes, for splitting data into packets before writing it
+	constexpr uint64_t GetVarUIntSize(uint64_t value)
+	{
+		uint64_t size = 1;
+		while (value >= 0x80)
+		{
+			value >>= 7;
+			size++;
+		}
+		return size;
+	}
+
+	constexpr uint64_t GetStringSize(std::string_view string, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Compact)
+			return GetVarUIntSize(string.size()) + string.size();
+
+		return sizeof(size_t) + string.size();
+	}
+
+	uint64_t GetChatMessageSize(const ChatMessageView& message, WireEncoding encoding);
+
+	void WriteChatMessage(Walnut::StreamWriter& stream, const ChatMessageView& message, WireEncoding encoding);
+	bool ReadChatMessage(Walnut::BufferStreamReader& stream, ChatMessage& message, WireEncoding encoding);
+
+	void WriteChatMessages(Walnut::StreamWriter& stream, const std::vector<ChatMessage>& messages, WireEncoding encoding);
+	bool ReadChatMessages(Walnut::BufferStreamReader& stream, std::vector<ChatMessage>& messages, WireEncoding encoding);
+
+}
@@ -0,0 +1,547 @@
+#include "ServerLayer.h"
+#include "LoopbackTransport.h"
+#include "ServerPacket.h"
+#include "WireFormat.h"
+#include "Packets.h"
+#include "Trace.h"
+#include "TextValidation.h"
+#include "ContentFilter.h"
+
+#include "Walnut/Serialization/BufferStream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// App-Server-Bench - runs a ServerLayer over LoopbackServerTransport with simulated clients
+// in this process: no sockets, single-threaded (unless --fanout-threads is given), same work
+// for the same arguments.
+//
+// Usage: App-Server-Bench [--clients <n>] [--messages <n>] [--history <n>] [--legacy] [--fanout-threads <n>] [--trace <file>]
+//
+// Exits with 1 if the allocation check fails.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+// Every heap allocation in the process is counted, for the allocation check
+////////////////////////////////////////////////////////////////////////////////
+static std::atomic<uint64_t> s_AllocationCount = 0;
+
+static void* CountedAllocate(size_t size, size_t alignment)
+{
+	s_AllocationCount.fetch_add(1, std::memory_order_relaxed);
+	size = std::max<size_t>(size, 1);
+#ifdef WL_PLATFORM_WINDOWS
+	void* memory = _aligned_malloc(size, alignment);
+#else
+	void* memory = alignment <= alignof(std::max_align_t) ? std::malloc(size) : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+	if (!memory)
+		throw std::bad_alloc();
+	return memory;
+}
+
+static void CountedFree(void* memory)
+{
+#ifdef WL_PLATFORM_WINDOWS
+	_aligned_free(memory);
+#else
+	std::free(memory);
+#endif
+}
+
+void* operator new(size_t size) { return CountedAllocate(size, alignof(std::max_align_t)); }
+void* operator new[](size_t size) { return CountedAllocate(size, alignof(std::max_align_t)); }
+void* operator new(size_t size, std::align_val_t alignment) { return CountedAllocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return CountedAllocate(size, (size_t)alignment); }
+void operator delete(void* memory) noexcept { CountedFree(memory); }
+void operator delete[](void* memory) noexcept { CountedFree(memory); }
+void operator delete(void* memory, size_t) noexcept { CountedFree(memory); }
+void operator delete[](void* memory, size_t) noexcept { CountedFree(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept { CountedFree(memory); }
+void operator delete[](void* memory, std::align_val_t) noexcept { CountedFree(memory); }
+void operator delete(void* memory, size_t, std::align_val_t) noexcept { CountedFree(memory); }
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept { CountedFree(memory); }
+
+using Clock = std::chrono::steady_clock;
+
+// Just enough of a client to complete the handshake and count what it gets
+struct SimulatedClient
+{
+	LoopbackClientTransport Transport;
+	WireEncoding Encoding = WireEncoding::Legacy;
+	bool Joined = false;
+
+	uint64_t PacketsReceived = 0;
+	uint64_t BytesReceived = 0;
+	uint64_t MessagesReceived = 0;
+	uint64_t HistoryMessagesReceived = 0;
+
+	SimulatedClient(LoopbackServerTransport& server)
+		: Transport(server)
+	{
+		Transport.SetDataReceivedCallback([this](const Walnut::Buffer buffer) { OnDataReceived(buffer); });
+	}
+
+	void Join(Walnut::Buffer scratchBuffer, const std::string& username, bool legacy)
+	{
+		Transport.ConnectToServer("loopback");
+
+		Packets::ToServer::ClientConnectionRequest request;
+		request.Color = 0xff00ff00;
+		request.Username = username;
+		if (!legacy)
+			request.Protocol = { CurrentProtocolVersion, SupportedProtocolCapabilities };
+
+		Walnut::BufferStreamWriter stream(scratchBuffer);
+		Wire::WritePacket(stream, request, WireEncoding::Legacy);
+		Transport.SendBuffer(stream.GetBuffer());
+	}
+
+	void Leave()
+	{
+		Transport.Disconnect();
+		Encoding = WireEncoding::Legacy;
+		Joined = false;
+		HistoryMessagesReceived = 0;
+	}
+
+	void SendMessage(Walnut::Buffer scratchBuffer, std::string_view message)
+	{
+		Walnut::BufferStreamWriter stream(scratchBuffer);
+		Wire::WritePacket(stream, Packets::ToServer::Message{ message }, Encoding);
+		Transport.SendBuffer(stream.GetBuffer());
+	}
+
+	void OnDataReceived(const Walnut::Buffer buffer)
+	{
+		PacketsReceived++;
+		BytesReceived += buffer.Size;
+
+		Walnut::BufferStreamReader stream(buffer);
+		PacketType type;
+		if (!Wire::ReadPacketType(stream, type, Encoding))
+			return;
+
+		switch (type)
+		{
+			case PacketType::ClientConnectionRequest:
+			{
+				Packets::ToClient::ClientConnectionResponse response;
+				if (!Wire::ReadPacket(stream, response, Encoding))
+					break;
+
+				if (response.Protocol)
+					Encoding = GetWireEncoding(response.Protocol->Capabilities);
+				Joined = response.Accepted;
+				break;
+			}
+			case PacketType::Message:
+				MessagesReceived++;
+				break;
+			case PacketType::MessageHistory:
+			{
+				uint32_t count;
+				if (Wire::ReadCount(stream, count, Encoding))
+					HistoryMessagesReceived += count;
+				break;
+			}
+			case PacketType::ConnectionStatus:
+			{
+				// Unanswered pings get the session disconnected after HeartbeatTimeout
+				Packets::ToClient::Ping ping;
+				if (!Wire::ReadPacket(stream, ping, Encoding))
+					break;
+
+				uint8_t data[32];
+				Walnut::Buffer pongBuffer(data, sizeof(data));
+				Walnut::BufferStreamWriter pongStream(pongBuffer);
+				Wire::WritePacket(pongStream, Packets::ToServer::Pong{ ping.ServerTime }, Encoding);
+				Transport.SendBuffer(pongStream.GetBuffer());
+				break;
+			}
+			default:
+				break;
+		}
+	}
+};
+
+struct BenchResult
+{
+	double Seconds = 0.0;
+	uint64_t Packets = 0;
+	uint64_t Bytes = 0;
+};
+
+// Runs the server's event loop until done(), gives up after a while in case it never is
+static bool RunUntil(ServerLayer& server, const std::function<bool()>& done)
+{
+	Clock::time_point deadline = Clock::now() + std::chrono::seconds(30);
+	while (!done())
+	{
+		if (Clock::now() > deadline)
+			return false;
+		server.RunEventLoop(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+static void PrintResult(const char* name, const BenchResult& result, uint64_t operations, const char* operationName)
+{
+	std::printf("%-12s %10.3f ms %12.0f %s/s %12llu packets %10.2f MB\n", name, result.Seconds * 1000.0, operations / result.Seconds, operationName,
+		(unsigned long long)result.Packets, result.Bytes / (1024.0 * 1024.0));
+}
+
+static void RunTextValidationBench()
+{
+	std::string ascii;
+	while (ascii.size() < MaxMessageLength)
+		ascii += "The quick brown fox jumps over the lazy dog. ";
+	ascii.resize(MaxMessageLength);
+
+	std::string mixed;
+	while (mixed.size() < MaxMessageLength)
+		mixed += "Gr\xC3\xBC\xC3\x9F""e \xE2\x82\xAC 100 \xF0\x9F\x98\x80 ok ";
+	mixed.resize(TextValidation::Scan(mixed, MaxMessageLength).Length);
+
+	const uint32_t iterations = 20000;
+	auto run = [&](const char* name, const std::string& text, const std::function<bool(const std::string&)>& scan)
+	{
+		uint32_t valid = 0;
+		Clock::time_point start = Clock::now();
+		for (uint32_t i = 0; i < iterations; i++)
+			valid += scan(text);
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		double megabytes = (double)text.size() * iterations / (1024.0 * 1024.0);
+		std::printf("%-20s %10.3f ms %12.0f MB/s %s\n", name, seconds * 1000.0, megabytes / seconds, valid == iterations ? "" : "(rejected)");
+	};
+
+	const std::pair<const char*, const std::string*> inputs[] = { { "ascii", &ascii }, { "utf-8", &mixed } };
+	for (const auto& [inputName, text] : inputs)
+	{
+		std::string name = std::string("text ") + inputName;
+		for (uint8_t i = 0; i <= (uint8_t)TextValidation::Implementation::AVX2; i++)
+		{
+			auto implementation = (TextValidation::Implementation)i;
+			if (!TextValidation::IsSupported(implementation))
+				continue;
+
+			run((name + " " + TextValidation::ImplementationToString(implementation)).c_str(), *text, [implementation](const std::string& text)
+			{
+				auto result = TextValidation::Scan(text, MaxMessageLength, implementation);
+				return result.ValidUTF8 && !result.HasControlCharacters && !result.OnlyWhitespace;
+			});
+		}
+	}
+}
+static void RunContentFilterBench()
+{
+	std::mt19937 random(1234);
+	auto randomWord = [&](uint32_t minLength, uint32_t maxLength)
+	{
+		std::string word(minLength + random() % (maxLength - minLength + 1), ' ');
+		for (char& c : word)
+			c = 'a' + random() % 26;
+		return word;
+	};
+
+	// Chat-sized messages, chat repeats the same words a lot
+	std::vector<std::string> vocabulary(5000);
+	for (std::string& word : vocabulary)
+		word = randomWord(2, 9);
+
+	std::vector<std::string> messages(10000);
+	uint64_t messageBytes = 0;
+	for (std::string& message : messages)
+	{
+		uint32_t length = 32 + random() % 224;
+		while (message.size() < length)
+			message += vocabulary[random() % vocabulary.size()] + " ";
+		messageBytes += message.size();
+	}
+
+	auto measure = [&](uint32_t passes, const std::function<void(std::string&)>& filter)
+	{
+		Clock::time_point start = Clock::now();
+		for (uint32_t pass = 0; pass < passes; pass++)
+		{
+			for (const std::string& message : messages)
+			{
+				std::string text = message;
+				filter(text);
+			}
+		}
+		return std::chrono::duration<double>(Clock::now() - start).count() * 1e9 / ((uint64_t)messages.size() * passes);
+	};
+
+	// Masked rather than blocked, so every message is scanned to the end. The per-term find()
+	// loop it replaces is only run while it finishes in reasonable time.
+	std::vector<ContentFilterRule> rules;
+	for (uint32_t termCount : { 10, 100, 1000, 10000, 50000 })
+	{
+		while (rules.size() < termCount)
+			rules.push_back({ randomWord(5, 12), ContentFilterAction::Mask });
+
+		ContentFilter filter;
+		filter.Build(rules);
+		double filterNanoseconds = measure(10, [&](std::string& text) { filter.Apply(text); });
+
+		double findNanoseconds = 0.0;
+		if (termCount <= 1000)
+		{
+			findNanoseconds = measure(1, [&](std::string& text)
+			{
+				for (const auto& rule : rules)
+				{
+					for (size_t position = text.find(rule.Term); position != std::string::npos; position = text.find(rule.Term, position + 1))
+						std::fill(text.begin() + position, text.begin() + position + rule.Term.size(), '*');
+				}
+			});
+		}
+
+		std::printf("filter %-6u terms %8.1f ns/message %8.0f MB/s %8.1f ms build %8llu KB", termCount, filterNanoseconds,
+			messageBytes / (1024.0 * 1024.0) / (filterNanoseconds * messages.size() / 1e9), filter.GetBuildMilliseconds(), (unsigned long long)filter.GetSize() / 1024);
+		if (findNanoseconds > 0.0)
+			std::printf("   (find() per term: %.1f ns/message)", findNanoseconds);
+		std::printf("\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t clientCount = 500;
+	uint32_t messageCount = 1000;
+	uint32_t historyCount = 10000;
+	bool legacy = false;
+	uint32_t fanOutThreads = 0;
+	std::string traceFilepath;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (arg == "--clients" && i + 1 < argc)
+			clientCount = std::max(2, std::atoi(argv[++i]));
+		else if (arg == "--messages" && i + 1 < argc)
+			messageCount = std::atoi(argv[++i]);
+		else if (arg == "--history" && i + 1 < argc)
+			historyCount = std::atoi(argv[++i]);
+		else if (arg == "--legacy")
+			legacy = true;
+		else if (arg == "--fanout-threads" && i + 1 < argc)
+			fanOutThreads = std::atoi(argv[++i]);
+		else if (arg == "--trace" && i + 1 < argc)
+			traceFilepath = argv[++i];
+		else
+		{
+			std::printf("Usage: App-Server-Bench [--clients <n>] [--messages <n>] [--history <n>] [--legacy] [--fanout-threads <n>] [--trace <file>]\n");
+			return 1;
+		}
+	}
+
+	if (!traceFilepath.empty())
+	{
+		if (Trace::IsCompiledIn())
+		{
+			Trace::SetThreadName("Main");
+			Trace::Start();
+		}
+		else
+		{
+			std::printf("Tracing isn't compiled into this build, ignoring --trace\n");
+		}
+	}
+
+	auto transport = std::make_unique<LoopbackServerTransport>();
+	LoopbackServerTransport& loopback = *transport;
+	// Simulated clients only touch their own counters, so they can take sends from any thread
+	loopback.SetConcurrentSends(fanOutThreads > 0);
+
+	// No pacing, so this measures the server's work rather than the send budget
+	ServerLayerSpecification spec;
+	spec.MessageHistory.Directory.clear();
+	spec.LegacyMessageHistoryFilePath.clear();
+	spec.DirectMessageHistoryFilePath.clear();
+	spec.ContentFilterFilePath.clear();
+	spec.SendBytesPerInterval = UINT64_MAX / 2;
+	spec.FanOutThreads = fanOutThreads;
+	// The history scenario syncs everything
+	spec.JoinHistoryMessages = UINT32_MAX;
+	spec.ConsoleInput = false;
+	spec.ConsoleOutput = false;
+
+	ServerLayer server(spec, std::move(transport));
+	server.OnAttach();
+
+	Walnut::Buffer scratchBuffer;
+	scratchBuffer.Allocate(8192);
+
+	auto measure = [&](const std::function<void()>& run, const std::function<bool()>& done)
+	{
+		BenchResult result;
+		uint64_t packets = loopback.GetSentMessages(), bytes = loopback.GetSentBytes();
+		Clock::time_point start = Clock::now();
+		run();
+		if (!RunUntil(server, done))
+			std::printf("  (timed out waiting for completion)\n");
+		result.Seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		result.Packets = loopback.GetSentMessages() - packets;
+		result.Bytes = loopback.GetSentBytes() - bytes;
+		return result;
+	};
+
+	std::printf("%u clients, %u messages, %u history messages, %s encoding, %u fan-out threads\n\n", clientCount, messageCount, historyCount,
+		legacy ? "legacy" : "compact", fanOutThreads);
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Handshake: every client joins (and everyone already there hears about it)
+	////////////////////////////////////////////////////////////////////////////////
+	std::vector<std::unique_ptr<SimulatedClient>> clients;
+	clients.reserve(clientCount + 1);
+	for (uint32_t i = 0; i < clientCount; i++)
+		clients.push_back(std::make_unique<SimulatedClient>(loopback));
+
+	BenchResult handshake = measure([&]()
+	{
+		for (uint32_t i = 0; i < clientCount; i++)
+			clients[i]->Join(scratchBuffer, "user" + std::to_string(i), legacy);
+	}, [&]()
+	{
+		for (const auto& client : clients)
+		{
+			if (!client->Joined)
+				return false;
+		}
+		return true;
+	});
+	PrintResult("handshake", handshake, clientCount, "joins");
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Fan-out: messages from round-robin senders to everyone else
+	////////////////////////////////////////////////////////////////////////////////
+	auto countMessages = [&]()
+	{
+		uint64_t count = 0;
+		for (const auto& client : clients)
+			count += client->MessagesReceived;
+		return count;
+	};
+
+	const std::string message(64, 'x');
+	uint64_t expectedDeliveries = countMessages() + (uint64_t)messageCount * (clientCount - 1);
+	BenchResult fanOut = measure([&]()
+	{
+		for (uint32_t i = 0; i < messageCount; i++)
+			clients[i % clientCount]->SendMessage(scratchBuffer, message);
+	}, [&]() { return countMessages() >= expectedDeliveries; });
+	PrintResult("fan-out", fanOut, (uint64_t)messageCount * (clientCount - 1), "deliveries");
+
+	// Everything came in at once, so this is mostly time spent waiting behind other messages
+	const LatencyHistogram& residence = server.GetMessageResidenceTimes();
+	std::printf("             message residence p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", residence.GetPercentile(50.0) / 1000.0,
+		residence.GetPercentile(99.0) / 1000.0, residence.GetMax() / 1000.0);
+
+	// Broadcasts to fewer than FanOutMinRecipients clients stay serial
+	const BroadcastStats& fanOutStats = server.GetFanOutBroadcastStats();
+	if (fanOutStats.Count > 0)
+	{
+		std::printf("             %llu broadcasts fanned out, %.1f us on average, %llu chunks (%llu stolen)\n", (unsigned long long)fanOutStats.Count,
+			fanOutStats.TotalNanoseconds / 1000.0 / fanOutStats.Count, (unsigned long long)fanOutStats.Chunks, (unsigned long long)fanOutStats.StolenChunks);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	// History sync: fill up history, then time a late joiner receiving all of it
+	////////////////////////////////////////////////////////////////////////////////
+	uint64_t expectedFill = clients[1]->MessagesReceived + historyCount;
+	for (uint32_t i = 0; i < historyCount; i++)
+		clients[0]->SendMessage(scratchBuffer, message);
+	RunUntil(server, [&]() { return clients[1]->MessagesReceived >= expectedFill; });
+
+	auto& lateJoiner = clients.emplace_back(std::make_unique<SimulatedClient>(loopback));
+	uint64_t expectedHistory = (uint64_t)messageCount + historyCount;
+	BenchResult historySync = measure([&]()
+	{
+		lateJoiner->Join(scratchBuffer, "late", legacy);
+	}, [&]() { return lateJoiner->HistoryMessagesReceived >= expectedHistory; });
+	PrintResult("history", historySync, lateJoiner->HistoryMessagesReceived, "messages");
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Allocations: with everything warmed up, relaying a chat message (receive, handle,
+	// record, log, fan out) shouldn't touch the heap. One at a time, so nothing queues up.
+	////////////////////////////////////////////////////////////////////////////////
+	const uint32_t allocationCheckMessages = 1000;
+	uint64_t expectedChecked = clients[1]->MessagesReceived + allocationCheckMessages;
+	uint64_t allocationsBefore = s_AllocationCount.load();
+	for (uint32_t i = 0; i < allocationCheckMessages; i++)
+	{
+		clients[0]->SendMessage(scratchBuffer, message);
+		server.RunEventLoop(std::chrono::milliseconds(0));
+	}
+	uint64_t allocations = s_AllocationCount.load() - allocationsBefore;
+	RunUntil(server, [&]() { return clients[1]->MessagesReceived >= expectedChecked; });
+
+	// The history is the one thing that has to keep growing (its arrays double, its text goes
+	// in blocks), a few allocations per thousand messages. Anything per message would be at
+	// least one each.
+	bool allocationCheckPassed = allocations < allocationCheckMessages / 100;
+	std::printf("%-12s %10llu heap allocations for %u messages (%.3f per message)%s\n", "allocations", (unsigned long long)allocations,
+		allocationCheckMessages, (double)allocations / allocationCheckMessages, allocationCheckPassed ? "" : ", FAILED: something on the message path allocates");
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Rejoin storm: everyone drops and reconnects at once (eg. server restart) and gets
+	// their join history again. Nothing is paced here, so admission slots free up right away.
+	////////////////////////////////////////////////////////////////////////////////
+	for (uint32_t i = 0; i < clientCount; i++)
+		clients[i]->Leave();
+	server.RunEventLoop(std::chrono::milliseconds(0));
+
+	BenchResult rejoin = measure([&]()
+	{
+		for (uint32_t i = 0; i < clientCount; i++)
+			clients[i]->Join(scratchBuffer, "user" + std::to_string(i), legacy);
+	}, [&]()
+	{
+		for (uint32_t i = 0; i < clientCount; i++)
+		{
+			if (!clients[i]->Joined || clients[i]->HistoryMessagesReceived < expectedHistory)
+				return false;
+		}
+		return true;
+	});
+	PrintResult("rejoin", rejoin, clientCount, "joins");
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Text validation: IsValidMessage's scan over max length messages, with every
+	// implementation this CPU supports
+	////////////////////////////////////////////////////////////////////////////////
+	std::printf("\n");
+	RunTextValidationBench();
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Content filter: the same messages through filters with more and more terms
+	////////////////////////////////////////////////////////////////////////////////
+	std::printf("\n");
+	RunContentFilterBench();
+
+	server.OnDetach();
+	scratchBuffer.Release();
+
+	if (!traceFilepath.empty() && Trace::IsCompiledIn())
+	{
+		if (Trace::Stop(traceFilepath))
+			std::printf("Trace written to %s\n", traceFilepath.c_str());
+		else
+			std::printf("Failed to write trace to %s\n", traceFilepath.c_str());
+	}
+
+	return allocationCheckPassed ? 0 : 1;
+}
@@ -0,0 +1,397 @@
+#include "LegacyHistoryReader.h"
+#include "MessageHistoryStore.h"
+#include "FanOutPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//
+// App-Server-History - offline maintenance of the server's message history (stop the server
+// first, or work on a copy).
+//
+// Usage: App-Server-History convert <MessageHistory.yaml> <store directory> [--threads <n>] [--chunk-size <MB>]
+//        App-Server-History compact <store directory> <output directory> [--dedup [<window>]]
+//        App-Server-History verify <store directory> [--threads <n>]
+//        App-Server-History stats <store directory> [--top <n>]
+//
+// verify exits with 1 if any segment is damaged.
+//
+
+using Clock = std::chrono::steady_clock;
+
+static void PrintUsage()
+{
+	std::printf("Usage: App-Server-History <command> ...\n");
+	std::printf("  convert <MessageHistory.yaml> <store directory> [--threads <n>] [--chunk-size <MB>]\n");
+	std::printf("      imports a single-file YAML history into a new store, parsing chunks of it in parallel\n");
+	std::printf("      (--chunk-size, default 4 MB, times threads + 1 is about what's in memory at once)\n");
+	std::printf("  compact <store directory> <output directory> [--dedup [<window>]]\n");
+	std::printf("      rewrites a store into full size, compressed segments. With --dedup, messages identical to\n");
+	std::printf("      one of the previous <window> (default 1024) in username, text and timestamp are dropped,\n");
+	std::printf("      which renumbers everything after them\n");
+	std::printf("  verify <store directory> [--threads <n>]\n");
+	std::printf("      checks every segment against the manifest (records, counts, sizes, checksums)\n");
+	std::printf("  stats <store directory> [--top <n>]\n");
+	std::printf("      message count, bytes per user (top <n>, default 20) and message size distribution\n");
+}
+
+static double GetSeconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Size of everything in the directory
+static uint64_t GetDirectorySize(const std::filesystem::path& directory)
+{
+	uint64_t size = 0;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(directory, error))
+	{
+		if (entry.is_regular_file(error))
+			size += entry.file_size(error);
+	}
+	return size;
+}
+
+static bool OpenExistingStore(MessageHistoryStore& store, const std::filesystem::path& directory)
+{
+	if (!MessageHistoryStore::Exists(directory))
+	{
+		std::printf("There's no message history in %s\n", directory.string().c_str());
+		return false;
+	}
+
+	MessageHistoryStoreSpecification spec;
+	spec.Directory = directory;
+	// Only looked at, a damaged manifest is an error rather than something to start over from
+	spec.ReadOnly = true;
+	// Everything is read once, front to back
+	spec.MaxCachedSegments = 1;
+	if (!store.Open(spec))
+	{
+		std::printf("Could not open the message history in %s, its manifest is damaged\n", directory.string().c_str());
+		return false;
+	}
+	return true;
+}
+
+// Output stores are new and written in one go: sealed by size only (ages mean nothing here), and
+// the manifest is only written at the end
+static bool CreateStore(MessageHistoryStore& store, const std::filesystem::path& directory)
+{
+	if (MessageHistoryStore::Exists(directory))
+	{
+		std::printf("There's already a message history in %s\n", directory.string().c_str());
+		return false;
+	}
+
+	MessageHistoryStoreSpecification spec;
+	spec.Directory = directory;
+	spec.MaxSegmentAgeSeconds = UINT64_MAX / 1000;
+	spec.MaxCachedSegments = 0;
+	spec.SaveManifestOnSeal = false;
+	return store.Open(spec);
+}
+
+static int Convert(const std::filesystem::path& yamlFilepath, const std::filesystem::path& directory, uint32_t threadCount, uint64_t chunkSize)
+{
+	LegacyHistoryReader reader;
+	if (!reader.Open(yamlFilepath))
+	{
+		std::printf("Could not open %s\n", yamlFilepath.string().c_str());
+		return 1;
+	}
+
+	MessageHistoryStore store;
+	if (!CreateStore(store, directory))
+		return 1;
+
+	// The legacy format has no times. Stored as 0 ("unknown"), which also keeps them out of --dedup.
+	FanOutPool pool(threadCount);
+	Clock::time_point start = Clock::now();
+	uint64_t messageCount = 0;
+	bool success = reader.Read(pool, chunkSize, [&](const ChatMessageView& message, uint64_t timestamp)
+	{
+		store.Append(message, timestamp);
+		messageCount++;
+	});
+	store.Close();
+
+	double seconds = GetSeconds(start);
+	double megabytes = reader.GetFileSize() / (1024.0 * 1024.0);
+	if (!success)
+	{
+		std::printf("Failed to parse %s %s\n", yamlFilepath.string().c_str(), reader.GetError().c_str());
+		std::printf("The %llu messages before that are in %s\n", (unsigned long long)messageCount, directory.string().c_str());
+		return 1;
+	}
+
+	std::printf("Converted %llu messages (%.2f MB of YAML, %u chunks on %u threads) in %.3f s, %.1f MB/s\n", (unsigned long long)messageCount,
+		megabytes, reader.GetChunkCount(), threadCount + 1, seconds, megabytes / seconds);
+	std::printf("%s: %u segments, %.2f MB\n", directory.string().c_str(), store.GetSegmentCount(), GetDirectorySize(directory) / (1024.0 * 1024.0));
+	return 0;
+}
+
+// The last window messages (with a known time), to spot ones that were stored twice
+class DuplicateFilter
+{
+public:
+	DuplicateFilter(uint32_t window)
+		: m_Window(std::max(window, 1u)) {}
+
+	// Remembers it if it isn't one
+	bool IsDuplicate(const ChatMessageView& message, uint64_t timestamp)
+	{
+		if (timestamp == 0)
+			return false; // Converted from YAML, can't tell a repeat from a duplicate
+
+		uint64_t hash = std::hash<std::string_view>()(message.Username) * 31 + std::hash<std::string_view>()(message.Message) + timestamp;
+		auto [begin, end] = m_Hashes.equal_range(hash);
+		for (auto it = begin; it != end; it++)
+		{
+			const Entry& entry = m_Entries[it->second - m_FirstIndex];
+			if (entry.Timestamp == timestamp && entry.Username == message.Username && entry.Message == message.Message)
+				return true;
+		}
+
+		if (m_Entries.size() == m_Window)
+		{
+			auto [oldBegin, oldEnd] = m_Hashes.equal_range(m_Entries.front().Hash);
+			for (auto it = oldBegin; it != oldEnd; it++)
+			{
+				if (it->second == m_FirstIndex)
+				{
+					m_Hashes.erase(it);
+					break;
+				}
+			}
+			m_Entries.pop_front();
+			m_FirstIndex++;
+		}
+
+		m_Hashes.emplace(hash, m_FirstIndex + m_Entries.size());
+		m_Entries.push_back({ hash, timestamp, std::string(message.Username), std::string(message.Message) });
+		return false;
+	}
+private:
+	struct Entry
+	{
+		uint64_t Hash;
+		uint64_t Timestamp;
+		std::string Username, Message;
+	};
+
+	uint32_t m_Window;
+	std::deque<Entry> m_Entries;
+	// Hash -> index of the entry, counted from the first message ever
+	std::unordered_multimap<uint64_t, uint64_t> m_Hashes;
+	uint64_t m_FirstIndex = 0;
+};
+
+static int Compact(const std::filesystem::path& directory, const std::filesystem::path& outputDirectory, bool dedup, uint32_t dedupWindow)
+{
+	std::error_code error;
+	if (std::filesystem::equivalent(directory, outputDirectory, error))
+	{
+		std::printf("Compacting writes a new store, the output directory has to be a different one\n");
+		return 1;
+	}
+
+	MessageHistoryStore store, output;
+	if (!OpenExistingStore(store, directory) || !CreateStore(output, outputDirectory))
+		return 1;
+
+	Clock::time_point start = Clock::now();
+	uint64_t duplicateCount = 0;
+	DuplicateFilter duplicates(dedupWindow);
+	store.ForEachTimestampedMessage(store.GetFirstSequence(), store.GetEndSequence(), [&](uint64_t, const ChatMessageView& message, uint64_t timestamp)
+	{
+		if (dedup && duplicates.IsDuplicate(message, timestamp))
+			duplicateCount++;
+		else
+			output.Append(message, timestamp);
+		return true;
+	});
+	output.Close();
+
+	std::printf("Compacted %llu messages in %.3f s", (unsigned long long)store.GetMessageCount(), GetSeconds(start));
+	if (dedup)
+		std::printf(", dropped %llu duplicates", (unsigned long long)duplicateCount);
+	std::printf("\n");
+	std::printf("%s: %u segments, %.2f MB\n", directory.string().c_str(), store.GetSegmentCount(), GetDirectorySize(directory) / (1024.0 * 1024.0));
+	std::printf("%s: %u segments, %.2f MB\n", outputDirectory.string().c_str(), output.GetSegmentCount(), GetDirectorySize(outputDirectory) / (1024.0 * 1024.0));
+	store.Close();
+	return 0;
+}
+
+static int Verify(const std::filesystem::path& directory, uint32_t threadCount)
+{
+	MessageHistoryStore store;
+	if (!OpenExistingStore(store, directory))
+		return 1;
+
+	// A segment per chunk, VerifySegment() only reads
+	std::vector<std::string> errors(store.GetSegmentCount());
+	FanOutPool pool(threadCount);
+	Clock::time_point start = Clock::now();
+	pool.Run(store.GetSegmentCount(), 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; i++)
+		{
+			if (!store.VerifySegment(i, errors[i]) && errors[i].empty())
+				errors[i] = "unknown error";
+		}
+	});
+
+	uint32_t damagedCount = 0;
+	for (uint32_t i = 0; i < errors.size(); i++)
+	{
+		if (errors[i].empty())
+			continue;
+
+		std::printf("Segment %u: %s\n", i, errors[i].c_str());
+		damagedCount++;
+	}
+
+	std::printf("Verified %u segments (%llu messages, %.2f MB) in %.3f s: %s\n", store.GetSegmentCount(), (unsigned long long)store.GetMessageCount(),
+		GetDirectorySize(directory) / (1024.0 * 1024.0), GetSeconds(start), damagedCount ? "DAMAGED" : "OK");
+	store.Close();
+	return damagedCount ? 1 : 0;
+}
+
+static int Stats(const std::filesystem::path& directory, uint32_t topCount)
+{
+	MessageHistoryStore store;
+	if (!OpenExistingStore(store, directory))
+		return 1;
+
+	struct UserStats
+	{
+		uint64_t Messages = 0;
+		uint64_t Bytes = 0;
+	};
+	std::map<std::string, UserStats, std::less<>> users;
+
+	// Message sizes in bytes, by power of two (bucket i is [2^(i-1), 2^i), 0 is empty messages)
+	uint64_t sizeCounts[33] = {};
+	uint64_t totalBytes = 0, maxSize = 0;
+	uint64_t firstTimestamp = 0, lastTimestamp = 0;
+
+	store.ForEachTimestampedMessage(store.GetFirstSequence(), store.GetEndSequence(), [&](uint64_t, const ChatMessageView& message, uint64_t timestamp)
+	{
+		auto it = users.find(message.Username);
+		if (it == users.end())
+			it = users.emplace(std::string(message.Username), UserStats()).first;
+		it->second.Messages++;
+		it->second.Bytes += message.Message.size();
+
+		uint64_t size = message.Message.size();
+		uint32_t bucket = 0;
+		while (bucket < 32 && (1ull << bucket) <= size)
+			bucket++;
+		sizeCounts[bucket]++;
+		totalBytes += size;
+		maxSize = std::max(maxSize, size);
+
+		if (timestamp)
+		{
+			firstTimestamp = firstTimestamp ? std::min(firstTimestamp, timestamp) : timestamp;
+			lastTimestamp = std::max(lastTimestamp, timestamp);
+		}
+		return true;
+	});
+
+	uint64_t messageCount = store.GetMessageCount();
+	std::printf("%s: %llu messages, %u segments, %.2f MB on disk, %.2f MB of text\n", directory.string().c_str(), (unsigned long long)messageCount,
+		store.GetSegmentCount(), GetDirectorySize(directory) / (1024.0 * 1024.0), totalBytes / (1024.0 * 1024.0));
+	if (firstTimestamp)
+		std::printf("Timestamped messages span %.1f days\n", (lastTimestamp - firstTimestamp) / (1000.0 * 60.0 * 60.0 * 24.0));
+
+	std::vector<std::pair<std::string_view, UserStats>> byBytes(users.begin(), users.end());
+	std::sort(byBytes.begin(), byBytes.end(), [](const auto& a, const auto& b) { return a.second.Bytes > b.second.Bytes; });
+
+	std::printf("\n%zu users, top %u by bytes:\n", users.size(), std::min<uint32_t>(topCount, (uint32_t)users.size()));
+	for (size_t i = 0; i < byBytes.size() && i < topCount; i++)
+	{
+		const auto& [username, stats] = byBytes[i];
+		std::printf("  %-32.*s %10llu messages %12llu bytes %6.2f%%\n", (int)username.size(), username.data(), (unsigned long long)stats.Messages,
+			(unsigned long long)stats.Bytes, totalBytes ? stats.Bytes * 100.0 / totalBytes : 0.0);
+	}
+
+	std::printf("\nMessage sizes (mean %.1f bytes, max %llu):\n", messageCount ? (double)totalBytes / messageCount : 0.0, (unsigned long long)maxSize);
+	for (uint32_t bucket = 0; bucket < 33; bucket++)
+	{
+		if (!sizeCounts[bucket])
+			continue;
+
+		uint64_t low = bucket ? 1ull << (bucket - 1) : 0;
+		uint64_t high = bucket ? (1ull << bucket) - 1 : 0;
+		std::printf("  %6llu - %-6llu %12llu %6.2f%%\n", (unsigned long long)low, (unsigned long long)high, (unsigned long long)sizeCounts[bucket],
+			sizeCounts[bucket] * 100.0 / messageCount);
+	}
+
+	store.Close();
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	std::string_view command = argv[1];
+	std::vector<std::filesystem::path> paths;
+	uint32_t threadCount = FanOutPool::GetDefaultWorkerCount();
+	uint64_t chunkSize = 4 * 1024 * 1024;
+	bool dedup = false;
+	uint32_t dedupWindow = 1024;
+	uint32_t topCount = 20;
+
+	for (int i = 2; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc)
+			threadCount = (uint32_t)std::max(1, std::atoi(argv[++i])) - 1; // Besides the main thread
+		else if (arg == "--chunk-size" && i + 1 < argc)
+			chunkSize = (uint64_t)std::max(1, std::atoi(argv[++i])) * 1024 * 1024;
+		else if (arg == "--dedup")
+		{
+			dedup = true;
+			if (i + 1 < argc && argv[i + 1][0] != '-' && std::atoi(argv[i + 1]) > 0)
+				dedupWindow = (uint32_t)std::atoi(argv[++i]);
+		}
+		else if (arg == "--top" && i + 1 < argc)
+			topCount = (uint32_t)std::max(0, std::atoi(argv[++i]));
+		else if (arg[0] != '-')
+			paths.push_back(argv[i]);
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if (command == "convert" && paths.size() == 2)
+		return Convert(paths[0], paths[1], threadCount, chunkSize);
+	if (command == "compact" && paths.size() == 2)
+		return Compact(paths[0], paths[1], dedup, dedupWindow);
+	if (command == "verify" && paths.size() == 1)
+		return Verify(paths[0], threadCount);
+	if (command == "stats" && paths.size() == 1)
+		return Stats(paths[0], topCount);
+
+	PrintUsage();
+	return 1;
+}
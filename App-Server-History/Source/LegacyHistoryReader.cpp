@@ -0,0 +1,500 @@
+#include "LegacyHistoryReader.h"
+
+#include <yaml-cpp/eventhandler.h>
+#include <yaml-cpp/exceptions.h>
+#include <yaml-cpp/parser.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <istream>
+#include <streambuf>
+#include <string_view>
+
+namespace {
+
+	// std::istream over a chunk without copying it
+	class MemoryStreamBuffer : public std::streambuf
+	{
+	public:
+		MemoryStreamBuffer(std::string& text) { setg(text.data(), text.data(), text.data() + text.size()); }
+	};
+
+	// Every map with a User and a Message in it is an entry, whatever it's nested in. Maps and
+	// lists as values are only looked into, never taken as a key or value themselves.
+	class EntryCollector : public YAML::EventHandler
+	{
+	public:
+		using EntryFunc = std::function<void(std::string_view username, std::string_view message, uint64_t timestamp)>;
+	public:
+		EntryCollector(const EntryFunc& func)
+			: m_Func(func) {}
+
+		virtual void OnDocumentStart(const YAML::Mark&) override {}
+		virtual void OnDocumentEnd() override {}
+
+		virtual void OnNull(const YAML::Mark&, YAML::anchor_t) override { OnValue({}); }
+		virtual void OnAlias(const YAML::Mark&, YAML::anchor_t) override { OnValue({}); }
+		virtual void OnScalar(const YAML::Mark&, const std::string&, YAML::anchor_t, const std::string& value) override { OnValue(value); }
+
+		virtual void OnSequenceStart(const YAML::Mark&, const std::string&, YAML::anchor_t, YAML::EmitterStyle::value) override
+		{
+			OnValue({});
+			m_Nodes.emplace_back();
+		}
+		virtual void OnSequenceEnd() override { m_Nodes.pop_back(); }
+
+		virtual void OnMapStart(const YAML::Mark&, const std::string&, YAML::anchor_t, YAML::EmitterStyle::value) override
+		{
+			OnValue({});
+			m_Nodes.emplace_back().IsMap = true;
+		}
+		virtual void OnMapEnd() override
+		{
+			const Node& map = m_Nodes.back();
+			if (map.HasUser && map.HasMessage)
+				m_Func(map.Username, map.Message, map.Timestamp);
+			m_Nodes.pop_back();
+		}
+	private:
+		// Keys and values alternate in a map, anything in a list is ignored
+		void OnValue(std::string_view value)
+		{
+			if (m_Nodes.empty() || !m_Nodes.back().IsMap)
+				return;
+
+			Node& map = m_Nodes.back();
+			if (map.ExpectingKey)
+			{
+				map.Key = value;
+			}
+			else if (map.Key == "User")
+			{
+				map.Username = value;
+				map.HasUser = true;
+			}
+			else if (map.Key == "Message")
+			{
+				map.Message = value;
+				map.HasMessage = true;
+			}
+			else if (map.Key == "Timestamp")
+			{
+				map.Timestamp = std::strtoull(std::string(value).c_str(), nullptr, 10);
+			}
+			map.ExpectingKey = !map.ExpectingKey;
+		}
+	private:
+		struct Node
+		{
+			bool IsMap = false;
+			bool ExpectingKey = true;
+			std::string Key;
+			std::string Username, Message;
+			uint64_t Timestamp = 0;
+			bool HasUser = false, HasMessage = false;
+		};
+		std::vector<Node> m_Nodes;
+		const EntryFunc& m_Func;
+	};
+
+	// Appends codepoint to text as UTF-8, like yaml-cpp does with \x, \u and \U escapes
+	void AppendUTF8(std::string& text, uint32_t codepoint)
+	{
+		if (codepoint < 0x80)
+		{
+			text += (char)codepoint;
+		}
+		else if (codepoint < 0x800)
+		{
+			text += (char)(0xC0 | (codepoint >> 6));
+			text += (char)(0x80 | (codepoint & 0x3F));
+		}
+		else if (codepoint < 0x10000)
+		{
+			text += (char)(0xE0 | (codepoint >> 12));
+			text += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+			text += (char)(0x80 | (codepoint & 0x3F));
+		}
+		else
+		{
+			text += (char)(0xF0 | (codepoint >> 18));
+			text += (char)(0x80 | ((codepoint >> 12) & 0x3F));
+			text += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+			text += (char)(0x80 | (codepoint & 0x3F));
+		}
+	}
+
+	//
+	// The scalars yaml-cpp's emitter writes on a single line: plain, single- or double-quoted.
+	// Appends the value to text, false for anything else (the chunk is parsed by yaml-cpp then).
+	//
+	bool ParseScalar(std::string_view line, std::string& text)
+	{
+		if (line.empty())
+			return false; // Null
+
+		if (line.front() == '"')
+		{
+			for (size_t i = 1; i < line.size(); i++)
+			{
+				char c = line[i];
+				if (c == '"')
+					return line.find_first_not_of(' ', i + 1) == std::string_view::npos;
+				if (c != '\\')
+				{
+					text += c;
+					continue;
+				}
+
+				if (++i == line.size())
+					return false;
+
+				uint32_t digits = 0;
+				switch (line[i])
+				{
+					case '0': text += '\0'; break;
+					case 'a': text += '\a'; break;
+					case 'b': text += '\b'; break;
+					case 't': case '\t': text += '\t'; break;
+					case 'n': text += '\n'; break;
+					case 'v': text += '\v'; break;
+					case 'f': text += '\f'; break;
+					case 'r': text += '\r'; break;
+					case 'e': text += '\x1B'; break;
+					case ' ': case '"': case '/': case '\\': text += line[i]; break;
+					case 'N': AppendUTF8(text, 0x85); break;
+					case '_': AppendUTF8(text, 0xA0); break;
+					case 'L': AppendUTF8(text, 0x2028); break;
+					case 'P': AppendUTF8(text, 0x2029); break;
+					case 'x': digits = 2; break;
+					case 'u': digits = 4; break;
+					case 'U': digits = 8; break;
+					default: return false;
+				}
+
+				if (digits)
+				{
+					if (line.size() - i - 1 < digits)
+						return false;
+
+					uint32_t codepoint = 0;
+					for (uint32_t digit = 0; digit < digits; digit++)
+					{
+						char hex = line[++i];
+						uint32_t value = hex >= '0' && hex <= '9' ? hex - '0' : (hex | 0x20) >= 'a' && (hex | 0x20) <= 'f' ? (hex | 0x20) - 'a' + 10 : 16;
+						if (value == 16)
+							return false;
+						codepoint = codepoint * 16 + value;
+					}
+					AppendUTF8(text, codepoint);
+				}
+			}
+			return false; // Continues on the next line
+		}
+
+		if (line.front() == '\'')
+		{
+			for (size_t i = 1; i < line.size(); i++)
+			{
+				if (line[i] != '\'')
+					text += line[i];
+				else if (i + 1 < line.size() && line[i + 1] == '\'')
+					text += line[++i];
+				else
+					return line.find_first_not_of(' ', i + 1) == std::string_view::npos;
+			}
+			return false;
+		}
+
+		// Plain. Indicators, comments, nulls and anything that looks like a nested node go
+		// the slow way.
+		if (std::string_view("-?:,[]{}#&*!|>%@`").find(line.front()) != std::string_view::npos)
+			return false;
+		if (line.find(": ") != std::string_view::npos || line.find(" #") != std::string_view::npos || line.back() == ':')
+			return false;
+		if (line == "~" || line == "null" || line == "Null" || line == "NULL")
+			return false;
+
+		text.append(line);
+		return true;
+	}
+
+}
+
+bool LegacyHistoryReader::Open(const std::filesystem::path& filepath)
+{
+	m_Stream = std::ifstream(filepath, std::ios::binary | std::ios::ate);
+	if (!m_Stream)
+	{
+		m_Error = "could not open file";
+		return false;
+	}
+
+	m_FileSize = (uint64_t)m_Stream.tellg();
+	m_Stream.seekg(0);
+	m_ChunkCount = 0;
+	m_Carry.clear();
+	m_CarryOffset = 0;
+	m_Error.clear();
+	return true;
+}
+
+bool LegacyHistoryReader::Read(FanOutPool& pool, uint64_t chunkSize, const MessageFunc& func)
+{
+	if (!FindEntries())
+		return ReadWholeFile(func);
+
+	// Reused for every batch, so their buffers are only ever grown
+	std::vector<Chunk> batch(pool.GetWorkerCount() + 1);
+	while (true)
+	{
+		uint32_t count = 0;
+		while (count < batch.size() && ReadChunk(chunkSize, batch[count]))
+			count++;
+		if (count == 0)
+			break;
+
+		m_ChunkCount += count;
+		uint32_t indent = (uint32_t)m_EntryPrefix.size() - 3;
+		pool.Run(count, 1, [&batch, indent](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i = begin; i < end; i++)
+				ParseChunk(batch[i], indent);
+		});
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (!EmitChunk(batch[i], func))
+				return false;
+		}
+	}
+	return true;
+}
+
+bool LegacyHistoryReader::FindEntries()
+{
+	// The list starts right at the top of anything the server wrote
+	m_Carry.resize((size_t)std::min<uint64_t>(m_FileSize, 64 * 1024));
+	m_Stream.read(m_Carry.data(), m_Carry.size());
+	m_Carry.resize((size_t)m_Stream.gcount());
+
+	bool foundList = false;
+	size_t position = 0;
+	while (position < m_Carry.size())
+	{
+		size_t lineEnd = m_Carry.find('\n', position);
+		if (lineEnd == std::string::npos)
+			return false;
+
+		std::string_view line(m_Carry.data() + position, lineEnd - position);
+		while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+			line.remove_suffix(1);
+
+		size_t indent = line.find_first_not_of(' ');
+		if (indent != std::string_view::npos && line[indent] != '#')
+		{
+			if (!foundList)
+			{
+				if (line != "MessageHistory:")
+					return false;
+				foundList = true;
+			}
+			else
+			{
+				if (line.substr(indent, 2) != "- ")
+					return false;
+
+				m_EntryPrefix = "\n" + std::string(indent, ' ') + "- ";
+				m_Carry.erase(0, position);
+				m_CarryOffset = position;
+				return true;
+			}
+		}
+		position = lineEnd + 1;
+	}
+	return false;
+}
+
+bool LegacyHistoryReader::ReadChunk(uint64_t chunkSize, Chunk& chunk)
+{
+	chunk.Offset = m_CarryOffset;
+	chunk.Source.swap(m_Carry);
+	m_Carry.clear();
+
+	while (true)
+	{
+		// Cut before the last entry that starts in it, the rest goes to the next chunk
+		if (chunk.Source.size() >= chunkSize)
+		{
+			size_t cut = chunk.Source.rfind(m_EntryPrefix);
+			if (cut != std::string::npos && cut > 0)
+			{
+				cut++; // The newline stays with this chunk
+				m_Carry.assign(chunk.Source, cut);
+				m_CarryOffset = chunk.Offset + cut;
+				chunk.Source.resize(cut);
+				return true;
+			}
+		}
+
+		// An entry can be bigger than a chunk, then it's read until the next one starts
+		size_t size = chunk.Source.size();
+		size_t readSize = (size_t)std::max<uint64_t>(chunkSize > size ? chunkSize - size : 0, 64 * 1024);
+		chunk.Source.resize(size + readSize);
+		m_Stream.read(chunk.Source.data() + size, readSize);
+		chunk.Source.resize(size + (size_t)m_Stream.gcount());
+		if (chunk.Source.size() == size)
+			return !chunk.Source.empty(); // End of the file
+	}
+}
+
+bool LegacyHistoryReader::ParseChunkFast(Chunk& chunk, uint32_t indent)
+{
+	// Every entry is "- User: ..." at indent, then "Message: ..." (and maybe "Timestamp: ...")
+	// lines two further in
+	std::string_view source = chunk.Source;
+	std::string message;
+	while (!source.empty())
+	{
+		size_t lineEnd = source.find('\n');
+		std::string_view line = source.substr(0, lineEnd);
+		source.remove_prefix(lineEnd == std::string_view::npos ? source.size() : lineEnd + 1);
+		if (!line.empty() && line.back() == '\r')
+			line.remove_suffix(1);
+		if (line.find_first_not_of(' ') == std::string_view::npos)
+			continue;
+
+		bool entryStart = line.size() > indent + 2 && line.substr(indent, 2) == "- " && line.find_first_not_of(' ') == indent;
+		bool entryLine = line.size() > indent + 2 && line.find_first_not_of(' ') == indent + 2;
+		if (entryStart)
+		{
+			if (!chunk.Entries.empty() && (chunk.Entries.back().UsernameSize == UINT32_MAX || chunk.Entries.back().MessageSize == UINT32_MAX))
+				return false;
+			chunk.Entries.push_back({ UINT32_MAX, UINT32_MAX, 0 });
+		}
+		else if (!entryLine || chunk.Entries.empty())
+		{
+			return false;
+		}
+
+		line.remove_prefix(indent + 2);
+		size_t separator = line.find(": ");
+		if (separator == std::string_view::npos)
+			return false;
+
+		std::string_view key = line.substr(0, separator);
+		std::string_view value = line.substr(separator + 2);
+		value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+		while (!value.empty() && value.back() == ' ')
+			value.remove_suffix(1);
+
+		Entry& entry = chunk.Entries.back();
+		if (key == "User" && entry.UsernameSize == UINT32_MAX)
+		{
+			// Username goes first in Text, the message is held back until the entry is done
+			size_t size = chunk.Text.size();
+			if (!ParseScalar(value, chunk.Text))
+				return false;
+			entry.UsernameSize = (uint32_t)(chunk.Text.size() - size);
+			if (entry.MessageSize != UINT32_MAX)
+				chunk.Text.append(message);
+		}
+		else if (key == "Message" && entry.MessageSize == UINT32_MAX)
+		{
+			message.clear();
+			if (!ParseScalar(value, message))
+				return false;
+			entry.MessageSize = (uint32_t)message.size();
+			if (entry.UsernameSize != UINT32_MAX)
+				chunk.Text.append(message);
+		}
+		else if (key == "Timestamp")
+		{
+			std::string timestamp;
+			if (!ParseScalar(value, timestamp) || timestamp.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+			entry.Timestamp = std::strtoull(timestamp.c_str(), nullptr, 10);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return chunk.Entries.empty() || (chunk.Entries.back().UsernameSize != UINT32_MAX && chunk.Entries.back().MessageSize != UINT32_MAX);
+}
+
+void LegacyHistoryReader::ParseChunk(Chunk& chunk, uint32_t indent)
+{
+	chunk.Text.clear();
+	chunk.Entries.clear();
+	chunk.Error.clear();
+	if (ParseChunkFast(chunk, indent))
+		return;
+
+	chunk.Text.clear();
+	chunk.Entries.clear();
+
+	EntryCollector::EntryFunc addEntry = [&chunk](std::string_view username, std::string_view message, uint64_t timestamp)
+	{
+		chunk.Text.append(username).append(message);
+		chunk.Entries.push_back({ (uint32_t)username.size(), (uint32_t)message.size(), timestamp });
+	};
+
+	MemoryStreamBuffer buffer(chunk.Source);
+	std::istream stream(&buffer);
+	try
+	{
+		EntryCollector collector(addEntry);
+		YAML::Parser parser(stream);
+		parser.HandleNextDocument(collector);
+	}
+	catch (const YAML::Exception& e)
+	{
+		chunk.Error = e.what();
+	}
+}
+
+bool LegacyHistoryReader::EmitChunk(const Chunk& chunk, const MessageFunc& func)
+{
+	if (!chunk.Error.empty())
+	{
+		// Line numbers in the error are from the start of the chunk
+		m_Error = "in the chunk at byte " + std::to_string(chunk.Offset) + ": " + chunk.Error;
+		return false;
+	}
+
+	std::string_view text = chunk.Text;
+	for (const Entry& entry : chunk.Entries)
+	{
+		func(ChatMessageView(text.substr(0, entry.UsernameSize), text.substr(entry.UsernameSize, entry.MessageSize)), entry.Timestamp);
+		text.remove_prefix(entry.UsernameSize + entry.MessageSize);
+	}
+	return true;
+}
+
+bool LegacyHistoryReader::ReadWholeFile(const MessageFunc& func)
+{
+	m_Stream.clear();
+	m_Stream.seekg(0);
+	m_Carry.clear();
+	m_ChunkCount = 1;
+
+	EntryCollector::EntryFunc emit = [&func](std::string_view username, std::string_view message, uint64_t timestamp)
+	{
+		func(ChatMessageView(username, message), timestamp);
+	};
+
+	try
+	{
+		EntryCollector collector(emit);
+		YAML::Parser parser(m_Stream);
+		parser.HandleNextDocument(collector);
+	}
+	catch (const YAML::Exception& e)
+	{
+		m_Error = e.what();
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "UserInfo.h"
+#include "FanOutPool.h"
+
+#include <stdint.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+//
+// LegacyHistoryReader - streams a MessageHistory.yaml (the single-file history from before
+// MessageHistoryStore) in chunks, parsing a batch of them at once on a FanOutPool. At most one
+// batch is in memory at a time, however big the file is.
+//
+// The file is cut between list entries ("- User: ..." lines at the list's indentation), which
+// is how the server always wrote it. Each chunk is then a YAML list of its own and is parsed
+// by hand if it only has what the server's emitter writes (one line per key, plain or quoted
+// scalars), otherwise with yaml-cpp's event parser. No node tree is ever built. Files laid
+// out any other way are parsed in one go on the calling thread (still streamed).
+//
+class LegacyHistoryReader
+{
+public:
+	// timestamp is 0 if the entry doesn't have one (legacy files never do)
+	using MessageFunc = std::function<void(const ChatMessageView& message, uint64_t timestamp)>;
+public:
+	bool Open(const std::filesystem::path& filepath);
+
+	// Calls func for every message, in file order and on the calling thread. Chunks are about
+	// chunkSize bytes, pool.GetWorkerCount() + 1 of them are parsed at once. False if the file
+	// couldn't be parsed (everything before the bad chunk has been read by then).
+	bool Read(FanOutPool& pool, uint64_t chunkSize, const MessageFunc& func);
+
+	const std::string& GetError() const { return m_Error; }
+	uint64_t GetFileSize() const { return m_FileSize; }
+	uint32_t GetChunkCount() const { return m_ChunkCount; }
+private:
+	struct Entry
+	{
+		uint32_t UsernameSize = 0;
+		uint32_t MessageSize = 0;
+		uint64_t Timestamp = 0;
+	};
+
+	// A parsed chunk: usernames and messages back to back in Text, in Entries order
+	struct Chunk
+	{
+		uint64_t Offset = 0;
+		std::string Source;
+		std::string Text;
+		std::vector<Entry> Entries;
+		std::string Error;
+	};
+
+	// Finds the MessageHistory list and how its entries are indented, false if it isn't laid
+	// out the way the server writes it
+	bool FindEntries();
+	// Next chunk's source, cut before an entry. False once the file is used up.
+	bool ReadChunk(uint64_t chunkSize, Chunk& chunk);
+	// Entries are at indent spaces
+	static void ParseChunk(Chunk& chunk, uint32_t indent);
+	// Only handles what the server's emitter writes, false if there's anything else in there
+	static bool ParseChunkFast(Chunk& chunk, uint32_t indent);
+	bool EmitChunk(const Chunk& chunk, const MessageFunc& func);
+	bool ReadWholeFile(const MessageFunc& func);
+private:
+	std::ifstream m_Stream;
+	uint64_t m_FileSize = 0;
+	uint32_t m_ChunkCount = 0;
+
+	// "\n" + indentation + "- ", what every entry starts with
+	std::string m_EntryPrefix;
+	// Read past the last chunk, starts at an entry
+	std::string m_Carry;
+	uint64_t m_CarryOffset = 0;
+	std::string m_Error;
+};
@@ -0,0 +1,134 @@
+#include "ServerLayer.h"
+#include "PacketCapture.h"
+#include "LoopbackTransport.h"
+#include "ServerPacket.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// App-Server-Replay - feeds a capture (ServerLayer --capture / /capture start) back into a
+// ServerLayer and reports throughput and per-handler timings.
+//
+// Usage: App-Server-Replay <capture file> [--speed <multiplier> | --max] [--verbose]
+//
+
+static void PrintUsage()
+{
+	std::printf("Usage: App-Server-Replay <capture file> [--speed <multiplier> | --max] [--verbose]\n");
+	std::printf("  --speed <multiplier>  replay at a multiple of the captured speed (default 1)\n");
+	std::printf("  --max                 replay as fast as possible\n");
+	std::printf("  --verbose             print server console output\n");
+}
+
+int main(int argc, char** argv)
+{
+	using Clock = std::chrono::steady_clock;
+
+	const char* captureFilepath = nullptr;
+	double speed = 1.0;
+	bool maxSpeed = false;
+	bool verbose = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (arg == "--speed" && i + 1 < argc)
+			speed = std::atof(argv[++i]);
+		else if (arg == "--max")
+			maxSpeed = true;
+		else if (arg == "--verbose")
+			verbose = true;
+		else if (!captureFilepath && arg[0] != '-')
+			captureFilepath = argv[i];
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if (!captureFilepath || speed <= 0.0)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	// Read everything up front so file IO isn't part of the measurement
+	PacketCaptureReader reader;
+	if (!reader.Open(captureFilepath))
+	{
+		std::printf("Could not open capture file %s\n", captureFilepath);
+		return 1;
+	}
+
+	std::vector<CaptureRecord> records;
+	uint64_t totalBytes = 0;
+	for (CaptureRecord record; reader.ReadNext(record);)
+	{
+		totalBytes += record.Data.size();
+		records.push_back(std::move(record));
+	}
+
+	if (records.empty())
+	{
+		std::printf("Capture file %s has no events\n", captureFilepath);
+		return 1;
+	}
+
+	// Throwaway server: no history files, no stdin, no sockets. Captured clients don't exist
+	// on the loopback transport, so whatever the server sends them is dropped.
+	ServerLayerSpecification spec;
+	spec.MessageHistory.Directory.clear();
+	spec.LegacyMessageHistoryFilePath.clear();
+	spec.DirectMessageHistoryFilePath.clear();
+	// The capture decides who disconnects when, not the replay's timing
+	spec.HeartbeatTimeout = 0.0f;
+	spec.HandshakeTimeout = 0.0f;
+	spec.ConsoleInput = false;
+	spec.ConsoleOutput = verbose;
+
+	ServerLayer server(spec, std::make_unique<LoopbackServerTransport>());
+	server.OnAttach();
+
+	Clock::time_point start = Clock::now();
+	Clock::duration maxLag = Clock::duration::zero();
+	for (const auto& record : records)
+	{
+		if (!maxSpeed)
+		{
+			Clock::time_point due = start + std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds((uint64_t)(record.Timestamp / speed)));
+
+			// Keep the server's timers (outbound flushes, presence, ...) running in the meantime
+			while (Clock::now() < due)
+				server.RunEventLoop(due - Clock::now());
+
+			maxLag = std::max(maxLag, Clock::now() - due);
+		}
+
+		server.ReplayEvent(record);
+		server.RunEventLoop(Clock::duration::zero());
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	server.OnDetach();
+
+	double capturedDuration = records.back().Timestamp / 1e9;
+	std::printf("\nReplayed %zu events (%.2f MB) in %.3fs, captured over %.3fs\n", records.size(), totalBytes / (1024.0 * 1024.0), elapsed, capturedDuration);
+	std::printf("  %.0f events/s, %.2f MB/s\n", records.size() / elapsed, totalBytes / (1024.0 * 1024.0) / elapsed);
+	if (!maxSpeed)
+		std::printf("  max lag behind schedule: %.3fms\n", std::chrono::duration<double, std::milli>(maxLag).count());
+
+	std::printf("\n%-24s %10s %12s %12s %12s\n", "Handler", "Count", "Total (ms)", "Avg (us)", "Max (us)");
+	for (const auto& [type, stats] : server.GetPacketHandlerStats())
+	{
+		std::printf("%-24s %10llu %12.3f %12.3f %12.3f\n", std::string(PacketTypeToString(type)).c_str(),
+			(unsigned long long)stats.Count, stats.TotalNanoseconds / 1e6, stats.TotalNanoseconds / 1e3 / stats.Count, stats.MaxNanoseconds / 1e3);
+	}
+
+	return 0;
+}
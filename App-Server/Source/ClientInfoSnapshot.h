@@ -0,0 +1,42 @@
+#pragma once
+
+#include "Walnut/Networking/Server.h"
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+//
+// Read-only copy of what the server's Client Info window shows, published by ServerLayer
+// every so often (see ServerLayer::PublishClientInfoSnapshot()). The UI only ever reads one
+// of these, never the live sessions or the transport's connection state.
+//
+struct ClientInfoSnapshotEntry
+{
+	Walnut::ClientID ID = 0;
+	std::string Username;
+	std::string ConnectionDesc;
+	uint32_t Color = 0;
+	uint8_t Presence = 0;
+
+	// Microseconds, 0 = not measured
+	uint32_t RoundTripTime = 0;
+	uint32_t QueuedPackets = 0;
+	uint64_t QueuedBytes = 0;
+	uint64_t PeakQueuedBytes = 0;
+	uint64_t BytesSent = 0;
+	uint64_t BytesReceived = 0;
+};
+
+struct ClientInfoSnapshot
+{
+	std::vector<ClientInfoSnapshotEntry> Clients;
+	std::chrono::steady_clock::time_point Time;
+
+	// Microseconds, across all clients (see LatencyHistogram), 0 = nothing measured yet
+	uint64_t RoundTripTimeP50 = 0;
+	uint64_t RoundTripTimeP99 = 0;
+	uint64_t MessageResidenceTimeP50 = 0;
+	uint64_t MessageResidenceTimeP99 = 0;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "UserInfo.h"
+#include "WireFormat.h"
+#include "OutboundQueue.h"
+#include "EventLoop.h"
+
+#include <unordered_set>
+
+//
+// Server-side state for a client that has completed the ClientConnectionRequest handshake
+//
+struct ClientSession
+{
+	UserInfo User;
+
+	// Negotiated during handshake, legacy clients stay at v1 with no capabilities
+	uint16_t ProtocolVersion = LegacyProtocolVersion;
+	uint32_t Capabilities = 0;
+	WireEncoding Encoding = WireEncoding::Legacy;
+
+	// As the transport described it when the client joined
+	std::string ConnectionDesc;
+
+	// Packets waiting for the transport to catch up, see ServerLayer::FlushOutboundQueue()
+	OutboundQueue Outbound;
+	// Waiting in the transport as of the last ServerLayer::UpdateSendQueueStatus(), plus
+	// everything sent since. Without transport status it's what was sent this interval.
+	uint64_t PendingSendBytes = 0;
+	// Seconds, as the transport last reported it
+	float SendQueueTime = 0.0f;
+	// File data on its way to this client that the server hasn't got yet (uploaders have been
+	// told they can send it), see ServerLayer::SendFileAckIfReady()
+	uint64_t FileBytesInFlight = 0;
+	// Since joining
+	uint64_t BytesSent = 0;
+	uint64_t BytesReceived = 0;
+	// Message history (sequences) [HistoryCursor, HistoryEnd) is paged out lazily, after
+	// everything else in the queue. Anything newer than HistoryEnd is sent live, held back
+	// until the history is done (OutboundQueue::HoldInteractive()). Anything older than
+	// HistoryBegin is only sent on request (PacketType::MessageHistoryRequest).
+	bool SendingHistory = false;
+	uint64_t HistoryBegin = 0;
+	uint64_t HistoryCursor = 0;
+	uint64_t HistoryEnd = 0;
+	// Holding one of the admission slots (ServerLayerSpecification::MaxConcurrentJoins) until
+	// the join history is sent
+	bool Admitting = false;
+	// Client couldn't keep up and is being disconnected, nothing more gets queued
+	bool EvictionPending = false;
+
+	// Presence reported by the client but not fanned out yet (User.Presence is what others
+	// were last told), see ServerLayer::FlushPresenceUpdates()
+	uint8_t PendingPresence = PresenceFlags::None;
+	bool PresenceDirty = false;
+	// Clears PresenceFlags::Typing if the client stops refreshing it
+	EventLoop::TimerID TypingExpiryTimer = 0;
+	// Users whose presence changed while this client was backed up. It's sent their current
+	// presence once it catches up, see ServerLayer::SendPresenceBacklog()
+	std::unordered_set<uint32_t> PresenceBacklog; // UserInfo::ID
+
+	// Microseconds, smoothed over the last few pings (0 = not measured yet), see ServerLayer::OnPong()
+	uint32_t RoundTripTime = 0;
+	// Server time in the last ping it hasn't answered yet (0 = none), see ServerLayer::SendPings()
+	uint64_t PingTime = 0;
+
+	bool HasCapability(uint32_t capabilities) const { return (Capabilities & capabilities) == capabilities; }
+};
@@ -0,0 +1,146 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Compression {
+
+	// Token: high nibble literal length, low nibble match length - MinMatch. A nibble of 15
+	// means more length follows in bytes of 255 (terminated by a byte < 255). Every sequence
+	// but the last is followed by a 16-bit match offset. The last sequence is literals only.
+	static const size_t MinMatch = 4;
+	static const size_t MaxOffset = 65535;
+	static const int HashBits = 14;
+
+	static uint32_t Read32(const uint8_t* data)
+	{
+		uint32_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	static uint32_t Hash(uint32_t value)
+	{
+		return (value * 2654435761u) >> (32 - HashBits);
+	}
+
+	static void WriteLength(std::vector<uint8_t>& output, size_t length)
+	{
+		while (length >= 255)
+		{
+			output.push_back(255);
+			length -= 255;
+		}
+		output.push_back((uint8_t)length);
+	}
+
+	static void WriteSequence(std::vector<uint8_t>& output, const uint8_t* literals, size_t literalLength, size_t matchLength, size_t offset)
+	{
+		size_t matchCode = matchLength ? matchLength - MinMatch : 0;
+		output.push_back((uint8_t)((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchCode, 15)));
+		if (literalLength >= 15)
+			WriteLength(output, literalLength - 15);
+
+		output.insert(output.end(), literals, literals + literalLength);
+
+		if (matchLength)
+		{
+			output.push_back((uint8_t)(offset & 0xff));
+			output.push_back((uint8_t)(offset >> 8));
+			if (matchCode >= 15)
+				WriteLength(output, matchCode - 15);
+		}
+	}
+
+	std::vector<uint8_t> Compress(const uint8_t* data, size_t size)
+	{
+		std::vector<uint8_t> output;
+		output.reserve(size / 2 + 16);
+
+		std::vector<int64_t> table(1 << HashBits, -1);
+
+		size_t position = 0, anchor = 0;
+		while (position + MinMatch <= size)
+		{
+			uint32_t value = Read32(data + position);
+			uint32_t hash = Hash(value);
+			int64_t candidate = table[hash];
+			table[hash] = (int64_t)position;
+
+			if (candidate < 0 || position - candidate > MaxOffset || Read32(data + candidate) != value)
+			{
+				position++;
+				continue;
+			}
+
+			size_t matchLength = MinMatch;
+			while (position + matchLength < size && data[candidate + matchLength] == data[position + matchLength])
+				matchLength++;
+
+			WriteSequence(output, data + anchor, position - anchor, matchLength, position - candidate);
+			position += matchLength;
+			anchor = position;
+		}
+
+		WriteSequence(output, data + anchor, size - anchor, 0, 0);
+		return output;
+	}
+
+	static bool ReadLength(const uint8_t* data, size_t size, size_t& position, size_t& length)
+	{
+		uint8_t byte;
+		do
+		{
+			if (position >= size)
+				return false;
+			byte = data[position++];
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+
+	bool Decompress(const uint8_t* data, size_t size, uint8_t* output, size_t outputSize)
+	{
+		size_t position = 0, outputPosition = 0;
+		while (position < size)
+		{
+			uint8_t token = data[position++];
+
+			size_t literalLength = token >> 4;
+			if (literalLength == 15 && !ReadLength(data, size, position, literalLength))
+				return false;
+			if (literalLength > size - position || literalLength > outputSize - outputPosition)
+				return false;
+
+			memcpy(output + outputPosition, data + position, literalLength);
+			position += literalLength;
+			outputPosition += literalLength;
+
+			// Last sequence has no match
+			if (position == size)
+				break;
+
+			if (size - position < 2)
+				return false;
+			size_t offset = data[position] | (data[position + 1] << 8);
+			position += 2;
+
+			size_t matchLength = token & 0xf;
+			if (matchLength == 15 && !ReadLength(data, size, position, matchLength))
+				return false;
+			matchLength += MinMatch;
+
+			if (offset == 0 || offset > outputPosition || matchLength > outputSize - outputPosition)
+				return false;
+
+			// Matches can overlap their own output, so copy byte by byte
+			const uint8_t* match = output + outputPosition - offset;
+			for (size_t i = 0; i < matchLength; i++)
+				output[outputPosition + i] = match[i];
+			outputPosition += matchLength;
+		}
+
+		return outputPosition == outputSize;
+	}
+
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+//
+// Small LZ77 block compressor (LZ4-style token format) for sealed history segments.
+// Chat text compresses well and this needs no external dependency.
+//
+namespace Compression {
+
+	std::vector<uint8_t> Compress(const uint8_t* data, size_t size);
+
+	// output must be exactly the uncompressed size, returns false on corrupt input
+	bool Decompress(const uint8_t* data, size_t size, uint8_t* output, size_t outputSize);
+
+}
@@ -0,0 +1,239 @@
+#include "ContentFilter.h"
+
+#include "Trace.h"
+#include "ScratchArena.h"
+
+#include <yaml-cpp/yaml.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+// Longer terms are ignored (and have no business in a chat filter)
+static const size_t s_MaxTermLength = 1024;
+// Set on transitions into a state where some term ends
+static const uint32_t s_MatchFlag = 0x80000000;
+
+static uint8_t FoldCase(uint8_t byte)
+{
+	return byte >= 'A' && byte <= 'Z' ? byte + ('a' - 'A') : byte;
+}
+
+std::string_view ContentFilterActionToString(ContentFilterAction action)
+{
+	switch (action)
+	{
+		case ContentFilterAction::None:  return "None";
+		case ContentFilterAction::Flag:  return "Flag";
+		case ContentFilterAction::Mask:  return "Mask";
+		case ContentFilterAction::Block: return "Block";
+	}
+	return "Unknown";
+}
+
+void ContentFilter::Build(const std::vector<ContentFilterRule>& rules)
+{
+	WC_TRACE_SCOPE("ContentFilter::Build");
+	auto startTime = std::chrono::steady_clock::now();
+
+	auto isUsable = [](const ContentFilterRule& rule)
+	{
+		return !rule.Term.empty() && rule.Term.size() <= s_MaxTermLength && rule.Action != ContentFilterAction::None;
+	};
+
+	// Byte classes, upper case ASCII shares its lower case class
+	memset(m_ByteClasses, 0, sizeof(m_ByteClasses));
+	m_ClassCount = 1;
+	for (const auto& rule : rules)
+	{
+		if (!isUsable(rule))
+			continue;
+
+		for (char c : rule.Term)
+		{
+			uint8_t byte = FoldCase((uint8_t)c);
+			if (!m_ByteClasses[byte])
+				m_ByteClasses[byte] = (uint8_t)m_ClassCount++;
+		}
+	}
+	for (uint8_t c = 'A'; c <= 'Z'; c++)
+		m_ByteClasses[c] = m_ByteClasses[FoldCase(c)];
+
+	// Trie first, transitions hold plain state indices until the end (0 = no child yet, the
+	// root is never anyone's child)
+	m_States.assign(1, State());
+	m_Transitions.assign(m_ClassCount, 0);
+	m_TermCount = 0;
+	for (const auto& rule : rules)
+	{
+		if (!isUsable(rule))
+			continue;
+
+		// Rows are addressed with 31 bits
+		if ((m_States.size() + rule.Term.size()) * m_ClassCount >= s_MatchFlag)
+			break;
+
+		uint32_t state = 0;
+		for (char c : rule.Term)
+		{
+			size_t index = (size_t)state * m_ClassCount + m_ByteClasses[(uint8_t)c];
+			if (!m_Transitions[index])
+			{
+				m_Transitions[index] = (uint32_t)m_States.size();
+				m_States.emplace_back();
+				m_Transitions.resize(m_Transitions.size() + m_ClassCount, 0);
+			}
+			state = m_Transitions[index];
+		}
+
+		// Same term more than once, most severe action wins
+		State& termState = m_States[state];
+		if (termState.TermLength == 0)
+			m_TermCount++;
+		termState.TermLength = (uint16_t)rule.Term.size();
+		termState.TermAction = std::max(termState.TermAction, rule.Action);
+	}
+
+	// Breadth first, so the state a failure link points to (shorter) already has its full row.
+	// Missing transitions are taken from there, and missing root transitions stay at the root.
+	std::vector<uint32_t> fail(m_States.size(), 0);
+	std::vector<uint32_t> queue;
+	queue.reserve(m_States.size());
+	for (uint32_t c = 0; c < m_ClassCount; c++)
+	{
+		if (m_Transitions[c])
+			queue.push_back(m_Transitions[c]);
+	}
+
+	for (size_t i = 0; i < queue.size(); i++)
+	{
+		uint32_t state = queue[i];
+		uint32_t* row = m_Transitions.data() + (size_t)state * m_ClassCount;
+		const uint32_t* failRow = m_Transitions.data() + (size_t)fail[state] * m_ClassCount;
+		for (uint32_t c = 0; c < m_ClassCount; c++)
+		{
+			if (!row[c])
+			{
+				row[c] = failRow[c];
+				continue;
+			}
+
+			uint32_t child = row[c];
+			fail[child] = failRow[c];
+			const State& failState = m_States[fail[child]];
+			m_States[child].Output = failState.TermLength ? fail[child] : failState.Output;
+			queue.push_back(child);
+		}
+	}
+
+	// Renumber breadth first too, so the shallow states nearly every byte goes through share as
+	// few cache lines as possible, and turn transitions into flagged row offsets
+	std::vector<uint32_t> newIndices(m_States.size(), 0);
+	for (size_t i = 0; i < queue.size(); i++)
+		newIndices[queue[i]] = (uint32_t)i + 1;
+
+	std::vector<State> states(m_States.size());
+	std::vector<uint32_t> transitions(m_Transitions.size());
+	for (uint32_t state = 0; state < (uint32_t)m_States.size(); state++)
+	{
+		uint32_t newIndex = newIndices[state];
+		states[newIndex] = m_States[state];
+		states[newIndex].Output = newIndices[m_States[state].Output];
+
+		for (uint32_t c = 0; c < m_ClassCount; c++)
+		{
+			uint32_t target = m_Transitions[(size_t)state * m_ClassCount + c];
+			const State& targetState = m_States[target];
+			transitions[(size_t)newIndex * m_ClassCount + c] = newIndices[target] * m_ClassCount | (targetState.TermLength || targetState.Output ? s_MatchFlag : 0);
+		}
+	}
+	m_States = std::move(states);
+	m_Transitions = std::move(transitions);
+
+	m_BuildMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+bool ContentFilter::LoadFromFile(const std::filesystem::path& filepath)
+{
+	std::vector<ContentFilterRule> rules;
+	bool loaded = LoadRulesFromFile(filepath, rules);
+	Build(rules);
+	return loaded;
+}
+
+bool ContentFilter::LoadRulesFromFile(const std::filesystem::path& filepath, std::vector<ContentFilterRule>& rules)
+{
+	WC_TRACE_SCOPE("ContentFilter::LoadRulesFromFile");
+	if (!std::filesystem::exists(filepath))
+		return false;
+
+	YAML::Node data;
+	try
+	{
+		data = YAML::LoadFile(filepath.string());
+	}
+	catch (YAML::Exception e)
+	{
+		std::cout << "[ERROR] Failed to load content filter " << filepath << std::endl << e.what() << std::endl;
+		return false;
+	}
+
+	auto rootNode = data["ContentFilter"];
+	if (!rootNode)
+		return false;
+
+	for (ContentFilterAction action : { ContentFilterAction::Block, ContentFilterAction::Mask, ContentFilterAction::Flag })
+	{
+		for (const auto& node : rootNode[std::string(ContentFilterActionToString(action))])
+			rules.push_back({ node.as<std::string>(), action });
+	}
+
+	return true;
+}
+
+ContentFilterAction ContentFilter::Apply(std::span<char> text) const
+{
+	if (m_TermCount == 0)
+		return ContentFilterAction::None;
+
+	ContentFilterAction result = ContentFilterAction::None;
+	// [begin, end) of masked matches
+	ScratchArena<1024> arena;
+	std::pmr::vector<std::pair<size_t, size_t>> masks(&arena);
+
+	const uint32_t* transitions = m_Transitions.data();
+	uint32_t row = 0;
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		uint32_t next = transitions[row + m_ByteClasses[(uint8_t)text[i]]];
+		row = next & ~s_MatchFlag;
+		if (!(next & s_MatchFlag))
+			continue;
+
+		// Every term ending here: this state's own and the ones down its output links
+		uint32_t state = row / m_ClassCount;
+		uint32_t match = m_States[state].TermLength ? state : m_States[state].Output;
+		while (match)
+		{
+			const State& matchState = m_States[match];
+			if (matchState.TermAction == ContentFilterAction::Block)
+				return ContentFilterAction::Block;
+
+			if (matchState.TermAction == ContentFilterAction::Mask)
+				masks.emplace_back(i + 1 - matchState.TermLength, i + 1);
+			result = std::max(result, matchState.TermAction);
+			match = matchState.Output;
+		}
+	}
+
+	for (const auto& [begin, end] : masks)
+		std::fill(text.begin() + begin, text.begin() + end, '*');
+
+	return result;
+}
+
+uint64_t ContentFilter::GetSize() const
+{
+	return m_States.size() * sizeof(State) + m_Transitions.size() * sizeof(uint32_t);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Ordered by severity, a message gets the most severe action of all terms it contains
+enum class ContentFilterAction : uint8_t
+{
+	None = 0,
+	Flag,  // Delivered as is, reported on the server console
+	Mask,  // Delivered with the term replaced by '*'
+	Block  // Not delivered or recorded
+};
+
+std::string_view ContentFilterActionToString(ContentFilterAction action);
+
+struct ContentFilterRule
+{
+	std::string Term;
+	ContentFilterAction Action = ContentFilterAction::Block;
+};
+
+//
+// ContentFilter - banned terms/links compiled into an Aho-Corasick automaton, so a message is
+// checked against every term in one pass over its bytes no matter how many terms there are.
+//
+// The automaton is turned into a full DFA (one table lookup per byte, no failure links to
+// follow) over byte classes: every byte that appears in a term gets its own class, the rest
+// share one, which keeps rows short.
+//
+// Matching is on substrings and ignores ASCII case. Immutable once built, so one can be shared
+// (and swapped for a rebuilt one) while messages are being filtered with it.
+//
+// Terms file (YAML):
+//   ContentFilter:
+//     Block: [ "term", ... ]
+//     Mask: [ ... ]
+//     Flag: [ ... ]
+//
+class ContentFilter
+{
+public:
+	void Build(const std::vector<ContentFilterRule>& rules);
+	bool LoadFromFile(const std::filesystem::path& filepath);
+	static bool LoadRulesFromFile(const std::filesystem::path& filepath, std::vector<ContentFilterRule>& rules);
+
+	// Masks text in place if that's the result (nothing is masked when it's Block). Doesn't
+	// allocate unless there are more masked matches than fit on the stack.
+	ContentFilterAction Apply(std::span<char> text) const;
+
+	uint32_t GetTermCount() const { return m_TermCount; }
+	uint32_t GetStateCount() const { return (uint32_t)m_States.size(); }
+	// Bytes used by the automaton
+	uint64_t GetSize() const;
+	float GetBuildMilliseconds() const { return m_BuildMilliseconds; }
+private:
+	struct State
+	{
+		// Nearest state down the failure chain that ends a term (0 = none)
+		uint32_t Output = 0;
+		// Term ending exactly here (Length 0 = none)
+		uint16_t TermLength = 0;
+		ContentFilterAction TermAction = ContentFilterAction::None;
+	};
+
+	std::vector<State> m_States;
+	// m_ClassCount entries per state. Each is the next state's row (state * m_ClassCount),
+	// with s_MatchFlag set if any term ends in that state.
+	std::vector<uint32_t> m_Transitions;
+	uint8_t m_ByteClasses[256] = {};
+	uint32_t m_ClassCount = 1;
+
+	uint32_t m_TermCount = 0;
+	float m_BuildMilliseconds = 0.0f;
+};
@@ -0,0 +1,115 @@
+#include "EncodedMessageHistory.h"
+
+#include "VectorStreamWriter.h"
+
+#include <algorithm>
+
+void EncodedMessageHistory::Reset(uint64_t beginSequence, uint32_t maxMessages)
+{
+	for (auto& encoded : m_Encoded)
+	{
+		encoded.Data.clear();
+		encoded.Offsets.assign(1, 0);
+	}
+
+	m_BeginSequence = beginSequence;
+	m_MaxMessages = std::max(maxMessages, 1u);
+}
+
+void EncodedMessageHistory::Append(const ChatMessageView& message)
+{
+	for (uint32_t i = 0; i < WireEncodingCount; i++)
+	{
+		auto& encoded = m_Encoded[i];
+		VectorStreamWriter stream(encoded.Data);
+		Wire::WriteChatMessage(stream, message, (WireEncoding)i);
+		encoded.Offsets.push_back(encoded.Data.size());
+	}
+
+	if (GetMessageCount() >= (uint64_t)m_MaxMessages * 2)
+		Trim();
+}
+
+bool EncodedMessageHistory::GetPageEnd(uint64_t pageBegin, uint64_t historyEnd, WireEncoding encoding, uint64_t maxBytes, uint32_t maxMessages, uint64_t& pageEnd) const
+{
+	if (!Contains(pageBegin, historyEnd))
+		return false;
+
+	if (pageBegin == historyEnd)
+	{
+		pageEnd = pageBegin;
+		return true;
+	}
+
+	const auto& offsets = m_Encoded[(int)encoding].Offsets;
+	size_t begin = pageBegin - m_BeginSequence;
+	size_t last = std::min(historyEnd, pageBegin + maxMessages) - m_BeginSequence;
+
+	// Last end offset that still fits, but always at least one message
+	auto it = std::upper_bound(offsets.begin() + begin + 1, offsets.begin() + last + 1, offsets[begin] + maxBytes);
+	size_t end = std::max<size_t>(it - offsets.begin() - 1, begin + 1);
+
+	pageEnd = m_BeginSequence + end;
+	return true;
+}
+
+bool EncodedMessageHistory::GetPageBegin(uint64_t pageEnd, uint64_t historyBegin, WireEncoding encoding, uint64_t maxBytes, uint32_t maxMessages, uint64_t& pageBegin) const
+{
+	if (pageEnd < m_BeginSequence || pageEnd > GetEndSequence())
+		return false;
+
+	if (pageEnd <= historyBegin)
+	{
+		pageBegin = pageEnd;
+		return true;
+	}
+
+	const auto& offsets = m_Encoded[(int)encoding].Offsets;
+	size_t end = pageEnd - m_BeginSequence;
+	uint64_t first = std::max(historyBegin, pageEnd - std::min<uint64_t>(pageEnd, maxMessages));
+
+	// The page could reach past the oldest message kept here, unless it fills up before that
+	uint64_t lowestOffset = 0;
+	if (first >= m_BeginSequence)
+		lowestOffset = offsets[first - m_BeginSequence];
+	else if (offsets[end] - offsets[0] <= maxBytes)
+		return false;
+
+	// First start offset that still fits, but always at least one message
+	uint64_t limit = std::max(offsets[end] - std::min(offsets[end], maxBytes), lowestOffset);
+	auto it = std::lower_bound(offsets.begin(), offsets.begin() + end, limit);
+	size_t begin = std::min<size_t>(it - offsets.begin(), end - 1);
+
+	pageBegin = m_BeginSequence + begin;
+	return true;
+}
+
+Walnut::Buffer EncodedMessageHistory::GetMessages(uint64_t begin, uint64_t end, WireEncoding encoding) const
+{
+	const auto& encoded = m_Encoded[(int)encoding];
+	uint64_t beginOffset = encoded.Offsets[begin - m_BeginSequence];
+	uint64_t endOffset = encoded.Offsets[end - m_BeginSequence];
+	return Walnut::Buffer(encoded.Data.data() + beginOffset, endOffset - beginOffset);
+}
+
+uint64_t EncodedMessageHistory::GetSize() const
+{
+	uint64_t size = 0;
+	for (const auto& encoded : m_Encoded)
+		size += encoded.Data.size() + encoded.Offsets.size() * sizeof(uint64_t);
+	return size;
+}
+
+void EncodedMessageHistory::Trim()
+{
+	size_t count = GetMessageCount() - m_MaxMessages;
+	for (auto& encoded : m_Encoded)
+	{
+		uint64_t trimmedBytes = encoded.Offsets[count];
+		encoded.Data.erase(encoded.Data.begin(), encoded.Data.begin() + trimmedBytes);
+		encoded.Offsets.erase(encoded.Offsets.begin(), encoded.Offsets.begin() + count);
+		for (uint64_t& offset : encoded.Offsets)
+			offset -= trimmedBytes;
+	}
+	m_BeginSequence += count;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "UserInfo.h"
+#include "WireFormat.h"
+
+#include "Walnut/Core/Buffer.h"
+
+#include <stdint.h>
+#include <vector>
+
+//
+// EncodedMessageHistory - the newest part of the message history, already encoded in every
+// WireEncoding. History pages are cut out of it with a memcpy instead of walking the
+// MessageHistoryStore and encoding every message again for each client that joins.
+//
+// Covers sequences [GetBeginSequence(), GetEndSequence()). It's append-only (messages are
+// encoded once, as they arrive) and trims its oldest messages once it holds twice
+// maxMessages, so it always keeps at least the newest maxMessages.
+//
+class EncodedMessageHistory
+{
+public:
+	void Reset(uint64_t beginSequence, uint32_t maxMessages);
+	void Append(const ChatMessageView& message);
+
+	uint64_t GetBeginSequence() const { return m_BeginSequence; }
+	uint64_t GetEndSequence() const { return m_BeginSequence + GetMessageCount(); }
+	uint64_t GetMessageCount() const { return m_Encoded[0].Offsets.size() - 1; }
+	bool Contains(uint64_t begin, uint64_t end) const { return begin >= m_BeginSequence && begin <= end && end <= GetEndSequence(); }
+
+	// Same paging rules as ServerLayer::GetMessageHistoryPageEnd/Begin (at most maxBytes of
+	// messages but at least one, at most maxMessages). Return false if the page can't be
+	// worked out from the messages kept here.
+	bool GetPageEnd(uint64_t pageBegin, uint64_t historyEnd, WireEncoding encoding, uint64_t maxBytes, uint32_t maxMessages, uint64_t& pageEnd) const;
+	bool GetPageBegin(uint64_t pageEnd, uint64_t historyBegin, WireEncoding encoding, uint64_t maxBytes, uint32_t maxMessages, uint64_t& pageBegin) const;
+
+	// Encoded messages [begin, end) back to back (which must be Contains()), valid until the
+	// next Append()
+	Walnut::Buffer GetMessages(uint64_t begin, uint64_t end, WireEncoding encoding) const;
+
+	// Bytes held, all encodings
+	uint64_t GetSize() const;
+private:
+	void Trim();
+private:
+	struct Encoded
+	{
+		std::vector<uint8_t> Data;
+		// Where each message starts in Data, plus one past the last one
+		std::vector<uint64_t> Offsets = { 0 };
+	};
+
+	Encoded m_Encoded[WireEncodingCount];
+	uint64_t m_BeginSequence = 0;
+	uint32_t m_MaxMessages = 0;
+};
@@ -0,0 +1,140 @@
+#include "FanOutPool.h"
+
+#include "Trace.h"
+
+#include <algorithm>
+
+FanOutPool::FanOutPool(uint32_t workerCount)
+{
+	for (uint32_t i = 0; i <= workerCount; i++)
+		m_Queues.push_back(std::make_unique<ChunkQueue>());
+
+	m_Workers.reserve(workerCount);
+	for (uint32_t i = 0; i < workerCount; i++)
+		m_Workers.emplace_back([this, i]() { WorkerThread(i); });
+}
+
+FanOutPool::~FanOutPool()
+{
+	{
+		std::scoped_lock<std::mutex> lock(m_Mutex);
+		m_Running = false;
+	}
+	m_WorkAvailable.notify_all();
+
+	for (auto& worker : m_Workers)
+		worker.join();
+}
+
+FanOutResult FanOutPool::Run(uint32_t count, uint32_t chunkSize, const ChunkFunc& function)
+{
+	WC_TRACE_SCOPE("FanOutPool::Run");
+	FanOutResult result;
+	if (count == 0)
+		return result;
+
+	chunkSize = std::max(chunkSize, 1u);
+	result.Chunks = (count + chunkSize - 1) / chunkSize;
+	m_RemainingChunks.store(result.Chunks, std::memory_order_relaxed);
+	m_StolenChunks.store(0, std::memory_order_relaxed);
+
+	// Dealt out round-robin, so every thread starts with about the same amount
+	uint32_t queueCount = (uint32_t)m_Queues.size();
+	for (uint32_t queueIndex = 0; queueIndex < queueCount; queueIndex++)
+	{
+		ChunkQueue& queue = *m_Queues[queueIndex];
+		std::scoped_lock<std::mutex> lock(queue.Mutex);
+		for (uint32_t chunkIndex = queueIndex; chunkIndex < result.Chunks; chunkIndex += queueCount)
+		{
+			uint32_t begin = chunkIndex * chunkSize;
+			queue.Chunks.push_back({ &function, begin, std::min(begin + chunkSize, count) });
+		}
+	}
+
+	if (result.Chunks > 1)
+	{
+		{
+			std::scoped_lock<std::mutex> lock(m_Mutex);
+			m_Generation++;
+		}
+		m_WorkAvailable.notify_all();
+	}
+
+	RunChunks(queueCount - 1);
+
+	// Out of chunks to take, the last few are still running on the workers
+	while (m_RemainingChunks.load(std::memory_order_acquire) != 0)
+		std::this_thread::yield();
+
+	result.StolenChunks = m_StolenChunks.load(std::memory_order_relaxed);
+	return result;
+}
+
+uint32_t FanOutPool::GetDefaultWorkerCount()
+{
+	uint32_t cores = std::thread::hardware_concurrency();
+	return cores > 1 ? cores - 1 : 0;
+}
+
+void FanOutPool::WorkerThread(uint32_t queueIndex)
+{
+	Trace::SetThreadName("Fan-Out");
+
+	uint64_t generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_WorkAvailable.wait(lock, [&]() { return !m_Running || m_Generation != generation; });
+			if (!m_Running)
+				return;
+
+			generation = m_Generation;
+		}
+
+		RunChunks(queueIndex);
+	}
+}
+
+void FanOutPool::RunChunks(uint32_t queueIndex)
+{
+	Chunk chunk;
+	while (PopChunk(queueIndex, chunk) || StealChunk(queueIndex, chunk))
+	{
+		WC_TRACE_SCOPE("FanOutPool::Chunk");
+		(*chunk.Function)(chunk.Begin, chunk.End);
+		// Release, so whatever the chunk did is visible to Run() once it sees zero
+		m_RemainingChunks.fetch_sub(1, std::memory_order_release);
+	}
+}
+
+bool FanOutPool::PopChunk(uint32_t queueIndex, Chunk& chunk)
+{
+	ChunkQueue& queue = *m_Queues[queueIndex];
+	std::scoped_lock<std::mutex> lock(queue.Mutex);
+	if (queue.Chunks.empty())
+		return false;
+
+	chunk = queue.Chunks.front();
+	queue.Chunks.pop_front();
+	return true;
+}
+
+bool FanOutPool::StealChunk(uint32_t queueIndex, Chunk& chunk)
+{
+	// Starting with the next queue over, so thieves don't all pile onto the same one
+	uint32_t queueCount = (uint32_t)m_Queues.size();
+	for (uint32_t i = 1; i < queueCount; i++)
+	{
+		ChunkQueue& queue = *m_Queues[(queueIndex + i) % queueCount];
+		std::scoped_lock<std::mutex> lock(queue.Mutex);
+		if (queue.Chunks.empty())
+			continue;
+
+		chunk = queue.Chunks.back();
+		queue.Chunks.pop_back();
+		m_StolenChunks.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// How a FanOutPool::Run() went
+struct FanOutResult
+{
+	uint32_t Chunks = 0;
+	// Run by someone other than the thread they were handed to
+	uint32_t StolenChunks = 0;
+};
+
+//
+// FanOutPool - splits a range (eg. a broadcast's recipients) into chunks and runs them on a
+// few worker threads plus the calling thread. Every thread has its own queue of chunks and
+// works through it front to back, whoever runs out steals from the back of someone else's, so
+// a thread that got slow chunks (or got scheduled late) doesn't hold everyone up.
+//
+class FanOutPool
+{
+public:
+	using ChunkFunc = std::function<void(uint32_t begin, uint32_t end)>;
+public:
+	FanOutPool(uint32_t workerCount);
+	~FanOutPool();
+
+	FanOutPool(const FanOutPool&) = delete;
+	FanOutPool& operator=(const FanOutPool&) = delete;
+
+	// Calls function on [0, count) in chunks of at most chunkSize, returns once every chunk is
+	// done. Chunks run concurrently, so function must be safe to call from several threads at
+	// once for different ranges. Only one Run() at a time.
+	FanOutResult Run(uint32_t count, uint32_t chunkSize, const ChunkFunc& function);
+
+	uint32_t GetWorkerCount() const { return (uint32_t)m_Workers.size(); }
+	// One per core, besides the calling thread
+	static uint32_t GetDefaultWorkerCount();
+private:
+	struct Chunk
+	{
+		// Stays with the chunk, a worker can still be on its way out of the previous Run()
+		const ChunkFunc* Function;
+		uint32_t Begin, End;
+	};
+
+	struct ChunkQueue
+	{
+		std::mutex Mutex;
+		std::deque<Chunk> Chunks;
+	};
+
+	void WorkerThread(uint32_t queueIndex);
+	// Runs chunks until there are none left in any queue
+	void RunChunks(uint32_t queueIndex);
+	bool PopChunk(uint32_t queueIndex, Chunk& chunk);
+	bool StealChunk(uint32_t queueIndex, Chunk& chunk);
+private:
+	// One per worker, the last one is the calling thread's
+	std::vector<std::unique_ptr<ChunkQueue>> m_Queues;
+	std::vector<std::thread> m_Workers;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_WorkAvailable;
+	uint64_t m_Generation = 0;
+	bool m_Running = true;
+
+	std::atomic<uint32_t> m_RemainingChunks = 0;
+	std::atomic<uint32_t> m_StolenChunks = 0;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Walnut/Networking/Server.h"
+
+#include "EventLoop.h"
+
+#include <stdint.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+//
+// Server-side state of a file a client is uploading (PacketType::FileOffer). Chunks are
+// written to disk and passed on to the recipients as they come in, the file is never held in
+// memory as a whole.
+//
+struct FileUpload
+{
+	// What recipients know it by
+	uint32_t ID = 0;
+
+	// Uploader, by username so the upload can be resumed from a new connection
+	std::string Username;
+	uint32_t ClientTransferID = 0;
+	// 0 while the uploader is disconnected, see ServerLayer::CleanUpFileUploads()
+	Walnut::ClientID UploaderID = 0;
+	std::chrono::steady_clock::time_point PausedTime;
+
+	std::string Filename;
+	uint64_t Size = 0;
+	// Everything before this is on disk (and on its way to the recipients)
+	uint64_t Received = 0;
+	// Last offset the uploader was told about with PacketType::FileAck, and how far that lets
+	// it send (Acked plus FileTransferWindow). Counted in each recipient's
+	// ClientSession::FileBytesInFlight until it's come in.
+	uint64_t Acked = 0;
+	uint64_t Granted = 0;
+	// The uploader (re)offered it and is waiting for a FileAck to say where to start
+	bool OfferAckPending = true;
+
+	// Offered to the clients connected at the time, nothing is sent on until they've all
+	// answered or OfferTimer runs out (see ServerLayer::StartFileUpload)
+	std::vector<Walnut::ClientID> OfferedRecipients;
+	EventLoop::TimerID OfferTimer = 0;
+	bool Started = false;
+	// Accepted it, whoever has left since is skipped
+	std::vector<Walnut::ClientID> Recipients;
+
+	std::filesystem::path Filepath;
+	std::ofstream Stream;
+};
@@ -0,0 +1,779 @@
+#include "MessageHistoryStore.h"
+
+#include "Compression.h"
+#include "Trace.h"
+
+#include <yaml-cpp/yaml.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+//
+// Segment file layout (little-endian):
+//   Header: "WCHS" | uint16 version | uint8 compressed | uint8 reserved | uint64 uncompressed size
+//   Records: uint64 timestamp | uint16 username size | username | uint32 message size | message
+// Active segments are uncompressed and only ever appended to (uncompressed size is 0, read to
+// the end of the file). Sealing rewrites the records as one Compression block, and the
+// manifest gets a CRC-32 of the (uncompressed) records.
+//
+
+static const char s_SegmentMagic[4] = { 'W', 'C', 'H', 'S' };
+static const uint16_t s_SegmentVersion = 1;
+static const size_t s_SegmentHeaderSize = 16;
+static const size_t s_RecordHeaderSize = sizeof(uint64_t) + sizeof(uint16_t) + sizeof(uint32_t);
+
+static const char* s_ManifestFilename = "Manifest.yaml";
+
+template<typename T>
+static void AppendRaw(std::vector<uint8_t>& buffer, const T& value)
+{
+	const uint8_t* bytes = (const uint8_t*)&value;
+	buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+template<typename T>
+static bool ReadRaw(const uint8_t* data, size_t size, size_t& position, T& value)
+{
+	if (size - position < sizeof(T))
+		return false;
+	memcpy(&value, data + position, sizeof(T));
+	position += sizeof(T);
+	return true;
+}
+
+static void AppendSegmentHeader(std::vector<uint8_t>& buffer, bool compressed, uint64_t uncompressedSize)
+{
+	buffer.insert(buffer.end(), s_SegmentMagic, s_SegmentMagic + sizeof(s_SegmentMagic));
+	AppendRaw<uint16_t>(buffer, s_SegmentVersion);
+	AppendRaw<uint8_t>(buffer, compressed ? 1 : 0);
+	AppendRaw<uint8_t>(buffer, 0);
+	AppendRaw<uint64_t>(buffer, uncompressedSize);
+}
+
+static void AppendRecord(std::vector<uint8_t>& buffer, const ChatMessageView& message, uint64_t timestamp)
+{
+	uint16_t usernameSize = (uint16_t)std::min<size_t>(message.Username.size(), UINT16_MAX);
+	AppendRaw<uint64_t>(buffer, timestamp);
+	AppendRaw<uint16_t>(buffer, usernameSize);
+	buffer.insert(buffer.end(), message.Username.begin(), message.Username.begin() + usernameSize);
+	AppendRaw<uint32_t>(buffer, (uint32_t)message.Message.size());
+	buffer.insert(buffer.end(), message.Message.begin(), message.Message.end());
+}
+
+static uint64_t GetRecordSize(const ChatMessageView& message)
+{
+	return s_RecordHeaderSize + message.Username.size() + message.Message.size();
+}
+
+// Calls func(username, message, timestamp) for every complete record, returns where it
+// stopped: the end, unless there's a partial record there
+template<typename Func>
+static size_t ForEachRecord(const uint8_t* records, size_t size, Func&& func)
+{
+	size_t position = 0;
+	while (position < size)
+	{
+		size_t recordBegin = position;
+		uint64_t timestamp;
+		uint16_t usernameSize;
+		uint32_t messageSize;
+		if (!ReadRaw(records, size, position, timestamp) || !ReadRaw(records, size, position, usernameSize)
+			|| size - position < usernameSize)
+			return recordBegin;
+
+		std::string_view username((const char*)records + position, usernameSize);
+		position += usernameSize;
+
+		if (!ReadRaw(records, size, position, messageSize) || size - position < messageSize)
+			return recordBegin;
+
+		std::string_view message((const char*)records + position, messageSize);
+		position += messageSize;
+
+		func(username, message, timestamp);
+	}
+	return position;
+}
+
+// CRC-32 (IEEE)
+static uint32_t GetChecksum(const uint8_t* data, size_t size)
+{
+	static const std::array<uint32_t, 256> s_Table = []()
+	{
+		std::array<uint32_t, 256> table;
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t value = i;
+			for (int bit = 0; bit < 8; bit++)
+				value = (value >> 1) ^ (value & 1 ? 0xEDB88320u : 0u);
+			table[i] = value;
+		}
+		return table;
+	}();
+
+	uint32_t crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < size; i++)
+		crc = s_Table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static bool ReadFile(const std::filesystem::path& filepath, std::vector<uint8_t>& data)
+{
+	std::ifstream stream(filepath, std::ios::binary | std::ios::ate);
+	if (!stream)
+		return false;
+
+	data.resize((size_t)stream.tellg());
+	stream.seekg(0);
+	return data.empty() || (bool)stream.read((char*)data.data(), data.size());
+}
+
+// The records in a segment file, decompressed if need be. error (if given) says what's wrong.
+static bool ReadSegmentRecords(const std::filesystem::path& filepath, std::vector<uint8_t>& records, std::string* error = nullptr, bool* compressed = nullptr)
+{
+	auto fail = [error](const char* reason)
+	{
+		if (error)
+			*error = reason;
+		return false;
+	};
+
+	std::vector<uint8_t> file;
+	if (!ReadFile(filepath, file))
+		return fail("could not read file");
+
+	if (file.size() < s_SegmentHeaderSize || memcmp(file.data(), s_SegmentMagic, sizeof(s_SegmentMagic)) != 0)
+		return fail("not a segment file");
+
+	size_t position = sizeof(s_SegmentMagic);
+	uint16_t version;
+	uint8_t isCompressed, reserved;
+	uint64_t uncompressedSize;
+	ReadRaw(file.data(), file.size(), position, version);
+	ReadRaw(file.data(), file.size(), position, isCompressed);
+	ReadRaw(file.data(), file.size(), position, reserved);
+	ReadRaw(file.data(), file.size(), position, uncompressedSize);
+	if (version != s_SegmentVersion)
+		return fail("unsupported segment version");
+
+	if (compressed)
+		*compressed = isCompressed;
+
+	if (isCompressed)
+	{
+		// Every compressed byte expands to at most 255 (a length byte), so a bigger size than
+		// that is a damaged header and would just be a huge allocation
+		uint64_t compressedSize = file.size() - position;
+		if (uncompressedSize > compressedSize * 255 + s_SegmentHeaderSize)
+			return fail("uncompressed size in the header is impossible");
+
+		records.resize(uncompressedSize);
+		if (!Compression::Decompress(file.data() + position, file.size() - position, records.data(), records.size()))
+			return fail("could not decompress records");
+	}
+	else
+	{
+		file.erase(file.begin(), file.begin() + position);
+		records = std::move(file);
+	}
+	return true;
+}
+
+// Writes next to the target and renames over it, so a crash never leaves a half-written file
+static bool WriteFileAtomic(const std::filesystem::path& filepath, const void* data, size_t size)
+{
+	std::filesystem::path tempFilepath = filepath;
+	tempFilepath += ".tmp";
+	{
+		std::ofstream stream(tempFilepath, std::ios::binary | std::ios::trunc);
+		if (!stream || !stream.write((const char*)data, size))
+			return false;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempFilepath, filepath, error);
+	return !error;
+}
+
+bool MessageHistoryStore::Open(const MessageHistoryStoreSpecification& specification)
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::Open");
+	Close();
+
+	m_Specification = specification;
+	m_Segments.clear();
+	m_SegmentCache.clear();
+	m_NextSegmentID = 1;
+
+	if (IsPersistent() && m_Specification.ReadOnly)
+	{
+		if (!LoadManifest())
+			return false;
+	}
+	else if (IsPersistent())
+	{
+		std::error_code error;
+		std::filesystem::create_directories(m_Specification.Directory, error);
+		if (error)
+		{
+			std::cout << "[ERROR] Could not create message history directory " << m_Specification.Directory << std::endl;
+			return false;
+		}
+
+		// Starting over without one would reuse segment filenames and write over what's there
+		if (!LoadManifest())
+			RebuildManifest();
+	}
+
+	if (m_Segments.empty() || m_Segments.back().Sealed)
+	{
+		// Read-only stores just don't have an active segment
+		if (!m_Specification.ReadOnly)
+			StartSegment();
+	}
+	else
+	{
+		// The manifest can lag behind the active segment's file (it's written after), the
+		// file is what counts
+		Segment& active = m_Segments.back();
+		m_ActiveSegmentData = std::make_shared<SegmentData>();
+		uint64_t completeSize = 0;
+		bool read = ReadSegmentFile(active, *m_ActiveSegmentData, &completeSize);
+
+		active.MessageCount = (uint32_t)m_ActiveSegmentData->Messages.size();
+		active.Size = 0;
+		for (const auto& message : m_ActiveSegmentData->Messages)
+			active.Size += GetRecordSize(message);
+		if (active.MessageCount)
+		{
+			active.FirstTimestamp = m_ActiveSegmentData->Timestamps.front();
+			active.LastTimestamp = m_ActiveSegmentData->Timestamps.back();
+		}
+		m_ActiveSegmentFlushedCount = active.MessageCount;
+
+		// A crash mid-append leaves a partial record at the end, which has to go before anything
+		// is appended after it. If it can't be cut off, the next flush writes the file over.
+		std::filesystem::path filepath = m_Specification.Directory / active.Filename;
+		std::error_code error;
+		if (read && !m_Specification.ReadOnly && std::filesystem::file_size(filepath, error) > completeSize)
+		{
+			std::filesystem::resize_file(filepath, completeSize, error);
+			if (error)
+				m_ActiveSegmentFlushedCount = 0;
+		}
+	}
+
+	m_Open = true;
+	return true;
+}
+
+void MessageHistoryStore::Close()
+{
+	if (!m_Open)
+		return;
+
+	Flush();
+	m_ActiveSegmentData.reset();
+	m_SegmentCache.clear();
+	m_Open = false;
+}
+
+uint64_t MessageHistoryStore::Append(const ChatMessageView& message)
+{
+	return Append(message, GetTimestamp());
+}
+
+uint64_t MessageHistoryStore::Append(const ChatMessageView& message, uint64_t timestamp)
+{
+	if (ShouldSealActiveSegment(timestamp))
+	{
+		SealActiveSegment();
+		StartSegment();
+	}
+
+	Segment& active = m_Segments.back();
+	if (active.MessageCount == 0)
+		active.FirstTimestamp = timestamp;
+	active.LastTimestamp = timestamp;
+	active.Size += GetRecordSize(message);
+
+	m_ActiveSegmentData->Add(message.Username, message.Message, timestamp);
+
+	return active.FirstSequence + active.MessageCount++;
+}
+
+void MessageHistoryStore::Flush()
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::Flush");
+	if (!IsPersistent() || m_Segments.empty() || m_Specification.ReadOnly)
+		return;
+
+	FlushActiveSegment();
+	if (m_ManifestDirty)
+		SaveManifest();
+}
+
+void MessageHistoryStore::FlushActiveSegment()
+{
+	Segment& active = m_Segments.back();
+	if (m_ActiveSegmentFlushedCount < active.MessageCount)
+	{
+		std::filesystem::path filepath = m_Specification.Directory / active.Filename;
+
+		std::vector<uint8_t> buffer;
+		if (m_ActiveSegmentFlushedCount == 0 || !std::filesystem::exists(filepath))
+		{
+			// Starting the file over, don't leave earlier records (or a partial one) behind
+			AppendSegmentHeader(buffer, false, 0);
+			m_ActiveSegmentFlushedCount = 0;
+		}
+
+		for (uint32_t i = m_ActiveSegmentFlushedCount; i < active.MessageCount; i++)
+			AppendRecord(buffer, m_ActiveSegmentData->Messages[i], m_ActiveSegmentData->Timestamps[i]);
+
+		auto mode = std::ios::binary | (m_ActiveSegmentFlushedCount == 0 ? std::ios::trunc : std::ios::app);
+		std::ofstream stream(filepath, mode);
+		if (stream && stream.write((const char*)buffer.data(), buffer.size()))
+		{
+			m_ActiveSegmentFlushedCount = active.MessageCount;
+			m_ManifestDirty = true;
+		}
+		else
+		{
+			std::cout << "[ERROR] Failed to write message history segment " << filepath << std::endl;
+		}
+	}
+}
+
+bool MessageHistoryStore::IsDirty() const
+{
+	if (!IsPersistent() || m_Segments.empty())
+		return false;
+
+	return m_ManifestDirty || m_ActiveSegmentFlushedCount < m_Segments.back().MessageCount;
+}
+
+void MessageHistoryStore::ForEachMessage(uint64_t begin, uint64_t end, const MessageFunc& func)
+{
+	ForEachTimestampedMessage(begin, end, [&func](uint64_t sequence, const ChatMessageView& message, uint64_t)
+	{
+		return func(sequence, message);
+	});
+}
+
+void MessageHistoryStore::ForEachTimestampedMessage(uint64_t begin, uint64_t end, const TimestampedMessageFunc& func)
+{
+	begin = std::max(begin, GetFirstSequence());
+	end = std::min(end, GetEndSequence());
+
+	while (begin < end)
+	{
+		size_t segmentIndex = FindSegment(begin);
+		uint64_t segmentBegin = m_Segments[segmentIndex].FirstSequence;
+		uint64_t segmentEnd = segmentBegin + m_Segments[segmentIndex].MessageCount;
+
+		// Holding on to the data keeps it alive even if the cache drops it
+		std::shared_ptr<SegmentData> data = GetSegmentData(segmentIndex);
+		for (uint64_t sequence = begin; sequence < std::min(end, segmentEnd); sequence++)
+		{
+			size_t index = (size_t)(sequence - segmentBegin);
+			if (index >= data->Messages.size())
+				break; // Unreadable segment
+
+			if (!func(sequence, data->Messages[index], data->Timestamps[index]))
+				return;
+		}
+		begin = segmentEnd;
+	}
+}
+
+void MessageHistoryStore::ForEachMessageReverse(uint64_t begin, uint64_t end, const MessageFunc& func)
+{
+	begin = std::max(begin, GetFirstSequence());
+	end = std::min(end, GetEndSequence());
+
+	while (begin < end)
+	{
+		size_t segmentIndex = FindSegment(end - 1);
+		uint64_t segmentBegin = m_Segments[segmentIndex].FirstSequence;
+
+		std::shared_ptr<SegmentData> data = GetSegmentData(segmentIndex);
+		for (uint64_t sequence = end; sequence > std::max(begin, segmentBegin); sequence--)
+		{
+			size_t index = (size_t)(sequence - 1 - segmentBegin);
+			if (index >= data->Messages.size())
+				continue; // Unreadable segment
+
+			if (!func(sequence - 1, data->Messages[index]))
+				return;
+		}
+		end = segmentBegin;
+	}
+}
+
+void MessageHistoryStore::Search(std::string_view text, uint32_t maxResults, const MessageFunc& func)
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::Search");
+	uint32_t resultCount = 0;
+	ForEachMessageReverse(GetFirstSequence(), GetEndSequence(), [&](uint64_t sequence, const ChatMessageView& message)
+	{
+		if (message.Message.find(text) == std::string_view::npos)
+			return true;
+
+		return func(sequence, message) && ++resultCount < maxResults;
+	});
+}
+
+uint64_t MessageHistoryStore::GetTimestamp()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool MessageHistoryStore::Exists(const std::filesystem::path& directory)
+{
+	return std::filesystem::exists(directory / s_ManifestFilename);
+}
+
+void MessageHistoryStore::StartSegment()
+{
+	char filename[32];
+	snprintf(filename, sizeof(filename), "Segment-%06llu.bin", (unsigned long long)m_NextSegmentID++);
+
+	Segment segment;
+	segment.Filename = filename;
+	segment.FirstSequence = GetEndSequence();
+	m_Segments.push_back(segment);
+
+	m_ActiveSegmentData = std::make_shared<SegmentData>();
+	// Appending shouldn't have to grow these (until the segment is sealed, in memory there's
+	// only the one)
+	m_ActiveSegmentData->Messages.reserve(m_Specification.MaxSegmentMessages);
+	m_ActiveSegmentData->Timestamps.reserve(m_Specification.MaxSegmentMessages);
+	m_ActiveSegmentFlushedCount = 0;
+	m_ManifestDirty = true;
+}
+
+void MessageHistoryStore::SealActiveSegment()
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::SealActiveSegment");
+	FlushActiveSegment();
+	if (m_Specification.SaveManifestOnSeal && m_ManifestDirty)
+		SaveManifest();
+
+	Segment& active = m_Segments.back();
+	active.Sealed = true;
+
+	// Checked (and compressed) as it is on disk
+	std::vector<uint8_t> records;
+	if (ReadSegmentRecords(m_Specification.Directory / active.Filename, records))
+	{
+		active.Checksum = GetChecksum(records.data(), records.size());
+		if (m_Specification.CompressSealedSegments)
+			active.Compressed = CompressSegmentFile(active, records);
+	}
+
+	// Just written, likely to be asked for again soon (eg. a client paging back)
+	m_SegmentCache.emplace_front(m_Segments.size() - 1, std::move(m_ActiveSegmentData));
+	if (m_SegmentCache.size() > m_Specification.MaxCachedSegments)
+		m_SegmentCache.pop_back();
+
+	m_ManifestDirty = true;
+}
+
+bool MessageHistoryStore::ShouldSealActiveSegment(uint64_t timestamp) const
+{
+	// In-memory stores never need to page anything out
+	if (!IsPersistent())
+		return false;
+
+	const Segment& active = m_Segments.back();
+	if (active.MessageCount == 0)
+		return false;
+
+	return active.MessageCount >= m_Specification.MaxSegmentMessages
+		|| active.Size >= m_Specification.MaxSegmentBytes
+		|| timestamp - active.FirstTimestamp >= m_Specification.MaxSegmentAgeSeconds * 1000;
+}
+
+size_t MessageHistoryStore::FindSegment(uint64_t sequence) const
+{
+	auto it = std::upper_bound(m_Segments.begin(), m_Segments.end(), sequence, [](uint64_t sequence, const Segment& segment)
+	{
+		return sequence < segment.FirstSequence;
+	});
+	return (size_t)(it - m_Segments.begin()) - 1;
+}
+
+std::shared_ptr<MessageHistoryStore::SegmentData> MessageHistoryStore::GetSegmentData(size_t segmentIndex)
+{
+	if (segmentIndex == m_Segments.size() - 1 && !m_Segments.back().Sealed)
+		return m_ActiveSegmentData;
+
+	for (auto it = m_SegmentCache.begin(); it != m_SegmentCache.end(); it++)
+	{
+		if (it->first == segmentIndex)
+		{
+			m_SegmentCache.splice(m_SegmentCache.begin(), m_SegmentCache, it);
+			return it->second;
+		}
+	}
+
+	// Cold segment
+	auto data = std::make_shared<SegmentData>();
+	if (!ReadSegmentFile(m_Segments[segmentIndex], *data))
+		std::cout << "[ERROR] Failed to read message history segment " << m_Segments[segmentIndex].Filename << std::endl;
+
+	m_SegmentCache.emplace_front(segmentIndex, data);
+	if (m_SegmentCache.size() > m_Specification.MaxCachedSegments)
+		m_SegmentCache.pop_back();
+
+	return data;
+}
+
+void MessageHistoryStore::SegmentData::Add(std::string_view username, std::string_view message, uint64_t timestamp)
+{
+	// One block for both, the username is usually short
+	char* text = (char*)Text.allocate(username.size() + message.size(), 1);
+	memcpy(text, username.data(), username.size());
+	memcpy(text + username.size(), message.data(), message.size());
+
+	Messages.emplace_back(std::string_view(text, username.size()), std::string_view(text + username.size(), message.size()));
+	Timestamps.push_back(timestamp);
+}
+
+bool MessageHistoryStore::ReadSegmentFile(const Segment& segment, SegmentData& data, uint64_t* completeSize) const
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::ReadSegmentFile");
+	std::vector<uint8_t> records;
+	if (!IsPersistent() || !ReadSegmentRecords(m_Specification.Directory / segment.Filename, records))
+		return false;
+
+	data.Messages.reserve(segment.MessageCount);
+	data.Timestamps.reserve(segment.MessageCount);
+
+	// A crash mid-append can leave a partial record at the end, everything before it is fine
+	size_t end = ForEachRecord(records.data(), records.size(), [&data](std::string_view username, std::string_view message, uint64_t timestamp)
+	{
+		data.Add(username, message, timestamp);
+	});
+
+	if (completeSize)
+		*completeSize = s_SegmentHeaderSize + end;
+
+	return true;
+}
+
+bool MessageHistoryStore::VerifySegment(uint32_t segmentIndex, std::string& error) const
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::VerifySegment");
+	const Segment& segment = m_Segments[segmentIndex];
+	if (segmentIndex > 0)
+	{
+		const Segment& previous = m_Segments[segmentIndex - 1];
+		if (segment.FirstSequence != previous.FirstSequence + previous.MessageCount)
+		{
+			error = "sequence range doesn't follow on from the previous segment";
+			return false;
+		}
+	}
+
+	if (!IsPersistent())
+		return true;
+
+	// The active segment's file is only created on the first flush
+	std::filesystem::path filepath = m_Specification.Directory / segment.Filename;
+	if (!segment.Sealed && segment.MessageCount == 0 && !std::filesystem::exists(filepath))
+		return true;
+
+	std::vector<uint8_t> records;
+	if (!ReadSegmentRecords(filepath, records, &error))
+		return false;
+
+	if (segment.Checksum && GetChecksum(records.data(), records.size()) != *segment.Checksum)
+	{
+		error = "checksum mismatch";
+		return false;
+	}
+
+	uint32_t messageCount = 0;
+	uint64_t size = 0;
+	size_t end = ForEachRecord(records.data(), records.size(), [&](std::string_view username, std::string_view message, uint64_t /*timestamp*/)
+	{
+		messageCount++;
+		size += GetRecordSize(ChatMessageView(username, message));
+	});
+
+	if (end != records.size())
+	{
+		error = "partial record at the end (" + std::to_string(records.size() - end) + " bytes)";
+		return false;
+	}
+	if (messageCount != segment.MessageCount)
+	{
+		error = "has " + std::to_string(messageCount) + " messages, the manifest says " + std::to_string(segment.MessageCount);
+		return false;
+	}
+	// Not in manifests from before it was recorded
+	if (segment.Size && size != segment.Size)
+	{
+		error = "records are " + std::to_string(size) + " bytes, the manifest says " + std::to_string(segment.Size);
+		return false;
+	}
+	return true;
+}
+
+bool MessageHistoryStore::CompressSegmentFile(const Segment& segment, const std::vector<uint8_t>& records) const
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::CompressSegmentFile");
+	std::vector<uint8_t> compressed = Compression::Compress(records.data(), records.size());
+	if (compressed.size() >= records.size())
+		return false; // Not worth it
+
+	std::vector<uint8_t> output;
+	output.reserve(s_SegmentHeaderSize + compressed.size());
+	AppendSegmentHeader(output, true, records.size());
+	output.insert(output.end(), compressed.begin(), compressed.end());
+
+	return WriteFileAtomic(m_Specification.Directory / segment.Filename, output.data(), output.size());
+}
+
+bool MessageHistoryStore::LoadManifest()
+{
+	std::filesystem::path filepath = m_Specification.Directory / s_ManifestFilename;
+	if (!std::filesystem::exists(filepath))
+		return false;
+
+	try
+	{
+		YAML::Node data = YAML::LoadFile(filepath.string());
+		auto rootNode = data["MessageHistory"];
+		if (!rootNode)
+			throw YAML::Exception(YAML::Mark::null_mark(), "no MessageHistory");
+
+		m_NextSegmentID = rootNode["NextSegmentID"].as<uint64_t>(1);
+		for (const auto& node : rootNode["Segments"])
+		{
+			Segment segment;
+			segment.Filename = node["File"].as<std::string>();
+			segment.FirstSequence = node["FirstSequence"].as<uint64_t>();
+			segment.MessageCount = node["MessageCount"].as<uint32_t>();
+			segment.FirstTimestamp = node["FirstTimestamp"].as<uint64_t>(0);
+			segment.LastTimestamp = node["LastTimestamp"].as<uint64_t>(0);
+			segment.Size = node["Size"].as<uint64_t>(0);
+			segment.Sealed = node["Sealed"].as<bool>(true);
+			segment.Compressed = node["Compressed"].as<bool>(false);
+			if (auto checksum = node["Checksum"])
+				segment.Checksum = checksum.as<uint32_t>();
+			m_Segments.push_back(segment);
+		}
+	}
+	catch (const YAML::Exception& e)
+	{
+		std::cout << "[ERROR] Failed to load message history manifest " << filepath << std::endl << e.what() << std::endl;
+		m_Segments.clear();
+		m_NextSegmentID = 1;
+		return false;
+	}
+
+	return true;
+}
+
+void MessageHistoryStore::RebuildManifest()
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::RebuildManifest");
+
+	std::vector<std::pair<uint64_t, std::string>> files;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(m_Specification.Directory, error))
+	{
+		std::string filename = entry.path().filename().string();
+		unsigned long long id;
+		if (filename.ends_with(".bin") && sscanf(filename.c_str(), "Segment-%llu.bin", &id) == 1)
+			files.emplace_back(id, filename);
+	}
+	if (files.empty())
+		return;
+
+	std::cout << "[WARN] Message history manifest is missing or damaged, rebuilding it from " << files.size() << " segment files" << std::endl;
+	std::sort(files.begin(), files.end());
+
+	for (const auto& [id, filename] : files)
+	{
+		// Never reuse a filename, even of a file that can't be read
+		m_NextSegmentID = std::max<uint64_t>(m_NextSegmentID, id + 1);
+
+		std::vector<uint8_t> records;
+		std::string readError;
+		bool compressed = false;
+		if (!ReadSegmentRecords(m_Specification.Directory / filename, records, &readError, &compressed))
+		{
+			std::cout << "[ERROR] Skipping message history segment " << filename << ": " << readError << std::endl;
+			continue;
+		}
+
+		Segment segment;
+		segment.Filename = filename;
+		segment.FirstSequence = GetEndSequence();
+		segment.Sealed = true;
+		segment.Compressed = compressed;
+		ForEachRecord(records.data(), records.size(), [&segment](std::string_view username, std::string_view message, uint64_t timestamp)
+		{
+			if (segment.MessageCount++ == 0)
+				segment.FirstTimestamp = timestamp;
+			segment.LastTimestamp = timestamp;
+			segment.Size += GetRecordSize(ChatMessageView(username, message));
+		});
+
+		if (segment.MessageCount)
+			m_Segments.push_back(segment);
+	}
+
+	// Picked up again as the active segment if it may still have been written to
+	if (!m_Segments.empty() && !m_Segments.back().Compressed)
+		m_Segments.back().Sealed = false;
+
+	m_ManifestDirty = true;
+}
+
+void MessageHistoryStore::SaveManifest()
+{
+	WC_TRACE_SCOPE("MessageHistoryStore::SaveManifest");
+	YAML::Emitter out;
+	{
+		out << YAML::BeginMap; // Root
+		out << YAML::Key << "MessageHistory" << YAML::Value;
+		out << YAML::BeginMap;
+		out << YAML::Key << "NextSegmentID" << YAML::Value << m_NextSegmentID;
+
+		out << YAML::Key << "Segments" << YAML::Value << YAML::BeginSeq;
+		for (const auto& segment : m_Segments)
+		{
+			out << YAML::BeginMap;
+			out << YAML::Key << "File" << YAML::Value << segment.Filename;
+			out << YAML::Key << "FirstSequence" << YAML::Value << segment.FirstSequence;
+			out << YAML::Key << "MessageCount" << YAML::Value << segment.MessageCount;
+			out << YAML::Key << "FirstTimestamp" << YAML::Value << segment.FirstTimestamp;
+			out << YAML::Key << "LastTimestamp" << YAML::Value << segment.LastTimestamp;
+			out << YAML::Key << "Size" << YAML::Value << segment.Size;
+			out << YAML::Key << "Sealed" << YAML::Value << segment.Sealed;
+			out << YAML::Key << "Compressed" << YAML::Value << segment.Compressed;
+			if (segment.Checksum)
+				out << YAML::Key << "Checksum" << YAML::Value << *segment.Checksum;
+			out << YAML::EndMap;
+		}
+		out << YAML::EndSeq;
+
+		out << YAML::EndMap;
+		out << YAML::EndMap; // Root
+	}
+
+	if (WriteFileAtomic(m_Specification.Directory / s_ManifestFilename, out.c_str(), out.size()))
+		m_ManifestDirty = false;
+	else
+		std::cout << "[ERROR] Failed to write message history manifest" << std::endl;
+}
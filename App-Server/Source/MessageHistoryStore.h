@@ -0,0 +1,155 @@
+#pragma once
+
+#include "UserInfo.h"
+
+#include <stdint.h>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct MessageHistoryStoreSpecification
+{
+	// Empty keeps everything in memory (one segment, nothing written)
+	std::filesystem::path Directory = "MessageHistory";
+
+	// The active segment is sealed and a new one started once it reaches any of these
+	uint32_t MaxSegmentMessages = 4096;
+	uint64_t MaxSegmentBytes = 1024 * 1024;
+	uint64_t MaxSegmentAgeSeconds = 24 * 60 * 60;
+
+	bool CompressSealedSegments = true;
+	// Sealed segments kept in memory after being read
+	uint32_t MaxCachedSegments = 4;
+	// Off for bulk writes (see App-Server-History), where rewriting the manifest every time
+	// adds up. It's still written on Flush()/Close(), a crash in between loses the segments
+	// sealed since.
+	bool SaveManifestOnSeal = true;
+	// For looking at a store without changing it (see App-Server-History): Open() fails if the
+	// manifest can't be loaded, and nothing is ever written. Append() can't be used.
+	bool ReadOnly = false;
+};
+
+//
+// MessageHistoryStore - chat history split into segment files, so retained history can grow
+// without bound while startup time and memory stay flat.
+//
+// <Directory>/Manifest.yaml lists every segment with its sequence and time range. New
+// messages go into the active segment, which lives in memory and is appended to its file on
+// Flush(). When the active segment gets too big or too old it's sealed (and compressed) and a
+// new one is started. Sealed segments are only read when something asks for messages in
+// them, and only the most recently used few stay in memory.
+//
+// Messages are numbered by sequence, starting at 0. Sequences are never reused.
+//
+class MessageHistoryStore
+{
+public:
+	// Return false to stop iterating
+	using MessageFunc = std::function<bool(uint64_t sequence, const ChatMessageView& message)>;
+	using TimestampedMessageFunc = std::function<bool(uint64_t sequence, const ChatMessageView& message, uint64_t timestamp)>;
+public:
+	bool Open(const MessageHistoryStoreSpecification& specification);
+	// Flushes first
+	void Close();
+
+	// The text is copied into the segment, message only has to be valid for the call
+	uint64_t Append(const ChatMessageView& message);
+	uint64_t Append(const ChatMessageView& message, uint64_t timestamp);
+
+	// Writes new messages to the active segment file, and the manifest if it changed
+	void Flush();
+	bool IsDirty() const;
+
+	uint64_t GetFirstSequence() const { return m_Segments.empty() ? 0 : m_Segments.front().FirstSequence; }
+	uint64_t GetEndSequence() const { return m_Segments.empty() ? 0 : m_Segments.back().FirstSequence + m_Segments.back().MessageCount; }
+	uint64_t GetMessageCount() const { return GetEndSequence() - GetFirstSequence(); }
+	uint32_t GetSegmentCount() const { return (uint32_t)m_Segments.size(); }
+	uint32_t GetCachedSegmentCount() const { return (uint32_t)m_SegmentCache.size(); }
+
+	// [begin, end) oldest first
+	void ForEachMessage(uint64_t begin, uint64_t end, const MessageFunc& func);
+	void ForEachTimestampedMessage(uint64_t begin, uint64_t end, const TimestampedMessageFunc& func);
+	// [begin, end) newest first
+	void ForEachMessageReverse(uint64_t begin, uint64_t end, const MessageFunc& func);
+
+	// Messages containing text, newest first
+	void Search(std::string_view text, uint32_t maxResults, const MessageFunc& func);
+
+	// Re-reads the segment's file and checks it against the manifest: header, every record
+	// readable, message count and size, checksum (sealed segments). Only reads, so different
+	// segments can be verified from several threads at once. On failure error says why.
+	bool VerifySegment(uint32_t segmentIndex, std::string& error) const;
+
+	// Unix time in milliseconds, what Append() stamps messages with
+	static uint64_t GetTimestamp();
+	// There's a store in directory (it has a manifest)
+	static bool Exists(const std::filesystem::path& directory);
+private:
+	struct Segment
+	{
+		std::string Filename;
+		uint64_t FirstSequence = 0;
+		uint32_t MessageCount = 0;
+		uint64_t FirstTimestamp = 0;
+		uint64_t LastTimestamp = 0;
+		// Uncompressed size of the records
+		uint64_t Size = 0;
+		bool Sealed = false;
+		bool Compressed = false;
+		// CRC-32 of the uncompressed records, set on sealing (not in manifests from before)
+		std::optional<uint32_t> Checksum;
+	};
+
+	struct SegmentData
+	{
+		// Usernames and message text, in blocks that never move (Messages points into them)
+		// and are all freed with the segment
+		std::pmr::monotonic_buffer_resource Text{ 64 * 1024 };
+		std::vector<ChatMessageView> Messages;
+		std::vector<uint64_t> Timestamps;
+
+		void Add(std::string_view username, std::string_view message, uint64_t timestamp);
+	};
+
+	bool IsPersistent() const { return !m_Specification.Directory.empty(); }
+
+	// Writes new messages to the active segment file
+	void FlushActiveSegment();
+	void StartSegment();
+	void SealActiveSegment();
+	bool ShouldSealActiveSegment(uint64_t timestamp) const;
+
+	// Index of the segment containing sequence (which must be in range)
+	size_t FindSegment(uint64_t sequence) const;
+	std::shared_ptr<SegmentData> GetSegmentData(size_t segmentIndex);
+	// completeSize (if given) is how much of the file there is up to the end of the last
+	// complete record, only meaningful for uncompressed (active) segments
+	bool ReadSegmentFile(const Segment& segment, SegmentData& data, uint64_t* completeSize = nullptr) const;
+	bool CompressSegmentFile(const Segment& segment, const std::vector<uint8_t>& records) const;
+
+	// False if it's missing or damaged
+	bool LoadManifest();
+	// From the segment files in the directory (sequences start over at 0)
+	void RebuildManifest();
+	void SaveManifest();
+private:
+	MessageHistoryStoreSpecification m_Specification;
+	bool m_Open = false;
+
+	// Oldest first, the last one is the active segment
+	std::vector<Segment> m_Segments;
+	std::shared_ptr<SegmentData> m_ActiveSegmentData;
+	// Active segment messages that are already in its file
+	uint32_t m_ActiveSegmentFlushedCount = 0;
+	uint64_t m_NextSegmentID = 1;
+	bool m_ManifestDirty = false;
+
+	// Sealed segments by index, most recently used first
+	std::list<std::pair<size_t, std::shared_ptr<SegmentData>>> m_SegmentCache;
+};
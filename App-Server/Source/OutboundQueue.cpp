@@ -0,0 +1,87 @@
+#include "OutboundQueue.h"
+
+void OutboundQueue::Push(const SharedBuffer& packet, DeliveryClass deliveryClass)
+{
+	switch (deliveryClass)
+	{
+		case DeliveryClass::Control:
+		case DeliveryClass::Presence: // Backed up clients get theirs per user, see ServerLayer::SendPresenceBacklog()
+			m_PriorityPackets.push_back(packet);
+			break;
+		case DeliveryClass::Interactive:
+			if (m_HoldingInteractive)
+				m_HeldPackets.push_back(packet);
+			else
+				m_PriorityPackets.push_back(packet);
+			break;
+		case DeliveryClass::Bulk:
+			m_BulkPackets.push_back(packet);
+			break;
+		case DeliveryClass::Transfer:
+			m_TransferPackets.push_back(packet);
+			break;
+	}
+
+	m_Size += packet->size();
+	m_Count++;
+	m_PeakSize = std::max(m_PeakSize, m_Size);
+}
+
+uint64_t OutboundQueue::Drain(uint64_t byteBudget, const SendFunc& send)
+{
+	uint64_t bytesSent = 0;
+	auto trySend = [&](const SharedBuffer& packet)
+	{
+		if (bytesSent > 0 && bytesSent + packet->size() > byteBudget)
+			return false;
+
+		send(packet);
+		bytesSent += packet->size();
+		m_Size -= packet->size();
+		m_Count--;
+		return true;
+	};
+
+	while (!m_PriorityPackets.empty() && trySend(m_PriorityPackets.front()))
+		m_PriorityPackets.pop_front();
+
+	while (!m_TransferPackets.empty() && trySend(m_TransferPackets.front()))
+		m_TransferPackets.pop_front();
+
+	while (!m_BulkPackets.empty() && trySend(m_BulkPackets.front()))
+		m_BulkPackets.pop_front();
+
+	return bytesSent;
+}
+
+uint64_t OutboundQueue::DropBulk()
+{
+	uint64_t bytesDropped = 0;
+	for (const auto& packet : m_BulkPackets)
+		bytesDropped += packet->size();
+
+	m_Size -= bytesDropped;
+	m_Count -= (uint32_t)m_BulkPackets.size();
+	m_DroppedCount += m_BulkPackets.size();
+	m_BulkPackets.clear();
+	return bytesDropped;
+}
+
+void OutboundQueue::ReleaseInteractive()
+{
+	m_HoldingInteractive = false;
+	m_PriorityPackets.insert(m_PriorityPackets.end(), m_HeldPackets.begin(), m_HeldPackets.end());
+	m_HeldPackets.clear();
+}
+
+void OutboundQueue::Clear()
+{
+	m_DroppedCount += m_Count;
+	m_PriorityPackets.clear();
+	m_TransferPackets.clear();
+	m_BulkPackets.clear();
+	m_HeldPackets.clear();
+	m_HoldingInteractive = false;
+	m_Size = 0;
+	m_Count = 0;
+}
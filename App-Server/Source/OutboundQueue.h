@@ -0,0 +1,61 @@
+#pragma once
+
+#include "ServerPacket.h"
+#include "SharedBuffer.h"
+
+#include <deque>
+#include <algorithm>
+#include <functional>
+
+//
+// OutboundQueue - per-client packets that couldn't be sent yet because the transport already
+// has a full send window queued for the client (see ServerLayer::FlushOutboundQueue).
+// 
+// Control/Interactive packets always go out ahead of Transfer and Bulk ones. Presence isn't
+// queued here, it's only sent as changes so it's kept per user instead (ClientSession::PresenceBacklog).
+//
+// Interactive packets (live chat) can be held back, eg. while a joining client is still being
+// sent the history from before it. They count towards the queue's size but aren't sent (and
+// the queue is empty as far as sending goes) until they're released.
+//
+class OutboundQueue
+{
+public:
+	using SendFunc = std::function<void(const SharedBuffer& packet)>;
+public:
+	void Push(const SharedBuffer& packet, DeliveryClass deliveryClass);
+
+	// Sends packets in priority order until byteBudget is used up (a packet is only sent
+	// if it fits, unless nothing has been sent yet). Returns bytes sent.
+	uint64_t Drain(uint64_t byteBudget, const SendFunc& send);
+
+	// Drops queued Bulk packets (never Transfer ones), returns bytes dropped
+	uint64_t DropBulk();
+	void Clear();
+
+	void HoldInteractive() { m_HoldingInteractive = true; }
+	// Held packets go out after the Control/Interactive ones already queued
+	void ReleaseInteractive();
+	bool IsHeld(DeliveryClass deliveryClass) const { return m_HoldingInteractive && deliveryClass == DeliveryClass::Interactive; }
+
+	// Nothing that can be sent (held packets don't count)
+	bool IsEmpty() const { return m_Count == m_HeldPackets.size(); }
+	uint64_t GetSize() const { return m_Size; }
+	uint32_t GetCount() const { return m_Count; }
+
+	// Stats
+	uint64_t GetPeakSize() const { return m_PeakSize; }
+	uint64_t GetDroppedCount() const { return m_DroppedCount; }
+private:
+	std::deque<SharedBuffer> m_PriorityPackets;
+	std::deque<SharedBuffer> m_TransferPackets;
+	std::deque<SharedBuffer> m_BulkPackets;
+	std::deque<SharedBuffer> m_HeldPackets;
+	bool m_HoldingInteractive = false;
+
+	uint64_t m_Size = 0;
+	uint32_t m_Count = 0;
+
+	uint64_t m_PeakSize = 0;
+	uint64_t m_DroppedCount = 0;
+};
@@ -0,0 +1,87 @@
+#include "PacketCapture.h"
+
+#include <cstring>
+
+static const char s_CaptureMagic[4] = { 'W', 'C', 'A', 'P' };
+static const uint16_t s_CaptureVersion = 1;
+
+template<typename T>
+static void WriteRaw(std::ofstream& stream, const T& value)
+{
+	stream.write((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+static bool ReadRaw(std::ifstream& stream, T& value)
+{
+	return (bool)stream.read((char*)&value, sizeof(T));
+}
+
+PacketCaptureWriter::~PacketCaptureWriter()
+{
+	Close();
+}
+
+bool PacketCaptureWriter::Open(const std::filesystem::path& filepath)
+{
+	Close();
+
+	m_Stream.open(filepath, std::ios::binary | std::ios::trunc);
+	if (!m_Stream)
+		return false;
+
+	m_Stream.write(s_CaptureMagic, sizeof(s_CaptureMagic));
+	WriteRaw<uint16_t>(m_Stream, s_CaptureVersion);
+	WriteRaw<uint16_t>(m_Stream, 0);
+
+	m_Filepath = filepath;
+	m_StartTime = std::chrono::steady_clock::now();
+	m_RecordCount = 0;
+	return true;
+}
+
+void PacketCaptureWriter::Close()
+{
+	if (m_Stream.is_open())
+		m_Stream.close();
+}
+
+void PacketCaptureWriter::Write(CaptureEventType type, uint32_t clientID, Walnut::Buffer data)
+{
+	if (!m_Stream.is_open())
+		return;
+
+	uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_StartTime).count();
+	WriteRaw<uint64_t>(m_Stream, timestamp);
+	WriteRaw<CaptureEventType>(m_Stream, type);
+	WriteRaw<uint32_t>(m_Stream, clientID);
+	WriteRaw<uint32_t>(m_Stream, (uint32_t)data.Size);
+	if (data.Size)
+		m_Stream.write((const char*)data.Data, data.Size);
+
+	m_RecordCount++;
+}
+
+bool PacketCaptureReader::Open(const std::filesystem::path& filepath)
+{
+	m_Stream.open(filepath, std::ios::binary);
+	if (!m_Stream)
+		return false;
+
+	char magic[4];
+	uint16_t version, reserved;
+	if (!m_Stream.read(magic, sizeof(magic)) || memcmp(magic, s_CaptureMagic, sizeof(magic)) != 0)
+		return false;
+
+	return ReadRaw(m_Stream, version) && ReadRaw(m_Stream, reserved) && version == s_CaptureVersion;
+}
+
+bool PacketCaptureReader::ReadNext(CaptureRecord& record)
+{
+	uint32_t dataSize;
+	if (!ReadRaw(m_Stream, record.Timestamp) || !ReadRaw(m_Stream, record.Type) || !ReadRaw(m_Stream, record.ClientID) || !ReadRaw(m_Stream, dataSize))
+		return false;
+
+	record.Data.resize(dataSize);
+	return dataSize == 0 || (bool)m_Stream.read((char*)record.Data.data(), dataSize);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Walnut/Core/Buffer.h"
+
+#include <stdint.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+//
+// Binary capture of everything clients sent to the server, for replaying real traffic later
+// 
+// File layout (little-endian):
+//   Header: "WCAP" | uint16 version | uint16 reserved
+//   Record: uint64 timestamp (ns since capture start) | uint8 CaptureEventType | uint32 client ID
+//           | uint32 data size | data
+// ClientConnected records carry the connection description as data, DataReceived records
+// carry the raw packet bytes exactly as received.
+//
+
+enum class CaptureEventType : uint8_t
+{
+	ClientConnected = 1, ClientDisconnected = 2, DataReceived = 3
+};
+
+struct CaptureRecord
+{
+	uint64_t Timestamp = 0;
+	CaptureEventType Type = CaptureEventType::DataReceived;
+	uint32_t ClientID = 0;
+	std::vector<uint8_t> Data;
+
+	Walnut::Buffer GetData() const { return Walnut::Buffer(Data.data(), Data.size()); }
+};
+
+class PacketCaptureWriter
+{
+public:
+	~PacketCaptureWriter();
+
+	bool Open(const std::filesystem::path& filepath);
+	void Close();
+	bool IsOpen() const { return m_Stream.is_open(); }
+
+	void Write(CaptureEventType type, uint32_t clientID, Walnut::Buffer data = {});
+
+	uint64_t GetRecordCount() const { return m_RecordCount; }
+	const std::filesystem::path& GetFilepath() const { return m_Filepath; }
+private:
+	std::ofstream m_Stream;
+	std::filesystem::path m_Filepath;
+	std::chrono::steady_clock::time_point m_StartTime;
+	uint64_t m_RecordCount = 0;
+};
+
+class PacketCaptureReader
+{
+public:
+	bool Open(const std::filesystem::path& filepath);
+	bool ReadNext(CaptureRecord& record);
+private:
+	std::ifstream m_Stream;
+};
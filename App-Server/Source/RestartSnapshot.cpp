@@ -0,0 +1,99 @@
+#include "RestartSnapshot.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+static const char s_SnapshotMagic[4] = { 'W', 'C', 'R', 'S' };
+static const uint16_t s_SnapshotVersion = 1;
+
+template<typename T>
+static void WriteRaw(std::ofstream& stream, const T& value)
+{
+	stream.write((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+static bool ReadRaw(std::ifstream& stream, T& value)
+{
+	return (bool)stream.read((char*)&value, sizeof(T));
+}
+
+bool RestartSnapshot::WriteToFile(const std::filesystem::path& filepath) const
+{
+	// Written next to it and renamed, so a half-written snapshot is never picked up
+	std::filesystem::path tempFilepath = filepath;
+	tempFilepath += ".tmp";
+	{
+		std::ofstream stream(tempFilepath, std::ios::binary | std::ios::trunc);
+		if (!stream)
+			return false;
+
+		stream.write(s_SnapshotMagic, sizeof(s_SnapshotMagic));
+		WriteRaw<uint16_t>(stream, s_SnapshotVersion);
+		WriteRaw<uint16_t>(stream, 0);
+		WriteRaw<uint64_t>(stream, CreationTime);
+		WriteRaw<uint64_t>(stream, HistoryEndSequence);
+		WriteRaw<uint32_t>(stream, (uint32_t)Sessions.size());
+		for (const auto& session : Sessions)
+		{
+			WriteRaw<uint64_t>(stream, session.ResumeToken);
+			WriteRaw<uint32_t>(stream, session.Color);
+			WriteRaw<uint8_t>(stream, session.Presence);
+			WriteRaw<uint16_t>(stream, (uint16_t)session.Username.size());
+			stream.write(session.Username.data(), session.Username.size());
+		}
+
+		if (!stream.flush())
+			return false;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempFilepath, filepath, error);
+	return !error;
+}
+
+bool RestartSnapshot::ReadFromFile(const std::filesystem::path& filepath)
+{
+	std::ifstream stream(filepath, std::ios::binary);
+	if (!stream)
+		return false;
+
+	char magic[4];
+	uint16_t version, reserved;
+	if (!stream.read(magic, sizeof(magic)) || memcmp(magic, s_SnapshotMagic, sizeof(magic)) != 0)
+		return false;
+	if (!ReadRaw(stream, version) || !ReadRaw(stream, reserved) || version != s_SnapshotVersion)
+		return false;
+
+	uint32_t sessionCount;
+	if (!ReadRaw(stream, CreationTime) || !ReadRaw(stream, HistoryEndSequence) || !ReadRaw(stream, sessionCount))
+		return false;
+
+	Sessions.clear();
+	Sessions.reserve(sessionCount);
+	for (uint32_t i = 0; i < sessionCount; i++)
+	{
+		RestartSession& session = Sessions.emplace_back();
+		uint16_t usernameSize;
+		if (!ReadRaw(stream, session.ResumeToken) || !ReadRaw(stream, session.Color) || !ReadRaw(stream, session.Presence) || !ReadRaw(stream, usernameSize))
+			return false;
+
+		session.Username.resize(usernameSize);
+		if (!stream.read(session.Username.data(), usernameSize))
+			return false;
+	}
+
+	return true;
+}
+
+uint64_t RestartSnapshot::GetAge() const
+{
+	uint64_t currentTime = GetUnixTime();
+	return currentTime > CreationTime ? currentTime - CreationTime : 0;
+}
+
+uint64_t RestartSnapshot::GetUnixTime()
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+//
+// Live state handed from a server restarting with /restart to the process replacing it, so
+// clients can resume their sessions (see PacketType::ServerRestart) instead of joining again.
+// Message history isn't in here, it's flushed to the store before this is written.
+//
+// File layout (little-endian):
+//   Header:  "WCRS" | uint16 version | uint16 reserved | uint64 creation time (seconds since
+//            epoch) | uint64 history end sequence | uint32 session count
+//   Session: uint64 resume token | uint32 color | uint8 presence | uint16 username size | username
+//
+
+struct RestartSession
+{
+	uint64_t ResumeToken = 0;
+	std::string Username;
+	uint32_t Color = 0;
+	uint8_t Presence = 0;
+};
+
+struct RestartSnapshot
+{
+	uint64_t CreationTime = 0;
+	// Every client in Sessions had been sent all messages before this
+	uint64_t HistoryEndSequence = 0;
+	std::vector<RestartSession> Sessions;
+
+	bool WriteToFile(const std::filesystem::path& filepath) const;
+	bool ReadFromFile(const std::filesystem::path& filepath);
+
+	// Seconds since CreationTime
+	uint64_t GetAge() const;
+	static uint64_t GetUnixTime();
+};
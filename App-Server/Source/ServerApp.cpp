@@ -3,15 +3,34 @@
 
 #include "ServerLayer.h"
 
+#include <cstdlib>
 #include <iostream>
+#include <string_view>
 
 Walnut::Application* Walnut::CreateApplication(int argc, char** argv)
 {
 	Walnut::ApplicationSpecification spec;
 	spec.Name = "Walnut Chat Server 1.0";
 
+	ServerLayerSpecification serverSpec;
+	for (int i = 1; i < argc; i++)
+	{
+		// --capture <file> records inbound traffic for App-Server-Replay
+		if (std::string_view(argv[i]) == "--capture" && i + 1 < argc)
+			serverSpec.CaptureFilePath = argv[++i];
+		// --max-joins <n> clients admitted at once during join storms (0 = no limit)
+		else if (std::string_view(argv[i]) == "--max-joins" && i + 1 < argc)
+			serverSpec.MaxConcurrentJoins = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		// --filter <file> content filter terms (see ContentFilter.h)
+		else if (std::string_view(argv[i]) == "--filter" && i + 1 < argc)
+			serverSpec.ContentFilterFilePath = argv[++i];
+		// --fanout-threads <n> worker threads for broadcasts to large audiences (0 = main thread only)
+		else if (std::string_view(argv[i]) == "--fanout-threads" && i + 1 < argc)
+			serverSpec.FanOutThreads = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+	}
+
 	Walnut::Application* app = new Walnut::Application(spec);
-	app->PushLayer<ServerLayer>();
+	app->PushLayer(std::make_shared<ServerLayer>(serverSpec));
 #ifndef WL_HEADLESS
 	app->SetMenubarCallback([app]()
 	{
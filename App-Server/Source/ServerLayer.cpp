@@ -1,328 +1,2353 @@
 #include "ServerLayer.h"
 
 #include "ServerPacket.h"
+#include "WireFormat.h"
+#include "WalnutServerTransport.h"
+#include "VectorStreamWriter.h"
+#include "Trace.h"
 
+#include "Walnut/Application.h"
 #include "Walnut/Core/Assert.h"
 #include "Walnut/Serialization/BufferStream.h"
 
-#include "Walnut/Utils/StringUtils.h"
-
 #include <yaml-cpp/yaml.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <random>
+
+ServerLayer::ServerLayer(const ServerLayerSpecification& specification, std::unique_ptr<ServerTransport> transport)
+	: m_Specification(specification), m_Server(std::move(transport))
+{
+}
 
 void ServerLayer::OnAttach()
 {
-	const int Port = 8192;
+	Trace::SetThreadName("Main");
+
+	const int Port = m_Specification.Port;
+
+	for (auto& scratchBuffers : m_ScratchBuffers)
+	{
+		for (auto& scratchBuffer : scratchBuffers)
+			scratchBuffer.Allocate(8192); // 8KB for now? probably too small for things like the client list/chat history
+	}
 
-	m_ScratchBuffer.Allocate(8192); // 8KB for now? probably too small for things like the client list/chat history
+	// Server callbacks (can) come in on the networking thread, so hand them over to the event loop
+	if (!m_Server)
+		m_Server = std::make_unique<WalnutServerTransport>(Port);
+	m_SendWindow = m_Server->HasSendQueueStatus() ? m_TransportSendWindow : m_Specification.SendBytesPerInterval;
 
-	m_Server = std::make_unique<Walnut::Server>(Port);
-	m_Server->SetClientConnectedCallback([this](const Walnut::ClientInfo& clientInfo) { OnClientConnected(clientInfo); });
-	m_Server->SetClientDisconnectedCallback([this](const Walnut::ClientInfo& clientInfo) { OnClientDisconnected(clientInfo); });
-	m_Server->SetDataReceivedCallback([this](const Walnut::ClientInfo& clientInfo, const Walnut::Buffer data) { OnDataReceived(clientInfo, data); });
+	m_Server->SetClientConnectedCallback([this](const Walnut::ClientInfo& clientInfo)
+	{
+		m_EventLoop.Post([this, clientInfo]() { OnClientConnected(clientInfo); });
+	});
+	m_Server->SetClientDisconnectedCallback([this](const Walnut::ClientInfo& clientInfo)
+	{
+		m_EventLoop.Post([this, clientInfo]() { OnClientDisconnected(clientInfo); });
+	});
+	m_Server->SetDataReceivedCallback([this](const Walnut::ClientInfo& clientInfo, const Walnut::Buffer data)
+	{
+		// Data is only valid for the duration of this callback. The task only captures two
+		// pointers, which std::function stores without allocating.
+		ReceivedPacket* packet = AcquireReceivedPacket();
+		packet->Client = clientInfo;
+		packet->Data.assign(data.As<uint8_t>(), data.As<uint8_t>() + data.Size);
+		packet->ReceiveTime = EventLoop::Clock::now();
+		m_EventLoop.Post([this, packet]()
+		{
+			OnDataReceived(packet->Client, Walnut::Buffer(packet->Data.data(), packet->Data.size()), packet->ReceiveTime);
+			ReleaseReceivedPacket(packet);
+		});
+	});
 	m_Server->Start();
 
-	m_MessageHistoryFilePath = "MessageHistory.yaml";
+	// Big broadcasts go out from several threads, if the transport can take that
+	if (m_Server->SupportsConcurrentSends() && m_Specification.FanOutThreads > 0)
+		m_FanOutPool = std::make_unique<FanOutPool>(m_Specification.FanOutThreads);
+
+	m_DirectMessageHistoryFilePath = m_Specification.DirectMessageHistoryFilePath;
+
+#ifdef WL_HEADLESS
+	m_Console.SetOutputEnabled(m_Specification.ConsoleOutput);
+#endif
 
 	m_Console.AddTaggedMessage("Info", "Loading message history...");
-	LoadMessageHistoryFromFile(m_MessageHistoryFilePath);
-	for (const auto& message : m_MessageHistory)
+	m_MessageHistory.Open(m_Specification.MessageHistory);
+	if (m_MessageHistory.GetMessageCount() == 0 && !m_Specification.LegacyMessageHistoryFilePath.empty())
+		ImportLegacyMessageHistory(m_Specification.LegacyMessageHistoryFilePath);
+	LoadDirectMessageHistoryFromFile(m_DirectMessageHistoryFilePath);
+
+	auto contentFilter = std::make_shared<ContentFilter>();
+	if (!m_Specification.ContentFilterFilePath.empty() && contentFilter->LoadFromFile(m_Specification.ContentFilterFilePath))
+		m_Console.AddTaggedMessage("Info", "Loaded content filter ({} terms)", contentFilter->GetTermCount());
+	m_ContentFilter = contentFilter;
+
+	LoadRestartSnapshot();
+
+	if (!m_Specification.FileTransferDirectory.empty())
+	{
+		std::error_code error;
+		std::filesystem::create_directories(m_Specification.FileTransferDirectory, error);
+
+		// Left behind by a crash, unfinished uploads never outlive the process
+		for (const auto& entry : std::filesystem::directory_iterator(m_Specification.FileTransferDirectory, error))
+		{
+			if (entry.path().extension() == ".part")
+				std::filesystem::remove(entry.path(), error);
+		}
+	}
+
+	// Just the part clients get on join, the rest stays on disk until asked for
+	uint64_t historyEnd = m_MessageHistory.GetEndSequence();
+	uint64_t joinHistoryBegin = historyEnd - std::min<uint64_t>(historyEnd, m_Specification.JoinHistoryMessages);
+	m_EncodedMessageHistory.Reset(joinHistoryBegin, std::min(m_Specification.JoinHistoryMessages, m_MaxEncodedHistoryMessages));
+	m_MessageHistory.ForEachMessage(joinHistoryBegin, historyEnd, [this](uint64_t /*sequence*/, const ChatMessageView& message)
+	{
+		m_Console.AddTaggedMessage(message.Username, "{}", message.Message);
+		m_EncodedMessageHistory.Append(message);
+		return true;
+	});
+
+	m_Console.AddTaggedMessage("Info", "Started server on port {}", Port);
+
+	if (!m_Specification.CaptureFilePath.empty())
+		StartCapture(m_Specification.CaptureFilePath);
+
+#ifdef WL_HEADLESS
+	// Console input arrives on the console's input thread
+	if (m_Specification.ConsoleInput)
+	{
+		m_Console.SetMessageSendCallback([this](std::string_view message)
+		{
+			m_EventLoop.Post([this, message = std::string(message)]() { SendChatMessage(message); });
+		});
+	}
+#else
+	m_Console.SetMessageSendCallback([this](std::string_view message) { SendChatMessage(message); });
+#endif
+
+	m_EventLoop.AddTimer(m_ClientListInterval, [this]() { OnClientListTimer(); });
+	m_EventLoop.AddTimer(m_HistorySaveInterval, [this]() { SaveHistoryIfDirty(); });
+	m_EventLoop.AddTimer(m_FileUploadCleanupInterval, [this]() { CleanUpFileUploads(); });
+	m_EventLoop.AddTimer(m_PingInterval, [this]() { SendPings(); });
+	m_EventLoop.AddTimer(m_IdleCheckInterval, [this]() { CheckIdleTimeouts(); });
+#ifndef WL_HEADLESS
+	// The Client Info window draws from this, never from the sessions themselves
+	PublishClientInfoSnapshot();
+	m_EventLoop.AddTimer(m_ClientInfoSnapshotInterval, [this]() { PublishClientInfoSnapshot(); });
+#endif
+}
+
+void ServerLayer::OnDetach()
+{
+	m_Server->Stop();
+	// wait for server to stop here?
+
+	if (m_ContentFilterThread.joinable())
+		m_ContentFilterThread.join();
+
+	// Handle anything that came in while stopping and make sure history is on disk
+	m_EventLoop.RunOnce(EventLoop::Clock::duration::zero());
+	SaveHistoryIfDirty();
+	m_MessageHistory.Close();
+	StopCapture();
+
+	// Can't be resumed by the next process
+	for (auto& [uploadID, upload] : m_FileUploads)
+	{
+		upload.Stream.close();
+		std::error_code error;
+		std::filesystem::remove(upload.Filepath, error);
+	}
+	m_FileUploads.clear();
+	m_FileUploadIDs.clear();
+
+	m_FanOutPool.reset();
+
+	for (auto& scratchBuffers : m_ScratchBuffers)
+	{
+		for (auto& scratchBuffer : scratchBuffers)
+			scratchBuffer.Release();
+	}
+}
+
+void ServerLayer::OnUpdate(float ts)
+{
+#ifdef WL_HEADLESS
+	// Nothing to draw, so sleep until a network event, console input or timer wakes us up
+	m_EventLoop.RunOnce();
+#else
+	// Don't block the UI, just handle whatever is ready this frame
+	m_EventLoop.RunOnce(EventLoop::Clock::duration::zero());
+#endif
+}
+
+void ServerLayer::OnClientListTimer()
+{
+	if (!m_ConnectedClients.empty())
+		SendClientListToAllClients();
+}
+
+void ServerLayer::SaveHistoryIfDirty()
+{
+	WC_TRACE_SCOPE("ServerLayer::SaveHistoryIfDirty");
+	if (m_MessageHistory.IsDirty())
+		m_MessageHistory.Flush();
+	if (m_DirectMessageHistoryDirty && !m_DirectMessageHistoryFilePath.empty())
+		SaveDirectMessageHistoryToFile(m_DirectMessageHistoryFilePath);
+}
+
+void ServerLayer::ReplayEvent(const CaptureRecord& record)
+{
+	Walnut::ClientInfo clientInfo = { record.ClientID, "" };
+	switch (record.Type)
+	{
+		case CaptureEventType::ClientConnected:
+			clientInfo.ConnectionDesc.assign((const char*)record.Data.data(), record.Data.size());
+			OnClientConnected(clientInfo);
+			break;
+		case CaptureEventType::ClientDisconnected:
+			OnClientDisconnected(clientInfo);
+			break;
+		case CaptureEventType::DataReceived:
+			OnDataReceived(clientInfo, record.GetData(), EventLoop::Clock::now());
+			break;
+	}
+}
+
+bool ServerLayer::StartCapture(const std::filesystem::path& filepath)
+{
+	if (!m_Capture.Open(filepath))
+	{
+		m_Console.AddItalicMessage("Could not open capture file {}", filepath.string());
+		return false;
+	}
+
+	// A replay starts from an empty server, so clients that are already connected get a
+	// synthesized connect + handshake, otherwise everything they send would be rejected
+	for (const auto& [clientID, session] : m_ConnectedClients)
+	{
+		Packets::ToServer::ClientConnectionRequest packet;
+		packet.Color = session.User.Color;
+		packet.Username = session.User.Username;
+		packet.Protocol = { session.ProtocolVersion, session.Capabilities };
+		Walnut::Buffer request = EncodePacket(packet, WireEncoding::Legacy);
+		m_Capture.Write(CaptureEventType::ClientConnected, clientID);
+		m_Capture.Write(CaptureEventType::DataReceived, clientID, request);
+	}
+
+	m_Console.AddItalicMessage("Capturing inbound traffic to {}", filepath.string());
+	return true;
+}
+
+void ServerLayer::StopCapture()
+{
+	if (!m_Capture.IsOpen())
+		return;
+
+	m_Capture.Close();
+	m_Console.AddItalicMessage("Capture stopped, {} events written to {}", m_Capture.GetRecordCount(), m_Capture.GetFilepath().string());
+}
+
+void ServerLayer::OnUIRender()
+{
+#ifndef WL_HEADLESS
+	UI_ClientInfo();
+
+	m_Console.OnUIRender();
+
+	// ImGui::ShowDemoWindow();
+#endif
+}
+
+#ifndef WL_HEADLESS
+namespace ClientInfoColumn {
+	enum : uint32_t
+	{
+		Username = 0, ID, RoundTripTime, QueuedPackets, QueuedBytes, PeakQueuedBytes, BytesSent, BytesReceived, Count
+	};
+}
+
+void ServerLayer::UI_ClientInfo()
+{
+	ImGui::Begin("Client Info");
+
+	std::shared_ptr<const ClientInfoSnapshot> snapshot = m_ClientInfoSnapshot.load();
+	if (!snapshot)
+	{
+		ImGui::End();
+		return;
+	}
+
+	ImGui::Text("Connected clients: %d", (int)snapshot->Clients.size());
+	if (snapshot->RoundTripTimeP50)
+	{
+		ImGui::TextDisabled("Round trip p50 %.1f ms, p99 %.1f ms - message residence p50 %.2f ms, p99 %.2f ms", snapshot->RoundTripTimeP50 / 1000.0f,
+			snapshot->RoundTripTimeP99 / 1000.0f, snapshot->MessageResidenceTimeP50 / 1000.0f, snapshot->MessageResidenceTimeP99 / 1000.0f);
+	}
+
+	ImGui::SetNextItemWidth(250.0f);
+	if (ImGui::InputTextWithHint("##Filter", "Search usernames", m_ClientInfoFilter, sizeof(m_ClientInfoFilter)))
+		m_ClientInfoRowsDirty = true;
+
+	ImGuiTableFlags tableFlags = ImGuiTableFlags_Sortable | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY | ImGuiTableFlags_Resizable
+		| ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV | ImGuiTableFlags_SizingFixedFit;
+	if (ImGui::BeginTable("Clients", ClientInfoColumn::Count, tableFlags))
+	{
+		ImGui::TableSetupScrollFreeze(0, 1);
+		ImGui::TableSetupColumn("Username", ImGuiTableColumnFlags_DefaultSort | ImGuiTableColumnFlags_WidthStretch, 0.0f, ClientInfoColumn::Username);
+		ImGui::TableSetupColumn("ID", 0, 0.0f, ClientInfoColumn::ID);
+		ImGui::TableSetupColumn("RTT (ms)", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, ClientInfoColumn::RoundTripTime);
+		ImGui::TableSetupColumn("Queued", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, ClientInfoColumn::QueuedPackets);
+		ImGui::TableSetupColumn("Queued KB", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, ClientInfoColumn::QueuedBytes);
+		ImGui::TableSetupColumn("Peak KB", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, ClientInfoColumn::PeakQueuedBytes);
+		ImGui::TableSetupColumn("Sent KB", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, ClientInfoColumn::BytesSent);
+		ImGui::TableSetupColumn("Received KB", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, ClientInfoColumn::BytesReceived);
+		ImGui::TableHeadersRow();
+
+		if (ImGuiTableSortSpecs* sortSpecs = ImGui::TableGetSortSpecs(); sortSpecs && sortSpecs->SpecsDirty)
+		{
+			if (sortSpecs->SpecsCount > 0)
+			{
+				m_ClientInfoSortColumn = sortSpecs->Specs[0].ColumnUserID;
+				m_ClientInfoSortAscending = sortSpecs->Specs[0].SortDirection == ImGuiSortDirection_Ascending;
+			}
+			sortSpecs->SpecsDirty = false;
+			m_ClientInfoRowsDirty = true;
+		}
+
+		if (m_ClientInfoRowsDirty || snapshot != m_ClientInfoRowsSnapshot)
+		{
+			UpdateClientInfoRows(*snapshot);
+			m_ClientInfoRowsSnapshot = snapshot;
+			m_ClientInfoRowsDirty = false;
+		}
+
+		// Only the rows that are actually visible get drawn
+		ImGuiListClipper clipper;
+		clipper.Begin((int)m_ClientInfoRows.size());
+		while (clipper.Step())
+		{
+			for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++)
+			{
+				const ClientInfoSnapshotEntry& client = snapshot->Clients[m_ClientInfoRows[row]];
+				ImGui::PushID((int)client.ID);
+				ImGui::TableNextRow();
+
+				ImGui::TableNextColumn();
+				ImGui::PushStyleColor(ImGuiCol_Text, ImColor(client.Color | 0xff000000).Value);
+				if (ImGui::Selectable(client.Username.c_str(), client.ID == m_SelectedClientID, ImGuiSelectableFlags_SpanAllColumns))
+					m_SelectedClientID = client.ID;
+				ImGui::PopStyleColor();
+				if (ImGui::IsItemHovered())
+					ImGui::SetTooltip("%s", client.ConnectionDesc.c_str());
+
+				ImGui::TableNextColumn();
+				ImGui::Text("%u", client.ID);
+				ImGui::TableNextColumn();
+				if (client.RoundTripTime)
+					ImGui::Text("%.1f", client.RoundTripTime / 1000.0f);
+				else
+					ImGui::TextDisabled("-");
+				ImGui::TableNextColumn();
+				ImGui::Text("%u", client.QueuedPackets);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.1f", client.QueuedBytes / 1024.0f);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.1f", client.PeakQueuedBytes / 1024.0f);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.1f", client.BytesSent / 1024.0f);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.1f", client.BytesReceived / 1024.0f);
+
+				ImGui::PopID();
+			}
+		}
+		clipper.End();
+
+		ImGui::EndTable();
+	}
+
+	ImGui::End();
+}
+
+void ServerLayer::UpdateClientInfoRows(const ClientInfoSnapshot& snapshot)
+{
+	WC_TRACE_SCOPE("ServerLayer::UpdateClientInfoRows");
+	auto toLower = [](std::string_view text)
+	{
+		std::string result(text);
+		std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+		return result;
+	};
+
+	std::string filter = toLower(m_ClientInfoFilter);
+	m_ClientInfoRows.clear();
+	for (uint32_t i = 0; i < (uint32_t)snapshot.Clients.size(); i++)
+	{
+		if (filter.empty() || toLower(snapshot.Clients[i].Username).find(filter) != std::string::npos)
+			m_ClientInfoRows.push_back(i);
+	}
+
+	auto sortKey = [column = m_ClientInfoSortColumn](const ClientInfoSnapshotEntry& client) -> uint64_t
+	{
+		switch (column)
+		{
+			case ClientInfoColumn::ID:              return client.ID;
+			case ClientInfoColumn::RoundTripTime:   return client.RoundTripTime;
+			case ClientInfoColumn::QueuedPackets:   return client.QueuedPackets;
+			case ClientInfoColumn::QueuedBytes:     return client.QueuedBytes;
+			case ClientInfoColumn::PeakQueuedBytes: return client.PeakQueuedBytes;
+			case ClientInfoColumn::BytesSent:       return client.BytesSent;
+			case ClientInfoColumn::BytesReceived:   return client.BytesReceived;
+		}
+		return 0;
+	};
+
+	// Ties (and the username column) go by username, so rows don't jump around between snapshots
+	std::sort(m_ClientInfoRows.begin(), m_ClientInfoRows.end(), [&](uint32_t a, uint32_t b)
+	{
+		const ClientInfoSnapshotEntry& clientA = snapshot.Clients[m_ClientInfoSortAscending ? a : b];
+		const ClientInfoSnapshotEntry& clientB = snapshot.Clients[m_ClientInfoSortAscending ? b : a];
+		uint64_t keyA = sortKey(clientA), keyB = sortKey(clientB);
+		if (keyA != keyB)
+			return keyA < keyB;
+		return clientA.Username < clientB.Username;
+	});
+}
+#endif
+
+void ServerLayer::PublishClientInfoSnapshot()
+{
+	WC_TRACE_SCOPE("ServerLayer::PublishClientInfoSnapshot");
+	auto snapshot = std::make_shared<ClientInfoSnapshot>();
+	snapshot->Time = EventLoop::Clock::now();
+	snapshot->Clients.reserve(m_ConnectedClients.size());
+	for (const auto& [clientID, session] : m_ConnectedClients)
+	{
+		// Not through the handshake yet
+		if (session.User.Username.empty())
+			continue;
+
+		ClientInfoSnapshotEntry& client = snapshot->Clients.emplace_back();
+		client.ID = clientID;
+		client.Username = session.User.Username;
+		client.ConnectionDesc = session.ConnectionDesc;
+		client.Color = session.User.Color;
+		client.Presence = session.User.Presence;
+		client.RoundTripTime = session.RoundTripTime;
+		client.QueuedPackets = session.Outbound.GetCount();
+		client.QueuedBytes = session.Outbound.GetSize();
+		client.PeakQueuedBytes = session.Outbound.GetPeakSize();
+		client.BytesSent = session.BytesSent;
+		client.BytesReceived = session.BytesReceived;
+	}
+
+	if (m_RoundTripTimes.GetCount())
+	{
+		snapshot->RoundTripTimeP50 = m_RoundTripTimes.GetPercentile(50.0);
+		snapshot->RoundTripTimeP99 = m_RoundTripTimes.GetPercentile(99.0);
+	}
+	if (m_MessageResidenceTimes.GetCount())
+	{
+		snapshot->MessageResidenceTimeP50 = m_MessageResidenceTimes.GetPercentile(50.0);
+		snapshot->MessageResidenceTimeP99 = m_MessageResidenceTimes.GetPercentile(99.0);
+	}
+
+	m_ClientInfoSnapshot.store(std::move(snapshot));
+}
+
+void ServerLayer::OnClientConnected(const Walnut::ClientInfo& clientInfo)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnClientConnected");
+	if (m_Capture.IsOpen())
+		m_Capture.Write(CaptureEventType::ClientConnected, clientInfo.ID, Walnut::Buffer(clientInfo.ConnectionDesc.data(), clientInfo.ConnectionDesc.size()));
+
+	// Client connection is handled in the PacketType::ClientConnectionRequest case, which has
+	// to come in before long
+	if (m_Specification.HandshakeTimeout > 0.0f)
+		m_IdleTimeouts.Schedule(clientInfo.ID, GetIdleTimeoutTicks(m_Specification.HandshakeTimeout));
+}
+
+void ServerLayer::OnClientDisconnected(const Walnut::ClientInfo& clientInfo)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnClientDisconnected");
+	if (m_Capture.IsOpen())
+		m_Capture.Write(CaptureEventType::ClientDisconnected, clientInfo.ID);
+
+	m_IdleTimeouts.Cancel(clientInfo.ID);
+	if (m_ConnectedClients.contains(clientInfo.ID))
+	{
+		m_EventLoop.CancelTimer(m_ConnectedClients.at(clientInfo.ID).TypingExpiryTimer);
+		EndAdmission(m_ConnectedClients.at(clientInfo.ID));
+		PauseFileUploads(clientInfo.ID);
+		RemoveFileRecipient(clientInfo.ID);
+		SendClientDisconnect(clientInfo);
+		const auto& userInfo = m_ConnectedClients.at(clientInfo.ID).User;
+		m_Console.AddItalicMessage("Client {} disconnected", userInfo.Username);
+		m_ClientIDsByUsername.erase(userInfo.Username);
+		m_ConnectedClients.erase(clientInfo.ID);
+		m_BroadcastTargetsValid = false;
+		InvalidateClientList(WireEncoding::Legacy);
+		InvalidateClientList(WireEncoding::Compact);
+	}
+	else if (RemoveFromAdmissionQueue(clientInfo.ID))
+	{
+		m_Console.AddItalicMessage("Client ID={} left the admission queue", clientInfo.ID);
+	}
+	else
+	{
+		std::cout << "[ERROR] OnClientDisconnected - Could not find client with ID=" << clientInfo.ID << std::endl;
+		std::cout << "  ConnectionDesc=" << clientInfo.ConnectionDesc << std::endl;
+	}
+}
+
+ServerLayer::ReceivedPacket* ServerLayer::AcquireReceivedPacket()
+{
+	std::scoped_lock<std::mutex> lock(m_ReceivedPacketMutex);
+	if (m_FreeReceivedPackets.empty())
+	{
+		m_FreeReceivedPackets.reserve(m_ReceivedPackets.size() + 1);
+		return m_ReceivedPackets.emplace_back(std::make_unique<ReceivedPacket>()).get();
+	}
+
+	ReceivedPacket* packet = m_FreeReceivedPackets.back();
+	m_FreeReceivedPackets.pop_back();
+	return packet;
+}
+
+void ServerLayer::ReleaseReceivedPacket(ReceivedPacket* packet)
+{
+	if (packet->Data.capacity() > m_MaxRecycledPacketSize)
+		std::vector<uint8_t>().swap(packet->Data);
+
+	std::scoped_lock<std::mutex> lock(m_ReceivedPacketMutex);
+	m_FreeReceivedPackets.push_back(packet);
+}
+
+void ServerLayer::OnDataReceived(const Walnut::ClientInfo& clientInfo, const Walnut::Buffer buffer, EventLoop::Clock::time_point receiveTime)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnDataReceived");
+	// Raw bytes as received, the PacketType is parsed again on replay
+	if (m_Capture.IsOpen())
+		m_Capture.Write(CaptureEventType::DataReceived, clientInfo.ID, buffer);
+
+	Walnut::BufferStreamReader stream(buffer);
+
+	// Clients that haven't completed the handshake yet are always legacy-encoded
+	WireEncoding encoding = WireEncoding::Legacy;
+	if (auto it = m_ConnectedClients.find(clientInfo.ID); it != m_ConnectedClients.end())
+	{
+		encoding = it->second.Encoding;
+		it->second.BytesReceived += buffer.Size;
+		ResetIdleTimeout(it->first, it->second);
+	}
+
+	PacketType type;
+	bool success = Wire::ReadPacketType(stream, type, encoding);
+	WL_CORE_VERIFY(success);
+	if (!success) // Why couldn't we read packet type? Probs invalid packet
+		return; 
+
+	auto handlerStart = std::chrono::steady_clock::now();
+	HandlePacket(clientInfo, type, stream, encoding, receiveTime);
+	m_PacketArena.Reset();
+
+	uint64_t handlerTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - handlerStart).count();
+	auto& stats = m_PacketHandlerStats[type];
+	stats.Count++;
+	stats.TotalNanoseconds += handlerTime;
+	stats.MaxNanoseconds = std::max(stats.MaxNanoseconds, handlerTime);
+}
+
+void ServerLayer::HandlePacket(const Walnut::ClientInfo& clientInfo, PacketType type, Walnut::BufferStreamReader& stream, WireEncoding encoding, EventLoop::Clock::time_point receiveTime)
+{
+	// PacketTypeToString() returns string literals, so data() is null terminated
+	WC_TRACE_SCOPE(PacketTypeToString(type).data());
+
+	// The handshake is the only thing a client can send before it has a session, and it
+	// can't send it again after
+	auto it = m_ConnectedClients.find(clientInfo.ID);
+	if (type == PacketType::ClientConnectionRequest)
+	{
+		if (it != m_ConnectedClients.end() || IsInAdmissionQueue(clientInfo.ID))
+			return; // Already connected (or waiting to)
+	}
+	else if (it == m_ConnectedClients.end())
+	{
+		// Reject data from clients we don't recognize
+		m_Console.AddMessage("Rejected incoming data from client ID={}", clientInfo.ID);
+		m_Console.AddMessage("  ConnectionDesc={}", clientInfo.ConnectionDesc);
+		return;
+	}
+	else if (!it->second.HasCapability(GetRequiredCapabilities(type)))
+	{
+		return;
+	}
+
+	using namespace Packets::ToServer;
+	Wire::DispatchPacket<Packets::ToServer::All>(type, stream, encoding, Wire::PacketHandlers
+	{
+		[&](const Message& packet)
+		{
+			std::string_view text = packet.Text;
+			if (!IsValidMessage(text)) // will trim to 4096 max chars if necessary (as defined in UserInfo.h)
+				return;
+
+			// The filter masks in place, so this needs a copy, but only for as long as the
+			// packet (the history keeps its own)
+			std::pmr::string message(text, &m_PacketArena);
+			const auto& client = it->second.User;
+			if (!FilterMessage(client, message))
+				return;
+
+			// Send to other clients and record
+			AppendMessageHistory({ client.Username, message });
+			m_Console.AddTaggedMessageWithColor(client.Color | 0xff000000, client.Username, "{}", std::string_view(message));
+			SendMessageToAllClients(clientInfo, message, receiveTime);
+
+			// Sending a message ends typing
+			const auto& session = m_ConnectedClients.at(clientInfo.ID);
+			if (session.PendingPresence & PresenceFlags::Typing)
+				OnUserPresence(clientInfo.ID, session.PendingPresence & ~PresenceFlags::Typing);
+		},
+		[&](const DirectMessage& packet)
+		{
+			std::string_view text = packet.Text;
+			if (!IsValidMessage(text))
+				return;
+
+			std::pmr::string message(text, &m_PacketArena);
+			if (FilterMessage(it->second.User, message))
+				OnDirectMessage(it->second.User, packet.ToUsername, message);
+		},
+		[&](const UserPresence& packet) { OnUserPresence(clientInfo.ID, packet.Presence); },
+		[&](const Pong& packet) { OnPong(clientInfo.ID, packet.ServerTime); },
+		[&](const MessageHistoryRequest& packet) { OnMessageHistoryRequest(clientInfo.ID, packet.BeforeSequence, packet.MaxMessages); },
+		[&](const FileOffer& packet) { OnFileOffer(clientInfo.ID, packet.TransferID, packet.ToUsername, packet.Filename, packet.Size); },
+		[&](const FileChunk& packet) { OnFileChunk(clientInfo.ID, packet.TransferID, packet.Offset, packet.Data); },
+		[&](const FileAck& packet) { OnFileOfferAnswer(clientInfo.ID, packet.TransferID, true); },
+		[&](const FileComplete& packet)
+		{
+			// Declining a file, otherwise it's only ever a cancel of the client's own upload
+			if (packet.Download)
+				OnFileOfferAnswer(clientInfo.ID, packet.TransferID, false);
+			else if (FileUpload* upload = FindFileUpload(clientInfo.ID, packet.TransferID))
+				FinishFileUpload(upload->ID, FileTransferStatus::Cancelled);
+		},
+		[&](const ClientConnectionRequest& packet)
+		{
+			// Legacy clients don't send a protocol version + capabilities, and the resume token
+			// is only there when reconnecting after a restart
+			uint16_t protocolVersion = packet.Protocol ? packet.Protocol->ProtocolVersion : LegacyProtocolVersion;
+			uint32_t capabilities = packet.Protocol ? packet.Protocol->Capabilities : 0;
+			uint64_t resumeToken = packet.Resume && (capabilities & ProtocolCapability::SessionResume) ? packet.Resume->ResumeToken : 0;
+			OnClientConnectionRequest(clientInfo, packet.Color, packet.Username, protocolVersion, capabilities, resumeToken);
+		}
+	});
+}
+
+void ServerLayer::OnMessageReceived(const Walnut::ClientInfo& clientInfo, std::string_view message)
+{
+
+}
+
+void ServerLayer::OnClientConnectionRequest(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username, uint16_t protocolVersion, uint32_t capabilities, uint64_t resumeToken)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnClientConnectionRequest");
+	if (protocolVersion > LegacyProtocolVersion)
+	{
+		protocolVersion = std::min(protocolVersion, CurrentProtocolVersion);
+		capabilities &= SupportedProtocolCapabilities;
+
+		// Presence and membership updates are carried in compact-encoded UserInfo/user IDs, so
+		// they need the compact encoding
+		if (!(capabilities & ProtocolCapability::CompactEncoding))
+			capabilities &= ~(ProtocolCapability::Presence | ProtocolCapability::MembershipUpdates | ProtocolCapability::FileTransfer);
+		if (m_Specification.FileTransferDirectory.empty())
+			capabilities &= ~ProtocolCapability::FileTransfer;
+	}
+	else
+	{
+		protocolVersion = LegacyProtocolVersion;
+		capabilities = 0;
+	}
+
+	// Back after a restart, there's no join history to send so this doesn't need a slot
+	if (resumeToken && (capabilities & ProtocolCapability::SessionResume) && ResumeClient(clientInfo, username, resumeToken, protocolVersion, capabilities))
+		return;
+
+	// Join storm, wait for a slot. Anyone already waiting goes first.
+	if (!m_AdmissionQueue.empty() || !HasAdmissionSlot())
+	{
+		// Nothing to hear from it while it waits, the transport notices if it goes away
+		m_IdleTimeouts.Cancel(clientInfo.ID);
+		m_AdmissionQueue.push_back({ clientInfo, userColor, std::string(username), protocolVersion, capabilities });
+		SendAdmissionStatus(m_AdmissionQueue.back(), (uint32_t)m_AdmissionQueue.size());
+		if (!m_AdmissionStatusTimer)
+			m_AdmissionStatusTimer = m_EventLoop.AddTimer(m_AdmissionStatusInterval, [this]() { SendAdmissionStatusToAll(); });
+		return;
+	}
+
+	AdmitClient(clientInfo, userColor, username, protocolVersion, capabilities);
+}
+
+void ServerLayer::AdmitClient(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username, uint16_t protocolVersion, uint32_t capabilities)
+{
+	WC_TRACE_SCOPE("ServerLayer::AdmitClient");
+	// Checked now rather than when the request came in, someone could have taken the name
+	// while it was queued
+	std::string requestedUsername(username);
+	bool isValidUsername = IsValidUsername(requestedUsername);
+
+	SendClientConnectionRequestResponse(clientInfo, isValidUsername, protocolVersion, capabilities);
+	if (isValidUsername)
+	{
+		m_Console.AddMessage("Welcome {} (color {})", requestedUsername, userColor);
+		auto& client = m_ConnectedClients[clientInfo.ID];
+		m_BroadcastTargetsValid = false;
+		client.User.Username = requestedUsername;
+		client.User.Color = userColor;
+		client.User.ID = clientInfo.ID;
+		client.ConnectionDesc = clientInfo.ConnectionDesc;
+		client.ProtocolVersion = protocolVersion;
+		client.Capabilities = capabilities;
+		client.Encoding = GetWireEncoding(capabilities);
+		m_ClientIDsByUsername[requestedUsername] = clientInfo.ID;
+		AddToClientList(client.User);
+
+		// connection complete? notify everyone else
+		SendClientConnect(clientInfo);
+
+		// Send the new client info about other connected clients
+		SendClientList(clientInfo);
+
+		// Send message history to new client, this takes up an admission slot until it's done
+		client.Admitting = true;
+		m_AdmittingClientCount++;
+		SendMessageHistory(clientInfo);
+		ResetIdleTimeout(clientInfo.ID, client);
+	}
+	else
+	{
+		m_Console.AddMessage("Client connection rejected with color {} and username {}", userColor, requestedUsername);
+		m_Console.AddMessage("Reason: invalid username");
+	}
+}
+
+bool ServerLayer::HasAdmissionSlot() const
+{
+	return m_Specification.MaxConcurrentJoins == 0 || m_AdmittingClientCount < m_Specification.MaxConcurrentJoins;
+}
+
+void ServerLayer::EndAdmission(ClientSession& session)
+{
+	if (!session.Admitting)
+		return;
+
+	session.Admitting = false;
+	m_AdmittingClientCount--;
+
+	// Not right away, this can be in the middle of going over m_ConnectedClients
+	if (!m_AdmissionQueue.empty())
+		m_EventLoop.Post([this]() { AdmitQueuedClients(); });
+}
+
+void ServerLayer::AdmitQueuedClients()
+{
+	while (!m_AdmissionQueue.empty() && HasAdmissionSlot())
+	{
+		PendingAdmission request = std::move(m_AdmissionQueue.front());
+		m_AdmissionQueue.pop_front();
+		AdmitClient(request.ClientInfo, request.Color, request.Username, request.ProtocolVersion, request.Capabilities);
+	}
+
+	if (m_AdmissionQueue.empty() && m_AdmissionStatusTimer)
+	{
+		m_EventLoop.CancelTimer(m_AdmissionStatusTimer);
+		m_AdmissionStatusTimer = 0;
+	}
+}
+
+bool ServerLayer::IsInAdmissionQueue(Walnut::ClientID clientID) const
+{
+	return std::any_of(m_AdmissionQueue.begin(), m_AdmissionQueue.end(), [clientID](const PendingAdmission& request) { return request.ClientInfo.ID == clientID; });
+}
+
+bool ServerLayer::RemoveFromAdmissionQueue(Walnut::ClientID clientID)
+{
+	auto it = std::find_if(m_AdmissionQueue.begin(), m_AdmissionQueue.end(), [clientID](const PendingAdmission& request) { return request.ClientInfo.ID == clientID; });
+	if (it == m_AdmissionQueue.end())
+		return false;
+
+	m_AdmissionQueue.erase(it);
+	return true;
+}
+
+void ServerLayer::SendAdmissionStatus(const PendingAdmission& request, uint32_t position)
+{
+	if (!(request.Capabilities & ProtocolCapability::AdmissionQueue))
+		return;
+
+	// No session yet, so this goes out legacy-encoded like the handshake response
+	SendPacket(request.ClientInfo.ID, Packets::ToClient::AdmissionStatus{ position, (uint32_t)m_AdmissionQueue.size() });
+}
+
+void ServerLayer::SendAdmissionStatusToAll()
+{
+	uint32_t position = 1;
+	for (const auto& request : m_AdmissionQueue)
+		SendAdmissionStatus(request, position++);
+}
+
+void ServerLayer::OnClientUpdate(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username)
+{
+
+}
+
+void ServerLayer::SendPacket(Walnut::ClientID clientID, PacketType type, const PacketEncoder& encode)
+{
+	WC_TRACE_SCOPE("ServerLayer::SendPacket");
+	// Clients that haven't completed the handshake get the legacy encoding
+	auto it = m_ConnectedClients.find(clientID);
+	ClientSession* session = it != m_ConnectedClients.end() ? &it->second : nullptr;
+	WireEncoding encoding = session ? session->Encoding : WireEncoding::Legacy;
+
+	uint32_t requiredCapabilities = GetRequiredCapabilities(type);
+	if (requiredCapabilities && (!session || !session->HasCapability(requiredCapabilities)))
+		return;
+
+	SharedBuffer sharedPacket;
+	DeliverPacket(clientID, session, GetDeliveryClass(type), EncodePacket(type, encoding, encode), sharedPacket);
+}
+
+void ServerLayer::SendPacketToAllClients(PacketType type, const PacketEncoder& encode, Walnut::ClientID excludeClientID, uint32_t excludeCapabilities, uint32_t requiredCapabilities)
+{
+	BroadcastPacket(type, encode, {}, 0, excludeClientID, excludeCapabilities, requiredCapabilities);
+}
+
+void ServerLayer::SendPacketVariantsToAllClients(PacketType type, const PacketEncoder& encode, const PacketEncoder& encodeVariant, uint32_t variantCapability, Walnut::ClientID excludeClientID)
+{
+	BroadcastPacket(type, encode, encodeVariant, variantCapability, excludeClientID, 0, 0);
+}
+
+void ServerLayer::BroadcastPacket(PacketType type, const PacketEncoder& encode, const PacketEncoder& encodeVariant, uint32_t variantCapability,
+	Walnut::ClientID excludeClientID, uint32_t excludeCapabilities, uint32_t requiredCapabilities)
+{
+	if (m_FanOutPool && m_ConnectedClients.size() >= m_Specification.FanOutMinRecipients)
+	{
+		FanOutPacketToAllClients(type, encode, encodeVariant, variantCapability, excludeClientID, excludeCapabilities, requiredCapabilities);
+		return;
+	}
+
+	WC_TRACE_SCOPE("ServerLayer::BroadcastPacket");
+	auto startTime = std::chrono::steady_clock::now();
+	DeliveryClass deliveryClass = GetDeliveryClass(type);
+	requiredCapabilities |= GetRequiredCapabilities(type);
+
+	// Encode lazily, at most once per encoding and variant
+	Walnut::Buffer encodedPackets[BroadcastVariantCount][WireEncodingCount];
+	SharedBuffer sharedPackets[BroadcastVariantCount][WireEncodingCount];
+
+	uint64_t recipients = 0;
+	for (auto& [clientID, session] : m_ConnectedClients)
+	{
+		if (clientID == excludeClientID || !session.HasCapability(requiredCapabilities) || (session.Capabilities & excludeCapabilities))
+			continue;
+
+		uint32_t variant = encodeVariant && session.HasCapability(variantCapability) ? 1 : 0;
+		int encodingIndex = (int)session.Encoding;
+		if (!encodedPackets[variant][encodingIndex])
+			encodedPackets[variant][encodingIndex] = EncodePacket(type, session.Encoding, variant ? encodeVariant : encode, variant);
+
+		DeliverPacket(clientID, &session, deliveryClass, encodedPackets[variant][encodingIndex], sharedPackets[variant][encodingIndex]);
+		recipients++;
+	}
+
+	RecordBroadcast(m_SerialBroadcastStats, recipients, startTime);
+}
+
+void ServerLayer::FanOutPacketToAllClients(PacketType type, const PacketEncoder& encode, const PacketEncoder& encodeVariant, uint32_t variantCapability,
+	Walnut::ClientID excludeClientID, uint32_t excludeCapabilities, uint32_t requiredCapabilities)
+{
+	WC_TRACE_SCOPE("ServerLayer::FanOutPacketToAllClients");
+	auto startTime = std::chrono::steady_clock::now();
+	DeliveryClass deliveryClass = GetDeliveryClass(type);
+	requiredCapabilities |= GetRequiredCapabilities(type);
+	bool reliable = IsReliableDelivery(deliveryClass);
+
+	const auto& targets = GetBroadcastTargets();
+
+	// Workers can't encode (the scratch buffers are shared), so every encoding in use is
+	// encoded up front. Direct sends and queues all use this one copy.
+	SharedBuffer packets[BroadcastVariantCount][WireEncodingCount];
+	for (uint32_t i = 0; i < WireEncodingCount; i++)
+	{
+		if (!m_BroadcastEncodings[i])
+			continue;
+
+		packets[0][i] = MakeSharedBuffer(EncodePacket(type, (WireEncoding)i, encode));
+		if (encodeVariant)
+			packets[1][i] = MakeSharedBuffer(EncodePacket(type, (WireEncoding)i, encodeVariant, 1));
+	}
+
+	m_FanOutQueued.assign(targets.size(), 0);
+	std::atomic<uint64_t> recipients = 0;
+	std::atomic<uint32_t> queued = 0;
+
+	// Only touches the chunk's own sessions, anything that isn't thread-safe is left for after
+	uint32_t threadCount = m_FanOutPool->GetWorkerCount() + 1;
+	uint32_t chunkSize = std::max((uint32_t)targets.size() / (threadCount * m_FanOutChunksPerThread), m_MinFanOutChunkSize);
+	FanOutResult result = m_FanOutPool->Run((uint32_t)targets.size(), chunkSize, [&](uint32_t begin, uint32_t end)
+	{
+		uint64_t chunkRecipients = 0;
+		uint32_t chunkQueued = 0;
+		for (uint32_t i = begin; i < end; i++)
+		{
+			auto [clientID, session] = targets[i];
+			if (clientID == excludeClientID || session->EvictionPending || !session->HasCapability(requiredCapabilities) || (session->Capabilities & excludeCapabilities))
+				continue;
+
+			uint32_t variant = encodeVariant && session->HasCapability(variantCapability) ? 1 : 0;
+			const SharedBuffer& packet = packets[variant][(int)session->Encoding];
+			if (CanSendDirectly(*session, deliveryClass, packet->size()))
+			{
+				m_Server->SendBufferToClient(clientID, AsBuffer(packet), reliable);
+				session->PendingSendBytes += packet->size();
+				session->BytesSent += packet->size();
+			}
+			else
+			{
+				session->Outbound.Push(packet, deliveryClass);
+				m_FanOutQueued[i] = 1;
+				chunkQueued++;
+			}
+			chunkRecipients++;
+		}
+
+		recipients.fetch_add(chunkRecipients, std::memory_order_relaxed);
+		queued.fetch_add(chunkQueued, std::memory_order_relaxed);
+	});
+
+	// Limits can evict (console, event loop), so they're checked here once everyone has it
+	if (queued)
+	{
+		for (size_t i = 0; i < targets.size(); i++)
+		{
+			if (m_FanOutQueued[i])
+				EnforceOutboundLimits(targets[i].first, *targets[i].second);
+		}
+		StartOutboundFlushTimer();
+	}
+
+	RecordBroadcast(m_FanOutBroadcastStats, recipients, startTime);
+	m_FanOutBroadcastStats.Chunks += result.Chunks;
+	m_FanOutBroadcastStats.StolenChunks += result.StolenChunks;
+}
+
+const std::vector<std::pair<Walnut::ClientID, ClientSession*>>& ServerLayer::GetBroadcastTargets()
+{
+	if (m_BroadcastTargetsValid)
+		return m_BroadcastTargets;
+
+	// Sessions don't move around in the map, so the pointers stay good until a join/leave
+	m_BroadcastTargets.clear();
+	m_BroadcastTargets.reserve(m_ConnectedClients.size());
+	std::fill(std::begin(m_BroadcastEncodings), std::end(m_BroadcastEncodings), false);
+	for (auto& [clientID, session] : m_ConnectedClients)
+	{
+		m_BroadcastTargets.emplace_back(clientID, &session);
+		m_BroadcastEncodings[(int)session.Encoding] = true;
+	}
+
+	m_BroadcastTargetsValid = true;
+	return m_BroadcastTargets;
+}
+
+void ServerLayer::RecordBroadcast(BroadcastStats& stats, uint64_t recipients, std::chrono::steady_clock::time_point startTime)
+{
+	uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+	stats.Count++;
+	stats.Recipients += recipients;
+	stats.TotalNanoseconds += nanoseconds;
+	stats.MaxNanoseconds = std::max(stats.MaxNanoseconds, nanoseconds);
+}
+
+void ServerLayer::SendPacketToClients(const std::vector<Walnut::ClientID>& clientIDs, PacketType type, const PacketEncoder& encode)
+{
+	WC_TRACE_SCOPE("ServerLayer::SendPacketToClients");
+	DeliveryClass deliveryClass = GetDeliveryClass(type);
+	uint32_t requiredCapabilities = GetRequiredCapabilities(type);
+
+	Walnut::Buffer encodedPackets[WireEncodingCount];
+	SharedBuffer sharedPackets[WireEncodingCount];
+
+	for (Walnut::ClientID clientID : clientIDs)
+	{
+		auto it = m_ConnectedClients.find(clientID);
+		if (it == m_ConnectedClients.end() || !it->second.HasCapability(requiredCapabilities))
+			continue;
+
+		auto& session = it->second;
+		int encodingIndex = (int)session.Encoding;
+		if (!encodedPackets[encodingIndex])
+			encodedPackets[encodingIndex] = EncodePacket(type, session.Encoding, encode);
+
+		DeliverPacket(clientID, &session, deliveryClass, encodedPackets[encodingIndex], sharedPackets[encodingIndex]);
+	}
+}
+
+void ServerLayer::ReserveScratchBuffer(WireEncoding encoding, uint64_t size, uint32_t variant)
+{
+	Walnut::Buffer& scratchBuffer = m_ScratchBuffers[variant][(int)encoding];
+	if (scratchBuffer.Size < size)
+		scratchBuffer.Allocate(size);
+}
+
+Walnut::Buffer ServerLayer::EncodePacket(PacketType type, WireEncoding encoding, const PacketEncoder& encode, uint32_t variant)
+{
+	Walnut::BufferStreamWriter stream(m_ScratchBuffers[variant][(int)encoding]);
+	Wire::WritePacketType(stream, type, encoding);
+	if (encode)
+		encode(stream, encoding);
+
+	return stream.GetBuffer();
+}
+
+void ServerLayer::DeliverPacket(Walnut::ClientID clientID, ClientSession* session, DeliveryClass deliveryClass, Walnut::Buffer packet, SharedBuffer& sharedPacket)
+{
+	if (!session)
+	{
+		// Handshake responses, there's no session (or queue) yet
+		m_Server->SendBufferToClient(clientID, packet, IsReliableDelivery(deliveryClass));
+		return;
+	}
+
+	if (session->EvictionPending)
+		return;
+
+	// Nothing queued ahead of it and within the send window, send straight from the scratch buffer.
+	// NOTE: Walnut::Server only exposes reliable/unreliable, so Control/Interactive use the
+	//       default reliable send flags. Keeping bulk data out of the way is what keeps them fast.
+	bool canSend = CanSendDirectly(*session, deliveryClass, packet.Size);
+	if (!canSend && session->Outbound.IsEmpty() && UpdateSendQueueStatus(clientID, *session))
+		canSend = CanSendDirectly(*session, deliveryClass, packet.Size); // The transport might have caught up since
+	if (canSend)
+	{
+		m_Server->SendBufferToClient(clientID, packet, IsReliableDelivery(deliveryClass));
+		session->PendingSendBytes += packet.Size;
+		session->BytesSent += packet.Size;
+		return;
+	}
+
+	// Scratch buffers get reused, so queued packets need their own (shared) copy
+	if (!sharedPacket)
+		sharedPacket = MakeSharedBuffer(packet);
+
+	session->Outbound.Push(sharedPacket, deliveryClass);
+	EnforceOutboundLimits(clientID, *session);
+	StartOutboundFlushTimer();
+}
+
+bool ServerLayer::CanSendDirectly(const ClientSession& session, DeliveryClass deliveryClass, uint64_t packetSize) const
+{
+	bool withinWindow = session.PendingSendBytes == 0 || session.PendingSendBytes + packetSize <= m_SendWindow;
+	return session.Outbound.IsEmpty() && !session.Outbound.IsHeld(deliveryClass) && withinWindow;
+}
+
+bool ServerLayer::UpdateSendQueueStatus(Walnut::ClientID clientID, ClientSession& session)
+{
+	ServerTransport::SendQueueStatus status;
+	if (!m_Server->GetSendQueueStatus(clientID, status))
+		return false;
+
+	session.PendingSendBytes = status.PendingBytes;
+	session.SendQueueTime = status.QueueTime;
+	return true;
+}
+
+void ServerLayer::FlushOutboundQueue(Walnut::ClientID clientID, ClientSession& session)
+{
+	WC_TRACE_SCOPE("ServerLayer::FlushOutboundQueue");
+	if (session.PendingSendBytes >= m_SendWindow)
+		return;
+
+	uint64_t bytesSent = session.Outbound.Drain(m_SendWindow - session.PendingSendBytes, [&](const SharedBuffer& packet)
+	{
+		m_Server->SendBufferToClient(clientID, AsBuffer(packet), true);
+	});
+	session.PendingSendBytes += bytesSent;
+	session.BytesSent += bytesSent;
+
+	if (!session.PresenceBacklog.empty())
+		SendPresenceBacklog(clientID, session);
+
+	// History goes out last, a page at a time. Live chat held back until it's done goes right after.
+	while (session.SendingHistory && session.Outbound.IsEmpty() && session.PendingSendBytes < m_SendWindow)
+	{
+		SendNextMessageHistoryPage(clientID, session);
+		if (!session.SendingHistory)
+			FlushOutboundQueue(clientID, session);
+	}
+}
+
+void ServerLayer::StartOutboundFlushTimer()
+{
+	if (!m_OutboundFlushTimer)
+		m_OutboundFlushTimer = m_EventLoop.AddTimer(m_OutboundFlushInterval, [this]() { OnOutboundFlushTimer(); });
+}
+
+void ServerLayer::OnOutboundFlushTimer()
+{
+	WC_TRACE_SCOPE("ServerLayer::OnOutboundFlushTimer");
+	bool pending = false;
+	for (auto& [clientID, session] : m_ConnectedClients)
+	{
+		if (session.PendingSendBytes == 0 && session.Outbound.IsEmpty() && session.PresenceBacklog.empty() && !session.SendingHistory)
+			continue;
+
+		// Without status from the transport it's a fixed budget per interval
+		if (!UpdateSendQueueStatus(clientID, session))
+			session.PendingSendBytes = 0;
+
+		FlushOutboundQueue(clientID, session);
+		EnforceOutboundLimits(clientID, session);
+		pending |= !session.Outbound.IsEmpty() || !session.PresenceBacklog.empty() || session.SendingHistory;
+	}
+
+	// Recipients might have caught up
+	if (m_FileAcksHeldBack)
+		SendHeldBackFileAcks();
+
+	// Nothing left to pace, stop ticking until there is
+	if (!pending && !m_FileAcksHeldBack)
+	{
+		m_EventLoop.CancelTimer(m_OutboundFlushTimer);
+		m_OutboundFlushTimer = 0;
+	}
+}
+
+void ServerLayer::EnforceOutboundLimits(Walnut::ClientID clientID, ClientSession& session)
+{
+	auto isOver = [&session](uint64_t maxBytes, uint32_t maxMessages, float maxQueueTime)
+	{
+		return session.Outbound.GetSize() > maxBytes || session.Outbound.GetCount() > maxMessages || session.SendQueueTime > maxQueueTime;
+	};
+
+	if (session.EvictionPending || !isOver(m_OutboundHighWaterBytes, m_OutboundHighWaterMessages, m_SendQueueTimeHighWater))
+		return;
+
+	// Not keeping up: don't spend its bandwidth on old history, just give it the latest page
+	if (session.SendingHistory)
+		session.HistoryCursor = GetMessageHistoryPageBegin(session.HistoryEnd, session.HistoryCursor, session.Encoding);
+	session.Outbound.DropBulk();
+
+	if (isOver(m_MaxOutboundQueueBytes, m_MaxOutboundQueueMessages, m_MaxSendQueueTime))
+		EvictSlowClient(clientID, session);
+}
+
+void ServerLayer::EvictSlowClient(Walnut::ClientID clientID, ClientSession& session)
+{
+	WC_TRACE_SCOPE("ServerLayer::EvictSlowClient");
+	m_Console.AddItalicMessage("Disconnecting {}: outbound queue over limit ({} messages, {} bytes, {:.1f}s in the transport)",
+		session.User.Username, session.Outbound.GetCount(), session.Outbound.GetSize(), session.SendQueueTime);
+
+	session.EvictionPending = true;
+	session.SendingHistory = false;
+	session.Outbound.Clear();
+	EndAdmission(session);
+
+	// Might be in the middle of a broadcast over m_ConnectedClients, so disconnect afterwards
+	m_EventLoop.Post([this, clientID]()
+	{
+		if (m_ConnectedClients.contains(clientID))
+			KickClient(clientID, "Connection too slow");
+	});
+}
+
+void ServerLayer::SendNextMessageHistoryPage(Walnut::ClientID clientID, ClientSession& session)
+{
+	WC_TRACE_SCOPE("ServerLayer::SendNextMessageHistoryPage");
+	uint64_t pageBegin = std::min(session.HistoryCursor, session.HistoryEnd);
+	uint64_t pageEnd = GetMessageHistoryPageEnd(pageBegin, session.HistoryEnd, session.Encoding);
+
+	Walnut::Buffer packet = EncodePacket(PacketType::MessageHistory, session.Encoding, [&](Walnut::StreamWriter& stream, WireEncoding encoding)
+	{
+		Wire::WriteCount(stream, (uint32_t)(pageEnd - pageBegin), encoding);
+		WriteMessageHistory(stream, pageBegin, pageEnd, encoding);
+	});
+
+	m_Server->SendBufferToClient(clientID, packet, true);
+	session.PendingSendBytes += packet.Size;
+	session.BytesSent += packet.Size;
+
+	// Clients that asked for it get an empty page to say that was all of it
+	session.HistoryCursor = pageEnd;
+	bool endMarker = session.HasCapability(ProtocolCapability::JoinHistoryEnd);
+	if (pageEnd == pageBegin || (pageEnd >= session.HistoryEnd && !endMarker))
+	{
+		session.SendingHistory = false;
+		session.Outbound.ReleaseInteractive();
+		EndAdmission(session);
+	}
+}
+
+uint64_t ServerLayer::GetMessageHistoryPageEnd(uint64_t pageBegin, uint64_t historyEnd, WireEncoding encoding, uint32_t maxMessages)
+{
+	uint64_t pageEnd = pageBegin;
+	if (m_EncodedMessageHistory.GetPageEnd(pageBegin, historyEnd, encoding, m_MessageHistoryPageSize, maxMessages, pageEnd))
+		return pageEnd;
+
+	uint64_t pageSize = 0;
+	m_MessageHistory.ForEachMessage(pageBegin, historyEnd, [&](uint64_t sequence, const ChatMessageView& message)
+	{
+		uint64_t messageSize = Wire::GetChatMessageSize(message, encoding);
+		if (pageEnd > pageBegin && (pageSize + messageSize > m_MessageHistoryPageSize || pageEnd - pageBegin >= maxMessages))
+			return false;
+
+		pageSize += messageSize;
+		pageEnd = sequence + 1;
+		return true;
+	});
+	return pageEnd;
+}
+
+uint64_t ServerLayer::GetMessageHistoryPageBegin(uint64_t pageEnd, uint64_t historyBegin, WireEncoding encoding, uint32_t maxMessages)
+{
+	uint64_t pageBegin = pageEnd;
+	if (m_EncodedMessageHistory.GetPageBegin(pageEnd, historyBegin, encoding, m_MessageHistoryPageSize, maxMessages, pageBegin))
+		return pageBegin;
+
+	uint64_t pageSize = 0;
+	m_MessageHistory.ForEachMessageReverse(historyBegin, pageEnd, [&](uint64_t sequence, const ChatMessageView& message)
+	{
+		uint64_t messageSize = Wire::GetChatMessageSize(message, encoding);
+		if (pageBegin < pageEnd && (pageSize + messageSize > m_MessageHistoryPageSize || pageEnd - pageBegin >= maxMessages))
+			return false;
+
+		pageSize += messageSize;
+		pageBegin = sequence;
+		return true;
+	});
+	return pageBegin;
+}
+
+void ServerLayer::WriteMessageHistory(Walnut::StreamWriter& stream, uint64_t begin, uint64_t end, WireEncoding encoding)
+{
+	if (m_EncodedMessageHistory.Contains(begin, end))
+	{
+		Walnut::Buffer messages = m_EncodedMessageHistory.GetMessages(begin, end, encoding);
+		stream.WriteData((const char*)messages.Data, messages.Size);
+		return;
+	}
+
+	m_MessageHistory.ForEachMessage(begin, end, [&](uint64_t /*sequence*/, const ChatMessageView& message)
+	{
+		Wire::WriteChatMessage(stream, message, encoding);
+		return true;
+	});
+}
+
+void ServerLayer::AppendMessageHistory(const ChatMessageView& message)
+{
+	m_MessageHistory.Append(message);
+	m_EncodedMessageHistory.Append(message);
+}
+
+void ServerLayer::OnUserPresence(Walnut::ClientID clientID, uint8_t presence)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnUserPresence");
+	auto& session = m_ConnectedClients.at(clientID);
+	presence &= PresenceFlags::All;
+
+	if (presence & PresenceFlags::Typing)
+	{
+		// Typing refreshes just push the expiry back
+		if (session.TypingExpiryTimer)
+		{
+			m_EventLoop.ResetTimer(session.TypingExpiryTimer);
+		}
+		else
+		{
+			session.TypingExpiryTimer = m_EventLoop.AddTimer(m_TypingTimeout, [this, clientID]()
+			{
+				auto& session = m_ConnectedClients.at(clientID);
+				session.TypingExpiryTimer = 0;
+				OnUserPresence(clientID, session.PendingPresence & ~PresenceFlags::Typing);
+			}, false);
+		}
+	}
+	else if (session.TypingExpiryTimer)
+	{
+		m_EventLoop.CancelTimer(session.TypingExpiryTimer);
+		session.TypingExpiryTimer = 0;
+	}
+
+	session.PendingPresence = presence;
+
+	// Only queue a fan-out if this could be a change, FlushPresenceUpdates() drops
+	// users that went back to their last published state within the window
+	if (session.PendingPresence == session.User.Presence || session.PresenceDirty)
+		return;
+
+	session.PresenceDirty = true;
+	m_PresenceDirtyClients.push_back(clientID);
+
+	if (!m_PresenceFlushTimer)
+		m_PresenceFlushTimer = m_EventLoop.AddTimer(m_PresenceFlushInterval, [this]() { FlushPresenceUpdates(); });
+}
+
+void ServerLayer::OnDirectMessage(const UserInfo& fromUser, std::string_view toUsername, std::string_view message)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnDirectMessage");
+	bool fromServer = fromUser.ID == ServerUserID;
+	auto reply = [&](std::string_view text)
+	{
+		if (fromServer)
+			m_Console.AddItalicMessage("{}", text);
+		else
+			SendServerMessage(fromUser.ID, text);
+	};
+
+	Walnut::ClientID toClientID = FindClientID(std::string(toUsername));
+	if (!toClientID)
+	{
+		reply(fmt::format("Could not send direct message; user {} is not online.", toUsername));
+		return;
+	}
+
+	const auto& toSession = m_ConnectedClients.at(toClientID);
+	if (!toSession.HasCapability(ProtocolCapability::DirectMessages))
+	{
+		reply(fmt::format("Could not send direct message; {}'s client doesn't support direct messages.", toUsername));
+		return;
+	}
+
+	// One send, no fan-out, and it stays out of the global history
+	SendDirectMessage(toClientID, fromUser, message);
+
+	ConversationKey conversation = std::minmax(fromUser.Username, toSession.User.Username);
+	m_DirectMessageHistory[conversation].emplace_back(fromUser.Username, std::string(message));
+	m_DirectMessageHistoryDirty = true;
+
+	if (fromServer)
+		m_Console.AddTaggedMessage(fmt::format("SERVER -> {}", toUsername), message);
+}
+
+void ServerLayer::OnMessageHistoryRequest(Walnut::ClientID clientID, uint64_t beforeSequence, uint32_t maxMessages)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnMessageHistoryRequest");
+	const auto& session = m_ConnectedClients.at(clientID);
+
+	if (beforeSequence == UINT64_MAX)
+		beforeSequence = session.HistoryBegin;
+	beforeSequence = std::min(beforeSequence, m_MessageHistory.GetEndSequence());
+	maxMessages = std::clamp(maxMessages, 1u, m_MaxMessageHistoryRequestMessages);
+
+	uint64_t pageBegin = GetMessageHistoryPageBegin(beforeSequence, m_MessageHistory.GetFirstSequence(), session.Encoding, maxMessages);
+	SendPacket(clientID, PacketType::MessageHistoryRequest, [&](Walnut::StreamWriter& stream, WireEncoding encoding)
+	{
+		stream.WriteRaw<uint64_t>(pageBegin);
+		Wire::WriteCount(stream, (uint32_t)(beforeSequence - pageBegin), encoding);
+		WriteMessageHistory(stream, pageBegin, beforeSequence, encoding);
+	});
+}
+
+void ServerLayer::SendClientList(const Walnut::ClientInfo& clientInfo)
+{
+	WC_TRACE_SCOPE("ServerLayer::SendClientList");
+	auto it = m_ConnectedClients.find(clientInfo.ID);
+	if (it == m_ConnectedClients.end())
+		return;
+
+	SharedBuffer packet = GetClientListPacket(it->second.Encoding);
+	DeliverPacket(clientInfo.ID, &it->second, GetDeliveryClass(PacketType::ClientList), AsBuffer(packet), packet);
+}
+
+void ServerLayer::SendClientListToAllClients()
+{
+	WC_TRACE_SCOPE("ServerLayer::SendClientListToAllClients");
+	// WL_INFO("Sending client list to all clients");
+	DeliveryClass deliveryClass = GetDeliveryClass(PacketType::ClientList);
+	for (auto& [clientID, session] : m_ConnectedClients)
+	{
+		SharedBuffer packet = GetClientListPacket(session.Encoding);
+		DeliverPacket(clientID, &session, deliveryClass, AsBuffer(packet), packet);
+	}
+}
+
+SharedBuffer ServerLayer::GetClientListPacket(WireEncoding encoding)
+{
+	int encodingIndex = (int)encoding;
+	SharedBuffer& packet = m_ClientListPackets[encodingIndex];
+	if (packet)
+		return packet;
+
+	std::vector<uint8_t>& entries = m_ClientListEntries[encodingIndex];
+	if (!m_ClientListEntriesValid[encodingIndex])
+	{
+		entries.clear();
+		VectorStreamWriter entryStream(entries);
+		for (const auto& [clientID, session] : m_ConnectedClients)
+			Wire::WriteUserInfo(entryStream, session.User, encoding);
+		m_ClientListEntriesValid[encodingIndex] = true;
+	}
+
+	// Not the scratch buffer, the list can get bigger than that
+	std::vector<uint8_t> data;
+	data.reserve(entries.size() + 16);
+	VectorStreamWriter stream(data);
+	Wire::WritePacketType(stream, PacketType::ClientList, encoding);
+	Wire::WriteCount(stream, (uint32_t)m_ConnectedClients.size(), encoding);
+	stream.WriteData((const char*)entries.data(), entries.size());
+
+	packet = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+	return packet;
+}
+
+void ServerLayer::AddToClientList(const UserInfo& user)
+{
+	for (uint32_t i = 0; i < WireEncodingCount; i++)
+	{
+		if (m_ClientListEntriesValid[i])
+		{
+			VectorStreamWriter stream(m_ClientListEntries[i]);
+			Wire::WriteUserInfo(stream, user, (WireEncoding)i);
+		}
+		m_ClientListPackets[i].reset();
+	}
+}
+
+void ServerLayer::InvalidateClientList(WireEncoding encoding)
+{
+	m_ClientListEntriesValid[(int)encoding] = false;
+	m_ClientListPackets[(int)encoding].reset();
+}
+
+void ServerLayer::SendClientConnect(const Walnut::ClientInfo& newClient)
+{
+	WL_VERIFY(m_ConnectedClients.contains(newClient.ID));
+	const auto& newClientInfo = m_ConnectedClients.at(newClient.ID).User;
+
+	SendPacketToAllClients(PacketType::ClientConnect, [&](Walnut::StreamWriter& stream, WireEncoding encoding)
+	{
+		Wire::WriteUserInfo(stream, newClientInfo, encoding);
+	}, newClient.ID, ProtocolCapability::MembershipUpdates);
+
+	m_PendingJoins.push_back(newClient.ID);
+	StartMembershipFlushTimer();
+}
+
+void ServerLayer::SendClientDisconnect(const Walnut::ClientInfo& clientInfo)
+{
+	const auto& userInfo = m_ConnectedClients.at(clientInfo.ID).User;
+
+	SendPacketToAllClients(PacketType::ClientDisconnect, [&](Walnut::StreamWriter& stream, WireEncoding encoding)
+	{
+		if (encoding == WireEncoding::Compact)
+			Wire::WriteUserID(stream, userInfo.ID);
+		else
+			stream.WriteObject(userInfo);
+	}, clientInfo.ID, ProtocolCapability::MembershipUpdates);
+
+	// Joined and left within the same window, nobody needs to hear about either. Unless
+	// someone joined after it: their ClientList has it, so they need the leave.
+	if (!m_PendingJoins.empty() && m_PendingJoins.back() == clientInfo.ID)
+	{
+		m_PendingJoins.pop_back();
+		return;
+	}
+
+	m_PendingLeaves.push_back(userInfo.ID);
+	StartMembershipFlushTimer();
+}
+
+void ServerLayer::StartMembershipFlushTimer()
+{
+	if (!m_MembershipFlushTimer)
+		m_MembershipFlushTimer = m_EventLoop.AddTimer(m_MembershipFlushInterval, [this]() { FlushMembershipUpdates(); });
+}
+
+void ServerLayer::FlushMembershipUpdates()
+{
+	WC_TRACE_SCOPE("ServerLayer::FlushMembershipUpdates");
+	m_EventLoop.CancelTimer(m_MembershipFlushTimer);
+	m_MembershipFlushTimer = 0;
+
+	if (m_PendingJoins.empty() && m_PendingLeaves.empty())
+		return;
+
+	// Clients that joined during the window already got them in their ClientList, they just
+	// skip anyone they know about
+	SendPacketToAllClients(PacketType::ClientListUpdate, [&](Walnut::StreamWriter& stream, WireEncoding encoding)
+	{
+		uint32_t joinCount = 0;
+		for (Walnut::ClientID clientID : m_PendingJoins)
+			joinCount += m_ConnectedClients.contains(clientID) ? 1 : 0;
+
+		Wire::WriteCount(stream, joinCount, encoding);
+		for (Walnut::ClientID clientID : m_PendingJoins)
+		{
+			if (auto it = m_ConnectedClients.find(clientID); it != m_ConnectedClients.end())
+				Wire::WriteUserInfo(stream, it->second.User, encoding);
+		}
+
+		Wire::WriteCount(stream, (uint32_t)m_PendingLeaves.size(), encoding);
+		for (uint32_t userID : m_PendingLeaves)
+			Wire::WriteUserID(stream, userID);
+	});
+
+	m_PendingJoins.clear();
+	m_PendingLeaves.clear();
+}
+
+void ServerLayer::SendClientConnectionRequestResponse(const Walnut::ClientInfo& clientInfo, bool response, uint16_t protocolVersion, uint32_t capabilities, bool resumed)
+{
+	// Sent before the client has a session, so always legacy-encoded. The client switches
+	// encoding after reading this.
+	WL_CORE_VERIFY(!m_ConnectedClients.contains(clientInfo.ID));
+	Packets::ToClient::ClientConnectionResponse packet;
+	packet.Accepted = response;
+
+	// Legacy clients only read the boolean
+	if (protocolVersion > LegacyProtocolVersion)
+	{
+		packet.Protocol = { protocolVersion, capabilities, (uint32_t)clientInfo.ID };
+		if (capabilities & ProtocolCapability::SessionResume)
+			packet.Resume = { resumed };
+	}
+	SendPacket(clientInfo.ID, packet);
+}
+
+void ServerLayer::SendClientUpdateResponse(const Walnut::ClientInfo& clientInfo)
+{
+
+}
+
+void ServerLayer::SendMessageToAllClients(const Walnut::ClientInfo& fromClient, std::string_view message, EventLoop::Clock::time_point receiveTime)
+{
+	const auto& fromUser = m_ConnectedClients.at(fromClient.ID).User;
+
+	Packets::ToClient::Message packet;
+	packet.From = { fromUser.ID, fromUser.Username };
+	packet.Text = message;
+
+	// Clients that asked for it get the same thing plus when it came in and went out
+	Packets::ToClient::Message stampedPacket = packet;
+	uint64_t receiveServerTime = GetServerTime(receiveTime);
+	uint64_t sendServerTime = GetServerTime(EventLoop::Clock::now());
+	stampedPacket.Stamps = { receiveServerTime, std::max(sendServerTime, receiveServerTime) };
+	SendPacketVariantsToAllClients(packet, stampedPacket, ProtocolCapability::LatencyStamps, fromClient.ID);
+
+	// Includes the relaying itself, which is most of it under load
+	m_MessageResidenceTimes.Record(std::chrono::duration_cast<std::chrono::microseconds>(EventLoop::Clock::now() - receiveTime).count());
+}
+
+void ServerLayer::SendMessageHistory(const Walnut::ClientInfo& clientInfo, uint64_t firstSequence)
+{
+	// History is split into pages (so it fits the scratch buffer) which are sent as the
+	// client's send budget allows, after anything more important. Clients just append each
+	// page, so this works for legacy clients too. Only the newest JoinHistoryMessages are
+	// sent, older ones are loaded from disk only if a client pages back to them.
+	// Live chat is held back until then, otherwise it would be appended above older history.
+	auto& session = m_ConnectedClients.at(clientInfo.ID);
+	session.SendingHistory = true;
+	session.Outbound.HoldInteractive();
+	session.HistoryEnd = m_MessageHistory.GetEndSequence();
+	session.HistoryBegin = std::max(m_MessageHistory.GetFirstSequence(), session.HistoryEnd - std::min<uint64_t>(session.HistoryEnd, m_Specification.JoinHistoryMessages));
+	session.HistoryBegin = std::max(session.HistoryBegin, std::min(firstSequence, session.HistoryEnd));
+	session.HistoryCursor = session.HistoryBegin;
+
+	FlushOutboundQueue(clientInfo.ID, session);
+	if (session.SendingHistory)
+		StartOutboundFlushTimer();
+}
+
+void ServerLayer::SendDirectMessage(Walnut::ClientID toClientID, const UserInfo& fromUser, std::string_view message)
+{
+	SendPacket(toClientID, Packets::ToClient::DirectMessage{ { fromUser.ID, fromUser.Username }, message });
+}
+
+void ServerLayer::SendServerMessage(Walnut::ClientID clientID, std::string_view message)
+{
+	SendPacket(clientID, Packets::ToClient::Message{ { ServerUserID, "SERVER" }, message, {} });
+}
+
+bool ServerLayer::FilterMessage(const UserInfo& fromUser, std::span<char> message)
+{
+	WC_TRACE_SCOPE("ServerLayer::FilterMessage");
+	ContentFilterAction action = m_ContentFilter->Apply(message);
+	m_ContentFilterCounts[(int)action]++;
+
+	std::string_view text(message.data(), message.size());
+	if (action == ContentFilterAction::Block)
+	{
+		m_Console.AddItalicMessage("Blocked message from {}: {}", fromUser.Username, text);
+		SendServerMessage(fromUser.ID, "Your message was blocked by the content filter.");
+		return false;
+	}
+
+	if (action == ContentFilterAction::Flag)
+		m_Console.AddItalicMessage("Flagged message from {}: {}", fromUser.Username, text);
+	return true;
+}
+
+bool ServerLayer::ReloadContentFilter()
+{
+	if (m_ContentFilterLoading || m_Specification.ContentFilterFilePath.empty())
+		return false;
+
+	// Done with its last filter already (m_ContentFilterLoading is cleared after it's posted)
+	if (m_ContentFilterThread.joinable())
+		m_ContentFilterThread.join();
+
+	m_ContentFilterLoading = true;
+	m_ContentFilterThread = std::thread([this, filepath = m_Specification.ContentFilterFilePath]()
+	{
+		Trace::SetThreadName("Content Filter");
+		auto contentFilter = std::make_shared<ContentFilter>();
+		bool loaded = contentFilter->LoadFromFile(filepath);
+		m_EventLoop.Post([this, contentFilter, loaded]() { OnContentFilterLoaded(contentFilter, loaded); });
+	});
+	return true;
+}
+
+void ServerLayer::OnContentFilterLoaded(std::shared_ptr<const ContentFilter> contentFilter, bool loaded)
+{
+	m_ContentFilterLoading = false;
+	if (!loaded)
+	{
+		m_Console.AddItalicMessage("Failed to load content filter from {}, keeping the current one", m_Specification.ContentFilterFilePath.string());
+		return;
+	}
+
+	m_ContentFilter = std::move(contentFilter);
+	m_Console.AddItalicMessage("Content filter reloaded: {} terms, {} states ({} KB), built in {:.1f}ms", m_ContentFilter->GetTermCount(),
+		m_ContentFilter->GetStateCount(), m_ContentFilter->GetSize() / 1024, m_ContentFilter->GetBuildMilliseconds());
+}
+
+void ServerLayer::SendServerShutdownToAllClients()
+{
+	SendPacketToAllClients(Packets::ToClient::ServerShutdown{});
+}
+
+void ServerLayer::SendClientKick(const Walnut::ClientInfo& clientInfo, std::string_view reason)
+{
+	// Bypasses the outbound queue, the connection is closed right after this
+	Walnut::Buffer packet = EncodePacket(Packets::ToClient::ClientKick{ Packets::ToClient::ClientKick::ReasonInfo{ reason } }, m_ConnectedClients.at(clientInfo.ID).Encoding);
+	m_Server->SendBufferToClient(clientInfo.ID, packet, true);
+}
+
+static void WriteUserPresence(Walnut::StreamWriter& stream, const std::vector<const UserInfo*>& users, WireEncoding encoding)
+{
+	Wire::WriteCount(stream, (uint32_t)users.size(), encoding);
+	for (const UserInfo* user : users)
+	{
+		if (encoding == WireEncoding::Compact)
+			Wire::WriteUserID(stream, user->ID);
+		else
+			stream.WriteString(user->Username);
+		stream.WriteRaw<uint8_t>(user->Presence);
+	}
+}
+
+void ServerLayer::FlushPresenceUpdates()
+{
+	WC_TRACE_SCOPE("ServerLayer::FlushPresenceUpdates");
+	std::vector<const UserInfo*> changedUsers;
+	changedUsers.reserve(std::min((uint32_t)m_PresenceDirtyClients.size(), m_MaxPresenceUpdatesPerFlush));
+
+	size_t index = 0;
+	for (; index < m_PresenceDirtyClients.size() && changedUsers.size() < m_MaxPresenceUpdatesPerFlush; index++)
+	{
+		auto it = m_ConnectedClients.find(m_PresenceDirtyClients[index]);
+		if (it == m_ConnectedClients.end())
+			continue; // disconnected in the meantime
+
+		auto& session = it->second;
+		session.PresenceDirty = false;
+		if (session.PendingPresence == session.User.Presence)
+			continue;
+
+		session.User.Presence = session.PendingPresence;
+		changedUsers.push_back(&session.User);
+	}
+	m_PresenceDirtyClients.erase(m_PresenceDirtyClients.begin(), m_PresenceDirtyClients.begin() + index);
+
+	if (!changedUsers.empty())
+	{
+		// Presence is only part of the compact encoding's client list
+		InvalidateClientList(WireEncoding::Compact);
+
+		// Only changes are sent, so a client that's backed up can't just queue them (or keep the
+		// latest batch). It's sent everyone's current state once it catches up instead.
+		DeliveryClass deliveryClass = GetDeliveryClass(PacketType::UserPresence);
+		uint32_t requiredCapabilities = GetRequiredCapabilities(PacketType::UserPresence);
+		Walnut::Buffer encodedPackets[WireEncodingCount];
+		bool backlogged = false;
+		for (auto& [clientID, session] : m_ConnectedClients)
+		{
+			if (session.EvictionPending || !session.HasCapability(requiredCapabilities))
+				continue;
+
+			int encodingIndex = (int)session.Encoding;
+			if (!encodedPackets[encodingIndex])
+			{
+				encodedPackets[encodingIndex] = EncodePacket(PacketType::UserPresence, session.Encoding, [&](Walnut::StreamWriter& stream, WireEncoding encoding)
+				{
+					WriteUserPresence(stream, changedUsers, encoding);
+				});
+			}
+
+			const Walnut::Buffer& packet = encodedPackets[encodingIndex];
+			bool canSend = session.PresenceBacklog.empty() && CanSendDirectly(session, deliveryClass, packet.Size);
+			if (!canSend && session.PresenceBacklog.empty() && session.Outbound.IsEmpty() && UpdateSendQueueStatus(clientID, session))
+				canSend = CanSendDirectly(session, deliveryClass, packet.Size);
+			if (canSend)
+			{
+				m_Server->SendBufferToClient(clientID, packet, IsReliableDelivery(deliveryClass));
+				session.PendingSendBytes += packet.Size;
+				session.BytesSent += packet.Size;
+				continue;
+			}
+
+			for (const UserInfo* user : changedUsers)
+				session.PresenceBacklog.insert(user->ID);
+			backlogged = true;
+		}
+
+		if (backlogged)
+			StartOutboundFlushTimer();
+	}
+
+	if (m_PresenceDirtyClients.empty())
+	{
+		m_EventLoop.CancelTimer(m_PresenceFlushTimer);
+		m_PresenceFlushTimer = 0;
+	}
+}
+
+void ServerLayer::SendPresenceBacklog(Walnut::ClientID clientID, ClientSession& session)
+{
+	WC_TRACE_SCOPE("ServerLayer::SendPresenceBacklog");
+	DeliveryClass deliveryClass = GetDeliveryClass(PacketType::UserPresence);
+	std::vector<const UserInfo*> users;
+	while (!session.PresenceBacklog.empty() && session.PendingSendBytes < m_SendWindow)
+	{
+		// Same batch size as the live updates, so it fits the scratch buffer
+		users.clear();
+		for (auto it = session.PresenceBacklog.begin(); it != session.PresenceBacklog.end() && users.size() < m_MaxPresenceUpdatesPerFlush; it = session.PresenceBacklog.erase(it))
+		{
+			auto userIt = m_ConnectedClients.find(*it);
+			if (userIt != m_ConnectedClients.end())
+				users.push_back(&userIt->second.User);
+		}
+
+		if (users.empty())
+			continue; // all of them left in the meantime
+
+		Walnut::Buffer packet = EncodePacket(PacketType::UserPresence, session.Encoding, [&](Walnut::StreamWriter& stream, WireEncoding encoding)
+		{
+			WriteUserPresence(stream, users, encoding);
+		});
+		m_Server->SendBufferToClient(clientID, packet, IsReliableDelivery(deliveryClass));
+		session.PendingSendBytes += packet.Size;
+		session.BytesSent += packet.Size;
+	}
+}
+
+void ServerLayer::SendPings()
+{
+	WC_TRACE_SCOPE("ServerLayer::SendPings");
+	uint64_t serverTime = GetServerTime(EventLoop::Clock::now());
+	for (auto& [clientID, session] : m_ConnectedClients)
+	{
+		if (!session.HasCapability(ProtocolCapability::LatencyStamps))
+			continue;
+
+		// Each client is told its own round trip time, there's nothing else for it to go by
+		session.PingTime = serverTime;
+		SendPacket(clientID, Packets::ToClient::Ping{ serverTime, session.RoundTripTime });
+	}
+}
+
+void ServerLayer::OnPong(Walnut::ClientID clientID, uint64_t pingTime)
+{
+	// Only an answer to the last ping we sent it counts, and only once
+	auto& session = m_ConnectedClients.at(clientID);
+	if (!session.PingTime || pingTime != session.PingTime)
+		return;
+	session.PingTime = 0;
+
+	// Includes time spent in the client's outbound queue, if it has one
+	uint64_t serverTime = GetServerTime(EventLoop::Clock::now());
+	uint32_t roundTripTime = (uint32_t)std::min<uint64_t>(serverTime - pingTime, UINT32_MAX);
+	m_RoundTripTimes.Record(roundTripTime);
+
+	// Smoothed like TCP's SRTT, one slow pong doesn't make a slow link
+	session.RoundTripTime = session.RoundTripTime ? (uint32_t)(((uint64_t)session.RoundTripTime * 7 + roundTripTime) / 8) : std::max(roundTripTime, 1u);
+}
+
+uint64_t ServerLayer::GetServerTime(EventLoop::Clock::time_point time) const
+{
+	return time > m_StartTime ? std::chrono::duration_cast<std::chrono::microseconds>(time - m_StartTime).count() : 0;
+}
+
+void ServerLayer::ResetIdleTimeout(Walnut::ClientID clientID, const ClientSession& session)
+{
+	// Pongs every m_PingInterval are the heartbeat, anything else it sends counts too
+	if (m_Specification.HeartbeatTimeout > 0.0f && session.HasCapability(ProtocolCapability::LatencyStamps))
+		m_IdleTimeouts.Schedule(clientID, GetIdleTimeoutTicks(m_Specification.HeartbeatTimeout));
+	else
+		m_IdleTimeouts.Cancel(clientID);
+}
+
+void ServerLayer::CheckIdleTimeouts()
+{
+	m_ExpiredIdleTimeouts.clear();
+	m_IdleTimeouts.Tick(m_ExpiredIdleTimeouts);
+	for (Walnut::ClientID clientID : m_ExpiredIdleTimeouts)
+		OnIdleTimeout(clientID);
+}
+
+void ServerLayer::OnIdleTimeout(Walnut::ClientID clientID)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnIdleTimeout");
+	if (auto it = m_ConnectedClients.find(clientID); it != m_ConnectedClients.end())
+	{
+		ClientSession& session = it->second;
+		m_Console.AddItalicMessage("Disconnecting {}: nothing heard from it in {}s", session.User.Username, m_Specification.HeartbeatTimeout);
+
+		// Most likely gone, so don't bother sending it anything more (the kick included)
+		session.EvictionPending = true;
+		session.Outbound.Clear();
+		KickClient(clientID, "Timed out");
+	}
+	else if (!IsInAdmissionQueue(clientID))
+	{
+		// Never got as far as a ClientConnectionRequest, there's no session to tell
+		m_Console.AddItalicMessage("Dropping connection ID={}: no handshake within {}s", clientID, m_Specification.HandshakeTimeout);
+		m_Server->KickClient(clientID);
+	}
+}
+
+uint32_t ServerLayer::GetIdleTimeoutTicks(float seconds) const
+{
+	return std::max((uint32_t)std::ceil(seconds / m_IdleCheckInterval), 1u);
+}
+
+void ServerLayer::OnFileOffer(Walnut::ClientID clientID, uint32_t transferID, std::string_view toUsername, std::string_view filename, uint64_t size)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnFileOffer");
+	const auto& user = m_ConnectedClients.at(clientID).User;
+
+	// Offered again, carry on from what we have
+	if (FileUpload* upload = FindFileUpload(clientID, transferID))
+	{
+		upload->OfferAckPending = true;
+		SendFileAckIfReady(*upload);
+		return;
+	}
+
+	// Back after a disconnect
+	for (auto& [uploadID, upload] : m_FileUploads)
+	{
+		if (upload.UploaderID || upload.Username != user.Username || upload.ClientTransferID != transferID || upload.Filename != filename || upload.Size != size)
+			continue;
+
+		upload.UploaderID = clientID;
+		upload.OfferAckPending = true;
+		m_FileUploadIDs[(uint64_t)clientID << 32 | transferID] = uploadID;
+		m_Console.AddItalicMessage("{} resumed sending {} at {} KB", user.Username, upload.Filename, upload.Received / 1024);
+		SendFileAckIfReady(upload);
+		return;
+	}
+
+	if (size == 0 || size > m_Specification.MaxFileTransferSize || !IsValidFilename(filename))
+	{
+		SendFileComplete(clientID, transferID, FileTransferStatus::Failed, true);
+		return;
+	}
+
+	// Counting the ones waiting to be resumed
+	uint32_t uploadCount = 0;
+	uint64_t uploadBytes = size;
+	for (const auto& [uploadID, upload] : m_FileUploads)
+	{
+		if (upload.Username != user.Username)
+			continue;
+
+		uploadCount++;
+		uploadBytes += upload.Size;
+	}
+	if (uploadCount >= m_Specification.MaxFileUploadsPerClient || uploadBytes > m_Specification.MaxFileUploadBytesPerClient)
+	{
+		SendServerMessage(clientID, "You're sending too many files at once, wait for some to finish");
+		SendFileComplete(clientID, transferID, FileTransferStatus::Failed, true);
+		return;
+	}
+
+	std::vector<Walnut::ClientID> recipients;
+	if (toUsername.empty())
+	{
+		for (const auto& [recipientID, session] : m_ConnectedClients)
+		{
+			if (recipientID != clientID && session.HasCapability(ProtocolCapability::FileTransfer))
+				recipients.push_back(recipientID);
+		}
+	}
+	else
+	{
+		Walnut::ClientID recipientID = FindClientID(std::string(toUsername));
+		if (!recipientID || recipientID == clientID || !m_ConnectedClients.at(recipientID).HasCapability(ProtocolCapability::FileTransfer))
+		{
+			SendServerMessage(clientID, fmt::format("Can't send files to {}", toUsername));
+			SendFileComplete(clientID, transferID, FileTransferStatus::Failed, true);
+			return;
+		}
+		recipients.push_back(recipientID);
+	}
+
+	uint32_t uploadID = m_NextFileUploadID++;
+	FileUpload& upload = m_FileUploads[uploadID];
+	upload.ID = uploadID;
+	upload.Username = user.Username;
+	upload.ClientTransferID = transferID;
+	upload.UploaderID = clientID;
+	upload.Filename = filename;
+	upload.Size = size;
+	upload.OfferedRecipients = std::move(recipients);
+	upload.Filepath = m_Specification.FileTransferDirectory / fmt::format("{}.part", uploadID);
+	upload.Stream.open(upload.Filepath, std::ios::binary | std::ios::trunc);
+	if (!upload.Stream)
+	{
+		m_Console.AddItalicMessage("Could not create {}", upload.Filepath.string());
+		m_FileUploads.erase(uploadID);
+		SendFileComplete(clientID, transferID, FileTransferStatus::Failed, true);
+		return;
+	}
+	m_FileUploadIDs[(uint64_t)clientID << 32 | transferID] = uploadID;
+
+	m_Console.AddItalicMessage("{} is offering {} ({} KB) to {}", user.Username, upload.Filename, size / 1024, toUsername.empty() ? "everyone" : toUsername);
+	if (upload.OfferedRecipients.empty())
+	{
+		StartFileUpload(upload);
+		return;
+	}
+
+	// The uploader gets its first FileAck once the recipients have answered
+	SendPacketToClients(upload.OfferedRecipients, Packets::ToClient::FileOffer{ uploadID, user.ID, upload.Filename, size });
+	upload.OfferTimer = m_EventLoop.AddTimer(m_FileOfferTimeout, [this, uploadID]()
+	{
+		auto it = m_FileUploads.find(uploadID);
+		if (it == m_FileUploads.end())
+			return;
+
+		it->second.OfferTimer = 0;
+		if (!it->second.Started)
+			StartFileUpload(it->second);
+	}, false);
+}
+
+void ServerLayer::OnFileChunk(Walnut::ClientID clientID, uint32_t transferID, uint64_t offset, std::string_view data)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnFileChunk");
+	FileUpload* upload = FindFileUpload(clientID, transferID);
+	if (!upload || offset != upload->Received)
+		return;
+
+	// Never more than it was told it could send, which is never past the end
+	if (data.empty() || data.size() > FileChunkSize || data.size() > upload->Granted - upload->Received)
+	{
+		FinishFileUpload(upload->ID, FileTransferStatus::Failed);
+		return;
+	}
+
+	upload->Stream.write(data.data(), data.size());
+	if (!upload->Stream)
+	{
+		m_Console.AddItalicMessage("Could not write to {}", upload->Filepath.string());
+		FinishFileUpload(upload->ID, FileTransferStatus::Failed);
+		return;
+	}
+
+	// Queued behind chat (DeliveryClass::Transfer) instead of the other way around
+	ReleaseFileBytesInFlight(*upload, data.size());
+	SendPacketToClients(upload->Recipients, Packets::ToClient::FileChunk{ upload->ID, offset, data });
+
+	upload->Received += data.size();
+	if (upload->Received == upload->Size)
+		FinishFileUpload(upload->ID, FileTransferStatus::Completed);
+	else
+		SendFileAckIfReady(*upload);
+}
+
+void ServerLayer::OnFileOfferAnswer(Walnut::ClientID clientID, uint32_t uploadID, bool accepted)
+{
+	WC_TRACE_SCOPE("ServerLayer::OnFileOfferAnswer");
+	auto it = m_FileUploads.find(uploadID);
+	if (it == m_FileUploads.end())
+		return;
+
+	FileUpload& upload = it->second;
+	auto offered = std::find(upload.OfferedRecipients.begin(), upload.OfferedRecipients.end(), clientID);
+	auto recipient = std::find(upload.Recipients.begin(), upload.Recipients.end(), clientID);
+	if (offered != upload.OfferedRecipients.end())
+	{
+		upload.OfferedRecipients.erase(offered);
+		if (accepted)
+			upload.Recipients.push_back(clientID);
+	}
+	else if (!accepted && recipient != upload.Recipients.end())
+	{
+		// Stopped receiving, what's been granted for it won't go to it anymore
+		upload.Recipients.erase(recipient);
+		auto session = m_ConnectedClients.find(clientID);
+		if (session != m_ConnectedClients.end())
+			session->second.FileBytesInFlight -= std::min(session->second.FileBytesInFlight, upload.Granted - upload.Received);
+	}
+	else
 	{
-		m_Console.AddTaggedMessage(message.Username, message.Message);
+		return;
 	}
 
-	m_Console.AddTaggedMessage("Info", "Started server on port {}", Port);
-
-	m_Console.SetMessageSendCallback([this](std::string_view message) { SendChatMessage(message); });
+	if (!upload.Started && upload.OfferedRecipients.empty())
+		StartFileUpload(upload);
+	else if (upload.Started && upload.Recipients.empty())
+		FinishFileUpload(uploadID, FileTransferStatus::Cancelled);
 }
 
-void ServerLayer::OnDetach()
+FileUpload* ServerLayer::FindFileUpload(Walnut::ClientID clientID, uint32_t transferID)
 {
-	m_Server->Stop();
-	// wait for server to stop here?
-
-	m_ScratchBuffer.Release();
+	auto it = m_FileUploadIDs.find((uint64_t)clientID << 32 | transferID);
+	return it != m_FileUploadIDs.end() ? &m_FileUploads.at(it->second) : nullptr;
 }
 
-void ServerLayer::OnUpdate(float ts)
+void ServerLayer::StartFileUpload(FileUpload& upload)
 {
-	m_ClientListTimer -= ts;
-	if (m_ClientListTimer < 0)
-	{
-		m_ClientListTimer = m_ClientListInterval;
-		SendClientListToAllClients();
+	m_EventLoop.CancelTimer(upload.OfferTimer);
+	upload.OfferTimer = 0;
+
+	// Whoever didn't answer in time doesn't get it
+	SendPacketToClients(upload.OfferedRecipients, Packets::ToClient::FileComplete{ upload.ID, FileTransferStatus::Cancelled, false });
+	upload.OfferedRecipients.clear();
 
-		// Save chat history every 10s too
-		SaveMessageHistoryToFile(m_MessageHistoryFilePath);
+	if (upload.Recipients.empty())
+	{
+		FinishFileUpload(upload.ID, FileTransferStatus::Declined);
+		return;
 	}
+
+	upload.Started = true;
+	SendFileAckIfReady(upload);
 }
 
-void ServerLayer::OnUIRender()
+void ServerLayer::SendFileAckIfReady(FileUpload& upload)
 {
-#ifndef WL_HEADLESS
-	{
-		ImGui::Begin("Client Info");
-		ImGui::Text("Connected clients: %d", m_ConnectedClients.size());
-
-		static bool selected = false;
-		for (const auto& [id, name] : m_ConnectedClients)
-		{
-			if (name.Username.empty())
-				continue;
+	if (!upload.UploaderID || !upload.Started)
+		return;
 
-			ImGui::Selectable(name.Username.c_str(), &selected);
-			if (ImGui::IsItemHovered())
-			{
-				// Get some more info about client from server
-				const auto& clientInfo = m_Server->GetConnectedClients().at(id);
+	// An offer is answered as soon as it can be, after that it's every m_FileAckInterval
+	if (!upload.OfferAckPending && upload.Received - upload.Acked < m_FileAckInterval)
+		return;
 
-				ImGui::BeginTooltip();
-				ImGui::SetTooltip(clientInfo.ConnectionDesc.c_str());
-				ImGui::EndTooltip();
-			}
+	uint64_t granted = std::min(upload.Received + FileTransferWindow, upload.Size);
+	uint64_t bytes = granted - upload.Granted;
+	for (Walnut::ClientID recipientID : upload.Recipients)
+	{
+		auto it = m_ConnectedClients.find(recipientID);
+		if (it != m_ConnectedClients.end() && it->second.Outbound.GetSize() + it->second.FileBytesInFlight + bytes > m_FileTransferBackpressureBytes)
+		{
+			// Retried every outbound flush until it fits
+			m_FileAcksHeldBack = true;
+			StartOutboundFlushTimer();
+			return;
 		}
-		ImGui::End();
 	}
 
-	m_Console.OnUIRender();
+	for (Walnut::ClientID recipientID : upload.Recipients)
+	{
+		auto it = m_ConnectedClients.find(recipientID);
+		if (it != m_ConnectedClients.end())
+			it->second.FileBytesInFlight += bytes;
+	}
 
-	// ImGui::ShowDemoWindow();
-#endif
+	upload.Granted = granted;
+	upload.Acked = upload.Received;
+	upload.OfferAckPending = false;
+	SendPacket(upload.UploaderID, Packets::ToClient::FileAck{ upload.ClientTransferID, upload.Acked });
 }
 
-void ServerLayer::OnClientConnected(const Walnut::ClientInfo& clientInfo)
+void ServerLayer::SendHeldBackFileAcks()
 {
-	// Client connection is handled in the PacketType::ClientConnectionRequest case
+	m_FileAcksHeldBack = false;
+	for (auto& [uploadID, upload] : m_FileUploads)
+		SendFileAckIfReady(upload);
 }
 
-void ServerLayer::OnClientDisconnected(const Walnut::ClientInfo& clientInfo)
+void ServerLayer::ReleaseFileBytesInFlight(const FileUpload& upload, uint64_t bytes)
 {
-	if (m_ConnectedClients.contains(clientInfo.ID))
-	{
-		SendClientDisconnect(clientInfo);
-		const auto& userInfo = m_ConnectedClients.at(clientInfo.ID);
-		m_Console.AddItalicMessage("Client {} disconnected", userInfo.Username);
-		m_ConnectedClients.erase(clientInfo.ID);
-	}
-	else
+	for (Walnut::ClientID recipientID : upload.Recipients)
 	{
-		std::cout << "[ERROR] OnClientDisconnected - Could not find client with ID=" << clientInfo.ID << std::endl;
-		std::cout << "  ConnectionDesc=" << clientInfo.ConnectionDesc << std::endl;
+		auto it = m_ConnectedClients.find(recipientID);
+		if (it != m_ConnectedClients.end())
+			it->second.FileBytesInFlight -= std::min(it->second.FileBytesInFlight, bytes);
 	}
 }
 
-void ServerLayer::OnDataReceived(const Walnut::ClientInfo& clientInfo, const Walnut::Buffer buffer)
+void ServerLayer::SendFileComplete(Walnut::ClientID clientID, uint32_t transferID, FileTransferStatus status, bool upload)
 {
-	Walnut::BufferStreamReader stream(buffer);
-
-	PacketType type;
-	bool success = stream.ReadRaw<PacketType>(type);
-	WL_CORE_VERIFY(success);
-	if (!success) // Why couldn't we read packet type? Probs invalid packet
-		return; 
+	SendPacket(clientID, Packets::ToClient::FileComplete{ transferID, status, upload });
+}
 
-	switch (type)
+void ServerLayer::FinishFileUpload(uint32_t uploadID, FileTransferStatus status)
+{
+	WC_TRACE_SCOPE("ServerLayer::FinishFileUpload");
+	FileUpload& upload = m_FileUploads.at(uploadID);
+	upload.Stream.close();
+	m_EventLoop.CancelTimer(upload.OfferTimer);
+	ReleaseFileBytesInFlight(upload, upload.Granted - upload.Received);
+
+	SendPacketToClients(upload.Recipients, Packets::ToClient::FileComplete{ uploadID, status, false });
+	SendPacketToClients(upload.OfferedRecipients, Packets::ToClient::FileComplete{ uploadID, status, false });
+	if (upload.UploaderID)
 	{
-		case PacketType::Message:
-		{
-			if (!m_ConnectedClients.contains(clientInfo.ID))
-			{
-				// Reject message data from clients we don't recognize
-				m_Console.AddMessage("Rejected incoming data from client ID={}", clientInfo.ID);
-				m_Console.AddMessage("  ConnectionDesc={}", clientInfo.ConnectionDesc);
-				return;
-			}
-
-			std::string message;
-			if (stream.ReadString(message))
-			{
-				if (IsValidMessage(message)) // will trim to 4096 max chars if necessary (as defined in UserInfo.h)
-				{
-					// Send to other clients and record
-					WL_CORE_VERIFY(m_ConnectedClients.contains(clientInfo.ID));
-					const auto& client = m_ConnectedClients.at(clientInfo.ID);
-
-					m_MessageHistory.push_back({ client.Username, message });
-					m_Console.AddTaggedMessageWithColor(client.Color | 0xff000000, client.Username, message);
-					SendMessageToAllClients(clientInfo, message);
-				}
-			}
-			break;
-		}
-		case PacketType::ClientConnectionRequest:
-		{
-			uint32_t requestedColor;
-			std::string requestedUsername;
-			stream.ReadRaw<uint32_t>(requestedColor);
-			if (stream.ReadString(requestedUsername))
-			{
-				bool isValidUsername = IsValidUsername(requestedUsername);
-				SendClientConnectionRequestResponse(clientInfo, isValidUsername);
-				if (isValidUsername)
-				{
-					m_Console.AddMessage("Welcome {} (color {})", requestedUsername, requestedColor);
-					auto& client = m_ConnectedClients[clientInfo.ID];
-					client.Username = requestedUsername;
-					client.Color = requestedColor;
-					// connection complete? notify everyone else
-					SendClientConnect(clientInfo);
-
-					// Send the new client info about other connected clients
-					SendClientList(clientInfo);
-					
-					// Send message history to new client
-					SendMessageHistory(clientInfo);
-				}
-				else
-				{
-					m_Console.AddMessage("Client connection rejected with color {} and username {}", requestedColor, requestedUsername);
-					m_Console.AddMessage("Reason: invalid username");
-				}
-
-			}
-			break;
-		}
+		SendFileComplete(upload.UploaderID, upload.ClientTransferID, status, true);
+		m_FileUploadIDs.erase((uint64_t)upload.UploaderID << 32 | upload.ClientTransferID);
+	}
 
+	std::error_code error;
+	if (status == FileTransferStatus::Completed)
+	{
+		std::filesystem::path filepath = m_Specification.FileTransferDirectory / fmt::format("{}-{}", uploadID, GetSafeFilename(upload.Filename));
+		std::filesystem::rename(upload.Filepath, filepath, error);
+		m_Console.AddItalicMessage("{} sent {} ({} KB), stored as {}", upload.Username, upload.Filename, upload.Size / 1024, filepath.string());
+	}
+	else
+	{
+		std::filesystem::remove(upload.Filepath, error);
+		if (status == FileTransferStatus::Declined)
+			m_Console.AddItalicMessage("Nobody accepted {} from {}", upload.Filename, upload.Username);
+		else
+			m_Console.AddItalicMessage("{} {} sending {}", upload.Username, status == FileTransferStatus::Cancelled ? "stopped" : "failed", upload.Filename);
 	}
 
+	m_FileUploads.erase(uploadID);
 }
 
-void ServerLayer::OnMessageReceived(const Walnut::ClientInfo& clientInfo, std::string_view message)
+void ServerLayer::PauseFileUploads(Walnut::ClientID clientID)
 {
+	for (auto& [uploadID, upload] : m_FileUploads)
+	{
+		if (upload.UploaderID != clientID)
+			continue;
+
+		m_FileUploadIDs.erase((uint64_t)clientID << 32 | upload.ClientTransferID);
+		upload.UploaderID = 0;
+		upload.PausedTime = std::chrono::steady_clock::now();
 
+		// Whatever it was allowed to send is lost with the connection, it's granted again on resume
+		ReleaseFileBytesInFlight(upload, upload.Granted - upload.Received);
+		upload.Granted = upload.Received;
+	}
 }
 
-void ServerLayer::OnClientConnectionRequest(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username)
+void ServerLayer::RemoveFileRecipient(Walnut::ClientID clientID)
 {
+	// Answering for it can finish uploads, so not while going through them
+	std::vector<uint32_t> uploadIDs;
+	for (const auto& [uploadID, upload] : m_FileUploads)
+		uploadIDs.push_back(uploadID);
 
+	for (uint32_t uploadID : uploadIDs)
+		OnFileOfferAnswer(clientID, uploadID, false);
 }
 
-void ServerLayer::OnClientUpdate(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username)
+void ServerLayer::CleanUpFileUploads()
 {
+	auto now = std::chrono::steady_clock::now();
+	std::vector<uint32_t> expiredUploads;
+	for (const auto& [uploadID, upload] : m_FileUploads)
+	{
+		if (!upload.UploaderID && std::chrono::duration<float>(now - upload.PausedTime).count() > m_FileUploadResumeTimeout)
+			expiredUploads.push_back(uploadID);
+	}
 
+	for (uint32_t uploadID : expiredUploads)
+		FinishFileUpload(uploadID, FileTransferStatus::Cancelled);
 }
 
-void ServerLayer::SendClientList(const Walnut::ClientInfo& clientInfo)
+bool ServerLayer::Restart()
 {
-	std::vector<UserInfo> clientList(m_ConnectedClients.size());
-	uint32_t index = 0;
-	for (const auto& [clientID, clientInfo] : m_ConnectedClients)
-		clientList[index++] = clientInfo;
-
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::ClientList);
-	stream.WriteArray(clientList);
+	WC_TRACE_SCOPE("ServerLayer::Restart");
+	const auto& filepath = m_Specification.RestartSnapshotFilePath;
+	if (filepath.empty())
+		return false;
 
-	// WL_INFO("Sending client list to all clients");
-	m_Server->SendBufferToClient(clientInfo.ID, Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()));
-}
+	// The next process only has what's on disk
+	SaveHistoryIfDirty();
 
-void ServerLayer::SendClientListToAllClients()
-{
-	std::vector<UserInfo> clientList(m_ConnectedClients.size());
-	uint32_t index = 0;
-	for (const auto& [clientID, clientInfo] : m_ConnectedClients)
-		clientList[index++] = clientInfo;
+	RestartSnapshot snapshot;
+	snapshot.CreationTime = RestartSnapshot::GetUnixTime();
+	snapshot.HistoryEndSequence = m_MessageHistory.GetEndSequence();
 
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::ClientList);
-	stream.WriteArray(clientList);
+	std::random_device randomDevice;
+	std::mt19937_64 random(((uint64_t)randomDevice() << 32) | randomDevice());
+	std::unordered_map<Walnut::ClientID, uint64_t> resumeTokens;
+	for (const auto& [clientID, session] : m_ConnectedClients)
+	{
+		// Clients still getting their join history don't have everything before
+		// HistoryEndSequence, they join again like everyone without SessionResume
+		if (!session.HasCapability(ProtocolCapability::SessionResume) || session.SendingHistory || session.EvictionPending)
+			continue;
+
+		uint64_t resumeToken = random() | 1; // never 0
+		resumeTokens[clientID] = resumeToken;
+		snapshot.Sessions.push_back({ resumeToken, session.User.Username, session.User.Color, (uint8_t)(session.PendingPresence & ~PresenceFlags::Typing) });
+	}
 
-	// WL_INFO("Sending client list to all clients");
-	m_Server->SendBufferToAllClients(Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()));
-}
+	if (!snapshot.WriteToFile(filepath))
+		return false;
 
-void ServerLayer::SendClientConnect(const Walnut::ClientInfo& newClient)
-{
-	WL_VERIFY(m_ConnectedClients.contains(newClient.ID));
-	const auto& newClientInfo = m_ConnectedClients.at(newClient.ID);
+	// Straight to the network, anything still queued first. Reliable packets arrive in order,
+	// so a client that gets its token got everything before it too.
+	for (auto& [clientID, session] : m_ConnectedClients)
+	{
+		session.Outbound.Drain(UINT64_MAX, [&, clientID = clientID](const SharedBuffer& packet)
+		{
+			m_Server->SendBufferToClient(clientID, AsBuffer(packet), true);
+		});
 
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::ClientConnect);
-	stream.WriteObject(newClientInfo);
+		Walnut::Buffer packet;
+		if (auto it = resumeTokens.find(clientID); it != resumeTokens.end())
+			packet = EncodePacket(Packets::ToClient::ServerRestart{ it->second }, session.Encoding);
+		else
+			packet = EncodePacket(Packets::ToClient::ServerShutdown{}, session.Encoding);
+		m_Server->SendBufferToClient(clientID, packet, true);
+	}
 
-	m_Server->SendBufferToAllClients(Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()), newClient.ID);
+	m_Console.AddItalicMessage("Restarting: {} of {} sessions can be resumed within {}s", snapshot.Sessions.size(), m_ConnectedClients.size(), m_SessionResumeTimeout);
+	m_Server->Stop();
+	Walnut::Application::Get().Close();
+	return true;
 }
 
-void ServerLayer::SendClientDisconnect(const Walnut::ClientInfo& clientInfo)
+void ServerLayer::LoadRestartSnapshot()
 {
-	const auto& userInfo = m_ConnectedClients.at(clientInfo.ID);
-
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::ClientDisconnect);
-	stream.WriteObject(userInfo);
+	WC_TRACE_SCOPE("ServerLayer::LoadRestartSnapshot");
+	const auto& filepath = m_Specification.RestartSnapshotFilePath;
+	if (filepath.empty() || !std::filesystem::exists(filepath))
+		return;
 
-	m_Server->SendBufferToAllClients(Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()), clientInfo.ID);
-}
+	RestartSnapshot snapshot;
+	bool loaded = snapshot.ReadFromFile(filepath);
 
-void ServerLayer::SendClientConnectionRequestResponse(const Walnut::ClientInfo& clientInfo, bool response)
-{
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::ClientConnectionRequest);
-	stream.WriteRaw<bool>(response);
+	// Only good for the process that comes right after the restart
+	std::error_code error;
+	std::filesystem::remove(filepath, error);
 
-	m_Server->SendBufferToClient(clientInfo.ID, Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()));
-}
+	if (!loaded)
+	{
+		m_Console.AddTaggedMessage("Info", "Ignoring invalid restart snapshot {}", filepath.string());
+		return;
+	}
 
-void ServerLayer::SendClientUpdateResponse(const Walnut::ClientInfo& clientInfo)
-{
+	uint64_t age = snapshot.GetAge();
+	if (age >= (uint64_t)m_SessionResumeTimeout)
+	{
+		m_Console.AddTaggedMessage("Info", "Ignoring restart snapshot from {}s ago", age);
+		return;
+	}
 
-}
+	// Clients would have messages we don't
+	if (snapshot.HistoryEndSequence > m_MessageHistory.GetEndSequence())
+	{
+		m_Console.AddTaggedMessage("Info", "Ignoring restart snapshot, message history is behind it ({} < {})", m_MessageHistory.GetEndSequence(), snapshot.HistoryEndSequence);
+		return;
+	}
 
-void ServerLayer::SendMessageToAllClients(const Walnut::ClientInfo& fromClient, std::string_view message)
-{
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::Message);
-	stream.WriteString(GetClientUsername(fromClient.ID));
-	stream.WriteString(message);
+	m_ResumableSessions.reserve(snapshot.Sessions.size());
+	for (auto& session : snapshot.Sessions)
+		m_ResumableSessions[session.Username] = std::move(session);
+	m_ResumeHistorySequence = snapshot.HistoryEndSequence;
 
-	m_Server->SendBufferToAllClients(Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()), fromClient.ID);
+	if (!m_ResumableSessions.empty())
+		m_SessionResumeTimer = m_EventLoop.AddTimer(m_SessionResumeTimeout - (float)age, [this]() { OnSessionResumeTimeout(); }, false);
+	m_Console.AddTaggedMessage("Info", "Loaded restart snapshot, {} sessions can be resumed", m_ResumableSessions.size());
 }
 
-void ServerLayer::SendMessageHistory(const Walnut::ClientInfo& clientInfo)
+bool ServerLayer::ResumeClient(const Walnut::ClientInfo& clientInfo, std::string_view username, uint64_t resumeToken, uint16_t protocolVersion, uint32_t capabilities)
 {
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::MessageHistory);
-	stream.WriteArray(m_MessageHistory);
+	WC_TRACE_SCOPE("ServerLayer::ResumeClient");
+	auto it = m_ResumableSessions.find(std::string(username));
+	if (it == m_ResumableSessions.end() || it->second.ResumeToken != resumeToken)
+		return false;
+
+	RestartSession resumedSession = std::move(it->second);
+	m_ResumableSessions.erase(it);
+	if (m_ResumableSessions.empty() && m_SessionResumeTimer)
+	{
+		m_EventLoop.CancelTimer(m_SessionResumeTimer);
+		m_SessionResumeTimer = 0;
+	}
 
-	m_Server->SendBufferToClient(clientInfo.ID, Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()));
+	SendClientConnectionRequestResponse(clientInfo, true, protocolVersion, capabilities, true);
+	m_Console.AddMessage("Welcome back {} (color {})", resumedSession.Username, resumedSession.Color);
+
+	auto& client = m_ConnectedClients[clientInfo.ID];
+	m_BroadcastTargetsValid = false;
+	client.User.Username = resumedSession.Username;
+	client.User.Color = resumedSession.Color;
+	client.User.Presence = resumedSession.Presence;
+	client.User.ID = clientInfo.ID;
+	client.PendingPresence = resumedSession.Presence;
+	client.ConnectionDesc = clientInfo.ConnectionDesc;
+	client.ProtocolVersion = protocolVersion;
+	client.Capabilities = capabilities;
+	client.Encoding = GetWireEncoding(capabilities);
+	m_ClientIDsByUsername[resumedSession.Username] = clientInfo.ID;
+	AddToClientList(client.User);
+
+	SendClientConnect(clientInfo);
+	// User IDs are new, so the client list still has to be sent
+	SendClientList(clientInfo);
+	// Only what was said since the restart
+	SendMessageHistory(clientInfo, m_ResumeHistorySequence);
+	ResetIdleTimeout(clientInfo.ID, client);
+	return true;
 }
 
-void ServerLayer::SendServerShutdownToAllClients()
+void ServerLayer::OnSessionResumeTimeout()
 {
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::ServerShutdown);
+	m_SessionResumeTimer = 0;
+	if (m_ResumableSessions.empty())
+		return;
 
-	m_Server->SendBufferToAllClients(Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()));
+	m_Console.AddItalicMessage("{} sessions weren't resumed after the restart, their usernames are free again", m_ResumableSessions.size());
+	m_ResumableSessions.clear();
 }
 
-void ServerLayer::SendClientKick(const Walnut::ClientInfo& clientInfo, std::string_view reason)
+bool ServerLayer::KickUser(std::string_view username, std::string_view reason)
 {
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::ClientKick);
-	stream.WriteString(std::string(reason));
+	Walnut::ClientID clientID = FindClientID(std::string(username));
+	if (!clientID)
+		return false; // Could not find user with requested username
 
-	m_Server->SendBufferToClient(clientInfo.ID, Walnut::Buffer(m_ScratchBuffer, stream.GetStreamPosition()));
+	KickClient(clientID, reason);
+	return true;
 }
 
-bool ServerLayer::KickUser(std::string_view username, std::string_view reason)
+void ServerLayer::KickClient(Walnut::ClientID clientID, std::string_view reason)
 {
-	for (const auto& [clientID, userInfo] : m_ConnectedClients)
-	{
-		if (userInfo.Username == username)
-		{
-			Walnut::ClientInfo clientInfo = { clientID, "" };
-			SendClientKick(clientInfo, reason);
-			m_Server->KickClient(clientID);
-			OnClientDisconnected(clientInfo);
-			return true;
-		}
-	}
-
-	// Could not find user with requested username
-	return false;
+	Walnut::ClientInfo clientInfo = { clientID, "" };
+	SendClientKick(clientInfo, reason);
+	m_Server->KickClient(clientID);
+	OnClientDisconnected(clientInfo);
 }
 
 void ServerLayer::Quit()
@@ -333,29 +2358,30 @@ void ServerLayer::Quit()
 
 bool ServerLayer::IsValidUsername(const std::string& username) const
 {
-	for (const auto& [id, client] : m_ConnectedClients)
-	{
-		if (client.Username == username)
-			return false;
-	}
+	return !m_ClientIDsByUsername.contains(username) && !m_ResumableSessions.contains(username);
+}
 
-	return true;
+Walnut::ClientID ServerLayer::FindClientID(const std::string& username) const
+{
+	auto it = m_ClientIDsByUsername.find(username);
+	return it != m_ClientIDsByUsername.end() ? it->second : 0;
 }
 
 const std::string& ServerLayer::GetClientUsername(Walnut::ClientID clientID) const
 {
 	WL_VERIFY(m_ConnectedClients.contains(clientID));
-	return m_ConnectedClients.at(clientID).Username;
+	return m_ConnectedClients.at(clientID).User.Username;
 }
 
 uint32_t ServerLayer::GetClientColor(Walnut::ClientID clientID) const
 {
 	WL_VERIFY(m_ConnectedClients.contains(clientID));
-	return m_ConnectedClients.at(clientID).Color;
+	return m_ConnectedClients.at(clientID).User.Color;
 }
 
 void ServerLayer::SendChatMessage(std::string_view message)
 {
+	WC_TRACE_SCOPE("ServerLayer::SendChatMessage");
 	if (message[0] == '/')
 	{
 		// Try to run command instead
@@ -363,25 +2389,40 @@ void ServerLayer::SendChatMessage(std::string_view message)
 		return;
 	}
 
-	Walnut::BufferStreamWriter stream(m_ScratchBuffer);
-	stream.WriteRaw<PacketType>(PacketType::Message);
-	stream.WriteString(std::string_view("SERVER")); // Username
-	stream.WriteString(message);
-	m_Server->SendBufferToAllClients(stream.GetBuffer());
+	SendPacketToAllClients(Packets::ToClient::Message{ { ServerUserID, "SERVER" }, message, {} });
 
 	// echo in own console and add to message history
-	m_Console.AddTaggedMessage("SERVER", message);
-	m_MessageHistory.push_back({ "SERVER", std::string(message) });
+	m_Console.AddTaggedMessage("SERVER", "{}", message);
+	AppendMessageHistory({ "SERVER", message });
+}
+
+// Like Walnut::Utils::SplitString() (empty tokens are skipped), but the tokens point into text
+static void SplitString(std::string_view text, char delimiter, std::pmr::vector<std::string_view>& tokens)
+{
+	size_t first = 0;
+	while (first < text.size())
+	{
+		size_t second = std::min(text.find(delimiter, first), text.size());
+		if (second != first)
+			tokens.push_back(text.substr(first, second - first));
+		first = second + 1;
+	}
 }
 
 void ServerLayer::OnCommand(std::string_view command)
 {
+	WC_TRACE_SCOPE("ServerLayer::OnCommand");
 	if (command.size() < 2 || command[0] != '/')
 		return;
 
 	std::string_view commandStr(&command[1], command.size() - 1);
 
-	auto tokens = Walnut::Utils::SplitString(commandStr, ' ');
+	ScratchArena<512> arena;
+	std::pmr::vector<std::string_view> tokens(&arena);
+	SplitString(commandStr, ' ', tokens);
+	if (tokens.empty())
+		return;
+
 	if (tokens[0] == "kick")
 	{
 		if (tokens.size() == 2 || tokens.size() == 3)
@@ -403,21 +2444,219 @@ void ServerLayer::OnCommand(std::string_view command)
 			m_Console.AddItalicMessage("Kick command requires single argument, eg. /kick <username>");
 		}
 	}
+	else if (tokens[0] == "msg")
+	{
+		std::string_view username, message;
+		if (ParseDirectMessageCommand(command, username, message))
+		{
+			UserInfo serverUser;
+			serverUser.Username = "SERVER";
+			serverUser.Color = 0xffffffff;
+			serverUser.ID = ServerUserID;
+			OnDirectMessage(serverUser, username, message);
+		}
+		else
+		{
+			m_Console.AddItalicMessage("Msg command requires a username and a message, eg. /msg <username> <message>");
+		}
+	}
+	else if (tokens[0] == "history")
+	{
+		m_Console.AddItalicMessage("Message history: {} messages (sequences {}-{}), {} segments, {} cached", m_MessageHistory.GetMessageCount(),
+			m_MessageHistory.GetFirstSequence(), m_MessageHistory.GetEndSequence(), m_MessageHistory.GetSegmentCount(), m_MessageHistory.GetCachedSegmentCount());
+		m_Console.AddItalicMessage("Encoded for sending: {} messages (sequences {}-{}), {} KB", m_EncodedMessageHistory.GetMessageCount(),
+			m_EncodedMessageHistory.GetBeginSequence(), m_EncodedMessageHistory.GetEndSequence(), m_EncodedMessageHistory.GetSize() / 1024);
+	}
+	else if (tokens[0] == "search")
+	{
+		if (command.size() > 8)
+		{
+			// Everything after "/search ", spaces included
+			std::string_view text = command.substr(8);
+			uint32_t resultCount = 0;
+			m_MessageHistory.Search(text, 20, [&](uint64_t sequence, const ChatMessageView& message)
+			{
+				m_Console.AddTaggedMessage(fmt::format("#{} {}", sequence, message.Username), "{}", message.Message);
+				resultCount++;
+				return true;
+			});
+			m_Console.AddItalicMessage("{} results for \"{}\"", resultCount, text);
+		}
+		else
+		{
+			m_Console.AddItalicMessage("Search command requires text to search for, eg. /search <text>");
+		}
+	}
+	else if (tokens[0] == "capture")
+	{
+		if (tokens.size() == 3 && tokens[1] == "start")
+		{
+			StopCapture();
+			StartCapture(tokens[2]);
+		}
+		else if (tokens.size() == 2 && tokens[1] == "stop")
+		{
+			StopCapture();
+		}
+		else
+		{
+			m_Console.AddItalicMessage("Capture command usage: /capture start <file> or /capture stop");
+		}
+	}
+	else if (tokens[0] == "filter")
+	{
+		if (tokens.size() == 2 && tokens[1] == "reload")
+		{
+			if (ReloadContentFilter())
+				m_Console.AddItalicMessage("Reloading content filter from {}...", m_Specification.ContentFilterFilePath.string());
+			else
+				m_Console.AddItalicMessage("Can't reload content filter (already reloading, or no filter file)");
+		}
+		else if (tokens.size() == 1)
+		{
+			m_Console.AddItalicMessage("Content filter: {} terms, {} states ({} KB)", m_ContentFilter->GetTermCount(), m_ContentFilter->GetStateCount(), m_ContentFilter->GetSize() / 1024);
+			m_Console.AddItalicMessage("  {} blocked, {} masked, {} flagged", m_ContentFilterCounts[(int)ContentFilterAction::Block],
+				m_ContentFilterCounts[(int)ContentFilterAction::Mask], m_ContentFilterCounts[(int)ContentFilterAction::Flag]);
+		}
+		else
+		{
+			m_Console.AddItalicMessage("Filter command usage: /filter or /filter reload");
+		}
+	}
+	else if (tokens[0] == "latency")
+	{
+		auto printPercentiles = [this](std::string_view name, const LatencyHistogram& histogram)
+		{
+			m_Console.AddItalicMessage("{}: {} samples, p50 {:.2f}ms, p90 {:.2f}ms, p99 {:.2f}ms, max {:.2f}ms", name, histogram.GetCount(),
+				histogram.GetPercentile(50.0) / 1000.0, histogram.GetPercentile(90.0) / 1000.0, histogram.GetPercentile(99.0) / 1000.0, histogram.GetMax() / 1000.0);
+		};
+
+		// Network vs. us: round trips are the link, residence is the time messages spend in here
+		printPercentiles("Round trip", m_RoundTripTimes);
+		printPercentiles("Message residence", m_MessageResidenceTimes);
+		if (tokens.size() == 2 && tokens[1] == "reset")
+		{
+			m_RoundTripTimes.Clear();
+			m_MessageResidenceTimes.Clear();
+			m_Console.AddItalicMessage("Latency stats reset");
+		}
+	}
+	else if (tokens[0] == "broadcasts")
+	{
+		auto printStats = [this](std::string_view name, const BroadcastStats& stats)
+		{
+			if (stats.Count == 0)
+			{
+				m_Console.AddItalicMessage("{}: none", name);
+				return;
+			}
+
+			m_Console.AddItalicMessage("{}: {} broadcasts, {} recipients on average, {:.1f}us on average, {:.1f}us max", name, stats.Count,
+				stats.Recipients / stats.Count, stats.TotalNanoseconds / stats.Count / 1000.0, stats.MaxNanoseconds / 1000.0);
+		};
+
+		printStats("Serial", m_SerialBroadcastStats);
+		printStats("Fanned out", m_FanOutBroadcastStats);
+		if (m_FanOutPool)
+		{
+			m_Console.AddItalicMessage("  {} threads (for {}+ recipients), {} chunks, {} stolen", m_FanOutPool->GetWorkerCount() + 1,
+				m_Specification.FanOutMinRecipients, m_FanOutBroadcastStats.Chunks, m_FanOutBroadcastStats.StolenChunks);
+		}
+		else
+		{
+			m_Console.AddItalicMessage("  Fan-out disabled (no worker threads, or the transport doesn't support concurrent sends)");
+		}
+	}
+	else if (tokens[0] == "restart")
+	{
+		if (!Restart())
+			m_Console.AddItalicMessage("Can't restart (no restart snapshot file, or it couldn't be written)");
+	}
+	else if (tokens[0] == "trace")
+	{
+		if (!Trace::IsCompiledIn())
+		{
+			m_Console.AddItalicMessage("Tracing isn't compiled into this build (WC_ENABLE_TRACING)");
+		}
+		else if (tokens.size() >= 2 && tokens[1] == "start")
+		{
+			if (Trace::Start())
+				m_Console.AddItalicMessage("Tracing started");
+			else
+				m_Console.AddItalicMessage("Already tracing");
+		}
+		else if (tokens.size() >= 2 && tokens[1] == "stop")
+		{
+			std::string filepath(tokens.size() >= 3 ? tokens[2] : "ServerTrace.json");
+			if (Trace::Stop(filepath))
+				m_Console.AddItalicMessage("Trace written to {}", filepath);
+			else
+				m_Console.AddItalicMessage("Failed to write trace (not tracing?)");
+		}
+		else
+		{
+			m_Console.AddItalicMessage("Trace command usage: /trace start or /trace stop [file]");
+		}
+	}
+}
+
+bool ServerLayer::ImportLegacyMessageHistory(const std::filesystem::path& filepath)
+{
+	WC_TRACE_SCOPE("ServerLayer::ImportLegacyMessageHistory");
+	if (!std::filesystem::exists(filepath))
+		return false;
+
+	YAML::Node data;
+	try
+	{
+		data = YAML::LoadFile(filepath.string());
+	}
+	catch (YAML::ParserException e)
+	{
+		std::cout << "[ERROR] Failed to load message history " << filepath << std::endl << e.what() << std::endl;
+		return false;
+	}
+
+	auto rootNode = data["MessageHistory"];
+	if (!rootNode)
+		return false;
+
+	for (const auto& node : rootNode)
+		m_MessageHistory.Append(ChatMessage(node["User"].as<std::string>(), node["Message"].as<std::string>()));
+	m_MessageHistory.Flush();
+
+	// Keep the original around, but make sure it's never imported twice
+	std::filesystem::path importedFilepath = filepath;
+	importedFilepath += ".imported";
+	std::error_code error;
+	std::filesystem::rename(filepath, importedFilepath, error);
+
+	m_Console.AddTaggedMessage("Info", "Imported {} messages from {}", rootNode.size(), filepath.string());
+	return true;
 }
 
-void ServerLayer::SaveMessageHistoryToFile(const std::filesystem::path& filepath)
+void ServerLayer::SaveDirectMessageHistoryToFile(const std::filesystem::path& filepath)
 {
+	WC_TRACE_SCOPE("ServerLayer::SaveDirectMessageHistoryToFile");
 	YAML::Emitter out;
 	{
 		out << YAML::BeginMap; // Root
-		out << YAML::Key << "MessageHistory" << YAML::Value;
+		out << YAML::Key << "DirectMessages" << YAML::Value;
 
 		out << YAML::BeginSeq;
-		for (const auto& chatMessage : m_MessageHistory)
+		for (const auto& [conversation, messages] : m_DirectMessageHistory)
 		{
 			out << YAML::BeginMap;
-			out << YAML::Key << "User" << YAML::Value << chatMessage.Username;
-			out << YAML::Key << "Message" << YAML::Value << chatMessage.Message;
+			out << YAML::Key << "Users" << YAML::Value << YAML::Flow << YAML::BeginSeq << conversation.first << conversation.second << YAML::EndSeq;
+			out << YAML::Key << "Messages" << YAML::Value << YAML::BeginSeq;
+			for (const auto& chatMessage : messages)
+			{
+				out << YAML::BeginMap;
+				out << YAML::Key << "User" << YAML::Value << chatMessage.Username;
+				out << YAML::Key << "Message" << YAML::Value << chatMessage.Message;
+				out << YAML::EndMap;
+			}
+			out << YAML::EndSeq;
 			out << YAML::EndMap;
 		}
 		out << YAML::EndSeq;
@@ -427,14 +2666,16 @@ void ServerLayer::SaveMessageHistoryToFile(const std::filesystem::path& filepath
 	std::ofstream fout(filepath);
 	fout << out.c_str();
 
+	m_DirectMessageHistoryDirty = false;
 }
 
-bool ServerLayer::LoadMessageHistoryFromFile(const std::filesystem::path& filepath)
+bool ServerLayer::LoadDirectMessageHistoryFromFile(const std::filesystem::path& filepath)
 {
+	WC_TRACE_SCOPE("ServerLayer::LoadDirectMessageHistoryFromFile");
 	if (!std::filesystem::exists(filepath))
 		return false;
 
-	m_MessageHistory.clear();
+	m_DirectMessageHistory.clear();
 
 	YAML::Node data;
 	try
@@ -443,17 +2684,25 @@ bool ServerLayer::LoadMessageHistoryFromFile(const std::filesystem::path& filepa
 	}
 	catch (YAML::ParserException e)
 	{
-		std::cout << "[ERROR] Failed to load message history " << filepath << std::endl << e.what() << std::endl;
+		std::cout << "[ERROR] Failed to load direct message history " << filepath << std::endl << e.what() << std::endl;
 		return false;
 	}
 
-	auto rootNode = data["MessageHistory"];
+	auto rootNode = data["DirectMessages"];
 	if (!rootNode)
 		return false;
 
-	m_MessageHistory.reserve(rootNode.size());
-	for (const auto& node : rootNode)
-		m_MessageHistory.emplace_back(ChatMessage(node["User"].as<std::string>(), node["Message"].as<std::string>()));
+	for (const auto& conversationNode : rootNode)
+	{
+		auto usersNode = conversationNode["Users"];
+		if (!usersNode || usersNode.size() != 2)
+			continue;
+
+		ConversationKey conversation = std::minmax(usersNode[0].as<std::string>(), usersNode[1].as<std::string>());
+		auto& messages = m_DirectMessageHistory[conversation];
+		for (const auto& node : conversationNode["Messages"])
+			messages.emplace_back(ChatMessage(node["User"].as<std::string>(), node["Message"].as<std::string>()));
+	}
 
 	return true;
-}
+}
\ No newline at end of file
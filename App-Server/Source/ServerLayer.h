@@ -1,7 +1,7 @@
 #pragma once
 
 #include "Walnut/Layer.h"
-#include "Walnut/Networking/Server.h"
+#include "Walnut/Serialization/BufferStream.h"
 
 #ifdef WL_HEADLESS
 #include "HeadlessConsole.h"
@@ -10,74 +10,578 @@
 #endif
 
 #include "UserInfo.h"
+#include "ClientSession.h"
+#include "WireFormat.h"
+#include "Packets.h"
+#include "EventLoop.h"
+#include "PacketCapture.h"
+#include "ServerTransport.h"
+#include "MessageHistoryStore.h"
+#include "EncodedMessageHistory.h"
+#include "ContentFilter.h"
+#include "RestartSnapshot.h"
+#include "FileUpload.h"
+#include "FanOutPool.h"
+#include "LatencyHistogram.h"
+#include "ClientInfoSnapshot.h"
+#include "ScratchArena.h"
+#include "TimerWheel.h"
 
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct ServerLayerSpecification
+{
+	int Port = 8192;
+
+	// Segmented message history, see MessageHistoryStore.h (empty directory = in-memory only)
+	MessageHistoryStoreSpecification MessageHistory;
+	// Single-file history from before segments existed, imported once if the store is empty
+	std::filesystem::path LegacyMessageHistoryFilePath = "MessageHistory.yaml";
+	// Empty disables loading/saving direct messages
+	std::filesystem::path DirectMessageHistoryFilePath = "DirectMessageHistory.yaml";
+	// Banned terms, see ContentFilter.h (empty disables filtering, /filter reload re-reads it)
+	std::filesystem::path ContentFilterFilePath = "ContentFilter.yaml";
+	// Written by /restart for the next process to pick up on startup, so clients can resume
+	// their sessions (empty disables /restart)
+	std::filesystem::path RestartSnapshotFilePath = "RestartSnapshot.bin";
+	// Uploaded files are stored here as they come in (empty disables file transfers)
+	std::filesystem::path FileTransferDirectory = "Transfers";
+	uint64_t MaxFileTransferSize = 256 * 1024 * 1024;
+	// Unfinished uploads a client can have at once, and their total size
+	uint32_t MaxFileUploadsPerClient = 4;
+	uint64_t MaxFileUploadBytesPerClient = 512 * 1024 * 1024;
+	// Newest messages a client gets on join, older ones are sent on request
+	uint32_t JoinHistoryMessages = 1000;
+	// Clients being admitted (handshake until their join history is sent) at once, the rest
+	// wait in a queue. 0 = no limit.
+	uint32_t MaxConcurrentJoins = 32;
+
+	// Capture inbound events from startup (can also be toggled with /capture)
+	std::filesystem::path CaptureFilePath;
+
+	// Per-client send budget every 20ms (~800KB/s), anything over it waits in the client's
+	// OutboundQueue. Only used if the transport can't report what it still has queued for a
+	// client, otherwise sends are paced by that.
+	uint64_t SendBytesPerInterval = 16 * 1024;
+	// Broadcasts to at least FanOutMinRecipients clients are sent from this many worker threads
+	// plus the main thread, if the transport supports concurrent sends (0 = main thread only)
+	uint32_t FanOutThreads = FanOutPool::GetDefaultWorkerCount();
+	uint32_t FanOutMinRecipients = 512;
+
+	// Sessions that get pings (ProtocolCapability::LatencyStamps, they answer every one) are
+	// disconnected after this many seconds without hearing anything from them. Connections
+	// that haven't sent a ClientConnectionRequest get HandshakeTimeout. 0 disables either.
+	float HeartbeatTimeout = 30.0f;
+	float HandshakeTimeout = 10.0f;
+
+	// Headless only
+	bool ConsoleInput = true;
+	bool ConsoleOutput = true;
+};
+
+// Time spent handling each PacketType in OnDataReceived
+struct PacketHandlerStats
+{
+	uint64_t Count = 0;
+	uint64_t TotalNanoseconds = 0;
+	uint64_t MaxNanoseconds = 0;
+};
+
+// Versions of a packet one broadcast can send, see ServerLayer::SendPacketVariantsToAllClients()
+const uint32_t BroadcastVariantCount = 2;
+
+// Broadcasts (SendPacketToAllClients), from send to the last recipient handled
+struct BroadcastStats
+{
+	uint64_t Count = 0;
+	uint64_t Recipients = 0;
+	uint64_t TotalNanoseconds = 0;
+	uint64_t MaxNanoseconds = 0;
+	// Fanned out ones only, see FanOutPool
+	uint64_t Chunks = 0;
+	uint64_t StolenChunks = 0;
+};
 
 class ServerLayer : public Walnut::Layer
 {
 public:
+	// Without a transport a WalnutServerTransport is created on specification.Port
+	ServerLayer(const ServerLayerSpecification& specification = ServerLayerSpecification(), std::unique_ptr<ServerTransport> transport = nullptr);
+
 	virtual void OnAttach() override;
 	virtual void OnDetach() override;
 	virtual void OnUpdate(float ts) override;
 	virtual void OnUIRender() override;
+
+	// Handles a captured event right away, as if it came in from the network (see App-Server-Replay)
+	void ReplayEvent(const CaptureRecord& record);
+	// Runs due timers/posted tasks, waiting at most maxWait for them
+	void RunEventLoop(EventLoop::Clock::duration maxWait) { m_EventLoop.RunOnce(maxWait); }
+
+	bool StartCapture(const std::filesystem::path& filepath);
+	void StopCapture();
+
+	const std::map<PacketType, PacketHandlerStats>& GetPacketHandlerStats() const { return m_PacketHandlerStats; }
+	const BroadcastStats& GetSerialBroadcastStats() const { return m_SerialBroadcastStats; }
+	const BroadcastStats& GetFanOutBroadcastStats() const { return m_FanOutBroadcastStats; }
+	// Microseconds, from PacketType::ConnectionStatus pings
+	const LatencyHistogram& GetRoundTripTimes() const { return m_RoundTripTimes; }
+	// Microseconds from a chat message coming in off the network to it being relayed
+	const LatencyHistogram& GetMessageResidenceTimes() const { return m_MessageResidenceTimes; }
+	// Latest published snapshot (GUI builds publish one every m_ClientInfoSnapshotInterval),
+	// safe to call from any thread
+	std::shared_ptr<const ClientInfoSnapshot> GetClientInfoSnapshot() const { return m_ClientInfoSnapshot.load(); }
 private:
+#ifndef WL_HEADLESS
+	// UI, only ever draws from m_ClientInfoSnapshot
+	void UI_ClientInfo();
+	// Filters and sorts the snapshot's clients into m_ClientInfoRows
+	void UpdateClientInfoRows(const ClientInfoSnapshot& snapshot);
+#endif
+	void PublishClientInfoSnapshot();
+
 	// Server event callbacks
 	void OnClientConnected(const Walnut::ClientInfo& clientInfo);
 	void OnClientDisconnected(const Walnut::ClientInfo& clientInfo);
-	void OnDataReceived(const Walnut::ClientInfo& clientInfo, const Walnut::Buffer buffer);
+	// A received packet on its way to the event loop. They're recycled, so copying one in
+	// reuses the storage a previous packet left behind.
+	struct ReceivedPacket
+	{
+		Walnut::ClientInfo Client;
+		std::vector<uint8_t> Data;
+		EventLoop::Clock::time_point ReceiveTime;
+	};
+	// Thread-safe
+	ReceivedPacket* AcquireReceivedPacket();
+	void ReleaseReceivedPacket(ReceivedPacket* packet);
+
+	// receiveTime is when the transport handed it over, before it waited in the event loop
+	void OnDataReceived(const Walnut::ClientInfo& clientInfo, const Walnut::Buffer buffer, EventLoop::Clock::time_point receiveTime);
+	void HandlePacket(const Walnut::ClientInfo& clientInfo, PacketType type, Walnut::BufferStreamReader& stream, WireEncoding encoding, EventLoop::Clock::time_point receiveTime);
 
 	////////////////////////////////////////////////////////////////////////////////
 	// Handle incoming messages
 	////////////////////////////////////////////////////////////////////////////////
 	void OnMessageReceived(const Walnut::ClientInfo& clientInfo, std::string_view message);
-	void OnClientConnectionRequest(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username);
+	void OnClientConnectionRequest(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username, uint16_t protocolVersion, uint32_t capabilities, uint64_t resumeToken);
+	void AdmitClient(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username, uint16_t protocolVersion, uint32_t capabilities);
 	void OnClientUpdate(const Walnut::ClientInfo& clientInfo, uint32_t userColor, std::string_view username);
+	void OnUserPresence(Walnut::ClientID clientID, uint8_t presence);
+	void OnDirectMessage(const UserInfo& fromUser, std::string_view toUsername, std::string_view message);
+	void OnMessageHistoryRequest(Walnut::ClientID clientID, uint64_t beforeSequence, uint32_t maxMessages);
 
 	////////////////////////////////////////////////////////////////////////////////
 	// Handle outgoing messages
 	////////////////////////////////////////////////////////////////////////////////
+	// Packets are encoded per wire encoding, so broadcasts encode once per encoding in use.
+	// The encoder writes the packet body, the PacketType header is written for it and also
+	// decides the packet's DeliveryClass.
+	using PacketEncoder = std::function<void(Walnut::StreamWriter& stream, WireEncoding encoding)>;
+	void SendPacket(Walnut::ClientID clientID, PacketType type, const PacketEncoder& encode);
+	// Clients with any of excludeCapabilities are skipped too (they get a batched equivalent),
+	// and so are clients without all of requiredCapabilities (on top of the packet type's own)
+	void SendPacketToAllClients(PacketType type, const PacketEncoder& encode, Walnut::ClientID excludeClientID = 0, uint32_t excludeCapabilities = 0, uint32_t requiredCapabilities = 0);
+	// Two versions of a packet in one broadcast, clients with variantCapability get encodeVariant's
+	// (eg. with trailing fields only they understand)
+	void SendPacketVariantsToAllClients(PacketType type, const PacketEncoder& encode, const PacketEncoder& encodeVariant, uint32_t variantCapability, Walnut::ClientID excludeClientID = 0);
+	// Clients that are gone (or can't get this packet type) are skipped
+	void SendPacketToClients(const std::vector<Walnut::ClientID>& clientIDs, PacketType type, const PacketEncoder& encode);
+
+	// The same for packets with a layout in Packets.h. Their exact size is known up front, so
+	// the scratch buffers are grown to fit before anything is written.
+	template<Wire::Packet P>
+	void SendPacket(Walnut::ClientID clientID, const P& packet)
+	{
+		ReserveScratchBuffers(packet);
+		SendPacket(clientID, P::Type, [&](Walnut::StreamWriter& stream, WireEncoding encoding) { Wire::WritePacketFields(stream, packet, encoding); });
+	}
+
+	template<Wire::Packet P>
+	void SendPacketToAllClients(const P& packet, Walnut::ClientID excludeClientID = 0, uint32_t excludeCapabilities = 0, uint32_t requiredCapabilities = 0)
+	{
+		ReserveScratchBuffers(packet);
+		SendPacketToAllClients(P::Type, [&](Walnut::StreamWriter& stream, WireEncoding encoding) { Wire::WritePacketFields(stream, packet, encoding); },
+			excludeClientID, excludeCapabilities, requiredCapabilities);
+	}
+
+	template<Wire::Packet P>
+	void SendPacketVariantsToAllClients(const P& packet, const P& variant, uint32_t variantCapability, Walnut::ClientID excludeClientID = 0)
+	{
+		ReserveScratchBuffers(packet);
+		ReserveScratchBuffers(variant, 1);
+		SendPacketVariantsToAllClients(P::Type, [&](Walnut::StreamWriter& stream, WireEncoding encoding) { Wire::WritePacketFields(stream, packet, encoding); },
+			[&](Walnut::StreamWriter& stream, WireEncoding encoding) { Wire::WritePacketFields(stream, variant, encoding); }, variantCapability, excludeClientID);
+	}
+
+	template<Wire::Packet P>
+	void SendPacketToClients(const std::vector<Walnut::ClientID>& clientIDs, const P& packet)
+	{
+		ReserveScratchBuffers(packet);
+		SendPacketToClients(clientIDs, P::Type, [&](Walnut::StreamWriter& stream, WireEncoding encoding) { Wire::WritePacketFields(stream, packet, encoding); });
+	}
+
+	template<Wire::Packet P>
+	Walnut::Buffer EncodePacket(const P& packet, WireEncoding encoding)
+	{
+		ReserveScratchBuffer(encoding, Wire::GetPacketSize(packet, encoding));
+		return EncodePacket(P::Type, encoding, [&](Walnut::StreamWriter& stream, WireEncoding encoding) { Wire::WritePacketFields(stream, packet, encoding); });
+	}
+
+	template<Wire::Packet P>
+	void ReserveScratchBuffers(const P& packet, uint32_t variant = 0)
+	{
+		for (uint32_t i = 0; i < WireEncodingCount; i++)
+			ReserveScratchBuffer((WireEncoding)i, Wire::GetPacketSize(packet, (WireEncoding)i), variant);
+	}
+	void ReserveScratchBuffer(WireEncoding encoding, uint64_t size, uint32_t variant = 0);
+
+	// Into the scratch buffer for the encoding (and broadcast variant), valid until the next one
+	Walnut::Buffer EncodePacket(PacketType type, WireEncoding encoding, const PacketEncoder& encode, uint32_t variant = 0);
+	void DeliverPacket(Walnut::ClientID clientID, ClientSession* session, DeliveryClass deliveryClass, Walnut::Buffer packet, SharedBuffer& sharedPacket);
+	// Nothing queued ahead of it, not held back and it fits in the send window
+	bool CanSendDirectly(const ClientSession& session, DeliveryClass deliveryClass, uint64_t packetSize) const;
+
+	// Both of the above, encodeVariant can be empty
+	void BroadcastPacket(PacketType type, const PacketEncoder& encode, const PacketEncoder& encodeVariant, uint32_t variantCapability,
+		Walnut::ClientID excludeClientID, uint32_t excludeCapabilities, uint32_t requiredCapabilities);
+	// BroadcastPacket() for big audiences: recipients are split into chunks that m_FanOutPool's
+	// workers send to in parallel, all from one shared copy per encoding (and variant)
+	void FanOutPacketToAllClients(PacketType type, const PacketEncoder& encode, const PacketEncoder& encodeVariant, uint32_t variantCapability,
+		Walnut::ClientID excludeClientID, uint32_t excludeCapabilities, uint32_t requiredCapabilities);
+	// Every connected client, rebuilt after joins/leaves
+	const std::vector<std::pair<Walnut::ClientID, ClientSession*>>& GetBroadcastTargets();
+	void RecordBroadcast(BroadcastStats& stats, uint64_t recipients, std::chrono::steady_clock::time_point startTime);
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Outbound queues/backpressure
+	////////////////////////////////////////////////////////////////////////////////
+	// From the transport, false if it can't tell
+	bool UpdateSendQueueStatus(Walnut::ClientID clientID, ClientSession& session);
+	void FlushOutboundQueue(Walnut::ClientID clientID, ClientSession& session);
+	void StartOutboundFlushTimer();
+	void OnOutboundFlushTimer();
+	void EnforceOutboundLimits(Walnut::ClientID clientID, ClientSession& session);
+	void EvictSlowClient(Walnut::ClientID clientID, ClientSession& session);
+	void SendNextMessageHistoryPage(Walnut::ClientID clientID, ClientSession& session);
+	// Pages are bounded by m_MessageHistoryPageSize and at least one message
+	uint64_t GetMessageHistoryPageEnd(uint64_t pageBegin, uint64_t historyEnd, WireEncoding encoding, uint32_t maxMessages = UINT32_MAX);
+	uint64_t GetMessageHistoryPageBegin(uint64_t pageEnd, uint64_t historyBegin, WireEncoding encoding, uint32_t maxMessages = UINT32_MAX);
+	// From m_EncodedMessageHistory if it has them, otherwise from the store
+	void WriteMessageHistory(Walnut::StreamWriter& stream, uint64_t begin, uint64_t end, WireEncoding encoding);
+	void AppendMessageHistory(const ChatMessageView& message);
+	////////////////////////////////////////////////////////////////////////////////
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Join storms
+	////////////////////////////////////////////////////////////////////////////////
+	// A client holds an admission slot from its ClientConnectionRequest being accepted until
+	// its initial history has been sent, past MaxConcurrentJoins requests wait in line
+	struct PendingAdmission
+	{
+		Walnut::ClientInfo ClientInfo;
+		uint32_t Color;
+		std::string Username;
+		uint16_t ProtocolVersion;
+		uint32_t Capabilities;
+	};
+	bool HasAdmissionSlot() const;
+	void EndAdmission(ClientSession& session);
+	void AdmitQueuedClients();
+	bool IsInAdmissionQueue(Walnut::ClientID clientID) const;
+	bool RemoveFromAdmissionQueue(Walnut::ClientID clientID);
+	void SendAdmissionStatus(const PendingAdmission& request, uint32_t position);
+	void SendAdmissionStatusToAll();
+	void StartMembershipFlushTimer();
+	void FlushMembershipUpdates();
+	////////////////////////////////////////////////////////////////////////////////
+
 	void SendClientList(const Walnut::ClientInfo& clientInfo);
 	void SendClientListToAllClients();
+	// Shared by every send until the client list changes
+	SharedBuffer GetClientListPacket(WireEncoding encoding);
+	void AddToClientList(const UserInfo& user);
+	// Anything other than a join, the entries get re-encoded on next use
+	void InvalidateClientList(WireEncoding encoding);
 	void SendClientConnect(const Walnut::ClientInfo& clientInfo);
 	void SendClientDisconnect(const Walnut::ClientInfo& clientInfo);
-	void SendClientConnectionRequestResponse(const Walnut::ClientInfo& clientInfo, bool response);
+	void SendClientConnectionRequestResponse(const Walnut::ClientInfo& clientInfo, bool response, uint16_t protocolVersion = LegacyProtocolVersion, uint32_t capabilities = 0, bool resumed = false);
 	void SendClientUpdateResponse(const Walnut::ClientInfo& clientInfo);
-	void SendMessageToAllClients(const Walnut::ClientInfo& fromClient, std::string_view message);
-	void SendMessageHistory(const Walnut::ClientInfo& clientInfo);
+	void SendMessageToAllClients(const Walnut::ClientInfo& fromClient, std::string_view message, EventLoop::Clock::time_point receiveTime);
+	// At most the newest JoinHistoryMessages, and nothing before firstSequence
+	void SendMessageHistory(const Walnut::ClientInfo& clientInfo, uint64_t firstSequence = 0);
+	void SendDirectMessage(Walnut::ClientID toClientID, const UserInfo& fromUser, std::string_view message);
+	// Chat message from "SERVER" to a single client, not recorded in history
+	void SendServerMessage(Walnut::ClientID clientID, std::string_view message);
 	void SendServerShutdownToAllClients();
 	void SendClientKick(const Walnut::ClientInfo& clientInfo, std::string_view reason);
+	void FlushPresenceUpdates();
+	// Current presence of the users in ClientSession::PresenceBacklog, within the send window
+	void SendPresenceBacklog(Walnut::ClientID clientID, ClientSession& session);
+	////////////////////////////////////////////////////////////////////////////////
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Latency (ProtocolCapability::LatencyStamps)
+	////////////////////////////////////////////////////////////////////////////////
+	void SendPings();
+	void OnPong(Walnut::ClientID clientID, uint64_t pingTime);
+	// Microseconds since the server started, what goes on the wire as "server time"
+	uint64_t GetServerTime(EventLoop::Clock::time_point time) const;
+	////////////////////////////////////////////////////////////////////////////////
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Idle connections
+	////////////////////////////////////////////////////////////////////////////////
+	// Pushes the session's deadline back, it just heard from the client (or was just created).
+	// Sessions that don't get pings are left alone: a quiet one isn't necessarily gone.
+	void ResetIdleTimeout(Walnut::ClientID clientID, const ClientSession& session);
+	void CheckIdleTimeouts();
+	void OnIdleTimeout(Walnut::ClientID clientID);
+	uint32_t GetIdleTimeoutTicks(float seconds) const;
+	////////////////////////////////////////////////////////////////////////////////
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Content filter
+	////////////////////////////////////////////////////////////////////////////////
+	// Runs message through m_ContentFilter (masking it if needed), false if it's blocked
+	bool FilterMessage(const UserInfo& fromUser, std::span<char> message);
+	// Loads and builds the filter on m_ContentFilterThread, swapped in when it's done
+	bool ReloadContentFilter();
+	void OnContentFilterLoaded(std::shared_ptr<const ContentFilter> contentFilter, bool loaded);
+	////////////////////////////////////////////////////////////////////////////////
+
+	////////////////////////////////////////////////////////////////////////////////
+	// File transfers
+	////////////////////////////////////////////////////////////////////////////////
+	void OnFileOffer(Walnut::ClientID clientID, uint32_t transferID, std::string_view toUsername, std::string_view filename, uint64_t size);
+	void OnFileChunk(Walnut::ClientID clientID, uint32_t transferID, uint64_t offset, std::string_view data);
+	// A recipient accepted/declined the offer, or stopped receiving
+	void OnFileOfferAnswer(Walnut::ClientID clientID, uint32_t uploadID, bool accepted);
+	// Uploads of connected clients only
+	FileUpload* FindFileUpload(Walnut::ClientID clientID, uint32_t transferID);
+	// Everyone has answered the offer (or the time's up), fails it if nobody accepted
+	void StartFileUpload(FileUpload& upload);
+	// Acks once enough has come in, unless a recipient is too far behind (then the uploader
+	// runs out of window and waits, see SendHeldBackFileAcks())
+	void SendFileAckIfReady(FileUpload& upload);
+	void SendHeldBackFileAcks();
+	// Granted bytes that won't come in anymore (or just did) stop counting against recipients
+	void ReleaseFileBytesInFlight(const FileUpload& upload, uint64_t bytes);
+	void SendFileComplete(Walnut::ClientID clientID, uint32_t transferID, FileTransferStatus status, bool upload);
+	void FinishFileUpload(uint32_t uploadID, FileTransferStatus status);
+	// Uploader disconnected, keep what we have for a while in case it comes back
+	void PauseFileUploads(Walnut::ClientID clientID);
+	// Recipient disconnected, declines whatever it hadn't answered yet
+	void RemoveFileRecipient(Walnut::ClientID clientID);
+	void CleanUpFileUploads();
+	////////////////////////////////////////////////////////////////////////////////
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Restarts
+	////////////////////////////////////////////////////////////////////////////////
+	// Writes the restart snapshot, hands out resume tokens (PacketType::ServerRestart) and quits
+	bool Restart();
+	void LoadRestartSnapshot();
+	// False if there's no such session to resume, the client joins normally then
+	bool ResumeClient(const Walnut::ClientInfo& clientInfo, std::string_view username, uint64_t resumeToken, uint16_t protocolVersion, uint32_t capabilities);
+	void OnSessionResumeTimeout();
 	////////////////////////////////////////////////////////////////////////////////
 
 	////////////////////////////////////////////////////////////////////////////////
 	// Commands
 	////////////////////////////////////////////////////////////////////////////////
 	bool KickUser(std::string_view username, std::string_view reason = "");
+	void KickClient(Walnut::ClientID clientID, std::string_view reason);
 	void Quit();
 	////////////////////////////////////////////////////////////////////////////////
 
 	bool IsValidUsername(const std::string& username) const;
+	// Returns 0 if no connected client has this username
+	Walnut::ClientID FindClientID(const std::string& username) const;
 	const std::string& GetClientUsername(Walnut::ClientID clientID) const;
 	uint32_t GetClientColor(Walnut::ClientID clientID) const;
 
+	void OnClientListTimer();
+	void SaveHistoryIfDirty();
+
 	void SendChatMessage(std::string_view message);
 	void OnCommand(std::string_view command);
-	void SaveMessageHistoryToFile(const std::filesystem::path& filepath);
-	bool LoadMessageHistoryFromFile(const std::filesystem::path& filepath);
+	bool ImportLegacyMessageHistory(const std::filesystem::path& filepath);
+	void SaveDirectMessageHistoryToFile(const std::filesystem::path& filepath);
+	bool LoadDirectMessageHistoryFromFile(const std::filesystem::path& filepath);
 private:
-	std::unique_ptr<Walnut::Server> m_Server;
+	ServerLayerSpecification m_Specification;
+	std::unique_ptr<ServerTransport> m_Server;
 #ifdef WL_HEADLESS
 	HeadlessConsole m_Console{ "Server Console" };
 #else
 	Walnut::UI::Console m_Console{ "Server Console" };
 #endif
-	std::vector<ChatMessage> m_MessageHistory;
-	std::filesystem::path m_MessageHistoryFilePath;
+	MessageHistoryStore m_MessageHistory;
+	// Newest JoinHistoryMessages (at most m_MaxEncodedHistoryMessages) ready to send
+	EncodedMessageHistory m_EncodedMessageHistory;
+
+	// Direct messages are kept per conversation (pair of usernames, sorted) and are never
+	// part of the global history that gets sent to every client
+	using ConversationKey = std::pair<std::string, std::string>;
+	std::map<ConversationKey, std::vector<ChatMessage>> m_DirectMessageHistory;
+	std::filesystem::path m_DirectMessageHistoryFilePath;
+	bool m_DirectMessageHistoryDirty = false;
+
+	// One per WireEncoding, for each of a broadcast's variants (SendPacketVariantsToAllClients())
+	Walnut::Buffer m_ScratchBuffers[BroadcastVariantCount][WireEncodingCount];
+	// Temporaries that only live while one packet is handled, reset after each
+	ScratchArena<16 * 1024> m_PacketArena;
+
+	// Every ReceivedPacket ever made, and the ones not in flight
+	std::mutex m_ReceivedPacketMutex;
+	std::vector<std::unique_ptr<ReceivedPacket>> m_ReceivedPackets;
+	std::vector<ReceivedPacket*> m_FreeReceivedPackets;
+	// Anything bigger (eg. a file chunk) gives its buffer back rather than keeping it around
+	const size_t m_MaxRecycledPacketSize = 8 * 1024;
 
-	Walnut::Buffer m_ScratchBuffer;
+	std::map<Walnut::ClientID, ClientSession> m_ConnectedClients;
+	// Username -> ClientID for every client in m_ConnectedClients
+	std::unordered_map<std::string, Walnut::ClientID> m_ClientIDsByUsername;
 
-	std::map<Walnut::ClientID, UserInfo> m_ConnectedClients;
+	// All server/console events are funneled through here and handled on the main thread.
+	// In headless builds OnUpdate() sleeps in here until there's something to do.
+	EventLoop m_EventLoop;
 
 	// Send client list every ten seconds
 	const float m_ClientListInterval = 10.0f;
-	float m_ClientListTimer = m_ClientListInterval;
+	// Save chat history (if it changed) every ten seconds
+	const float m_HistorySaveInterval = 10.0f;
+
+	// Most a client can have waiting in the transport, the rest waits in its OutboundQueue
+	// (where it's prioritized and can be coalesced or dropped). Set in OnAttach(): without
+	// transport status it's ServerLayerSpecification::SendBytesPerInterval, reset every flush.
+	const float m_OutboundFlushInterval = 0.02f;
+	const uint64_t m_TransportSendWindow = 64 * 1024;
+	uint64_t m_SendWindow = 0;
+	EventLoop::TimerID m_OutboundFlushTimer = 0;
+	// Over the high-water mark a client stops getting history (skips to the latest page)
+	// and bulk data, over the max it gets disconnected. The queue only grows while the
+	// transport is backed up, and the transport's queue time is checked the same way.
+	const uint64_t m_OutboundHighWaterBytes = 256 * 1024;
+	const uint32_t m_OutboundHighWaterMessages = 1024;
+	const float m_SendQueueTimeHighWater = 2.0f;
+	const uint64_t m_MaxOutboundQueueBytes = 1024 * 1024;
+	const uint32_t m_MaxOutboundQueueMessages = 4096;
+	const float m_MaxSendQueueTime = 10.0f;
+	// Target size of a single MessageHistory/MessageHistoryRequest page
+	const uint64_t m_MessageHistoryPageSize = 4 * 1024;
+	const uint32_t m_MaxMessageHistoryRequestMessages = 256;
+	const uint32_t m_MaxEncodedHistoryMessages = 16 * 1024;
+
+	// Per WireEncoding: every connected client's encoded UserInfo, appended to on join (order
+	// doesn't matter to clients), and the last ClientList packet built from it
+	std::vector<uint8_t> m_ClientListEntries[WireEncodingCount];
+	bool m_ClientListEntriesValid[WireEncodingCount] = {};
+	SharedBuffer m_ClientListPackets[WireEncodingCount];
+
+	// Presence changes are coalesced per user over this window, deduplicated, and fanned out
+	// in batches of at most m_MaxPresenceUpdatesPerFlush users (the rest waits a window)
+	const float m_PresenceFlushInterval = 0.25f;
+	const uint32_t m_MaxPresenceUpdatesPerFlush = 128;
+	// Clients refresh their typing state every few seconds, if they don't it's cleared
+	const float m_TypingTimeout = 8.0f;
+	std::vector<Walnut::ClientID> m_PresenceDirtyClients;
+	EventLoop::TimerID m_PresenceFlushTimer = 0;
+
+	// See ServerLayerSpecification::MaxConcurrentJoins
+	uint32_t m_AdmittingClientCount = 0;
+	std::deque<PendingAdmission> m_AdmissionQueue;
+	// Queued clients get their position this often
+	const float m_AdmissionStatusInterval = 1.0f;
+	EventLoop::TimerID m_AdmissionStatusTimer = 0;
+
+	// Joins/leaves collected for PacketType::ClientListUpdate (clients with
+	// ProtocolCapability::MembershipUpdates), sent once per window
+	const float m_MembershipFlushInterval = 0.25f;
+	std::vector<Walnut::ClientID> m_PendingJoins;
+	std::vector<uint32_t> m_PendingLeaves;
+	EventLoop::TimerID m_MembershipFlushTimer = 0;
+
+	// Never null, replaced as a whole on reload. Building a big one takes a while, so that's
+	// done off the main thread and only the swap happens here.
+	std::shared_ptr<const ContentFilter> m_ContentFilter;
+	std::thread m_ContentFilterThread;
+	bool m_ContentFilterLoading = false;
+	// Per ContentFilterAction
+	uint64_t m_ContentFilterCounts[4] = {};
+
+	// Sessions from the restart snapshot waiting for their client to come back, by username
+	// (the names stay taken until then). Anyone who doesn't make it within
+	// m_SessionResumeTimeout of the restart has to join normally.
+	std::unordered_map<std::string, RestartSession> m_ResumableSessions;
+	// They had every message before this one
+	uint64_t m_ResumeHistorySequence = 0;
+	const float m_SessionResumeTimeout = 30.0f;
+	EventLoop::TimerID m_SessionResumeTimer = 0;
+
+	// By FileUpload::ID
+	std::map<uint32_t, FileUpload> m_FileUploads;
+	// Uploader client ID << 32 | client's transfer ID -> FileUpload::ID, for connected uploaders
+	std::unordered_map<uint64_t, uint32_t> m_FileUploadIDs;
+	uint32_t m_NextFileUploadID = 1;
+	// Uploads get acked every m_FileAckInterval bytes (well within FileTransferWindow, so they
+	// don't stall), but only while each recipient's queue plus everything granted to uploads
+	// it's receiving stays under m_FileTransferBackpressureBytes, however many there are.
+	// That stays under the high-water mark, and a client that still falls behind is
+	// disconnected rather than missing chunks (DeliveryClass::Transfer).
+	const uint64_t m_FileAckInterval = 16 * 1024;
+	const uint64_t m_FileTransferBackpressureBytes = 96 * 1024;
+	bool m_FileAcksHeldBack = false;
+	// Recipients who haven't answered an offer by then don't get the file
+	const float m_FileOfferTimeout = 60.0f;
+	// Unfinished uploads of disconnected clients are kept this long for them to resume
+	const float m_FileUploadResumeTimeout = 5.0f * 60.0f;
+	const float m_FileUploadCleanupInterval = 60.0f;
+
+	EventLoop::Clock::time_point m_StartTime = EventLoop::Clock::now();
+	const float m_PingInterval = 2.0f;
+	LatencyHistogram m_RoundTripTimes;
+	LatencyHistogram m_MessageResidenceTimes;
+
+	// Heartbeat/handshake deadlines by client ID, in m_IdleCheckInterval ticks. Sessions get
+	// one while they're pinged, connections until their ClientConnectionRequest comes in.
+	TimerWheel m_IdleTimeouts;
+	std::vector<Walnut::ClientID> m_ExpiredIdleTimeouts;
+	const float m_IdleCheckInterval = 1.0f;
+
+	// Replaced as a whole on publish, readers hold on to the one they loaded
+	std::atomic<std::shared_ptr<const ClientInfoSnapshot>> m_ClientInfoSnapshot;
+	const float m_ClientInfoSnapshotInterval = 0.5f;
+	// Client Info window: what's shown of m_ClientInfoRowsSnapshot, filtered and sorted
+	// (indices into its Clients), rebuilt when the snapshot, filter or sort order changes
+	std::shared_ptr<const ClientInfoSnapshot> m_ClientInfoRowsSnapshot;
+	std::vector<uint32_t> m_ClientInfoRows;
+	bool m_ClientInfoRowsDirty = true;
+	char m_ClientInfoFilter[64] = {};
+	uint32_t m_ClientInfoSortColumn = 0;
+	bool m_ClientInfoSortAscending = true;
+	Walnut::ClientID m_SelectedClientID = 0;
+
+	// Only with a transport that supports concurrent sends (and FanOutThreads > 0)
+	std::unique_ptr<FanOutPool> m_FanOutPool;
+	// Per m_FanOutPool thread, at least
+	const uint32_t m_FanOutChunksPerThread = 4;
+	const uint32_t m_MinFanOutChunkSize = 64;
+	std::vector<std::pair<Walnut::ClientID, ClientSession*>> m_BroadcastTargets;
+	bool m_BroadcastTargetsValid = false;
+	bool m_BroadcastEncodings[WireEncodingCount] = {};
+	// Per broadcast target, set by the workers for clients whose packet got queued
+	std::vector<uint8_t> m_FanOutQueued;
+	BroadcastStats m_SerialBroadcastStats;
+	BroadcastStats m_FanOutBroadcastStats;
+
+	PacketCaptureWriter m_Capture;
+	std::map<PacketType, PacketHandlerStats> m_PacketHandlerStats;
 };
\ No newline at end of file
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Walnut/Core/Buffer.h"
+
+#include <memory>
+#include <vector>
+
+//
+// Immutable, reference-counted copy of an encoded packet. The same packet can sit in
+// many clients' outbound queues without being copied per client.
+//
+using SharedBuffer = std::shared_ptr<const std::vector<uint8_t>>;
+
+inline SharedBuffer MakeSharedBuffer(Walnut::Buffer buffer)
+{
+	const uint8_t* data = buffer.As<uint8_t>();
+	return std::make_shared<const std::vector<uint8_t>>(data, data + buffer.Size);
+}
+
+inline Walnut::Buffer AsBuffer(const SharedBuffer& sharedBuffer)
+{
+	return Walnut::Buffer(sharedBuffer->data(), sharedBuffer->size());
+}
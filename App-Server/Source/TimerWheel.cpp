@@ -0,0 +1,60 @@
+#include "TimerWheel.h"
+
+#include <algorithm>
+
+TimerWheel::TimerWheel(uint32_t slotCount)
+	: m_Slots(std::max(slotCount, 2u))
+{
+}
+
+void TimerWheel::Schedule(ID id, uint32_t ticks)
+{
+	uint64_t deadline = m_CurrentTick + std::max(ticks, 1u);
+
+	auto [it, inserted] = m_Entries.try_emplace(id);
+	Entry& entry = it->second;
+	entry.Deadline = deadline;
+
+	// Later than where it's filed: picked up from there when that slot comes up. Earlier: file
+	// it again, the old copy is skipped as stale.
+	if (inserted || deadline < entry.FiledTick)
+		File(id, entry);
+}
+
+void TimerWheel::Cancel(ID id)
+{
+	// Whatever is left in the slots is skipped as stale
+	m_Entries.erase(id);
+}
+
+void TimerWheel::Tick(std::vector<ID>& expired)
+{
+	m_CurrentTick++;
+	auto& slot = m_Slots[m_CurrentTick % m_Slots.size()];
+
+	// File() never puts anything in the current slot, so it's safe to iterate while re-filing
+	for (ID id : slot)
+	{
+		auto it = m_Entries.find(id);
+		if (it == m_Entries.end() || it->second.FiledTick != m_CurrentTick)
+			continue; // Cancelled or re-filed since
+
+		if (it->second.Deadline <= m_CurrentTick)
+		{
+			expired.push_back(id);
+			m_Entries.erase(it);
+		}
+		else
+		{
+			File(id, it->second);
+		}
+	}
+	slot.clear();
+}
+
+void TimerWheel::File(ID id, Entry& entry)
+{
+	// At most one lap ahead, so a slot only ever holds one live tick's worth of IDs
+	entry.FiledTick = std::min<uint64_t>(entry.Deadline, m_CurrentTick + m_Slots.size() - 1);
+	m_Slots[entry.FiledTick % m_Slots.size()].push_back(id);
+}
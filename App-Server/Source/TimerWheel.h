@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+//
+// TimerWheel - deadlines for lots of IDs that keep getting pushed back, like every session's
+// "haven't heard from it in a while" timeout. Time moves in ticks and Tick() only looks at the
+// current tick's slot, so a tick costs as much as what's filed there, not the number of IDs.
+//
+// Pushing a deadline back is O(1): the ID stays filed where it was and is moved along once
+// that slot comes up, so a busy ID gets re-filed about once per timeout, not once per update.
+//
+class TimerWheel
+{
+public:
+	using ID = uint32_t;
+public:
+	// Deadlines further out than slotCount ticks are fine, they just get re-filed on the way
+	TimerWheel(uint32_t slotCount = 64);
+
+	// Due after ticks more Tick()s (at least one), replaces id's current deadline
+	void Schedule(ID id, uint32_t ticks);
+	void Cancel(ID id);
+	bool Contains(ID id) const { return m_Entries.contains(id); }
+
+	// Advances one tick, appends the IDs that are now due to expired (they're forgotten)
+	void Tick(std::vector<ID>& expired);
+
+	uint32_t GetCount() const { return (uint32_t)m_Entries.size(); }
+private:
+	struct Entry
+	{
+		uint64_t Deadline = 0;
+		// The tick whose slot it's in, copies in any other slot are stale
+		uint64_t FiledTick = 0;
+	};
+	void File(ID id, Entry& entry);
+private:
+	std::vector<std::vector<ID>> m_Slots;
+	std::unordered_map<ID, Entry> m_Entries;
+	uint64_t m_CurrentTick = 0;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Walnut/Serialization/StreamWriter.h"
+
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+
+//
+// StreamWriter into a std::vector that grows as needed, for encoding things that are kept
+// around (or can outgrow a fixed scratch buffer, like a big client list).
+//
+class VectorStreamWriter : public Walnut::StreamWriter
+{
+public:
+	VectorStreamWriter(std::vector<uint8_t>& target)
+		: m_Target(target), m_Position(target.size())
+	{
+	}
+
+	bool IsStreamGood() const override { return true; }
+	uint64_t GetStreamPosition() override { return m_Position; }
+	void SetStreamPosition(uint64_t position) override { m_Position = position; }
+
+	bool WriteData(const char* data, size_t size) override
+	{
+		if (m_Position + size > m_Target.size())
+			m_Target.resize(m_Position + size);
+
+		memcpy(m_Target.data() + m_Position, data, size);
+		m_Position += size;
+		return true;
+	}
+private:
+	std::vector<uint8_t>& m_Target;
+	uint64_t m_Position;
+};
@@ -23,4 +23,10 @@ include "Walnut/Build-Walnut-Headless-External.lua"
 group "App"
     include "App-Common/Build-App-Common-Headless.lua"
     include "App-Server/Build-App-Server-Headless.lua"
+    include "App-Client/Build-App-Client-Headless.lua"
+
+group "Tools"
+    include "App-Server-Replay/Build-App-Server-Replay.lua"
+    include "App-Server-Bench/Build-App-Server-Bench.lua"
+    include "App-Server-History/Build-App-Server-History.lua"
 group ""
\ No newline at end of file